@@ -0,0 +1,159 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* NUMA Topology from the ACPI SRAT and SLIT */
+
+#include <stddef.h>
+#include <string.h>
+#include <kernel/acpi.h>
+#include <kernel/logger.h>
+#include <kernel/memory.h>
+
+// proximity domains are arbitrary 32-bit numbers, so map them to dense node
+// numbers in the order they first appear
+static uint32_t domains[PMM_MAX_NODES];
+static int nodeCount = 0;
+
+typedef struct {
+    uint32_t apicID;
+    int node;
+} CPUAffinity;
+
+static CPUAffinity cpuAffinity[ACPI_MAX_CPU_AFFINITY];
+static int cpuAffinityCount = 0;
+
+/* domainToNode(): translates a proximity domain to a node number
+ * params: domain - ACPI proximity domain
+ * params: create - whether to assign a node number to new domains
+ * returns: node number, -1 if not found
+ */
+
+static int domainToNode(uint32_t domain, bool create) {
+    for(int i = 0; i < nodeCount; i++) {
+        if(domains[i] == domain) return i;
+    }
+
+    if(!create) return -1;
+    if(nodeCount >= PMM_MAX_NODES) {
+        KWARN("too many NUMA nodes, ignoring proximity domain %d\n", domain);
+        return -1;
+    }
+
+    domains[nodeCount] = domain;
+    return nodeCount++;
+}
+
+/* addCPUAffinity(): records the node of a CPU
+ * params: apicID - local APIC ID of the CPU
+ * params: domain - ACPI proximity domain
+ * returns: nothing
+ */
+
+static void addCPUAffinity(uint32_t apicID, uint32_t domain) {
+    int node = domainToNode(domain, true);
+    if(node < 0) return;
+
+    if(cpuAffinityCount >= ACPI_MAX_CPU_AFFINITY) {
+        KWARN("too many CPUs in SRAT, ignoring local APIC 0x%02X\n", apicID);
+        return;
+    }
+
+    cpuAffinity[cpuAffinityCount].apicID = apicID;
+    cpuAffinity[cpuAffinityCount].node = node;
+    cpuAffinityCount++;
+}
+
+/* acpiNUMAInit(): reads the NUMA topology from the SRAT and SLIT and passes
+ * it on to the physical memory manager
+ * params: none
+ * returns: number of NUMA nodes, -1 if the topology is not known
+ */
+
+int acpiNUMAInit() {
+    ACPISRAT *srat = acpiFindTable("SRAT", 0);
+    if(!srat) {
+        KDEBUG("ACPI SRAT table is not present, assuming uniform memory access\n");
+        return -1;
+    }
+
+    KDEBUG("reading ACPI SRAT table...\n");
+
+    uint8_t *ptr = srat->entries;
+    size_t n = (size_t)(ptr - (uint8_t *)srat);
+
+    while(n < srat->header.length) {
+        if(ptr[1] < 2) break;   // malformed entry, avoid looping forever
+
+        switch(*ptr) {
+        case SRAT_TYPE_CPU_AFFINITY:
+            ACPISRATCPUAffinity *cpu = (ACPISRATCPUAffinity *)ptr;
+            if(cpu->flags & SRAT_AFFINITY_ENABLED) {
+                uint32_t domain = cpu->domainLow | (cpu->domainHigh[0] << 8)
+                    | (cpu->domainHigh[1] << 16) | (cpu->domainHigh[2] << 24);
+                KDEBUG("local APIC 0x%02X is in proximity domain %d\n", cpu->apicID, domain);
+                addCPUAffinity(cpu->apicID, domain);
+            }
+            break;
+        case SRAT_TYPE_X2APIC_AFFINITY:
+            ACPISRATX2APICAffinity *x2apic = (ACPISRATX2APICAffinity *)ptr;
+            if(x2apic->flags & SRAT_AFFINITY_ENABLED) {
+                KDEBUG("local x2APIC 0x%08X is in proximity domain %d\n", x2apic->x2apicID, x2apic->domain);
+                addCPUAffinity(x2apic->x2apicID, x2apic->domain);
+            }
+            break;
+        case SRAT_TYPE_MEMORY_AFFINITY:
+            ACPISRATMemoryAffinity *mem = (ACPISRATMemoryAffinity *)ptr;
+            if(mem->flags & SRAT_AFFINITY_ENABLED) {
+                KDEBUG("memory %016X - %016X is in proximity domain %d%s\n", mem->base,
+                    mem->base + mem->size - 1, mem->domain,
+                    mem->flags & SRAT_MEMORY_HOTPLUG ? " (hot-pluggable)" : "");
+
+                int node = domainToNode(mem->domain, true);
+                if(node >= 0) pmmAddNodeRange(node, mem->base, mem->size);
+            }
+            break;
+        default:
+            KWARN("unimplemented SRAT entry type 0x%02X with length %d, skipping...\n", ptr[0], ptr[1]);
+        }
+
+        n += ptr[1];
+        ptr += ptr[1];
+    }
+
+    // distances between nodes are optional and default to local/remote
+    ACPISLIT *slit = acpiFindTable("SLIT", 0);
+    if(slit) {
+        KDEBUG("reading ACPI SLIT table with %d localities...\n", slit->localities);
+
+        for(uint64_t i = 0; i < slit->localities; i++) {
+            int from = domainToNode(i, false);
+            if(from < 0) continue;
+
+            for(uint64_t j = 0; j < slit->localities; j++) {
+                int to = domainToNode(j, false);
+                if(to >= 0) pmmSetNodeDistance(from, to, slit->entries[(i * slit->localities) + j]);
+            }
+        }
+    }
+
+    KDEBUG("system has %d NUMA node%s\n", nodeCount, nodeCount != 1 ? "s" : "");
+    pmmInitNUMA(nodeCount);
+    return nodeCount;
+}
+
+/* acpiCPUNode(): returns the NUMA node of a CPU
+ * params: apicID - local APIC ID of the CPU
+ * returns: node number, zero if not known
+ */
+
+int acpiCPUNode(uint32_t apicID) {
+    for(int i = 0; i < cpuAffinityCount; i++) {
+        if(cpuAffinity[i].apicID == apicID) return cpuAffinity[i].node;
+    }
+
+    return 0;
+}
\ No newline at end of file
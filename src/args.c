@@ -76,3 +76,67 @@ int parseBootArgs(char ***argv, char *args) {
     argv[0] = v;
     return argc;
 }
+
+
+/* bootArgSize(): finds a "name=size" boot argument, where the size may have a
+ * K, M, or G suffix; this does not allocate memory so it is usable before the
+ * memory managers are initialized
+ * params: args - string containing arguments
+ * params: name - name of the argument
+ * returns: size in bytes, zero if the argument is not present
+ */
+
+uint64_t bootArgSize(const char *args, const char *name) {
+    size_t nameLen = strlen(name);
+    size_t len = strlen(args);
+
+    for(size_t i = 0; i + nameLen < len; i++) {
+        // arguments are separated by spaces
+        if(i && args[i-1] != ' ') continue;
+        if(memcmp(args+i, name, nameLen) || args[i+nameLen] != '=') continue;
+
+        const char *ptr = args + i + nameLen + 1;
+        uint64_t size = 0;
+        while(*ptr >= '0' && *ptr <= '9') {
+            size = (size * 10) + (*ptr - '0');
+            ptr++;
+        }
+
+        // every suffix falls through to the smaller ones
+        switch(*ptr) {
+        case 'G':
+        case 'g':
+            size <<= 10;
+        case 'M':
+        case 'm':
+            size <<= 10;
+        case 'K':
+        case 'k':
+            size <<= 10;
+        }
+
+        return size;
+    }
+
+    return 0;
+}
+
+/* bootArgFlag(): checks for a boot argument that is a plain flag, without
+ * allocating memory
+ * params: args - string containing arguments
+ * params: name - name of the flag
+ * returns: true if the flag is present
+ */
+
+bool bootArgFlag(const char *args, const char *name) {
+    size_t nameLen = strlen(name);
+    size_t len = strlen(args);
+
+    for(size_t i = 0; i + nameLen <= len; i++) {
+        if(i && args[i-1] != ' ') continue;
+        if(memcmp(args+i, name, nameLen)) continue;
+        if(!args[i+nameLen] || args[i+nameLen] == ' ') return true;
+    }
+
+    return false;
+}
\ No newline at end of file
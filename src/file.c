@@ -16,6 +16,7 @@
 #include <kernel/file.h>
 #include <kernel/io.h>
 #include <kernel/sched.h>
+#include <kernel/memory.h>
 #include <kernel/socket.h>
 #include <kernel/servers.h>
 #include <sys/types.h>
@@ -133,6 +134,13 @@ ssize_t readFile(Thread *t, uint64_t id, IODescriptor *iod, void *buffer, size_t
 
     if(!(iod->flags & O_RDONLY)) return -EPERM;
 
+    // regular files may be read straight out of the page cache
+    if(!fd->charDev) {
+        ssize_t cached = pageCacheRead(t, fd->device, fd->id, fd->position, (uintptr_t) buffer, count);
+        if(cached > 0) fd->position += cached;
+        if(cached) return cached;
+    }
+
     RWCommand *command = calloc(1, sizeof(RWCommand));
     if(!command) return -ENOMEM;
 
@@ -148,6 +156,7 @@ ssize_t readFile(Thread *t, uint64_t id, IODescriptor *iod, void *buffer, size_t
     strcpy(command->device, fd->device);
     strcpy(command->path, fd->path);
 
+    if(!fd->charDev) t->syscall.cacheGeneration = pageCacheGeneration(fd->device, fd->id);
     int status = requestServer(t, fd->sd, command);
 
     free(command);
@@ -185,6 +194,7 @@ ssize_t writeFile(Thread *t, uint64_t id, IODescriptor *iod, const void *buffer,
     memcpy(command->data, buffer, count);
 
     if(fd->charDev) command->silent = 1;
+    else pageCacheInvalidate(fd->device, fd->id, command->position, (command->position < 0) ? 0 : count);
 
     int status = requestServer(t, fd->sd, command);
     free(command);
@@ -47,5 +47,66 @@ typedef struct {
     uint64_t tables[];
 } __attribute__((packed)) ACPIXSDT;
 
+// System Resource Affinity Table
+#define SRAT_TYPE_CPU_AFFINITY          0
+#define SRAT_TYPE_MEMORY_AFFINITY       1
+#define SRAT_TYPE_X2APIC_AFFINITY       2
+
+#define SRAT_AFFINITY_ENABLED           0x01
+#define SRAT_MEMORY_HOTPLUG             0x02
+#define SRAT_MEMORY_NONVOLATILE         0x04
+
+#define ACPI_MAX_CPU_AFFINITY           256
+
+typedef struct {
+    ACPIStandardHeader header;
+    uint32_t reserved1;
+    uint64_t reserved2;
+    uint8_t entries[];
+} __attribute__((packed)) ACPISRAT;
+
+typedef struct {
+    uint8_t type;           // 0
+    uint8_t length;         // 16
+    uint8_t domainLow;
+    uint8_t apicID;
+    uint32_t flags;
+    uint8_t sapicEID;
+    uint8_t domainHigh[3];
+    uint32_t clockDomain;
+} __attribute__((packed)) ACPISRATCPUAffinity;
+
+typedef struct {
+    uint8_t type;           // 1
+    uint8_t length;         // 40
+    uint32_t domain;
+    uint16_t reserved1;
+    uint64_t base;
+    uint64_t size;
+    uint32_t reserved2;
+    uint32_t flags;
+    uint64_t reserved3;
+} __attribute__((packed)) ACPISRATMemoryAffinity;
+
+typedef struct {
+    uint8_t type;           // 2
+    uint8_t length;         // 24
+    uint16_t reserved1;
+    uint32_t domain;
+    uint32_t x2apicID;
+    uint32_t flags;
+    uint32_t clockDomain;
+    uint32_t reserved2;
+} __attribute__((packed)) ACPISRATX2APICAffinity;
+
+// System Locality Information Table
+typedef struct {
+    ACPIStandardHeader header;
+    uint64_t localities;
+    uint8_t entries[];      // localities * localities matrix of distances
+} __attribute__((packed)) ACPISLIT;
+
 int acpiInit(KernelBootInfo *);
 void *acpiFindTable(const char *, int);
+int acpiNUMAInit();
+int acpiCPUNode(uint32_t);
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 typedef struct {
     uint8_t flags;
@@ -85,3 +86,5 @@ typedef struct {
 #define MEMORY_ATTRIBUTES_NV            0x02
 
 int parseBootArgs(char ***, char *);
+uint64_t bootArgSize(const char *, const char *);
+bool bootArgFlag(const char *, const char *);
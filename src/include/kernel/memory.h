@@ -21,11 +21,48 @@
 
 #define PMM_CONTIGUOUS_LOW      0x01
 
+// the buddy allocator manages blocks of 2^order pages
+#define PMM_MAX_ORDER           10          // largest block is 1024 pages (4 MiB)
+#define PMM_ORDERS              (PMM_MAX_ORDER+1)
+
+// physical memory zones, general allocations prefer the highest zone
+#define PMM_ZONE_DMA32          0           // below 4 GiB, reachable by 32-bit DMA
+#define PMM_ZONE_NORMAL         1           // everything else
+#define PMM_ZONE_CMA            2           // reserved for contiguous allocations
+#define PMM_ZONES               3
+#define PMM_DMA32_LIMIT         0x100000000
+#define PMM_DMA32_RESERVE       4096        // DMA32 pages (16 MiB) kept back from general allocations
+
+// NUMA nodes each hold their own set of zones
+#define PMM_MAX_NODES           8
+#define PMM_MAX_NODE_RANGES     32          // memory ranges with a known node
+#define PMM_LOCAL_DISTANCE      10          // ACPI SLIT convention
+#define PMM_REMOTE_DISTANCE     20
+
+// memory compaction
+#define PMM_COMPACT_ORDER       9           // background compaction keeps 2 MiB blocks available
+#define PMM_COMPACT_INTERVAL    5           // seconds between background passes
+
+// per-CPU page caches in front of the buddy allocator
+#define PMM_CACHE_SIZE          64          // pages held by each CPU
+#define PMM_CACHE_BATCH         32          // pages moved per refill or drain
+
+// pages shared copy-on-write count their extra references
+#define PMM_SHARE_MAX           0xFFFE
+#define PMM_SHARE_UNMANAGED     0xFFFF      // never handed out by the allocator
+
 // these flags control allocated memory
 #define VMM_USER                0x01        // kernel-user toggle
 #define VMM_EXEC                0x02
 #define VMM_WRITE               0x04
 #define VMM_NO_CACHE            0x08
+#define VMM_DEVICE              0x10        // mapped explicitly, never allocated on demand
+#define VMM_FILE                0x20        // contents come from a file
+
+// pages of anonymous memory brought in around a fault, at most one bit each in
+// the fault-around state of an address space
+#define VMM_FAULT_AROUND        16          // default maximum window
+#define VMM_FAULT_AROUND_MAX    64
 
 // these flags are used as platform-independent status codes after page faults
 #define VMM_PAGE_FAULT_PRESENT  0x01        // caused by a present page
@@ -39,8 +76,38 @@
 #define VMM_PAGE_SWAP_MASK      0xE00000
 #define VMM_PAGE_SWAP           0x200000    // swap from disk
 #define VMM_PAGE_ALLOCATE       0x400000    // allocate physical memory
+#define VMM_PAGE_SWAP_SHIFT     24          // swap handle stored above the type bits
+
+// cold user pages are compressed into memory once free memory drops below
+// one part in SWAP_LOW_WATERMARK, until it is back to SWAP_HIGH_WATERMARK
+#define SWAP_LOW_WATERMARK      64
+#define SWAP_HIGH_WATERMARK     32
+#define SWAP_SCAN_BATCH         256         // pages scanned per process per pass
+#define SWAP_MAX_SIZE           (PAGE_SIZE - (PAGE_SIZE / 4))   // worse compression isn't worth it
+
+// page cache of file contents, kept to at most one part in PAGE_CACHE_LIMIT of
+// usable memory
+#define PAGE_CACHE_LIMIT        4
+#define PAGE_CACHE_BUCKETS      4096
+#define PAGE_CACHE_FILE_BUCKETS 256
+
+// page cache fill flags
+#define PAGE_CACHE_EOF          0x01        // the file ends within the data
+#define PAGE_CACHE_MAPPED       0x02        // data came from mmap(), may extend past the end of the file
+
+// small kernel heap allocations come from slabs of one page, one cache per
+// size class, each with a free list per CPU
+#define SLAB_CLASSES            10
+#define SLAB_MAX_SIZE           1024        // larger allocations take whole pages
+#define SLAB_HEADER_SIZE        64
+#define SLAB_MAGAZINE_SIZE      32          // objects held on each CPU per class
+#define SLAB_EMPTY_MAX          2           // empty slabs kept around per cache
+#define SLAB_MAGIC              0x424C53584C554CULL
 
-// TODO: adjust bit masks and shifting here when implementing true swapping
+// kernel virtual address arenas
+#define VMEM_QCACHE_MAX         8           // allocations of up to this many pages are cached
+#define VMEM_QCACHE_SIZE        16          // extents cached for each of those sizes
+#define VMEM_BOOT_EXTENTS       64          // extent tags available before any are allocated
 
 // protection and flags for memory-mapped files
 #define PROT_READ               0x01
@@ -58,6 +125,25 @@
 #define MS_SYNC                 0x02
 #define MS_INVALIDATE           0x04
 
+#define MREMAP_MAYMOVE          0x01
+
+typedef struct {
+    uint64_t base, limit;           // physical address range covered by the zone
+    size_t managedPages;            // pages handed to the buddy allocator
+    size_t freePages;               // pages on the zone's free lists
+    size_t freeBlocks[PMM_ORDERS];  // free buddy blocks of each order
+    uint64_t allocations;           // blocks allocated from this zone
+    uint64_t fallbacks;             // allocations that wanted a higher zone
+} PhysicalMemoryZone;
+
+typedef struct {
+    size_t managedPages;            // pages handed to the buddy allocator
+    size_t freePages;               // pages on the node's free lists
+    uint64_t localAllocations;      // blocks given to CPUs on this node
+    uint64_t remoteAllocations;     // blocks given to CPUs on other nodes
+    uint8_t distance[PMM_MAX_NODES];
+} PhysicalMemoryNode;
+
 typedef struct {
     uint64_t highestPhysicalAddress;
     uint64_t lowestUsableAddress;
@@ -65,12 +151,110 @@ typedef struct {
     size_t highestPage;
     size_t usablePages, usedPages;
     size_t reservedPages;
+    size_t freeBlocks[PMM_ORDERS];  // free buddy blocks of each order
+    PhysicalMemoryZone zones[PMM_ZONES];
+    int nodeCount;
+    PhysicalMemoryNode nodes[PMM_MAX_NODES];
+
+    // per-CPU cache statistics
+    size_t cachedPages;
+    uint64_t cacheHits, cacheMisses;
+    uint64_t cacheRefills, cacheDrains;
+
+    // contiguous memory area statistics
+    uint64_t cmaAllocations;        // contiguous allocations served from the CMA
+    uint64_t cmaLentPages;          // CMA pages lent to movable allocations
+
+    // compaction statistics
+    uint64_t compactRuns, compactSuccesses;
+    uint64_t pagesMigrated;
+
+    // copy-on-write statistics
+    uint64_t pagesShared;           // page references shared by fork()
+    uint64_t cowFaults;             // writes to shared pages
+    uint64_t cowCopies;             // faults that had to copy the page
+
+    // compressed swap statistics
+    uint64_t swapPages;             // pages held compressed in memory
+    uint64_t swapBytes;             // memory taken up by their contents
+    uint64_t swapScanned;           // pages looked at by reclaim
+    uint64_t swapOuts, swapIns;     // pages compressed and brought back
+    uint64_t swapRejected;          // pages that didn't compress well enough
+    uint64_t swapInTime;            // nanoseconds spent on swap-ins
 } PhysicalMemoryStatus;
 
+typedef struct {
+    lock_t lock;                // only ever contended by the owning CPU
+    int node;                   // NUMA node of the owning CPU
+    int count;
+    uintptr_t pages[PMM_CACHE_SIZE];
+} PhysicalMemoryCache;
+
 typedef struct {
     uint64_t usedPages, usedBytes;
 } KernelHeapStatus;
 
+// range of kernel virtual addresses, with its free extents kept in two AVL
+// trees, one by address for coalescing and one by size for best-fit searches
+struct VmemExtent;
+
+typedef struct {
+    lock_t lock;
+    bool ready;
+    uintptr_t base, limit;          // limit is exclusive
+    struct VmemExtent *roots[2];
+
+    // recently freed small extents, by size in pages
+    int qcount[VMEM_QCACHE_MAX];
+    uintptr_t qcache[VMEM_QCACHE_MAX][VMEM_QCACHE_SIZE];
+
+    size_t extents;                 // free extents in the trees
+    size_t freePages, usedPages;
+    uint64_t allocations, frees, qcacheHits;
+} VmemArena;
+
+typedef struct {
+    lock_t lock;                // only ever contended by the owning CPU
+    int count[SLAB_CLASSES];
+    void *objects[SLAB_CLASSES][SLAB_MAGAZINE_SIZE];
+} SlabCPUCache;
+
+typedef struct {
+    size_t size;                // object size
+    size_t slabs;               // pages backing the cache
+    size_t objects;             // objects the slabs can hold
+    size_t used;                // objects handed out and not yet freed
+    uint64_t allocations, frees;
+    uint64_t cpuHits, cpuMisses;    // served by the per-CPU free lists or not
+} SlabStatus;
+
+// virtual memory area, a range of pages with the same flags
+typedef struct VMA {
+    uintptr_t base, limit;          // limit is exclusive
+    int flags;                      // VMM flags
+
+    // AVL tree keyed by base, and the subtree information for gap searches
+    struct VMA *left, *right;
+    int height;
+    uintptr_t minBase, maxLimit;
+    uintptr_t maxGap;
+} VMA;
+
+typedef struct {
+    lock_t lock;
+    VMA *root;
+    size_t count;
+    size_t pages;                   // pages committed, excluding device memory
+
+    // fault-around window of the last fault, and statistics for tuning it
+    uintptr_t faultBase, faultLimit;
+    size_t faultWindow;
+    uint64_t prefaultMask;          // pages of the window that were prefaulted
+    uint64_t faults, prefaulted, prefaultHits;
+
+    uintptr_t reclaimCursor;        // where the next swap scan resumes
+} VMATree;
+
 typedef struct {
     int fd, prot, flags;
     pid_t pid, tid;     // original owner
@@ -91,19 +275,80 @@ struct MmapSyscallParams {
 };
 
 void pmmInit(KernelBootInfo *);
+void pmmInitBuddy();
+int pmmAddNodeRange(int, uintptr_t, uint64_t);
+void pmmSetNodeDistance(int, int, int);
+void pmmInitNUMA(int);
+void pmmPin(uintptr_t, size_t);
+void pmmPinPage(uintptr_t);
+uintptr_t pmmCompactionWindow(size_t, uintptr_t, uintptr_t);
+size_t pmmClaimRange(uintptr_t, size_t, bool *);
+bool pmmNeedsCompaction(int);
+uintptr_t pmmCompact(size_t, uintptr_t, uintptr_t);
+void compactStatus(PhysicalMemoryStatus *);
+void *compactionThread(void *);
 void pmmStatus(PhysicalMemoryStatus *);
 uintptr_t pmmAllocate(void);
 uintptr_t pmmAllocateContiguous(size_t, int);
+uintptr_t pmmAllocateMovable(void);
 int pmmFree(uintptr_t);
 int pmmFreeContiguous(uintptr_t, size_t);
+size_t pmmAllocateBatch(size_t, uintptr_t *);
+int pmmFreeBatch(size_t, uintptr_t *);
+bool pmmShare(uintptr_t);
+int pmmShareCount(uintptr_t);
+uintptr_t pmmUnshare(uintptr_t);
+void pmmMoveShares(uintptr_t, uintptr_t);
+bool pmmReclaimable(uintptr_t);
 
-void vmmInit();
+void vmmInit(KernelBootInfo *);
 uintptr_t vmmAllocate(uintptr_t, uintptr_t, size_t, int);
 int vmmFree(uintptr_t, size_t);
 int vmmPageFault(uintptr_t, int);       // the platform-specific page fault handler must call this
 uintptr_t vmmMMIO(uintptr_t, bool);
 int vmmPageStatus(uintptr_t, uintptr_t *);
 uintptr_t vmmSetFlags(uintptr_t, size_t, int);
+int vmmRelease(uintptr_t, size_t);
+int vmmMove(uintptr_t, uintptr_t, size_t);
+uintptr_t vmmRemap(uintptr_t, size_t, size_t, uintptr_t, uintptr_t, int, bool);
+
+VMATree *vmaCreate();
+VMATree *vmaClone(VMATree *);
+void vmaDestroy(VMATree *);
+bool vmaFind(VMATree *, uintptr_t, VMA *);
+uintptr_t vmaAllocate(VMATree *, uintptr_t, uintptr_t, size_t, int);
+int vmaRemove(VMATree *, uintptr_t, size_t);
+int vmaProtect(VMATree *, uintptr_t, size_t, int);
+
+void swapInit(KernelBootInfo *);
+void swapStatus(PhysicalMemoryStatus *);
+int swapIn(uintptr_t, uintptr_t, int);
+bool swapShare(uintptr_t);
+void swapDiscard(uintptr_t);
+void *reclaimThread(void *);
+
+extern VmemArena kernelHeapArena;
+uintptr_t vmemAllocate(VmemArena *, size_t);
+bool vmemClaim(VmemArena *, uintptr_t, size_t);
+void vmemFree(VmemArena *, uintptr_t, size_t);
+void vmemStatus(VmemArena *, size_t *, size_t *, size_t *);
+
+extern bool heapGuard;
+void slabInit(KernelBootInfo *);
+void *slabAllocate(size_t);
+bool slabFree(void *);
+size_t slabSize(const void *);
+int slabStatus(SlabStatus *, int);
+
+void pageCacheInit(KernelBootInfo *);
+ssize_t pageCacheRead(Thread *, const char *, uint64_t, off_t, uintptr_t, size_t);
+uint64_t pageCacheGeneration(const char *, uint64_t);
+void pageCacheFill(const char *, uint64_t, off_t, const void *, size_t, int, uint64_t);
+bool pageCacheMap(const char *, uint64_t, off_t, size_t, uintptr_t);
+void pageCacheInvalidate(const char *, uint64_t, off_t, size_t);
+size_t pageCacheShrink(size_t);
+void pageCacheMigrate(uintptr_t, uintptr_t);
+int pageCacheStatus(const char *, uint64_t *, uint64_t *, size_t *);
 
 void *sbrk(Thread *, intptr_t);
 
@@ -111,8 +356,13 @@ uintptr_t mmio(Thread *, uintptr_t, off_t, int);
 uintptr_t pcontig(Thread *, uintptr_t, off_t, int);
 uintptr_t vtop(Thread *, uintptr_t);
 
+int copyToUser(Thread *, uintptr_t, const void *, size_t);
+int copyFromUser(Thread *, void *, uintptr_t, size_t);
+ssize_t strncpyFromUser(Thread *, char *, uintptr_t, size_t);
+
 void *mmap(Thread *, uint64_t, void *, size_t, int, int, int, off_t);
 int munmap(Thread *, void *, size_t);
+void *mremap(Thread *, void *, size_t, size_t, int);
 int msync(Thread *, uint64_t, void *, size_t, int);
 
 void mmapHandle(MmapCommand *, SyscallRequest *);
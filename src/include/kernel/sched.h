@@ -15,6 +15,7 @@
 #include <platform/lock.h>
 #include <kernel/syscalls.h>
 #include <kernel/io.h>
+#include <kernel/timer.h>
 
 typedef struct Process Process;
 typedef struct Thread Thread;
@@ -25,6 +26,13 @@ typedef struct Thread Thread;
 #define SCHED_TIME_SLICE        1       // ms
 
 #define MAX_PID                 99999
+#define PID_INDEX_LEAF          256     // IDs per leaf of the PID/TID index
+#define MAX_PROCESS_TIMERS      32      // timer_create() timers per process
+
+// per-CPU run queues are balanced by pulling threads from the busiest queue
+// every so often, when it is longer than the local one by a margin
+#define SCHED_BALANCE_INTERVAL  100     // timer ticks
+#define SCHED_IMBALANCE         2       // threads
 
 #define THREAD_QUEUED           0
 #define THREAD_RUNNING          1
@@ -32,9 +40,19 @@ typedef struct Thread Thread;
 #define THREAD_ZOMBIE           3
 #define THREAD_SLEEP            4
 
-#define PRIORITY_NORMAL         1
-#define PRIORITY_HIGH           2
-#define PRIORITY_HIGHEST        3
+#define PRIORITY_LOW            1
+#define PRIORITY_NORMAL         2
+#define PRIORITY_HIGH           3
+#define PRIORITY_HIGHEST        4
+#define PRIORITY_LEVELS         4
+
+// threads of a lower priority that have waited this long are run anyway
+#define SCHED_STARVATION_LIMIT  100000000   // ns
+
+// setpriority() and getpriority()
+#define PRIO_PROCESS            0
+#define PRIO_PGRP               1
+#define PRIO_USER               2
 
 // exit status
 #define EXIT_NORMAL             0x100
@@ -54,8 +72,9 @@ typedef struct SignalQueue {
 struct Thread {
     int status, cpu, priority;
     pid_t pid, tid;         // pid == tid for the main thread
-    uint64_t time;          // timeslice OR sleep time if sleeping thread
+    uint64_t time;          // timeslice
     lock_t lock;
+    KernelTimer sleepTimer; // wakes the thread up if it is sleeping
 
     bool normalExit;        // true when the thread ends by exit() and is not forcefully killed
     bool clean;             // true when the exit status has been read by waitpid()
@@ -74,6 +93,14 @@ struct Thread {
     int pages;              // memory pages used
 
     struct Thread *next;
+
+    // run queue the thread is waiting in, if any
+    bool enqueued;
+    int runLevel;           // priority level it was queued at
+    struct RunQueue *runQueue;
+    struct Thread *runNext;
+    uint64_t queuedAt;      // nanoseconds
+
     void *context;          // platform-specific (page tables, registers, etc)
     void *signalContext;
 
@@ -99,6 +126,11 @@ struct Process {
 
     int pages;              // memory pages used
 
+    // setitimer() and alarm() timer, and timer_create() timers
+    KernelTimer realTimer;
+    uint64_t realInterval;  // timer ticks
+    struct ProcessTimer *timers[MAX_PROCESS_TIMERS];
+
     size_t threadCount;
     size_t childrenCount;
 
@@ -107,28 +139,55 @@ struct Process {
     struct Process *next;
 };
 
+// threads of one CPU that are ready to run, one list per priority level;
+// blocked, sleeping and exited threads are never kept here
+typedef struct RunQueue {
+    lock_t lock;
+    Thread *head[PRIORITY_LEVELS], *tail[PRIORITY_LEVELS];
+    uint32_t levels;                // bitmap of non-empty levels
+    size_t count;
+    uint64_t ticks;                 // timer ticks, for load balancing
+    int cpu;                        // index of the CPU it belongs to
+    bool idle;                      // CPU is halted with its timer stopped
+
+    uint64_t switches;              // threads switched to
+    uint64_t steals, pulls;         // threads taken while idle and while balancing
+    uint64_t latency, maxLatency;   // total and worst time from queueing to running, ns
+} RunQueue;
+
+typedef struct {
+    size_t queued;
+    uint64_t switches, steals, pulls;
+    uint64_t latency, maxLatency;
+} SchedCPUStatus;
+
 extern int processes, threads;
 void schedInit();
 void schedLock();
 void schedRelease();
-uint64_t schedTimer();
+uint64_t schedTimer(uint64_t);
+uint64_t schedIdle();
+void schedResume();
 pid_t getPid();
 pid_t getTid();
 void *schedGetState(pid_t);
 void schedule();
 Process *getProcess(pid_t);
 Thread *getThread(pid_t);
+bool indexThread(pid_t, Thread *);
 uint64_t schedTimeslice(Thread *, int);
 void schedAdjustTimeslice();
 void setScheduling(bool);
 void blockThread(Thread *);
 void unblockThread(Thread *);
 Process *getProcessQueue();
-void schedStatus();
+bool processIsIdle(Process *);
+int schedStatus(SchedCPUStatus *, int);
 bool schedBusy();
 
 pid_t kthreadCreate(void *(*)(void *), void *);
 pid_t processCreate();
+void processDestroy(Process *);
 int threadUseContext(pid_t);
 void setLocalSched(bool);
 
@@ -139,9 +198,9 @@ void setKernelPID(pid_t);
 pid_t getKernelPID();
 int schedException(pid_t, pid_t);
 void terminateThread(Thread *, int, bool);
-void schedSleepTimer();
 Thread *getKernelThread();
 void threadCleanup(Thread *);
+void schedDequeue(Thread *);
 
 // these functions are exposed as system calls, but some will need to take
 // the thread as an argument from the system call handler - the actual user
@@ -154,4 +213,7 @@ int execve(Thread *, uint16_t, const char *, const char **, const char **);
 int execveHandle(void *);
 int execrdv(Thread *, const char *, const char **);
 unsigned long msleep(Thread *, unsigned long);
+int setpriority(Thread *, int, id_t, int);
+int getpriority(Thread *, int, id_t);
+void schedSetPriority(Thread *, int);
 pid_t waitpid(Thread *, pid_t, int *, int);
@@ -30,8 +30,12 @@
 #define COMMAND_PROCESS_LIST    0x0005  // get list of processes/threads
 #define COMMAND_PROCESS_STATUS  0x0006  // get status of process/thread
 #define COMMAND_FRAMEBUFFER     0x0007  // request frame buffer access
+#define COMMAND_CACHE_INVALIDATE    0x0008  // drop cached pages of a changed file
+#define COMMAND_CACHE_STATUS    0x0009  // get page cache statistics of a device
+#define COMMAND_HEAP_STATUS     0x000A  // get kernel heap statistics
+#define COMMAND_SCHED_STATUS    0x000B  // get run queue statistics of each CPU
 
-#define MAX_GENERAL_COMMAND     0x0007
+#define MAX_GENERAL_COMMAND     0x000B
 
 /* these commands are requested by the kernel for lumen to fulfill syscall requests */
 #define COMMAND_STAT            0x8000
@@ -107,6 +111,67 @@ typedef struct {
     char cpu[64];                   // CPU model
 } SysInfoResponse;
 
+/* process status command */
+typedef struct {
+    MessageHeader header;
+    pid_t pid, parent;
+    uid_t user;
+    gid_t group;
+    int threads;
+    uint64_t committedPages;    // memory reserved by the process
+    uint64_t residentPages;     // memory actually backed by physical pages
+    uint64_t faults;            // page faults on untouched memory
+    uint64_t prefaultedPages;   // pages brought in around those faults
+    uint64_t prefaultHits;      // prefaulted pages that were later touched
+} ProcessStatusCommand;
+
+/* page cache invalidation command, sent by file system servers when a file
+ * changes other than through write() */
+typedef struct {
+    MessageHeader header;
+    char device[MAX_FILE_PATH];
+    uint64_t id;
+    off_t offset;
+    size_t length;          // zero for the whole file
+} CacheInvalidateCommand;
+
+/* page cache status command */
+typedef struct {
+    MessageHeader header;
+    char device[MAX_FILE_PATH];
+    uint64_t hits, misses;  // read() and mmap() requests served or not
+    uint64_t pages;         // pages cached
+} CacheStatusCommand;
+
+/* kernel heap status command, one entry per slab cache */
+typedef struct {
+    MessageHeader header;
+    uint64_t usedPages;         // virtual pages allocated from the heap
+    uint64_t freePages;         // and not allocated
+    uint64_t freeExtents;       // free ranges the latter is split into
+    int caches;
+    struct {
+        uint64_t size;              // object size
+        uint64_t slabs, objects;    // pages backing the cache and objects they hold
+        uint64_t used;              // objects in use
+        uint64_t allocations, frees;
+        uint64_t cpuHits, cpuMisses;    // served by the per-CPU free lists or not
+    } cache[16];
+} HeapStatusCommand;
+
+/* scheduler status command, one entry per CPU */
+typedef struct {
+    MessageHeader header;
+    int cpus;
+    struct {
+        uint64_t queued;            // threads waiting to run
+        uint64_t switches;          // threads switched to
+        uint64_t steals, pulls;     // threads taken from other CPUs while idle and while balancing
+        uint64_t latency;           // total time threads waited to run, ns
+        uint64_t maxLatency;        // and the longest wait
+    } cpu[64];
+} SchedStatusCommand;
+
 /* framebuffer access command */
 typedef struct {
     MessageHeader header;
@@ -86,6 +86,24 @@ typedef struct {
     long si_band;
 } siginfo_t;
 
+// timer_create() notification
+#define SIGEV_SIGNAL    0
+#define SIGEV_NONE      1
+#define SIGEV_THREAD    2
+
+union sigval {
+    int sival_int;
+    void *sival_ptr;
+};
+
+struct sigevent {
+    int sigev_notify;
+    int sigev_signo;
+    union sigval sigev_value;
+    void (*sigev_notify_function)(union sigval);
+    void *sigev_notify_attributes;
+};
+
 struct sigaction {
     union {
         void (*sa_handler)(int);
@@ -11,7 +11,7 @@
 #include <stdbool.h>
 #include <kernel/sched.h>
 
-#define MAX_SYSCALL             66
+#define MAX_SYSCALL             77
 
 /* IPC syscall indexes, this range will be used for immediate handling without
  * waiting for the kernel thread to dispatch the syscall */
@@ -30,6 +30,7 @@ typedef struct SyscallRequest {
     uint64_t function;
     uint64_t params[4];
     uint64_t ret;           // return value from the kernel to the program
+    uint64_t cacheGeneration;   // page cache generation of the file being read
 
     struct Thread *thread;
     struct SyscallRequest *next;
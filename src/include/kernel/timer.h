@@ -0,0 +1,39 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// hierarchical timer wheel, each level covering SLOTS times the range of the
+// one below it; 64^4 ticks is a little under two days at 100 Hz, and longer
+// timers are parked in the top level until they come within range
+#define TIMER_WHEEL_BITS        6
+#define TIMER_WHEEL_SLOTS       (1 << TIMER_WHEEL_BITS)     // must fit in a uint64_t bitmap
+#define TIMER_WHEEL_LEVELS      4
+
+// kernel timers are embedded in whatever structure they belong to
+typedef struct KernelTimer {
+    uint64_t deadline;              // uptime in timer ticks
+
+    // called with the timer wheel locked when the deadline is reached, and
+    // so must not start or cancel timers; returns the deadline to go off at
+    // next, zero to stop
+    uint64_t (*expire)(struct KernelTimer *);
+    void *arg;
+
+    bool pending;
+    int level, slot;
+    struct KernelTimer *next, *prev;
+} KernelTimer;
+
+void ktimerStart(KernelTimer *, uint64_t);
+bool ktimerCancel(KernelTimer *);
+uint64_t ktimerRemaining(KernelTimer *);
+void ktimerExpire();
+uint64_t ktimerNext();
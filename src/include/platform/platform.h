@@ -24,6 +24,8 @@
 #define PLATFORM_PAGE_EXEC                  0x0008
 #define PLATFORM_PAGE_WRITE                 0x0010
 #define PLATFORM_PAGE_NO_CACHE              0x0020
+#define PLATFORM_PAGE_COW                   0x0040      // read-only until copied on write
+#define PLATFORM_PAGE_ACCESSED              0x0080      // touched since it was mapped
 #define PLATFORM_PAGE_ERROR                 0x8000      // all bits invalid if this bit is set
 
 extern char *platformCPUModel;
@@ -31,14 +33,25 @@ extern char *platformCPUModel;
 int platformCPUSetup();         // very early setup for one CPU
 int platformPagingSetup();      // paging setup for virtual memory management
 uintptr_t platformGetPage(int *, uintptr_t);     // get physical address and flags of a page
+uintptr_t platformGetThreadPage(void *, int *, uintptr_t);   // same, in another thread's address space
 uintptr_t platformMapPage(uintptr_t, uintptr_t, int);    // map a physical address to a virtual address
 int platformUnmapPage(uintptr_t);               // and vice versa
+typedef int (*PlatformPageWalker)(uintptr_t, uintptr_t *, void *);
+int platformWalkUserPages(void *, PlatformPageWalker, void *);  // visit every present user page of a thread
+typedef int (*PlatformPageScanner)(uintptr_t, uintptr_t *, int *, void *);
+size_t platformScanUserPages(void *, uintptr_t *, size_t, PlatformPageScanner, void *);  // and resumably change their flags
+void platformFlushTLB();        // flush the local CPU's translations
+void platformInvalidateTLB();   // and every other CPU's
+void platformInvalidatePages(uintptr_t, size_t);    // invalidate a range wherever the address space is in use
 
 int platformRegisterCPU(void *);    // registers a CPU, relevant to multiprocessor systems
 int platformCountCPU();
 void *platformGetCPU(int);          // find CPU structure from index
 int platformWhichCPU();             // index of current CPU
 uint64_t platformUptime();          // total uptime of boot CPU
+uint64_t platformNanoseconds();     // high-resolution timestamp for short intervals
+void platformSetTimer(uint64_t);    // ticks until the next timer interrupt on this CPU, zero to stop it
+void platformWakeCPU(int);          // interrupt a CPU idling with its timer stopped
 void platformAcknowledgeIRQ(void *);    // must be called at the end of interrupt handlers
 void platformInitialSeed();
 uint64_t platformRand();
@@ -49,21 +62,27 @@ void platformSwitchContext(Thread *);       // perform a context switch
 void platformHalt();                        // halt the CPU until the next context switch
 void *platformGetPagingRoot();
 void *platformCloneKernelSpace();           // clone kernel thread page tables
-void *platformCloneUserSpace(uintptr_t);    // clone user thread page tables
+void *platformCloneUserSpace(uintptr_t, bool);  // clone user thread page tables, optionally copy-on-write
 pid_t platformGetPid();
 pid_t platformGetTid();
 Process *platformGetProcess();
 Thread *platformGetThread();
 int platformUseContext(void *);     // use the paging context of a thread without switching context
 SyscallRequest *platformCreateSyscallContext(Thread *); // create syscall context from register state
-void *platformCloneContext(void *, const void *);   // for fork()
+void *platformCloneContext(void *, const void *, bool);     // for fork()
 void platformSetContextStatus(void *, uint64_t);    // store syscall return value in the context
 int platformIoperm(Thread *, uintptr_t, uintptr_t, int);    // request I/O port access
 int platformGetMaxIRQ();        // maximum interrupt implemented by hardware
 int platformConfigureIRQ(Thread *, int, IRQHandler *);  // configure an IRQ pin
 IRQCommand *platformGetIRQCommand();    // per-CPU IRQ command structure
+void *platformGetPMMCache();    // per-CPU physical page cache, NULL if not set up yet
+void *platformGetSlabCache();   // per-CPU slab free lists, NULL if not set up yet
+void *platformGetRunQueue(int); // run queue of a CPU by index, NULL if not set up yet
+void *platformGetVMAs();        // memory areas of the address space in use, NULL if none
 void platformIdle();            // to be called when the CPU is idle
 void platformCleanThread(void *, uintptr_t);   // garbage collector after thread is killed or replaced by exec()
+void platformMemoryUsage(void *, size_t *, size_t *);  // committed and resident pages of a thread context
+void *platformGetContextVMAs(void *);   // memory areas of a thread context, NULL if none
 int platformSendSignal(Thread *, Thread *, int, uintptr_t);
 void platformSigreturn(Thread *);
 time_t platformTimestamp();         // unix timestamp
@@ -12,6 +12,7 @@
 void *memcpy(void *, const void *, size_t);
 void *memmove(void *, const void *, size_t);
 size_t strlen(const char *);
+size_t strnlen(const char *, size_t);
 char *strcpy(char *, const char *);
 void *memset(void *, int, size_t);
 int strcmp(const char *, const char *);
@@ -10,9 +10,52 @@
 #include <sys/types.h>
 #include <kernel/sched.h>
 
+// setitimer() and getitimer()
+#define ITIMER_REAL             0
+#define ITIMER_VIRTUAL          1
+#define ITIMER_PROF             2
+
+// clocks for timer_create()
+#define CLOCK_REALTIME          0
+#define CLOCK_MONOTONIC         1
+
+// timer_settime() flags
+#define TIMER_ABSTIME           0x01
+
 struct timeval {
     time_t tv_sec;
     suseconds_t tv_usec;
 };
 
+struct timespec {
+    time_t tv_sec;
+    long tv_nsec;
+};
+
+struct itimerval {
+    struct timeval it_interval;
+    struct timeval it_value;
+};
+
+struct itimerspec {
+    struct timespec it_interval;
+    struct timespec it_value;
+};
+
+struct sigevent;
+
 int gettimeofday(Thread *, struct timeval *, void *);
+uint64_t timevalTicks(const struct timeval *);
+uint64_t timespecTicks(const struct timespec *);
+void ticksTimeval(uint64_t, struct timeval *);
+void ticksTimespec(uint64_t, struct timespec *);
+
+int nanosleep(Thread *, const struct timespec *, struct timespec *);
+int setitimer(Thread *, int, const struct itimerval *, struct itimerval *);
+int getitimer(Thread *, int, struct itimerval *);
+unsigned int alarm(Thread *, unsigned int);
+int timer_create(Thread *, clockid_t, const struct sigevent *, timer_t *);
+int timer_settime(Thread *, timer_t, int, const struct itimerspec *, struct itimerspec *);
+int timer_gettime(Thread *, timer_t, struct itimerspec *);
+int timer_delete(Thread *, timer_t);
+void timerRelease(Process *);
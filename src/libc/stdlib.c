@@ -13,8 +13,6 @@
 #include <platform/platform.h>
 #include <platform/lock.h>
 
-static lock_t lock = LOCK_INITIAL;
-
 struct mallocHeader {
     uint64_t byteSize;
     uint64_t pageSize;
@@ -94,86 +92,83 @@ long atol(const char *s) {
     return v;
 }
 
-void *malloc(size_t size) {
-    if(!size) return NULL;
-    size_t pageSize = (size + sizeof(struct mallocHeader) + PAGE_SIZE - 1) / PAGE_SIZE;
+/* pageAllocate(): allocates whole pages of memory, for large allocations and
+ * for the user heap
+ * params: size - number of bytes to allocate
+ * params: base - base of the heap
+ * params: limit - limit of the heap
+ * params: flags - VMM flags of the pages
+ * params: guard - true to leave an unmapped page after the allocation
+ * returns: pointer to the allocated memory, NULL on fail
+ */
 
-    acquireLockBlocking(&lock);
+static void *pageAllocate(size_t size, uintptr_t base, uintptr_t limit, int flags, bool guard) {
+    size_t pageSize = (size + sizeof(struct mallocHeader) + PAGE_SIZE - 1) / PAGE_SIZE;
+    size_t totalSize = guard ? pageSize + 1 : pageSize;
 
-    // allocate memory with kernel permissions, write permissions, and no execute
-    // there's probably never a scenario where it's a good idea to execute code
-    // in a block of memory allocated by malloc() or its derivatives
-    uintptr_t ptr = vmmAllocate(KERNEL_HEAP_BASE, KERNEL_HEAP_LIMIT, pageSize, VMM_WRITE);
-    if(!ptr) {
-        releaseLock(&lock);
-        return NULL;
-    }
+    uintptr_t ptr = vmmAllocate(base, limit, totalSize, flags);
+    if(!ptr) return NULL;
 
     struct mallocHeader *header = (struct mallocHeader *)ptr;
     header->byteSize = size;
-    header->pageSize = pageSize;
-
-    // allocate a guard page as well
-    uintptr_t guard = ptr + (pageSize*PAGE_SIZE);
-    platformMapPage(guard, 0, 0);
+    header->pageSize = totalSize;
 
-    releaseLock(&lock);
+    // the guard page is reserved along with the allocation but never backed
+    // by memory, so running past the end faults
+    if(guard) platformMapPage(ptr + (pageSize*PAGE_SIZE), 0, 0);
 
     return (void *)((uintptr_t)ptr + sizeof(struct mallocHeader));
 }
 
-void *umalloc(size_t size) {
-    /* this is the exact same as malloc() but allocates in the user space to
-     * be used for signal structures */
-    if(!size) return NULL;
-    size_t pageSize = (size + sizeof(struct mallocHeader) + PAGE_SIZE - 1) / PAGE_SIZE;
+/* pageReallocate(): resizes an allocation made by pageAllocate() by moving
+ * its page table entries instead of copying its contents
+ * params: ptr - pointer to the allocation
+ * params: size - new size in bytes
+ * params: base - base of the heap
+ * params: limit - limit of the heap
+ * params: flags - VMM flags of the pages
+ * returns: pointer to the resized allocation, NULL on fail
+ */
 
-    acquireLockBlocking(&lock);
+static void *pageReallocate(void *ptr, size_t size, uintptr_t base, uintptr_t limit, int flags) {
+    uintptr_t oldBase = (uintptr_t)ptr & ~(PAGE_SIZE-1);
+    struct mallocHeader *header = (struct mallocHeader *)oldBase;
+    size_t pageSize = (size + sizeof(struct mallocHeader) + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    uintptr_t ptr = vmmAllocate(USER_HEAP_BASE, USER_HEAP_LIMIT, pageSize, VMM_WRITE | VMM_USER);
-    if(!ptr) {
-        releaseLock(&lock);
-        return NULL;
-    }
+    uintptr_t newBase = vmmRemap(oldBase, header->pageSize, pageSize, base, limit, flags, true);
+    if(!newBase) return NULL;
 
-    struct mallocHeader *header = (struct mallocHeader *)ptr;
+    header = (struct mallocHeader *)newBase;
     header->byteSize = size;
     header->pageSize = pageSize;
+    return (void *)(newBase + sizeof(struct mallocHeader));
+}
 
-    // allocate a guard page as well
-    uintptr_t guard = ptr + (pageSize*PAGE_SIZE);
-    platformMapPage(guard, 0, 0);
+void *malloc(size_t size) {
+    if(!size) return NULL;
 
-    releaseLock(&lock);
+    // small allocations come from the slab caches unless guard pages are on
+    void *ptr = slabAllocate(size);
+    if(ptr) return ptr;
 
-    return (void *)((uintptr_t)ptr + sizeof(struct mallocHeader));
+    // allocate memory with kernel permissions, write permissions, and no execute
+    // there's probably never a scenario where it's a good idea to execute code
+    // in a block of memory allocated by malloc() or its derivatives
+    return pageAllocate(size, KERNEL_HEAP_BASE, KERNEL_HEAP_LIMIT, VMM_WRITE, heapGuard);
+}
+
+void *umalloc(size_t size) {
+    /* this is the exact same as malloc() but allocates in the user space to
+     * be used for signal structures */
+    if(!size) return NULL;
+    return pageAllocate(size, USER_HEAP_BASE, USER_HEAP_LIMIT, VMM_WRITE | VMM_USER, heapGuard);
 }
 
 void *uxmalloc(size_t size) {
     /* again exactly the same umalloc() but with execute permissions, this will
      * be used for installing platform-specific signal trampoline code */
     if(!size) return NULL;
-    size_t pageSize = (size + sizeof(struct mallocHeader) + PAGE_SIZE - 1) / PAGE_SIZE;
-
-    acquireLockBlocking(&lock);
-
-    uintptr_t ptr = vmmAllocate(USER_HEAP_BASE, USER_HEAP_LIMIT, pageSize, VMM_WRITE | VMM_USER | VMM_EXEC);
-    if(!ptr) {
-        releaseLock(&lock);
-        return NULL;
-    }
-
-    struct mallocHeader *header = (struct mallocHeader *)ptr;
-    header->byteSize = size;
-    header->pageSize = pageSize;
-
-    // allocate a guard page as well
-    uintptr_t guard = ptr + (pageSize*PAGE_SIZE);
-    platformMapPage(guard, 0, 0);
-
-    releaseLock(&lock);
-
-    return (void *)((uintptr_t)ptr + sizeof(struct mallocHeader));
+    return pageAllocate(size, USER_HEAP_BASE, USER_HEAP_LIMIT, VMM_WRITE | VMM_USER | VMM_EXEC, heapGuard);
 }
 
 void *calloc(size_t num, size_t size) {
@@ -194,13 +189,24 @@ void *realloc(void *ptr, size_t newSize) {
     if(!newSize) return NULL;
     if(!ptr) return malloc(newSize);
 
+    // slab objects that are already big enough stay where they are
+    size_t oldSize = slabSize(ptr);
+    if(oldSize && (newSize <= oldSize)) return ptr;
+
+    // whole-page allocations are resized in the page tables, except with
+    // guard pages, which would have to move out of the way first
+    if(!oldSize && !heapGuard)
+        return pageReallocate(ptr, newSize, KERNEL_HEAP_BASE, KERNEL_HEAP_LIMIT, VMM_WRITE);
+
     void *newPtr = malloc(newSize);
     if(!newPtr) return NULL;
 
-    uintptr_t oldBase = (uintptr_t)ptr;
-    oldBase &= ~(PAGE_SIZE-1);
-    struct mallocHeader *header = (struct mallocHeader *)oldBase;
-    size_t oldSize = header->byteSize;
+    if(!oldSize) {
+        uintptr_t oldBase = (uintptr_t)ptr;
+        oldBase &= ~(PAGE_SIZE-1);
+        struct mallocHeader *header = (struct mallocHeader *)oldBase;
+        oldSize = header->byteSize;
+    }
 
     if(oldSize > newSize) {
         // we're shrinking the memory, copy the new size only
@@ -216,6 +222,7 @@ void *realloc(void *ptr, size_t newSize) {
 void *urealloc(void *ptr, size_t newSize) {
     if(!newSize) return NULL;
     if(!ptr) return umalloc(newSize);
+    if(!heapGuard) return pageReallocate(ptr, newSize, USER_HEAP_BASE, USER_HEAP_LIMIT, VMM_WRITE | VMM_USER);
 
     void *newPtr = umalloc(newSize);
     if(!newPtr) return NULL;
@@ -238,6 +245,8 @@ void *urealloc(void *ptr, size_t newSize) {
 
 void free(void *ptr) {
     if(!ptr) return;
+    if(slabFree(ptr)) return;
+
     uintptr_t base = (uintptr_t)ptr;
     base &= ~(PAGE_SIZE-1);
     struct mallocHeader *header = (struct mallocHeader *)base;
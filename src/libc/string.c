@@ -17,6 +17,12 @@ size_t strlen(const char *s) {
     return i;
 }
 
+size_t strnlen(const char *s, size_t max) {
+    size_t i = 0;
+    while((i < max) && s[i]) i++;
+    return i;
+}
+
 char *strcpy(char *dst, const char *src) {
     return (char *)memcpy(dst, src, strlen(src)+1);
 }
@@ -111,6 +111,12 @@ int main(int argc, char **argv) {
     for(int i = 0; i < platformCountCPU(); i++)
         kthreadCreate(&idleThread, NULL);
 
+    // background memory compaction
+    kthreadCreate(&compactionThread, NULL);
+
+    // compressed swap when memory runs low
+    kthreadCreate(&reclaimThread, NULL);
+
     // now enable the scheduler
     setScheduling(true);
 
@@ -44,8 +44,6 @@ void *sbrk(Thread *t, intptr_t delta) {
             return (void *) -ENOMEM;
         }
 
-        memset((void *)ptr, 0, pages*PAGE_SIZE);
-
         t->pages += pages;
         p->pages += pages;
         t->highest += (pages * PAGE_SIZE);
@@ -0,0 +1,244 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* Physical Memory Compaction */
+
+/* when free memory is too fragmented for a contiguous allocation, a range of
+ * memory is chosen whose used pages all belong to user processes; those pages
+ * are copied elsewhere and every page table entry pointing at them is
+ * rewritten, leaving the whole range free
+ *
+ * the scheduler is locked throughout, and only processes with no thread on a
+ * CPU and no system call in progress are touched; stale translations are shot
+ * down on every CPU before the old pages are handed out */
+
+#include <stdlib.h>
+#include <string.h>
+#include <kernel/memory.h>
+#include <kernel/sched.h>
+#include <kernel/logger.h>
+#include <platform/platform.h>
+#include <platform/mmap.h>
+
+static lock_t lock = LOCK_INITIAL;
+static uint64_t runs = 0, successes = 0, migrated = 0;
+
+typedef struct {
+    uintptr_t base;
+    size_t count;
+    bool *claimed;          // free pages taken off the free lists
+    bool *mapped;           // pages found in a user page table
+    uintptr_t *copies;      // new location of each migrated page
+    bool busy;              // set when a page belongs to a running process
+} CompactionRange;
+
+/* findPages(): page walker that records which pages of the range are mapped */
+
+static int findPages(uintptr_t virt, uintptr_t *phys, void *arg) {
+    CompactionRange *range = (CompactionRange *) arg;
+    if((*phys < range->base) || (*phys >= (range->base + (range->count * PAGE_SIZE))))
+        return 0;
+
+    range->mapped[(*phys - range->base) / PAGE_SIZE] = true;
+    return 0;
+}
+
+/* findBusyPages(): page walker that fails if a page of the range is mapped */
+
+static int findBusyPages(uintptr_t virt, uintptr_t *phys, void *arg) {
+    CompactionRange *range = (CompactionRange *) arg;
+    if((*phys < range->base) || (*phys >= (range->base + (range->count * PAGE_SIZE))))
+        return 0;
+
+    range->busy = true;
+    return 1;
+}
+
+/* remapPages(): page walker that points mappings at the migrated copies */
+
+static int remapPages(uintptr_t virt, uintptr_t *phys, void *arg) {
+    CompactionRange *range = (CompactionRange *) arg;
+    if((*phys < range->base) || (*phys >= (range->base + (range->count * PAGE_SIZE))))
+        return 0;
+
+    *phys = range->copies[(*phys - range->base) / PAGE_SIZE];
+    return 0;
+}
+
+/* walkProcesses(): runs a page walker over every user address space
+ * params: walker - page walker for idle processes
+ * params: busyWalker - page walker for running processes, NULL to skip them
+ * params: range - compaction range
+ * returns: nothing
+ */
+
+static void walkProcesses(PlatformPageWalker walker, PlatformPageWalker busyWalker, CompactionRange *range) {
+    Process *p = getProcessQueue();
+    while(p) {
+        PlatformPageWalker w = processIsIdle(p) ? walker : busyWalker;
+        if(w && p->threads) {
+            // threads of a process may or may not share an address space,
+            // and walking a shared one twice is harmless
+            for(size_t i = 0; i < p->threadCount; i++) {
+                if(p->threads[i]) platformWalkUserPages(p->threads[i]->context, w, range);
+                if(range->busy) return;
+            }
+        }
+
+        p = p->next;
+    }
+}
+
+/* pmmCompact(): frees up a contiguous range of memory by migrating user pages
+ * out of the way, and then allocates it
+ * params: count - number of pages
+ * params: base - lowest address the range may start at
+ * params: limit - highest address the range may extend to
+ * returns: physical address of the allocated range, zero on fail
+ */
+
+uintptr_t pmmCompact(size_t count, uintptr_t base, uintptr_t limit) {
+    if(!count) return 0;
+
+    // only one compaction at a time, anyone else just fails the allocation
+    if(!acquireLock(&lock)) return 0;
+    runs++;
+
+    CompactionRange range;
+    memset(&range, 0, sizeof(CompactionRange));
+    range.count = count;
+    range.base = pmmCompactionWindow(count, base, limit);
+    if(!range.base) goto fail;
+
+    range.claimed = calloc(count, sizeof(bool));
+    range.mapped = calloc(count, sizeof(bool));
+    range.copies = calloc(count, sizeof(uintptr_t));
+    if(!range.claimed || !range.mapped || !range.copies) goto fail;
+
+    // keep anything else from allocating from the range in the meantime
+    pmmClaimRange(range.base, count, range.claimed);
+
+    schedLock();
+
+    // every used page must be mapped by a process that is not running, or
+    // else it belongs to the kernel or can change under our feet
+    walkProcesses(&findPages, &findBusyPages, &range);
+
+    size_t moving = 0;
+    for(size_t i = 0; !range.busy && (i < count); i++) {
+        if(range.claimed[i]) continue;
+        if(!range.mapped[i]) range.busy = true;
+        else moving++;
+    }
+
+    if(range.busy) {
+        schedRelease();
+        goto fail;
+    }
+
+    // copy the pages elsewhere, the claimed range guarantees the copies land
+    // outside of it
+    size_t copied = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(range.claimed[i]) continue;
+
+        range.copies[i] = pmmAllocate();
+        if(!range.copies[i]) break;
+
+        memcpy((void *)vmmMMIO(range.copies[i], true), (const void *)vmmMMIO(range.base + (i * PAGE_SIZE), true), PAGE_SIZE);
+        copied++;
+    }
+
+    if(copied != moving) {
+        for(size_t i = 0; i < count; i++) {
+            if(range.copies[i]) pmmFree(range.copies[i]);
+        }
+
+        schedRelease();
+        goto fail;
+    }
+
+    // pages shared copy-on-write take their references along, including the
+    // page cache's
+    for(size_t i = 0; i < count; i++) {
+        if(range.copies[i]) {
+            pmmMoveShares(range.base + (i * PAGE_SIZE), range.copies[i]);
+            pageCacheMigrate(range.base + (i * PAGE_SIZE), range.copies[i]);
+        }
+    }
+
+    walkProcesses(&remapPages, NULL, &range);
+    platformInvalidateTLB();
+    schedRelease();
+
+    // the old pages stay marked as used and now make up the allocation
+    pmmPin(range.base, count);
+
+    successes++;
+    migrated += moving;
+    releaseLock(&lock);
+
+    KDEBUG("compaction migrated %d pages to free %d KiB at 0x%08X\n", moving, (count * PAGE_SIZE) / 1024, range.base);
+
+    free(range.claimed);
+    free(range.mapped);
+    free(range.copies);
+    return range.base;
+
+fail:
+    // give back whatever was claimed
+    if(range.claimed) {
+        for(size_t i = 0; i < count; i++) {
+            if(range.claimed[i]) pmmFree(range.base + (i * PAGE_SIZE));
+        }
+    }
+
+    releaseLock(&lock);
+
+    if(range.claimed) free(range.claimed);
+    if(range.mapped) free(range.mapped);
+    if(range.copies) free(range.copies);
+    return 0;
+}
+
+/* compactStatus(): fills in compaction statistics
+ * params: dst - physical memory status structure
+ * returns: nothing
+ */
+
+void compactStatus(PhysicalMemoryStatus *dst) {
+    dst->compactRuns = runs;
+    dst->compactSuccesses = successes;
+    dst->pagesMigrated = migrated;
+}
+
+/* compactionThread(): kernel thread that periodically defragments memory so
+ * that large blocks are available before anyone needs them
+ * params: args - unused
+ * returns: never
+ */
+
+void *compactionThread(void *args) {
+    uint64_t interval = PMM_COMPACT_INTERVAL * PLATFORM_TIMER_FREQUENCY;
+    uint64_t next = platformUptime() + interval;
+
+    for(;;) {
+        if(platformUptime() >= next) {
+            // compact one block and give it straight back, which leaves it
+            // coalesced in the free lists
+            while(pmmNeedsCompaction(PMM_COMPACT_ORDER)) {
+                uintptr_t block = pmmCompact((size_t)1 << PMM_COMPACT_ORDER, 0, (uintptr_t)-1);
+                if(!block) break;
+                pmmFreeContiguous(block, (size_t)1 << PMM_COMPACT_ORDER);
+            }
+
+            next = platformUptime() + interval;
+        }
+
+        platformIdle();
+    }
+}
\ No newline at end of file
@@ -16,6 +16,74 @@
 #include <kernel/servers.h>
 #include <platform/platform.h>
 
+/* mmapCreate(): reserves the pages of a file mapping along with its header
+ * params: t - thread the mapping belongs to
+ * params: fd - file descriptor
+ * params: addr - process-suggested address
+ * params: len - length of the mapping
+ * params: prot - protection flags
+ * params: flags - mapping flags
+ * params: off - offset into file descriptor
+ * returns: pointer to the mapping past its header, zero on fail
+ */
+
+static uintptr_t mmapCreate(Thread *t, int fd, void *addr, size_t len, int prot, int flags, off_t off) {
+    size_t pageCount = (len+PAGE_SIZE-1) / PAGE_SIZE;
+
+    uintptr_t base;
+    if(!(flags & MAP_FIXED)) {
+        base = vmmAllocate(USER_MMIO_BASE, USER_LIMIT_ADDRESS, pageCount+1, VMM_USER | VMM_WRITE | VMM_FILE);
+    } else {
+        uintptr_t start = (uintptr_t) addr - PAGE_SIZE;
+        base = vmmAllocate(start, USER_LIMIT_ADDRESS, pageCount+1, VMM_USER | VMM_WRITE | VMM_FILE);
+        if(base && (base != start)) {
+            vmmFree(base, pageCount+1);
+            return 0;
+        }
+    }
+
+    if(!base) return 0;
+
+    // first page will be reserved for the mapping
+    MmapHeader *header = (MmapHeader *) base;
+    header->fd = fd;
+    header->flags = flags;
+    header->length = len;
+    header->offset = off;
+    header->prot = prot;
+    header->pid = t->pid;
+    header->tid = t->tid;
+    header->device = false;
+
+    // mmap adds one extra reference to a file descriptor
+    // so it will not be closed even when close() is invoked
+    Process *proc = getProcess(t->pid);
+    FileDescriptor *file = (FileDescriptor *) proc->io[fd].data;
+    file->refCount++;
+
+    return base + PAGE_SIZE;    // skip over to the next page
+}
+
+/* mmapShareable(): checks if a file mapping can share the page cache's pages,
+ * which is the case unless writes to it must reach the file
+ * params: prot - protection flags
+ * params: flags - mapping flags
+ * returns: true if the mapping can be shared copy-on-write
+ */
+
+static inline bool mmapShareable(int prot, int flags) {
+    return (flags & MAP_PRIVATE) || !(prot & PROT_WRITE);
+}
+
+/* mmapAreaFlags(): returns the area flags of the pages of a file mapping */
+
+static int mmapAreaFlags(int prot) {
+    int areaFlags = VMM_USER | VMM_FILE;
+    if(prot & PROT_WRITE) areaFlags |= VMM_WRITE;
+    if(prot & PROT_EXEC) areaFlags |= VMM_EXEC;
+    return areaFlags;
+}
+
 /* mmap(): creates a memory mapping for a file descriptor
  * params: t - calling thread
  * params: id - syscall ID
@@ -45,13 +113,15 @@ void *mmap(Thread *t, uint64_t id, void *addr, size_t len, int prot, int flags,
         if(prot & PROT_WRITE) pageFlags |= VMM_WRITE;
         if(prot & PROT_EXEC) pageFlags |= VMM_EXEC;
 
+        // the header is written by the kernel, so it stays writable even in
+        // read-only mappings
         uintptr_t anon;
         if(flags & MAP_FIXED) {
-            anon = vmmAllocate(USER_MMIO_BASE, USER_LIMIT_ADDRESS, pageCount+1, pageFlags);
+            anon = vmmAllocate(USER_MMIO_BASE, USER_LIMIT_ADDRESS, pageCount+1, pageFlags | VMM_WRITE);
         } else {
             uintptr_t base = (uintptr_t) addr;
 
-            anon = vmmAllocate(base, USER_LIMIT_ADDRESS, pageCount+1, pageFlags);
+            anon = vmmAllocate(base, USER_LIMIT_ADDRESS, pageCount+1, pageFlags | VMM_WRITE);
             if(anon && (anon != base)) {
                 vmmFree(anon, pageCount+1);
                 return (void *) -ENOMEM;
@@ -59,8 +129,9 @@ void *mmap(Thread *t, uint64_t id, void *addr, size_t len, int prot, int flags,
         }
     
         if(!anon) return (void *) -ENOMEM;
+        if(!(pageFlags & VMM_WRITE)) vmmSetFlags(anon + PAGE_SIZE, pageCount, pageFlags);
 
-        memset((void *) anon, 0, (pageCount+1) * PAGE_SIZE);
+        // the mapping itself is zero-filled as it is touched
         MmapHeader *hdr = (MmapHeader *) anon;
         hdr->flags = flags;
         hdr->length = len;
@@ -94,6 +165,26 @@ void *mmap(Thread *t, uint64_t id, void *addr, size_t len, int prot, int flags,
 
     FileDescriptor *f = (FileDescriptor *) io->data;
 
+    // mappings whose pages are all cached are set up without asking the
+    // file system server at all
+    if(!f->charDev && mmapShareable(prot, flags) && (io->flags & O_RDONLY) && !(off & (PAGE_SIZE-1))) {
+        uintptr_t base = mmapCreate(t, fd, addr, len, prot, flags, off);
+        if(!base) {
+            free(command);
+            return (void *) -ENOMEM;
+        }
+
+        if(pageCacheMap(f->device, f->id, off, len, base)) {
+            vmmSetFlags(base, (len+PAGE_SIZE-1) / PAGE_SIZE, mmapAreaFlags(prot));
+            free(command);
+            return (void *) base;
+        }
+
+        // otherwise undo everything and fall back to the server
+        f->refCount--;
+        vmmFree(base - PAGE_SIZE, ((len+PAGE_SIZE-1) / PAGE_SIZE) + 1);
+    }
+
     command->header.header.command = COMMAND_MMAP;
     command->header.header.length = sizeof(MmapCommand);
     command->header.id = id;
@@ -111,6 +202,7 @@ void *mmap(Thread *t, uint64_t id, void *addr, size_t len, int prot, int flags,
     command->flags = flags;
     command->off = off;
 
+    if(!f->charDev) t->syscall.cacheGeneration = pageCacheGeneration(f->device, f->id);
     int status = requestServer(t, 0, command);
     free(command);
     return (void *) (intptr_t) status;
@@ -130,41 +222,13 @@ void mmapHandle(MmapCommand *msg, SyscallRequest *req) {
     if(msg->prot & PROT_WRITE) pageFlags |= PLATFORM_PAGE_WRITE;
     if(msg->prot & PROT_EXEC) pageFlags |= PLATFORM_PAGE_EXEC;
 
-    uintptr_t base;
-    if(!(msg->flags & MAP_FIXED)) {
-        base = vmmAllocate(USER_MMIO_BASE, USER_LIMIT_ADDRESS, pageCount+1, VMM_USER | VMM_WRITE);
-    } else {
-        uintptr_t start = (uintptr_t) msg->addr - PAGE_SIZE;
-        base = vmmAllocate(start, USER_LIMIT_ADDRESS, pageCount+1, VMM_USER | VMM_WRITE);
-        if(base && (base != start)) {
-            vmmFree(base, pageCount+1);
-            req->ret = -ENOMEM;
-            return;
-        }
-    }
-
+    uintptr_t base = mmapCreate(req->thread, p->fd, msg->addr, msg->len, msg->prot, p->flags, msg->off);
     if(!base) {
         req->ret = -ENOMEM;
         return;
     }
 
-    // first page will be reserved for the mapping
-    MmapHeader *header = (MmapHeader *) base;
-    header->fd = p->fd;
-    header->flags = p->flags;
-    header->length = msg->len;
-    header->offset = msg->off;
-    header->prot = msg->prot;
-    header->pid = req->thread->pid;
-    header->tid = req->thread->tid;
-
-    base += PAGE_SIZE;      // skip over to the next page
-
-    // mmap adds one extra reference to a file descriptor
-    // so it will not be closed even when close() is invoked
-    Process *proc = getProcess(req->thread->pid);
-    FileDescriptor *file = (FileDescriptor *) proc->io[p->fd].data;
-    file->refCount++;
+    MmapHeader *header = (MmapHeader *) (base - PAGE_SIZE);
 
     if(msg->responseType) {
         /* memory-mapped device file */
@@ -172,12 +236,27 @@ void mmapHandle(MmapCommand *msg, SyscallRequest *req) {
 
         for(size_t i = 0; i < pageCount; i++)
             platformMapPage(base + (i*PAGE_SIZE), msg->mmio + (i*PAGE_SIZE), pageFlags);
+
+        // everything past the header belongs to the device
+        int areaFlags = VMM_USER | VMM_DEVICE;
+        if(msg->prot & PROT_WRITE) areaFlags |= VMM_WRITE;
+        if(msg->prot & PROT_EXEC) areaFlags |= VMM_EXEC;
+        vmmSetFlags(base, pageCount, areaFlags);
     } else {
         /* memory-mapped regular file */
-        header->device = false;
+        Process *proc = getProcess(req->thread->pid);
+        FileDescriptor *file = (FileDescriptor *) proc->io[p->fd].data;
+
+        // keep the contents in the page cache, and share its pages with the
+        // mapping where writes don't have to reach the file
+        pageCacheFill(file->device, file->id, msg->off, msg->data, msg->len, PAGE_CACHE_MAPPED, req->cacheGeneration);
 
-        memcpy((void *) base, msg->data, msg->len);
-        memset((void *)((uintptr_t) base + msg->len), 0, PAGE_SIZE - msg->len);
+        if(mmapShareable(msg->prot, msg->flags) && pageCacheMap(file->device, file->id, msg->off, msg->len, base)) {
+            vmmSetFlags(base, pageCount, mmapAreaFlags(msg->prot));
+        } else {
+            // the rest of the last page is zero-filled when it is touched
+            memcpy((void *) base, msg->data, msg->len);
+        }
     }
 
     req->ret = base;
@@ -220,7 +299,7 @@ int munmap(Thread *t, void *addr, size_t len) {
 
     if(header->device) {
         vmmFree(ptr-PAGE_SIZE, 1);
-        for(int i = 0; i < pageCount; i++) platformUnmapPage(ptr + (i*PAGE_SIZE));
+        vmmRelease(ptr, pageCount);
     } else {
         vmmFree(ptr-PAGE_SIZE, pageCount+1);
     }
@@ -228,6 +307,58 @@ int munmap(Thread *t, void *addr, size_t len) {
     return 0;
 }
 
+/* mremap(): resizes a memory mapping, moving it if it can't grow in place;
+ * either way its pages are moved in the page tables and never copied
+ * params: t - calling thread
+ * params: addr - address of the mapping
+ * params: oldLen - current length of the mapping
+ * params: newLen - new length of the mapping
+ * params: flags - MREMAP_MAYMOVE to allow moving the mapping
+ * returns: new address of the mapping, negative errno on fail
+ */
+
+void *mremap(Thread *t, void *addr, size_t oldLen, size_t newLen, int flags) {
+    uintptr_t ptr = (uintptr_t) addr;
+    if(ptr & (PAGE_SIZE-1)) return (void *) -EINVAL;
+    if(ptr < USER_MMIO_BASE || ptr > USER_LIMIT_ADDRESS) return (void *) -EINVAL;
+    if(!oldLen || !newLen || (flags & ~MREMAP_MAYMOVE)) return (void *) -EINVAL;
+
+    // the header is writable by the process, so nothing in it is trusted
+    // until the areas show that there really is a mapping here
+    VMATree *vmas = platformGetVMAs();
+    VMA headerArea, area;
+    if(!vmas || !vmaFind(vmas, ptr - PAGE_SIZE, &headerArea) || !vmaFind(vmas, ptr, &area))
+        return (void *) -EINVAL;
+    if((headerArea.flags & (VMM_USER | VMM_WRITE)) != (VMM_USER | VMM_WRITE))
+        return (void *) -EINVAL;
+
+    size_t pageCount = (oldLen+PAGE_SIZE-1) / PAGE_SIZE;
+    size_t newPageCount = (newLen+PAGE_SIZE-1) / PAGE_SIZE;
+    if((area.limit - ptr) < (pageCount * PAGE_SIZE)) return (void *) -EINVAL;
+
+    // only whole mappings can be resized, since the header describes them
+    MmapHeader *header = (MmapHeader *)((uintptr_t) ptr-PAGE_SIZE);
+    if(((header->length+PAGE_SIZE-1) / PAGE_SIZE) != pageCount) return (void *) -EINVAL;
+
+    // device memory doesn't belong to the kernel, and there is nothing behind
+    // the end of a file mapping to grow it with
+    if((headerArea.flags | area.flags) & VMM_DEVICE) return (void *) -EINVAL;
+    if((area.flags & VMM_FILE) && (newPageCount > pageCount)) return (void *) -EINVAL;
+
+    uintptr_t base = vmmRemap(ptr - PAGE_SIZE, pageCount+1, newPageCount+1,
+        USER_MMIO_BASE, USER_LIMIT_ADDRESS, area.flags, flags & MREMAP_MAYMOVE);
+    if(!base) return (void *) -ENOMEM;
+
+    // a moved header takes the protection of the whole new range, but the
+    // kernel still has to write to it
+    if(base != (ptr - PAGE_SIZE))
+        vmmSetFlags(base, 1, VMM_USER | VMM_WRITE | (area.flags & VMM_FILE));
+
+    header = (MmapHeader *) base;
+    header->length = newLen;
+    return (void *) (base + PAGE_SIZE);
+}
+
 /* msync(): syncs disk storage with memory-mapped I/O
  * params: t - calling thread
  * params: addr - address of the mapping
@@ -276,6 +407,9 @@ int msync(Thread *t, uint64_t id, void *addr, size_t len, int flags) {
     strcpy(cmd->device, file->device);
     memcpy(cmd->data, addr, len);
 
+    // the cached contents of the file are now out of date
+    pageCacheInvalidate(file->device, file->id, header->offset, len);
+
     int status = requestServer(t, file->sd, cmd);
     free(cmd);
     return status;
@@ -47,7 +47,7 @@ uintptr_t mmio(Thread *t, uintptr_t addr, off_t count, int flags) {
         if(flags & MMIO_X) pageFlags |= PLATFORM_PAGE_EXEC;
         if(flags & MMIO_CD) pageFlags |= PLATFORM_PAGE_NO_CACHE;
 
-        uintptr_t virt = vmmAllocate(USER_MMIO_BASE, USER_LIMIT_ADDRESS, pageCount, VMM_USER);
+        uintptr_t virt = vmmAllocate(USER_MMIO_BASE, USER_LIMIT_ADDRESS, pageCount, VMM_USER | VMM_DEVICE);
         if(!virt) return 0;
 
         for(int i = 0; i < pageCount; i++)
@@ -59,8 +59,7 @@ uintptr_t mmio(Thread *t, uintptr_t addr, off_t count, int flags) {
         // deleting a memory mapping
         if(addr < USER_MMIO_BASE) return addr;
 
-        for(int i = 0; i < pageCount; i++)
-            platformMapPage(addr + (i * PAGE_SIZE), 0, 0);
+        vmmRelease(addr, pageCount);
 
         //KDEBUG("unmapped %d pages at virtual address 0x%X for tid %d\n", pageCount, addr, t->tid);
         return 0;
@@ -88,5 +87,9 @@ uintptr_t vtop(Thread *t, uintptr_t virt) {
     // disallow using this function to gain access to kernel physical memory
     if(!(flags & PLATFORM_PAGE_USER)) return 0;
 
+    // the caller is presumably going to hand this address to a device, so
+    // the page can't be moved by memory compaction anymore
+    if(flags & PLATFORM_PAGE_PRESENT) pmmPinPage(phys);
+
     return phys | offset;
 }
\ No newline at end of file
@@ -0,0 +1,624 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* Page Cache */
+
+/* file contents returned by the file system servers in response to read() and
+ * mmap() are kept in whole physical pages, keyed by device, file ID and
+ * offset, so that later reads of the same data are served without a round
+ * trip through lumen and the server, and so that every private or read-only
+ * mapping of a file shares the same physical pages copy-on-write
+ *
+ * the cache only ever holds clean data: writes still go straight to the
+ * server and drop the pages they touch, and servers can drop pages of files
+ * that change behind the kernel's back with an invalidation message
+ *
+ * only files with a non-zero ID can be cached, because that is what tells
+ * two opens of the same file apart from two different files
+ *
+ * a read that was sent before a write may still come back after the write
+ * dropped its pages, so every invalidation bumps a generation number and
+ * data from requests sent before it is not cached */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <platform/platform.h>
+#include <platform/lock.h>
+#include <kernel/memory.h>
+#include <kernel/logger.h>
+
+typedef struct CacheDevice {
+    struct CacheDevice *next;
+    char *name;
+    uint64_t hits, misses;
+    size_t pages;
+} CacheDevice;
+
+typedef struct CacheFile {
+    struct CacheFile *next;         // hash chain
+    CacheDevice *device;
+    uint64_t id;
+    struct CachePage *pages;        // every cached page of the file
+} CacheFile;
+
+typedef struct CachePage {
+    struct CachePage *next;         // hash chain by file and offset
+    struct CachePage *physNext;     // hash chain by physical address
+    struct CachePage *fileNext, *filePrev;
+    struct CachePage *lruNext, *lruPrev;
+    CacheFile *file;
+    off_t offset;
+    uintptr_t phys;
+    size_t valid;                   // bytes of file data in the page
+    int flags;
+} CachePage;
+
+static bool enabled = true;
+static lock_t lock = LOCK_INITIAL;
+static size_t limit = 0, count = 0;
+
+static CacheDevice *devices = NULL;
+static CacheFile *files[PAGE_CACHE_FILE_BUCKETS];
+static CachePage *pages[PAGE_CACHE_BUCKETS];
+static CachePage *physPages[PAGE_CACHE_BUCKETS];
+static CachePage *lruHead = NULL, *lruTail = NULL;   // least recently used first
+static uint64_t generations[PAGE_CACHE_FILE_BUCKETS];  // shared by files that hash alike
+
+/* pageCacheInit(): configures the page cache
+ * params: boot - kernel boot information structure
+ * returns: nothing
+ */
+
+void pageCacheInit(KernelBootInfo *boot) {
+    memset(files, 0, sizeof(files));
+    memset(pages, 0, sizeof(pages));
+    memset(physPages, 0, sizeof(physPages));
+    memset(generations, 0, sizeof(generations));
+
+    // allow the cache to be turned off for comparison
+    enabled = !bootArgFlag(boot->arguments, "nopagecache");
+    if(!enabled) {
+        KDEBUG("page cache disabled by boot arguments\n");
+        return;
+    }
+
+    PhysicalMemoryStatus status;
+    pmmStatus(&status);
+    limit = status.usablePages / PAGE_CACHE_LIMIT;
+
+    KDEBUG("page cache is limited to %d MiB\n", (limit * PAGE_SIZE) >> 20);
+}
+
+static inline size_t fileHash(const char *device, uint64_t id) {
+    uint64_t hash = 14695981039346656037ULL;
+    while(*device) {
+        hash ^= (uint8_t) *device++;
+        hash *= 1099511628211ULL;
+    }
+
+    return (hash ^ id) % PAGE_CACHE_FILE_BUCKETS;
+}
+
+static inline size_t pageHash(CacheFile *file, off_t offset) {
+    uint64_t hash = ((uintptr_t) file >> 4) ^ ((offset / PAGE_SIZE) * 0x9E3779B97F4A7C15ULL);
+    return (hash ^ (hash >> 32)) % PAGE_CACHE_BUCKETS;
+}
+
+static inline size_t physHash(uintptr_t phys) {
+    return (phys / PAGE_SIZE) % PAGE_CACHE_BUCKETS;
+}
+
+/* findDevice(): finds the statistics of a device
+ * params: name - name of the device
+ * params: create - true to create the entry if it doesn't exist
+ * returns: pointer to the device, NULL if not found
+ */
+
+static CacheDevice *findDevice(const char *name, bool create) {
+    CacheDevice *device = devices;
+    while(device) {
+        if(!strcmp(device->name, name)) return device;
+        device = device->next;
+    }
+
+    if(!create) return NULL;
+
+    device = calloc(1, sizeof(CacheDevice));
+    if(!device) return NULL;
+    device->name = malloc(strlen(name) + 1);
+    if(!device->name) {
+        free(device);
+        return NULL;
+    }
+
+    strcpy(device->name, name);
+    device->next = devices;
+    devices = device;
+    return device;
+}
+
+/* findFile(): finds the cached pages of a file
+ * params: device - device the file lives on
+ * params: id - unique ID of the file
+ * params: create - true to create the entry if it doesn't exist
+ * returns: pointer to the file, NULL if not found
+ */
+
+static CacheFile *findFile(CacheDevice *device, uint64_t id, bool create) {
+    size_t bucket = fileHash(device->name, id);
+    CacheFile *file = files[bucket];
+    while(file) {
+        if((file->device == device) && (file->id == id)) return file;
+        file = file->next;
+    }
+
+    if(!create) return NULL;
+
+    file = calloc(1, sizeof(CacheFile));
+    if(!file) return NULL;
+    file->device = device;
+    file->id = id;
+    file->next = files[bucket];
+    files[bucket] = file;
+    return file;
+}
+
+/* findPage(): finds a cached page of a file
+ * params: file - file to look in
+ * params: offset - page-aligned offset into the file
+ * returns: pointer to the page, NULL if not cached
+ */
+
+static CachePage *findPage(CacheFile *file, off_t offset) {
+    if(!file) return NULL;
+
+    CachePage *page = pages[pageHash(file, offset)];
+    while(page) {
+        if((page->file == file) && (page->offset == offset)) return page;
+        page = page->next;
+    }
+
+    return NULL;
+}
+
+/* lruRemove(): takes a page off the LRU list */
+
+static void lruRemove(CachePage *page) {
+    if(page->lruPrev) page->lruPrev->lruNext = page->lruNext;
+    else lruHead = page->lruNext;
+    if(page->lruNext) page->lruNext->lruPrev = page->lruPrev;
+    else lruTail = page->lruPrev;
+}
+
+/* lruAppend(): puts a page at the most recently used end of the LRU list */
+
+static void lruAppend(CachePage *page) {
+    page->lruNext = NULL;
+    page->lruPrev = lruTail;
+    if(lruTail) lruTail->lruNext = page;
+    else lruHead = page;
+    lruTail = page;
+}
+
+static void touch(CachePage *page) {
+    if(page == lruTail) return;
+    lruRemove(page);
+    lruAppend(page);
+}
+
+/* dropPage(): removes a page from the cache, with the lock held; mappings that
+ * share the page keep it until they are gone
+ * params: page - page to remove
+ * returns: nothing
+ */
+
+static void dropPage(CachePage *page) {
+    CachePage **link = &pages[pageHash(page->file, page->offset)];
+    while(*link && (*link != page)) link = &(*link)->next;
+    if(*link) *link = page->next;
+
+    link = &physPages[physHash(page->phys)];
+    while(*link && (*link != page)) link = &(*link)->physNext;
+    if(*link) *link = page->physNext;
+
+    if(page->filePrev) page->filePrev->fileNext = page->fileNext;
+    else page->file->pages = page->fileNext;
+    if(page->fileNext) page->fileNext->filePrev = page->filePrev;
+
+    lruRemove(page);
+
+    CacheFile *file = page->file;
+    file->device->pages--;
+    count--;
+
+    pmmFree(page->phys);
+    free(page);
+
+    // and forget about files with nothing left in the cache
+    if(!file->pages) {
+        CacheFile **fileLink = &files[fileHash(file->device->name, file->id)];
+        while(*fileLink && (*fileLink != file)) fileLink = &(*fileLink)->next;
+        if(*fileLink) *fileLink = file->next;
+        free(file);
+    }
+}
+
+/* pageCacheRead(): serves a read() from the cache
+ * params: t - thread to copy the data to
+ * params: device - device the file lives on
+ * params: id - unique ID of the file
+ * params: offset - position in the file
+ * params: buffer - user address to read into
+ * params: length - number of bytes to read
+ * returns: number of bytes read, zero if the data is not all cached, negative
+ *          error code on fail
+ */
+
+ssize_t pageCacheRead(Thread *t, const char *device, uint64_t id, off_t offset, uintptr_t buffer, size_t length) {
+    if(!enabled || !id || !length || (offset < 0)) return 0;
+
+    acquireLockBlocking(&lock);
+
+    CacheDevice *dev = findDevice(device, true);
+    CacheFile *file = dev ? findFile(dev, id, false) : NULL;
+    if(!file) {
+        if(dev) dev->misses++;
+        releaseLock(&lock);
+        return 0;
+    }
+
+    // only serve the read if it can be served in full, that is either every
+    // byte is cached or the file is known to end within the cached data
+    size_t total = 0;
+    off_t position = offset;
+    bool eof = false;
+    while(total < length) {
+        CachePage *page = findPage(file, position & ~(PAGE_SIZE-1));
+        size_t inPage = position & (PAGE_SIZE-1);
+        if(!page || (page->flags & PAGE_CACHE_MAPPED)) break;
+
+        size_t chunk = (inPage < page->valid) ? page->valid - inPage : 0;
+        if(chunk > (length - total)) chunk = length - total;
+        total += chunk;
+        position += chunk;
+
+        if(((inPage + chunk) >= page->valid) && (page->flags & PAGE_CACHE_EOF)) {
+            eof = true;
+            break;
+        }
+
+        if(!chunk) break;
+    }
+
+    // reading at the end of the file is left to the server too, since zero
+    // bytes would look like a blocked request
+    if(!total || ((total < length) && !eof)) {
+        dev->misses++;
+        releaseLock(&lock);
+        return 0;
+    }
+
+    dev->hits++;
+    releaseLock(&lock);
+
+    // copy through a bounce buffer so that the cache isn't locked while the
+    // destination may be faulted in
+    uint8_t *bounce = malloc(PAGE_SIZE);
+    if(!bounce) return -ENOMEM;
+
+    size_t copied = 0;
+    position = offset;
+    while(copied < total) {
+        size_t inPage = position & (PAGE_SIZE-1);
+        size_t chunk = PAGE_SIZE - inPage;
+        if(chunk > (total - copied)) chunk = total - copied;
+
+        acquireLockBlocking(&lock);
+        CachePage *page = findPage(findFile(dev, id, false), position & ~(PAGE_SIZE-1));
+        if(!page || (page->flags & PAGE_CACHE_MAPPED) || ((inPage + chunk) > page->valid)) {
+            // invalidated in the meantime, the caller just sees a short read
+            releaseLock(&lock);
+            break;
+        }
+
+        memcpy(bounce, (const void *) vmmMMIO(page->phys + inPage, true), chunk);
+        touch(page);
+        releaseLock(&lock);
+
+        if(copyToUser(t, buffer + copied, bounce, chunk)) {
+            free(bounce);
+            return -EFAULT;
+        }
+
+        copied += chunk;
+        position += chunk;
+    }
+
+    free(bounce);
+    return copied;
+}
+
+/* pageCacheGeneration(): returns the invalidation generation of a file, to
+ * be passed back to pageCacheFill() along with the data of a request sent now
+ * params: device - device the file lives on
+ * params: id - unique ID of the file
+ * returns: generation number
+ */
+
+uint64_t pageCacheGeneration(const char *device, uint64_t id) {
+    if(!enabled || !id) return 0;
+    return __atomic_load_n(&generations[fileHash(device, id)], __ATOMIC_ACQUIRE);
+}
+
+/* pageCacheFill(): adds file data returned by a server to the cache
+ * params: device - device the file lives on
+ * params: id - unique ID of the file
+ * params: offset - position in the file the data starts at
+ * params: data - file data
+ * params: length - number of bytes of data
+ * params: flags - PAGE_CACHE_EOF if the file ends with the data, and
+ *                 PAGE_CACHE_MAPPED if the data came from mmap()
+ * params: generation - generation of the file when the request was sent
+ * returns: nothing
+ */
+
+void pageCacheFill(const char *device, uint64_t id, off_t offset, const void *data, size_t length, int flags, uint64_t generation) {
+    if(!enabled || !id || (offset < 0)) return;
+    size_t fileBucket = fileHash(device, id);
+
+    // only pages that start within the data can be cached
+    off_t end = offset + length;
+    off_t position = (offset + PAGE_SIZE - 1) & ~(PAGE_SIZE-1);
+
+    for(; position < end; position += PAGE_SIZE) {
+        size_t valid = end - position;
+        if(valid > PAGE_SIZE) valid = PAGE_SIZE;
+
+        // a partial page is only any good if nothing follows it in the file
+        if((valid < PAGE_SIZE) && !(flags & (PAGE_CACHE_EOF | PAGE_CACHE_MAPPED))) break;
+
+        uintptr_t phys = pmmAllocate();
+        if(!phys) return;
+
+        uint8_t *ptr = (uint8_t *) vmmMMIO(phys, true);
+        memcpy(ptr, (const uint8_t *) data + (position - offset), valid);
+        if(valid < PAGE_SIZE) memset(ptr + valid, 0, PAGE_SIZE - valid);
+
+        CachePage *page = calloc(1, sizeof(CachePage));
+        if(!page) {
+            pmmFree(phys);
+            return;
+        }
+
+        acquireLockBlocking(&lock);
+
+        // the file changed while the request was in flight, so the data may
+        // already be stale
+        if(generations[fileBucket] != generation) {
+            releaseLock(&lock);
+            pmmFree(phys);
+            free(page);
+            return;
+        }
+
+        // newer data replaces whatever was cached before, and dropping pages
+        // may free the file so it is only looked up after
+        CacheDevice *dev = findDevice(device, true);
+        CachePage *old = dev ? findPage(findFile(dev, id, false), position) : NULL;
+        if(old) dropPage(old);
+
+        while(lruHead && (count >= limit)) dropPage(lruHead);
+
+        CacheFile *file = dev ? findFile(dev, id, true) : NULL;
+        if(!file) {
+            releaseLock(&lock);
+            pmmFree(phys);
+            free(page);
+            return;
+        }
+
+        page->file = file;
+        page->offset = position;
+        page->phys = phys;
+        page->valid = valid;
+        page->flags = flags & PAGE_CACHE_MAPPED;
+        if((valid < PAGE_SIZE) || ((position + PAGE_SIZE) == end)) page->flags |= (flags & PAGE_CACHE_EOF);
+
+        size_t bucket = pageHash(file, position);
+        page->next = pages[bucket];
+        pages[bucket] = page;
+
+        bucket = physHash(phys);
+        page->physNext = physPages[bucket];
+        physPages[bucket] = page;
+
+        page->fileNext = file->pages;
+        if(file->pages) file->pages->filePrev = page;
+        file->pages = page;
+
+        lruAppend(page);
+        dev->pages++;
+        count++;
+
+        releaseLock(&lock);
+    }
+}
+
+/* pageCacheMap(): maps cached pages of a file into the address space in use,
+ * shared with the cache so that they are copied on the first write
+ * params: device - device the file lives on
+ * params: id - unique ID of the file
+ * params: offset - page-aligned position in the file
+ * params: length - length of the mapping
+ * params: base - user address to map the pages at
+ * returns: true if every page was mapped, false if nothing was
+ */
+
+bool pageCacheMap(const char *device, uint64_t id, off_t offset, size_t length, uintptr_t base) {
+    if(!enabled || !id || !length || (offset < 0) || (offset & (PAGE_SIZE-1))) return false;
+
+    size_t pageCount = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    acquireLockBlocking(&lock);
+
+    CacheDevice *dev = findDevice(device, true);
+    CacheFile *file = dev ? findFile(dev, id, false) : NULL;
+
+    size_t i;
+    for(i = 0; file && (i < pageCount); i++) {
+        if(!findPage(file, offset + (i * PAGE_SIZE))) break;
+    }
+
+    if(!file || (i < pageCount)) {
+        if(dev) dev->misses++;
+        releaseLock(&lock);
+        return false;
+    }
+
+    for(i = 0; i < pageCount; i++) {
+        CachePage *page = findPage(file, offset + (i * PAGE_SIZE));
+        if(!pmmShare(page->phys)) break;
+
+        // the caller sets the final permissions, which makes the pages
+        // copy-on-write if the mapping is writable
+        if(!platformMapPage(base + (i * PAGE_SIZE), page->phys, PLATFORM_PAGE_PRESENT | PLATFORM_PAGE_USER)) {
+            pmmFree(page->phys);
+            break;
+        }
+
+        touch(page);
+    }
+
+    if(i < pageCount) {
+        // undo the whole thing so that the caller can fall back to a copy
+        for(size_t j = 0; j < i; j++) {
+            CachePage *page = findPage(file, offset + (j * PAGE_SIZE));
+            platformUnmapPage(base + (j * PAGE_SIZE));
+            pmmFree(page->phys);
+        }
+
+        platformInvalidatePages(base, i);
+        dev->misses++;
+        releaseLock(&lock);
+        return false;
+    }
+
+    dev->hits++;
+    releaseLock(&lock);
+    return true;
+}
+
+/* pageCacheInvalidate(): drops cached pages of a file that has changed
+ * params: device - device the file lives on
+ * params: id - unique ID of the file
+ * params: offset - position in the file the change starts at
+ * params: length - number of bytes changed, zero for the whole file
+ * returns: nothing
+ */
+
+void pageCacheInvalidate(const char *device, uint64_t id, off_t offset, size_t length) {
+    if(!enabled || !id) return;
+
+    acquireLockBlocking(&lock);
+
+    // even with nothing cached, data still in flight must not be cached
+    __atomic_add_fetch(&generations[fileHash(device, id)], 1, __ATOMIC_RELEASE);
+
+    CacheDevice *dev = findDevice(device, false);
+    CacheFile *file = dev ? findFile(dev, id, false) : NULL;
+    if(!file) {
+        releaseLock(&lock);
+        return;
+    }
+
+    // whatever was known about the end of the file may not hold anymore
+    // either, so that goes as well
+    off_t start = offset & ~(PAGE_SIZE-1);
+    off_t end = offset + length;
+    CachePage *page = file->pages;
+    while(page) {
+        // the file itself is freed along with its last page, which is always
+        // the last one visited
+        CachePage *next = page->fileNext;
+        if(!length || (page->flags & PAGE_CACHE_EOF) || ((page->offset >= start) && (page->offset < end)))
+            dropPage(page);
+
+        page = next;
+    }
+
+    releaseLock(&lock);
+}
+
+/* pageCacheShrink(): frees up memory by dropping the least recently used pages
+ * params: target - number of pages to drop
+ * returns: number of pages dropped
+ */
+
+size_t pageCacheShrink(size_t target) {
+    size_t dropped = 0;
+
+    acquireLockBlocking(&lock);
+    while(lruHead && (dropped < target)) {
+        dropPage(lruHead);
+        dropped++;
+    }
+
+    releaseLock(&lock);
+    return dropped;
+}
+
+/* pageCacheMigrate(): follows a cached page that was moved elsewhere in
+ * physical memory by compaction
+ * params: from - old physical address
+ * params: to - new physical address
+ * returns: nothing
+ */
+
+void pageCacheMigrate(uintptr_t from, uintptr_t to) {
+    acquireLockBlocking(&lock);
+
+    CachePage **link = &physPages[physHash(from)];
+    while(*link && ((*link)->phys != from)) link = &(*link)->physNext;
+
+    CachePage *page = *link;
+    if(page) {
+        *link = page->physNext;
+        page->phys = to;
+
+        size_t bucket = physHash(to);
+        page->physNext = physPages[bucket];
+        physPages[bucket] = page;
+    }
+
+    releaseLock(&lock);
+}
+
+/* pageCacheStatus(): returns page cache statistics for a device
+ * params: device - name of the device
+ * params: hits - where to store the number of requests served from the cache
+ * params: misses - where to store the number of requests that weren't
+ * params: cached - where to store the number of pages cached
+ * returns: zero on success, -ENOENT if nothing was ever cached for the device
+ */
+
+int pageCacheStatus(const char *device, uint64_t *hits, uint64_t *misses, size_t *cached) {
+    acquireLockBlocking(&lock);
+
+    CacheDevice *dev = findDevice(device, false);
+    if(!dev) {
+        releaseLock(&lock);
+        return -ENOENT;
+    }
+
+    *hits = dev->hits;
+    *misses = dev->misses;
+    *cached = dev->pages;
+
+    releaseLock(&lock);
+    return 0;
+}
\ No newline at end of file
@@ -12,13 +12,175 @@
 #include <kernel/memory.h>
 #include <kernel/boot.h>
 #include <kernel/logger.h>
+#include <platform/platform.h>
 #include <platform/lock.h>
 
 static PhysicalMemoryStatus status;
-static uint8_t *pmmBitmap;
+static uint64_t *pmmBitmap;
 static size_t pmmBitmapSize;
 static lock_t lock = LOCK_INITIAL;
 
+/* Buddy Allocator
+ * free memory is kept in blocks of 2^order pages with one free list per order
+ * the lists are linked through the first page of every free block, and a
+ * bitmap per order records which blocks are on a free list so that buddies
+ * can be found without trusting the contents of free pages; the page bitmap
+ * above is still maintained as a cross-check against double allocations
+ *
+ * every zone of every NUMA node has its own set of free lists; blocks are
+ * naturally aligned and no larger than 4 MiB, so a block never straddles a
+ * zone boundary, and nodes are tracked at the same 4 MiB granularity so that
+ * a block never straddles a node boundary either */
+
+typedef struct {
+    uintptr_t next, prev;       // physical addresses, zero terminates the list
+} FreeBlock;
+
+static uintptr_t freeLists[PMM_MAX_NODES][PMM_ZONES][PMM_ORDERS];
+static uint8_t *nodeMap;        // node of every max-order chunk of memory
+static uint8_t nodeFallback[PMM_MAX_NODES][PMM_MAX_NODES];  // nodes by distance
+
+typedef struct {
+    int node;
+    uintptr_t base;
+    uint64_t length;
+} NodeRange;
+
+static NodeRange nodeRanges[PMM_MAX_NODE_RANGES];
+static int nodeRangeCount = 0;
+
+// pages that must never be migrated by compaction, because their physical
+// address has been handed out to a driver
+static uint64_t *pinBitmap;
+
+// extra references to every page shared copy-on-write, pages the allocator
+// never managed are marked so that they are always copied instead
+static uint16_t *shareCounts;
+static bool shareEnabled = true;
+
+/* Contiguous Memory Area
+ * a region reserved at boot for contiguous allocations, whose pages are only
+ * lent to movable allocations when there is no other free memory; borrowed
+ * pages are migrated out whenever the region is needed for its purpose */
+
+static size_t cmaRequest = 0;       // bytes, from the boot arguments
+static uintptr_t cmaBase = 0, cmaLimit = 0;
+static uint8_t *orderBitmaps[PMM_ORDERS];
+static uintptr_t buddyLimit;    // no block may extend past this address
+static bool buddyReady = false;
+
+/* the bitmap is manipulated one 64-bit word at a time wherever possible, so
+ * that ranges of pages cost one operation per 64 pages instead of per page */
+
+static inline int popcount64(uint64_t v) {
+    // avoid __builtin_popcountll(), which needs libgcc without POPCNT
+    v = v - ((v >> 1) & 0x5555555555555555);
+    v = (v & 0x3333333333333333) + ((v >> 2) & 0x3333333333333333);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0F;
+    return (v * 0x0101010101010101) >> 56;
+}
+
+static inline uint64_t rangeMask(uintptr_t bit, size_t count) {
+    if(count >= 64) return ~(uint64_t)0;
+    return (((uint64_t)1 << count) - 1) << bit;
+}
+
+/* pmmMarkRange(): sets or clears the bits of a range of pages
+ * params: phys - physical address of the first page
+ * params: count - number of pages
+ * params: use - whether the pages are used
+ * returns: number of pages whose state actually changed
+ */
+
+static size_t pmmMarkRange(uintptr_t phys, size_t count, bool use) {
+    uintptr_t page = phys / PAGE_SIZE;
+    uintptr_t end = page + count;
+    size_t changed = 0;
+
+    while(page < end) {
+        uintptr_t bit = page % 64;
+        size_t n = 64 - bit;
+        if(n > (end - page)) n = end - page;
+
+        uint64_t mask = rangeMask(bit, n);
+        uint64_t *word = &pmmBitmap[page / 64];
+        if(use) {
+            changed += popcount64(~*word & mask);
+            *word |= mask;
+        } else {
+            changed += popcount64(*word & mask);
+            *word &= ~mask;
+        }
+
+        page += n;
+    }
+
+    return changed;
+}
+
+/* pmmCountUsed(): counts the used pages in a range
+ * params: phys - physical address of the first page
+ * params: count - number of pages
+ * returns: number of used pages
+ */
+
+static size_t pmmCountUsed(uintptr_t phys, size_t count) {
+    uintptr_t page = phys / PAGE_SIZE;
+    uintptr_t end = page + count;
+    size_t used = 0;
+
+    while(page < end) {
+        uintptr_t bit = page % 64;
+        size_t n = 64 - bit;
+        if(n > (end - page)) n = end - page;
+
+        used += popcount64(pmmBitmap[page / 64] & rangeMask(bit, n));
+        page += n;
+    }
+
+    return used;
+}
+
+/* pmmNextFree(): finds the next free page in the bitmap
+ * params: page - page index to start at
+ * params: end - page index to stop at
+ * returns: index of the free page, end if none
+ */
+
+static uintptr_t pmmNextFree(uintptr_t page, uintptr_t end) {
+    while(page < end) {
+        uint64_t word = ~pmmBitmap[page / 64] >> (page % 64);
+        if(word) {
+            page += __builtin_ctzll(word);
+            break;
+        }
+
+        page = (page + 64) & ~(uintptr_t)63;
+    }
+
+    return (page < end) ? page : end;
+}
+
+/* pmmNextUsed(): finds the next used page in the bitmap
+ * params: page - page index to start at
+ * params: end - page index to stop at
+ * returns: index of the used page, end if none
+ */
+
+static uintptr_t pmmNextUsed(uintptr_t page, uintptr_t end) {
+    while(page < end) {
+        uint64_t word = pmmBitmap[page / 64] >> (page % 64);
+        if(word) {
+            page += __builtin_ctzll(word);
+            break;
+        }
+
+        page = (page + 64) & ~(uintptr_t)63;
+    }
+
+    return (page < end) ? page : end;
+}
+
 /* pmmMark(): marks a page as free or used
  * params: phys - physical address
  * params: use - whether the page is used
@@ -27,21 +189,21 @@ static lock_t lock = LOCK_INITIAL;
 
 int pmmMark(uintptr_t phys, bool use) {
     uintptr_t page = phys / PAGE_SIZE;
-    uintptr_t byte = page / 8;
-    uintptr_t bit = page % 8;
+    uint64_t bit = (uint64_t)1 << (page % 64);
+    uint64_t *word = &pmmBitmap[page / 64];
 
     if(use) {
-        if(pmmBitmap[byte] & (1 << bit)) {
+        if(*word & bit) {
             return -1;      // already marked as used
         } else {
-            pmmBitmap[byte] |= (1 << bit);
+            *word |= bit;
             status.usedPages++;
         }
     } else {
-        if(!(pmmBitmap[byte] & (1 << bit))) {
+        if(!(*word & bit)) {
             return -1;      // already marked as free 
         } else {
-            pmmBitmap[byte] &= ~(1 << bit);
+            *word &= ~bit;
             status.usedPages--;
         }
     }
@@ -57,41 +219,27 @@ int pmmMark(uintptr_t phys, bool use) {
  */
 
 int pmmMarkContiguous(uintptr_t phys, size_t count, bool use) {
-    int status = 0;
-    for(size_t i = 0; i < count; i++) {
-        status |= pmmMark(phys, use);
-        phys += PAGE_SIZE;
-    }
+    size_t changed = pmmMarkRange(phys, count, use);
+    if(use) status.usedPages += changed;
+    else status.usedPages -= changed;
 
-    return status;
+    return (changed == count) ? 0 : -1;
 }
 
-/* pmmInitMark(): marks pages as free or used without checking their status
- * this is necessary during the startup process while parsing the memory map 
+/* pmmInitMarkContiguous(): marks pages as free or used without checking their
+ * status, this is necessary during the startup process while parsing the
+ * memory map 
  * params: phys - physical address
+ * params: count - number of pages
  * params: use - whether the page is used
  * returns: nothing
  */
 
-static void pmmInitMark(uintptr_t phys, bool use) {
-    uintptr_t page = phys / PAGE_SIZE;
-    uintptr_t byte = page / 8;
-    uintptr_t bit = page % 8;
-
-    if(use) {
-        pmmBitmap[byte] |= (1 << bit);
-        status.reservedPages++;
-    } else {
-        pmmBitmap[byte] &= ~(1 << bit);
-        status.usablePages++;
-    }
-}
-
 static void pmmInitMarkContiguous(uintptr_t phys, size_t count, bool use) {
-    for(size_t i = 0; i < count; i++) {
-        pmmInitMark(phys, use);
-        phys += PAGE_SIZE;
-    }
+    pmmMarkRange(phys, count, use);
+
+    if(use) status.reservedPages += count;
+    else status.usablePages += count;
 }
 
 /* pmmInit(): this is called from platformMain() early in the boot process
@@ -104,12 +252,12 @@ void pmmInit(KernelBootInfo *boot) {
 
     // this is set by the boot loader and is guaranteed to be page-aligned
     // it accounts for modules, ramdisk, and other things loaded in memory
-    pmmBitmap = (uint8_t *)boot->lowestFreeMemory + KERNEL_BASE_ADDRESS;
+    pmmBitmap = (uint64_t *)(boot->lowestFreeMemory + KERNEL_BASE_ADDRESS);
 
     status.highestPhysicalAddress = boot->highestPhysicalAddress;
     status.highestPage = (status.highestPhysicalAddress + PAGE_SIZE - 1) / PAGE_SIZE;
 
-    pmmBitmapSize = (status.highestPage + 7) / 8;
+    pmmBitmapSize = ((status.highestPage + 63) / 64) * 8;
 
     // reset the bitmap reserving everything, and then mark the RAM regions as free later
     memset(pmmBitmap, 0xFF, pmmBitmapSize);
@@ -164,6 +312,12 @@ void pmmInit(KernelBootInfo *boot) {
 
     status.lowestUsableAddress = (uintptr_t)kernelPages * PAGE_SIZE;
 
+    // the contiguous memory area is carved out once the buddy allocator is up
+    cmaRequest = bootArgSize(boot->arguments, "cma");
+
+    // allow copy-on-write to be turned off for comparison
+    shareEnabled = !bootArgFlag(boot->arguments, "nocow");
+
     KDEBUG("highest kernel address is 0x%08X\n", boot->kernelHighestAddress);
     KDEBUG("highest physical address is 0x%08X\n", boot->highestPhysicalAddress);
     KDEBUG("lowest usable address is 0x%08X\n", status.lowestUsableAddress);
@@ -182,6 +336,14 @@ void pmmInit(KernelBootInfo *boot) {
 
 void pmmStatus(PhysicalMemoryStatus *dst) {
     memcpy(dst, &status, sizeof(PhysicalMemoryStatus));
+    compactStatus(dst);
+    swapStatus(dst);
+
+    // pages sitting in per-CPU caches are free as far as the caller cares
+    dst->cachedPages = __atomic_load_n(&status.cachedPages, __ATOMIC_RELAXED);
+    dst->cacheHits = __atomic_load_n(&status.cacheHits, __ATOMIC_RELAXED);
+    dst->cacheMisses = __atomic_load_n(&status.cacheMisses, __ATOMIC_RELAXED);
+    dst->usedPages -= dst->cachedPages;
 }
 
 /* pmmIsUsed(): returns whether a page is used
@@ -194,10 +356,768 @@ bool pmmIsUsed(uintptr_t phys) {
     if(phys >= status.highestUsableAddress) return true;
 
     uintptr_t page = phys / PAGE_SIZE;
-    uintptr_t byte = page / 8;
-    uintptr_t bit = page % 8;
+    return (pmmBitmap[page / 64] >> (page % 64)) & 1;
+}
+
+/* pmmScan(): finds and marks a free page by scanning the bitmap
+ * this is only used in early boot before the buddy allocator is ready
+ * params: none
+ * returns: physical address of the page, zero on fail
+ */
+
+static uintptr_t pmmScan() {
+    uintptr_t end = status.highestUsableAddress / PAGE_SIZE;
+    uintptr_t page = pmmNextFree(status.lowestUsableAddress / PAGE_SIZE, end);
+    if(page >= end) return 0;
+
+    pmmMark(page * PAGE_SIZE, true);
+    return page * PAGE_SIZE;
+}
+
+/* pmmScanContiguous(): finds a run of free pages by scanning the bitmap
+ * params: count - number of pages
+ * params: base - lowest address the run may start at
+ * params: limit - highest address the run may extend to
+ * returns: physical address of the first page, zero on fail
+ */
+
+static uintptr_t pmmScanContiguous(size_t count, uintptr_t base, uintptr_t limit) {
+    if(limit > status.highestUsableAddress) limit = status.highestUsableAddress;
+    if(base < status.lowestUsableAddress) base = status.lowestUsableAddress;
+
+    uintptr_t end = limit / PAGE_SIZE;
+    uintptr_t start = pmmNextFree(base / PAGE_SIZE, end);
+
+    while((start + count) <= end) {
+        uintptr_t used = pmmNextUsed(start, start + count);
+        if(used >= (start + count)) return start * PAGE_SIZE;
+
+        // skip past the used page
+        start = pmmNextFree(used, end);
+    }
+
+    return 0;
+}
+
+/* helper functions for the buddy allocator's free lists */
+
+static inline FreeBlock *blockHeader(uintptr_t phys) {
+    return (FreeBlock *) vmmMMIO(phys, true);
+}
+
+static inline bool inCMA(uintptr_t phys) {
+    return (phys >= cmaBase) && (phys < cmaLimit);
+}
+
+static inline int zoneOf(uintptr_t phys) {
+    if(inCMA(phys)) return PMM_ZONE_CMA;
+    return (phys < PMM_DMA32_LIMIT) ? PMM_ZONE_DMA32 : PMM_ZONE_NORMAL;
+}
+
+static inline int nodeOf(uintptr_t phys) {
+    return nodeMap[phys / ((uintptr_t)PAGE_SIZE << PMM_MAX_ORDER)];
+}
+
+static bool blockIsFree(uintptr_t phys, int order) {
+    uintptr_t index = phys / ((uintptr_t)PAGE_SIZE << order);
+    return (orderBitmaps[order][index / 8] >> (index % 8)) & 1;
+}
+
+static void blockSetFree(uintptr_t phys, int order, bool free) {
+    uintptr_t index = phys / ((uintptr_t)PAGE_SIZE << order);
+    if(free) orderBitmaps[order][index / 8] |= (1 << (index % 8));
+    else orderBitmaps[order][index / 8] &= ~(1 << (index % 8));
+}
+
+static void blockPush(uintptr_t phys, int order) {
+    int node = nodeOf(phys);
+    int zone = zoneOf(phys);
+    uintptr_t *list = &freeLists[node][zone][order];
+
+    FreeBlock *block = blockHeader(phys);
+    block->prev = 0;
+    block->next = *list;
+    if(*list) blockHeader(*list)->prev = phys;
+
+    *list = phys;
+    blockSetFree(phys, order, true);
+    status.freeBlocks[order]++;
+    status.zones[zone].freeBlocks[order]++;
+    status.zones[zone].freePages += (size_t)1 << order;
+    status.nodes[node].freePages += (size_t)1 << order;
+}
+
+static void blockRemove(uintptr_t phys, int order) {
+    int node = nodeOf(phys);
+    int zone = zoneOf(phys);
+
+    FreeBlock *block = blockHeader(phys);
+    if(block->prev) blockHeader(block->prev)->next = block->next;
+    else freeLists[node][zone][order] = block->next;
+    if(block->next) blockHeader(block->next)->prev = block->prev;
+
+    blockSetFree(phys, order, false);
+    status.freeBlocks[order]--;
+    status.zones[zone].freeBlocks[order]--;
+    status.zones[zone].freePages -= (size_t)1 << order;
+    status.nodes[node].freePages -= (size_t)1 << order;
+}
+
+/* buddyAllocateZone(): removes a block from one zone's free lists, splitting
+ * larger blocks as necessary
+ * params: node - NUMA node to allocate from
+ * params: zone - zone to allocate from
+ * params: order - order of the block
+ * params: limit - highest address the block may extend to
+ * returns: physical address of the block, zero on fail
+ */
+
+static uintptr_t buddyAllocateZone(int node, int zone, int order, uintptr_t limit) {
+    for(int i = order; i <= PMM_MAX_ORDER; i++) {
+        uintptr_t block = freeLists[node][zone][i];
+        while(block && ((block + ((uintptr_t)PAGE_SIZE << i)) > limit))
+            block = blockHeader(block)->next;
+
+        if(!block) continue;
+
+        blockRemove(block, i);
+
+        // return the unused upper halves to the lower orders
+        while(i > order) {
+            i--;
+            blockPush(block + ((uintptr_t)PAGE_SIZE << i), i);
+        }
+
+        status.zones[zone].allocations++;
+        return block;
+    }
 
-    return ((pmmBitmap[byte] >> bit) & 1);
+    return 0;
+}
+
+/* buddyAllocate(): allocates a block from the closest NUMA node and the
+ * highest zone that can satisfy the request, so that memory stays local to
+ * the requesting CPU and low memory stays available for devices that need it
+ * params: order - order of the block
+ * params: limit - highest address the block may extend to
+ * params: node - NUMA node of the requesting CPU
+ * returns: physical address of the block, zero on fail
+ */
+
+static uintptr_t buddyAllocate(int order, uintptr_t limit, int node) {
+    if(node < 0 || node >= status.nodeCount) node = 0;
+
+    for(int i = 0; i < status.nodeCount; i++) {
+        int n = nodeFallback[node][i];
+        if(!status.nodes[n].freePages) continue;
+
+        // the CMA zone is never used for general allocations
+        for(int zone = PMM_ZONE_NORMAL; zone >= 0; zone--) {
+            PhysicalMemoryZone *z = &status.zones[zone];
+            if(!z->managedPages || (z->base >= limit)) continue;
+
+            // general allocations may only dip into DMA32 while there is
+            // memory to spare there, unless DMA32 is all the memory there is
+            bool fallback = (limit > z->limit) && (zone < PMM_ZONE_NORMAL) && status.zones[zone+1].managedPages;
+            if(fallback && (z->freePages < (PMM_DMA32_RESERVE + ((size_t)1 << order))))
+                continue;
+
+            uintptr_t block = buddyAllocateZone(n, zone, order, limit);
+            if(block) {
+                if(fallback) z->fallbacks++;
+                if(n == node) status.nodes[n].localAllocations++;
+                else status.nodes[n].remoteAllocations++;
+                return block;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* localNode(): returns the NUMA node of the running CPU
+ * params: none
+ * returns: node number, zero if unknown
+ */
+
+static int localNode() {
+    PhysicalMemoryCache *cache = platformGetPMMCache();
+    return cache ? cache->node : 0;
+}
+
+/* unpin(): clears the pinned state of freed pages, this may be called without
+ * the global lock so the bitmap is updated atomically
+ * params: phys - physical address of the first page
+ * params: count - number of pages
+ * returns: nothing
+ */
+
+static inline void unpin(uintptr_t phys, size_t count) {
+    if(!buddyReady || (phys + (count * PAGE_SIZE)) > buddyLimit) return;
+
+    if(count == 1) {
+        uintptr_t page = phys / PAGE_SIZE;
+        __atomic_fetch_and(&pinBitmap[page / 64], ~((uint64_t)1 << (page % 64)), __ATOMIC_RELAXED);
+        return;
+    }
+
+    uintptr_t page = phys / PAGE_SIZE;
+    uintptr_t end = page + count;
+    while(page < end) {
+        uintptr_t bit = page % 64;
+        size_t n = 64 - bit;
+        if(n > (end - page)) n = end - page;
+
+        __atomic_fetch_and(&pinBitmap[page / 64], ~rangeMask(bit, n), __ATOMIC_RELAXED);
+        page += n;
+    }
+}
+
+/* dropShare(): drops one extra reference to a page shared copy-on-write
+ * params: phys - physical address of the page
+ * returns: true if a reference was dropped, false if the page must be freed
+ */
+
+static inline bool dropShare(uintptr_t phys) {
+    if(!buddyReady || phys >= buddyLimit) return false;
+
+    uint16_t *share = &shareCounts[phys / PAGE_SIZE];
+    uint16_t count = __atomic_load_n(share, __ATOMIC_RELAXED);
+    do {
+        if(!count || (count == PMM_SHARE_UNMANAGED)) return false;
+    } while(!__atomic_compare_exchange_n(share, &count, count - 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    return true;
+}
+
+/* buddyFree(): returns a block to the free lists, merging it with its buddy
+ * for as long as the buddy is also free
+ * params: phys - physical address of the block
+ * params: order - order of the block
+ * returns: nothing
+ */
+
+static void buddyFree(uintptr_t phys, int order) {
+    while(order < PMM_MAX_ORDER) {
+        uintptr_t buddy = phys ^ ((uintptr_t)PAGE_SIZE << order);
+        if((buddy + ((uintptr_t)PAGE_SIZE << order)) > buddyLimit) break;
+        if(!blockIsFree(buddy, order)) break;
+
+        blockRemove(buddy, order);
+        if(buddy < phys) phys = buddy;
+        order++;
+    }
+
+    blockPush(phys, order);
+}
+
+/* buddyFreeRange(): returns an arbitrary range of pages to the free lists
+ * params: phys - physical address of the first page
+ * params: count - number of pages
+ * returns: nothing
+ */
+
+static void buddyFreeRange(uintptr_t phys, size_t count) {
+    while(count) {
+        // largest naturally aligned block that fits in the range
+        int order = 0;
+        while((order < PMM_MAX_ORDER) && !((phys / PAGE_SIZE) & ((uintptr_t)1 << order))
+            && (((size_t)2 << order) <= count))
+            order++;
+
+        buddyFree(phys, order);
+        phys += (uintptr_t)PAGE_SIZE << order;
+        count -= (size_t)1 << order;
+    }
+}
+
+/* buddyCarve(): removes an arbitrary range of free pages from the free lists
+ * params: phys - physical address of the first page
+ * params: count - number of pages, all of which must be free
+ * returns: nothing
+ */
+
+static void buddyCarve(uintptr_t phys, size_t count) {
+    uintptr_t end = phys + (count * PAGE_SIZE);
+    uintptr_t addr = phys;
+
+    while(addr < end) {
+        // find the free block that contains this page
+        int order;
+        uintptr_t head = addr;
+        for(order = 0; order <= PMM_MAX_ORDER; order++) {
+            head = addr & ~(((uintptr_t)PAGE_SIZE << order) - 1);
+            if(blockIsFree(head, order)) break;
+        }
+
+        if(order > PMM_MAX_ORDER) {
+            KERROR("free page 0x%08X is not in any free list\n", addr);
+            addr += PAGE_SIZE;
+            continue;
+        }
+
+        blockRemove(head, order);
+
+        // and give back the parts of the block outside of the range
+        uintptr_t blockEnd = head + ((uintptr_t)PAGE_SIZE << order);
+        if(head < addr) buddyFreeRange(head, (addr - head) / PAGE_SIZE);
+        if(blockEnd > end) buddyFreeRange(end, (blockEnd - end) / PAGE_SIZE);
+
+        addr = blockEnd;
+    }
+}
+
+/* pmmInitBuddy(): builds the buddy allocator's free lists from the bitmap
+ * this is called by the virtual memory manager as soon as physical memory is
+ * reachable through the kernel's direct mapping, because the free lists are
+ * linked through the free pages themselves
+ * params: none
+ * returns: nothing
+ */
+
+void pmmInitBuddy() {
+    acquireLockBlocking(&lock);
+
+    // highestUsableAddress is inclusive
+    buddyLimit = (status.highestUsableAddress + 1) & ~(PAGE_SIZE-1);
+    if(buddyLimit > KERNEL_MMIO_LIMIT) buddyLimit = KERNEL_MMIO_LIMIT;
+
+    // allocate the per-order bitmaps
+    size_t pages = buddyLimit / PAGE_SIZE;
+    size_t chunks = (pages + (1 << PMM_MAX_ORDER) - 1) >> PMM_MAX_ORDER;
+    size_t pinSize = ((pages + 63) / 64) * 8;
+    size_t shareSize = pages * sizeof(uint16_t);
+    size_t size = pinSize + shareSize + chunks;
+    for(int i = 0; i <= PMM_MAX_ORDER; i++)
+        size += ((pages >> i) + 7) / 8;
+
+    size_t metaPages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    uintptr_t meta = pmmScanContiguous(metaPages, 0, buddyLimit);
+    if(!meta) {
+        KERROR("unable to allocate memory for the buddy allocator\n");
+        while(1);
+    }
+
+    pmmMarkContiguous(meta, metaPages, true);
+    uint8_t *ptr = (uint8_t *) vmmMMIO(meta, true);
+    memset(ptr, 0, metaPages * PAGE_SIZE);
+
+    pinBitmap = (uint64_t *) ptr;
+    ptr += pinSize;
+
+    // only pages that are free now can be shared later
+    shareCounts = (uint16_t *) ptr;
+    memset(shareCounts, 0xFF, shareSize);
+    ptr += shareSize;
+
+    // everything belongs to node zero until NUMA information is available
+    nodeMap = ptr;
+    ptr += chunks;
+    status.nodeCount = 1;
+    status.nodes[0].distance[0] = PMM_LOCAL_DISTANCE;
+
+    for(int i = 0; i <= PMM_MAX_ORDER; i++) {
+        orderBitmaps[i] = ptr;
+        ptr += ((pages >> i) + 7) / 8;
+    }
+
+    // memory that isn't directly mapped can't hold free list links
+    size_t unmapped = 0;
+    if(status.highestUsableAddress > buddyLimit) {
+        unmapped = pmmMarkRange(buddyLimit, (status.highestUsableAddress - buddyLimit) / PAGE_SIZE, true);
+        status.usablePages -= unmapped;
+        status.reservedPages += unmapped;
+    }
+
+    if(unmapped) KWARN("ignoring %d MiB of memory beyond the kernel's direct mapping\n", (unmapped * PAGE_SIZE) / 0x100000);
+
+    // reserve the contiguous memory area, aligned to the largest block so
+    // that no block straddles its boundaries, and preferably reachable by
+    // 32-bit DMA because that's where contiguous memory is needed the most
+    if(cmaRequest) {
+        size_t align = (size_t)1 << PMM_MAX_ORDER;
+        size_t count = ((cmaRequest / PAGE_SIZE) + align - 1) & ~(align - 1);
+
+        uintptr_t start = pmmScanContiguous(count + align - 1, 0, (buddyLimit < PMM_DMA32_LIMIT) ? buddyLimit : PMM_DMA32_LIMIT);
+        if(!start) start = pmmScanContiguous(count + align - 1, 0, buddyLimit);
+
+        if(start) {
+            cmaBase = (start + (align * PAGE_SIZE) - 1) & ~((align * PAGE_SIZE) - 1);
+            cmaLimit = cmaBase + (count * PAGE_SIZE);
+            status.zones[PMM_ZONE_CMA].base = cmaBase;
+            status.zones[PMM_ZONE_CMA].limit = cmaLimit;
+        } else {
+            KWARN("unable to reserve %d MiB for the contiguous memory area\n", cmaRequest / 0x100000);
+        }
+    }
+
+    // set up the zones
+    status.zones[PMM_ZONE_DMA32].base = 0;
+    status.zones[PMM_ZONE_DMA32].limit = (buddyLimit < PMM_DMA32_LIMIT) ? buddyLimit : PMM_DMA32_LIMIT;
+    status.zones[PMM_ZONE_NORMAL].base = PMM_DMA32_LIMIT;
+    status.zones[PMM_ZONE_NORMAL].limit = buddyLimit;
+
+    // now hand every run of free pages over to the buddy allocator
+    uintptr_t end = buddyLimit / PAGE_SIZE;
+    uintptr_t run = pmmNextFree(status.lowestUsableAddress / PAGE_SIZE, end);
+    while(run < end) {
+        uintptr_t used = pmmNextUsed(run, end);
+        buddyFreeRange(run * PAGE_SIZE, used - run);
+        memset(&shareCounts[run], 0, (used - run) * sizeof(uint16_t));
+        run = pmmNextFree(used, end);
+    }
+
+    for(int i = 0; i < PMM_ZONES; i++)
+        status.zones[i].managedPages = status.zones[i].freePages;
+    status.nodes[0].managedPages = status.nodes[0].freePages;
+
+    buddyReady = true;
+    releaseLock(&lock);
+
+    KDEBUG("buddy allocator initialized with %d orders, %d KiB of metadata\n", PMM_ORDERS, (metaPages * PAGE_SIZE) / 1024);
+    for(int i = 0; i <= PMM_MAX_ORDER; i++) {
+        if(status.freeBlocks[i])
+            KDEBUG(" order %d (%d KiB): %d free blocks\n", i, (PAGE_SIZE << i) / 1024, status.freeBlocks[i]);
+    }
+
+    const char *zoneNames[] = { "DMA32", "normal", "contiguous" };
+    for(int i = 0; i < PMM_ZONES; i++) {
+        if(status.zones[i].managedPages)
+            KDEBUG(" %s zone: %d MiB\n", zoneNames[i], (status.zones[i].managedPages * PAGE_SIZE) / 0x100000);
+    }
+}
+
+/* pmmAddNodeRange(): records the NUMA node of a range of physical memory,
+ * this only takes effect once pmmInitNUMA() is called
+ * params: node - node number
+ * params: base - physical address of the range
+ * params: length - size of the range in bytes
+ * returns: zero on success
+ */
+
+int pmmAddNodeRange(int node, uintptr_t base, uint64_t length) {
+    if(node < 0 || node >= PMM_MAX_NODES || !length) return -1;
+    if(nodeRangeCount >= PMM_MAX_NODE_RANGES) {
+        KWARN("too many NUMA memory ranges, ignoring 0x%08X on node %d\n", base, node);
+        return -1;
+    }
+
+    nodeRanges[nodeRangeCount].node = node;
+    nodeRanges[nodeRangeCount].base = base;
+    nodeRanges[nodeRangeCount].length = length;
+    nodeRangeCount++;
+    return 0;
+}
+
+/* pmmSetNodeDistance(): sets the relative distance between two NUMA nodes
+ * params: from - node the memory access originates from
+ * params: to - node the memory is on
+ * params: distance - relative distance, where 10 is local memory
+ * returns: nothing
+ */
+
+void pmmSetNodeDistance(int from, int to, int distance) {
+    if(from < 0 || from >= PMM_MAX_NODES || to < 0 || to >= PMM_MAX_NODES) return;
+    if(distance < PMM_LOCAL_DISTANCE || distance > 0xFF) return;
+    status.nodes[from].distance[to] = distance;
+}
+
+/* pmmInitNUMA(): splits free memory into per-node pools after the platform
+ * has reported the memory ranges of every node; this must be called before
+ * any non-boot CPU starts allocating memory
+ * params: count - number of NUMA nodes
+ * returns: nothing
+ */
+
+void pmmInitNUMA(int count) {
+    if(count <= 1 || !buddyReady) return;
+    if(count > PMM_MAX_NODES) count = PMM_MAX_NODES;
+
+    acquireLockBlocking(&lock);
+
+    // pull every free block off the lists, chaining them through their own
+    // headers with the order stored in place of the back link
+    uintptr_t pending = 0;
+    for(int zone = 0; zone < PMM_ZONES; zone++) {
+        for(int order = 0; order <= PMM_MAX_ORDER; order++) {
+            while(freeLists[0][zone][order]) {
+                uintptr_t block = freeLists[0][zone][order];
+                blockRemove(block, order);
+                blockHeader(block)->next = pending;
+                blockHeader(block)->prev = order;
+                pending = block;
+            }
+        }
+    }
+
+    // assign each chunk to the node whose range covers its start, or to any
+    // node that covers part of it if none does
+    size_t chunkSize = (size_t)PAGE_SIZE << PMM_MAX_ORDER;
+    size_t chunks = (buddyLimit + chunkSize - 1) / chunkSize;
+    memset(nodeMap, 0xFF, chunks);
+
+    for(int i = 0; i < nodeRangeCount; i++) {
+        if(nodeRanges[i].node >= count || nodeRanges[i].base >= buddyLimit) continue;
+
+        uintptr_t end = nodeRanges[i].base + nodeRanges[i].length;
+        if(end > buddyLimit) end = buddyLimit;
+
+        for(uintptr_t c = nodeRanges[i].base / chunkSize; (c * chunkSize) < end; c++) {
+            if((nodeMap[c] == 0xFF) || ((c * chunkSize) >= nodeRanges[i].base))
+                nodeMap[c] = nodeRanges[i].node;
+        }
+    }
+
+    for(size_t i = 0; i < chunks; i++) {
+        if(nodeMap[i] == 0xFF) nodeMap[i] = 0;
+    }
+
+    // and give the blocks back to the lists of their new nodes
+    while(pending) {
+        uintptr_t block = pending;
+        int order = blockHeader(block)->prev;
+        pending = blockHeader(block)->next;
+        blockPush(block, order);
+    }
+
+    status.nodeCount = count;
+    for(int i = 0; i < count; i++) {
+        status.nodes[i].managedPages = status.nodes[i].freePages;
+
+        // fill in distances the platform didn't report
+        for(int j = 0; j < count; j++) {
+            if(!status.nodes[i].distance[j])
+                status.nodes[i].distance[j] = (i == j) ? PMM_LOCAL_DISTANCE : PMM_REMOTE_DISTANCE;
+        }
+
+        // sort the fallback order by distance, keeping the local node first
+        for(int j = 0; j < count; j++) nodeFallback[i][j] = j;
+        for(int j = 1; j < count; j++) {
+            uint8_t n = nodeFallback[i][j];
+            int k = j;
+            while((k > 0) && (nodeFallback[i][k-1] != i) && ((n == i)
+                || (status.nodes[i].distance[nodeFallback[i][k-1]] > status.nodes[i].distance[n]))) {
+                nodeFallback[i][k] = nodeFallback[i][k-1];
+                k--;
+            }
+
+            nodeFallback[i][k] = n;
+        }
+    }
+
+    releaseLock(&lock);
+
+    for(int i = 0; i < count; i++) {
+        KDEBUG("NUMA node %d: %d MiB\n", i, (status.nodes[i].managedPages * PAGE_SIZE) / 0x100000);
+    }
+}
+
+/* pmmPin(): prevents pages from being migrated by compaction until they are
+ * freed
+ * params: phys - physical address of the first page
+ * params: count - number of pages
+ * returns: nothing
+ */
+
+void pmmPin(uintptr_t phys, size_t count) {
+    if(!buddyReady || (phys + (count * PAGE_SIZE)) > buddyLimit) return;
+
+    uintptr_t page = phys / PAGE_SIZE;
+    uintptr_t end = page + count;
+    while(page < end) {
+        uintptr_t bit = page % 64;
+        size_t n = 64 - bit;
+        if(n > (end - page)) n = end - page;
+
+        __atomic_fetch_or(&pinBitmap[page / 64], rangeMask(bit, n), __ATOMIC_RELAXED);
+        page += n;
+    }
+}
+
+/* pmmPinPage(): pins a single page that is already in use
+ * params: phys - physical address of the page
+ * returns: nothing
+ */
+
+void pmmPinPage(uintptr_t phys) {
+    acquireLockBlocking(&lock);
+    if(pmmIsUsed(phys & ~(PAGE_SIZE-1))) pmmPin(phys & ~(PAGE_SIZE-1), 1);
+    releaseLock(&lock);
+}
+
+/* pmmCompactionWindow(): finds the range of memory that can be freed up for a
+ * contiguous allocation by migrating the fewest pages
+ * params: count - number of pages
+ * params: base - lowest address the range may start at
+ * params: limit - highest address the range may extend to
+ * returns: physical address of the range, zero if there is no candidate
+ */
+
+uintptr_t pmmCompactionWindow(size_t count, uintptr_t base, uintptr_t limit) {
+    if(!buddyReady || !count) return 0;
+    if(limit > buddyLimit) limit = buddyLimit;
+
+    // align windows the same way the buddy allocator would
+    size_t align = 1;
+    while((align < count) && (align < ((size_t)1 << PMM_MAX_ORDER))) align <<= 1;
+
+    uintptr_t best = 0;
+    size_t bestUsed = count;
+
+    acquireLockBlocking(&lock);
+
+    if(base < status.lowestUsableAddress) base = status.lowestUsableAddress;
+    uintptr_t page = (base / PAGE_SIZE + align - 1) & ~(align - 1);
+    uintptr_t end = limit / PAGE_SIZE;
+    for(; (page + count) <= end; page += align) {
+        // skip windows containing pinned pages
+        bool pinned = false;
+        for(uintptr_t p = page; p < (page + count); p = (p + 64) & ~(uintptr_t)63) {
+            uintptr_t bit = p % 64;
+            size_t n = 64 - bit;
+            if(n > (page + count - p)) n = page + count - p;
+
+            if(pinBitmap[p / 64] & rangeMask(bit, n)) {
+                pinned = true;
+                break;
+            }
+        }
+
+        if(pinned) continue;
+
+        size_t used = pmmCountUsed(page * PAGE_SIZE, count);
+        if(used && (used < bestUsed)) {
+            best = page * PAGE_SIZE;
+            bestUsed = used;
+            if(used == 1) break;
+        }
+    }
+
+    releaseLock(&lock);
+    return best;
+}
+
+/* pmmClaimRange(): takes every free page in a range off the free lists so that
+ * nothing else can allocate it while its used pages are being migrated
+ * params: phys - physical address of the first page
+ * params: count - number of pages
+ * params: claimed - array of count booleans, set for every page claimed
+ * returns: number of pages claimed
+ */
+
+size_t pmmClaimRange(uintptr_t phys, size_t count, bool *claimed) {
+    size_t total = 0;
+    uintptr_t base = phys / PAGE_SIZE;
+    uintptr_t end = base + count;
+
+    acquireLockBlocking(&lock);
+
+    uintptr_t run = pmmNextFree(base, end);
+    while(run < end) {
+        uintptr_t used = pmmNextUsed(run, end);
+        buddyCarve(run * PAGE_SIZE, used - run);
+        pmmMarkContiguous(run * PAGE_SIZE, used - run, true);
+
+        for(uintptr_t i = run; i < used; i++) claimed[i - base] = true;
+        total += used - run;
+        run = pmmNextFree(used, end);
+    }
+
+    releaseLock(&lock);
+    return total;
+}
+
+/* pmmNeedsCompaction(): checks whether free memory is too fragmented to
+ * satisfy allocations of a given order
+ * params: order - order of the allocation
+ * returns: true if compaction could help
+ */
+
+bool pmmNeedsCompaction(int order) {
+    if(!buddyReady) return false;
+
+    // the contiguous memory area doesn't count, it is kept free regardless
+    size_t free = 0;
+    for(int zone = 0; zone <= PMM_ZONE_NORMAL; zone++) {
+        for(int i = order; i <= PMM_MAX_ORDER; i++) {
+            if(status.zones[zone].freeBlocks[i]) return false;
+        }
+
+        free += status.zones[zone].freePages;
+    }
+
+    // only worth it if there is plenty of memory to gather
+    return free >= ((size_t)4 << order);
+}
+
+/* pmmCacheRefill(): moves a batch of pages from the buddy allocator into a
+ * per-CPU cache, the global lock must NOT be held by the caller
+ * params: cache - per-CPU cache
+ * returns: number of pages added
+ */
+
+static int pmmCacheRefill(PhysicalMemoryCache *cache) {
+    int count = 0;
+
+    acquireLockBlocking(&lock);
+    while((count < PMM_CACHE_BATCH) && (cache->count < PMM_CACHE_SIZE)) {
+        uintptr_t addr = buddyAllocate(0, buddyLimit, cache->node);
+        if(!addr) break;
+
+        // cached pages stay marked as used so they are never handed out twice
+        if(pmmMark(addr, true))
+            KERROR("buddy allocator returned used page 0x%08X\n", addr);
+
+        cache->pages[cache->count++] = addr;
+        count++;
+    }
+
+    __atomic_add_fetch(&status.cachedPages, count, __ATOMIC_RELAXED);
+    status.cacheRefills++;
+    releaseLock(&lock);
+
+    return count;
+}
+
+/* pmmCacheDrain(): returns a batch of the coldest pages in a per-CPU cache to
+ * the buddy allocator, the global lock must NOT be held by the caller
+ * params: cache - per-CPU cache
+ * returns: nothing
+ */
+
+static void pmmCacheDrain(PhysicalMemoryCache *cache) {
+    int count = PMM_CACHE_BATCH;
+    if(count > cache->count) count = cache->count;
+
+    acquireLockBlocking(&lock);
+    for(int i = 0; i < count; i++) {
+        // the bottom of the cache holds the least recently freed pages
+        if(!pmmMark(cache->pages[i], false)) buddyFree(cache->pages[i], 0);
+        else KERROR("double free of physical page 0x%08X\n", cache->pages[i]);
+    }
+
+    __atomic_sub_fetch(&status.cachedPages, count, __ATOMIC_RELAXED);
+    status.cacheDrains++;
+    releaseLock(&lock);
+
+    cache->count -= count;
+    memmove(&cache->pages[0], &cache->pages[count], cache->count * sizeof(uintptr_t));
+}
+
+/* pmmCacheHolds(): checks whether a page is already in a per-CPU cache, which
+ * catches double frees that the bitmap can't since cached pages stay marked
+ * as used, with the cache locked
+ * params: cache - per-CPU cache
+ * params: phys - physical address of the page
+ * returns: true if the page is in the cache
+ */
+
+static bool pmmCacheHolds(PhysicalMemoryCache *cache, uintptr_t phys) {
+    for(int i = 0; i < cache->count; i++) {
+        if(cache->pages[i] == phys) return true;
+    }
+
+    return false;
 }
 
 /* pmmAllocate(): allocates one page
@@ -206,21 +1126,42 @@ bool pmmIsUsed(uintptr_t phys) {
  */
 
 uintptr_t pmmAllocate(void) {
-    acquireLockBlocking(&lock);
-    uintptr_t addr;
+    uintptr_t addr = 0;
 
-    for(addr = status.lowestUsableAddress; addr < status.highestUsableAddress; addr += PAGE_SIZE) {
-        if(!pmmIsUsed(addr)) {
-            pmmMark(addr, true);
-            //KDEBUG("allocated physical page at 0x%08X, %d pages in use\n", addr, status.usedPages);
+    // try the local CPU's cache first so the global lock is only touched when
+    // the cache needs a refill
+    PhysicalMemoryCache *cache = platformGetPMMCache();
+    if(cache && buddyReady) {
+        acquireLockBlocking(&cache->lock);
+        if(cache->count) {
+            __atomic_add_fetch(&status.cacheHits, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&status.cacheMisses, 1, __ATOMIC_RELAXED);
+            pmmCacheRefill(cache);
+        }
 
-            releaseLock(&lock);
-            return addr;
+        if(cache->count) {
+            addr = cache->pages[--cache->count];
+            __atomic_sub_fetch(&status.cachedPages, 1, __ATOMIC_RELAXED);
         }
+
+        releaseLock(&cache->lock);
+        return addr;
+    }
+
+    acquireLockBlocking(&lock);
+
+    if(buddyReady) {
+        addr = buddyAllocate(0, buddyLimit, 0);
+        if(addr && pmmMark(addr, true))
+            KERROR("buddy allocator returned used page 0x%08X\n", addr);
+    } else {
+        addr = pmmScan();
     }
 
+    //KDEBUG("allocated physical page at 0x%08X, %d pages in use\n", addr, status.usedPages);
     releaseLock(&lock);
-    return 0;
+    return addr;
 }
 
 /* pmmFree(): frees one page
@@ -229,15 +1170,211 @@ uintptr_t pmmAllocate(void) {
  */
 
 int pmmFree(uintptr_t phys) {
-    if(phys <= status.lowestUsableAddress || phys >= status.highestUsableAddress) return -1;
+    phys &= ~(PAGE_SIZE-1);
+    if(phys < status.lowestUsableAddress || phys >= status.highestUsableAddress) return -1;
+    if(!pmmIsUsed(phys)) return -1;
     //KDEBUG("freeing memory at 0x%08X, %d pages in use\n", phys, status.usedPages);
 
+    // shared pages are only freed along with their last reference
+    if(dropShare(phys)) return 0;
+    unpin(phys, 1);
+
+    // pages of the contiguous memory area must go straight back to it
+    PhysicalMemoryCache *cache = platformGetPMMCache();
+    if(cache && buddyReady && !inCMA(phys)) {
+        acquireLockBlocking(&cache->lock);
+        if(pmmCacheHolds(cache, phys)) {
+            releaseLock(&cache->lock);
+            return -1;
+        }
+
+        if(cache->count >= PMM_CACHE_SIZE) pmmCacheDrain(cache);
+        cache->pages[cache->count++] = phys;
+        __atomic_add_fetch(&status.cachedPages, 1, __ATOMIC_RELAXED);
+        releaseLock(&cache->lock);
+        return 0;
+    }
+
     acquireLockBlocking(&lock);
     int s = pmmMark(phys, false);
+    if(!s && buddyReady) buddyFree(phys, 0);
+    releaseLock(&lock);
+    return s;
+}
+
+/* pmmAllocateBatch(): allocates multiple pages that need not be contiguous,
+ * taking each lock at most once for the whole batch
+ * params: count - number of pages to allocate
+ * params: pages - array to store the physical addresses of the pages in
+ * returns: number of pages allocated, which is less than count on fail
+ */
+
+size_t pmmAllocateBatch(size_t count, uintptr_t *pages) {
+    size_t allocated = 0;
+    if(!count) return 0;
+
+    // pages already owned by this CPU are the cheapest to hand out
+    PhysicalMemoryCache *cache = platformGetPMMCache();
+    if(cache && buddyReady) {
+        acquireLockBlocking(&cache->lock);
+        while(cache->count && (allocated < count))
+            pages[allocated++] = cache->pages[--cache->count];
+
+        __atomic_add_fetch(&status.cacheHits, allocated, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&status.cachedPages, allocated, __ATOMIC_RELAXED);
+        releaseLock(&cache->lock);
+    }
+
+    if(allocated >= count) return allocated;
+
+    int node = cache ? cache->node : 0;
+    acquireLockBlocking(&lock);
+
+    if(buddyReady) {
+        // take the largest blocks that fit in what's left of the batch, which
+        // keeps the number of free list operations logarithmic in the count
+        int order = PMM_MAX_ORDER;
+        while(allocated < count) {
+            while(order && (((size_t)1 << order) > (count - allocated)))
+                order--;
+
+            uintptr_t block = buddyAllocate(order, buddyLimit, node);
+            if(!block) {
+                if(!order) break;
+                order--;
+                continue;
+            }
+
+            size_t blockPages = (size_t)1 << order;
+            if(pmmMarkContiguous(block, blockPages, true))
+                KERROR("buddy allocator returned used block 0x%08X\n", block);
+
+            for(size_t i = 0; i < blockPages; i++)
+                pages[allocated++] = block + (i * PAGE_SIZE);
+        }
+    } else {
+        while(allocated < count) {
+            uintptr_t addr = pmmScan();
+            if(!addr) break;
+            pages[allocated++] = addr;
+        }
+    }
+
+    releaseLock(&lock);
+    return allocated;
+}
+
+/* pmmFreeBatch(): frees multiple pages that need not be contiguous, taking
+ * each lock at most once for the whole batch
+ * params: count - number of pages to free
+ * params: pages - array of physical addresses of the pages
+ * returns: zero on success
+ */
+
+int pmmFreeBatch(size_t count, uintptr_t *pages) {
+    size_t i = 0;
+    int s = 0;
+
+    // refill this CPU's cache first so the pages stay warm for reuse
+    PhysicalMemoryCache *cache = platformGetPMMCache();
+    if(cache && buddyReady) {
+        size_t cached = 0;
+        acquireLockBlocking(&cache->lock);
+        while((i < count) && (cache->count < PMM_CACHE_SIZE) && !inCMA(pages[i])) {
+            uintptr_t phys = pages[i++] & ~(PAGE_SIZE-1);
+            if(phys < status.lowestUsableAddress || phys >= status.highestUsableAddress) {
+                s = -1;
+            } else if(!pmmIsUsed(phys) || pmmCacheHolds(cache, phys)) {
+                s = -1;     // double free
+            } else if(!dropShare(phys)) {
+                unpin(phys, 1);
+                cache->pages[cache->count++] = phys;
+                cached++;
+            }
+        }
+
+        __atomic_add_fetch(&status.cachedPages, cached, __ATOMIC_RELAXED);
+        releaseLock(&cache->lock);
+    }
+
+    if(i >= count) return s;
+
+    acquireLockBlocking(&lock);
+    for(; i < count; i++) {
+        uintptr_t phys = pages[i] & ~(PAGE_SIZE-1);
+        if(phys < status.lowestUsableAddress || phys >= status.highestUsableAddress) {
+            s = -1;
+        } else if(dropShare(phys)) {
+            continue;
+        } else if(!pmmMark(phys, false)) {
+            unpin(phys, 1);
+            if(buddyReady) buddyFree(phys, 0);
+        } else {
+            s = -1;
+        }
+    }
+
     releaseLock(&lock);
     return s;
 }
 
+/* cmaAllocate(): allocates contiguous memory from the contiguous memory area,
+ * the global lock must be held by the caller
+ * params: count - number of pages
+ * params: limit - highest address the allocation may extend to
+ * returns: physical address of the first page, zero on fail
+ */
+
+static uintptr_t cmaAllocate(size_t count, uintptr_t limit) {
+    if(limit > cmaLimit) limit = cmaLimit;
+    if((cmaBase + (count * PAGE_SIZE)) > limit) return 0;
+
+    uintptr_t start = 0;
+    int order = 0;
+    while((order <= PMM_MAX_ORDER) && (((size_t)1 << order) < count))
+        order++;
+
+    if(order <= PMM_MAX_ORDER) {
+        for(int i = 0; !start && (i < status.nodeCount); i++)
+            start = buddyAllocateZone(i, PMM_ZONE_CMA, order, limit);
+
+        if(start && (((size_t)1 << order) > count))
+            buddyFreeRange(start + (count * PAGE_SIZE), ((size_t)1 << order) - count);
+    }
+
+    if(!start) {
+        start = pmmScanContiguous(count, cmaBase, limit);
+        if(start) buddyCarve(start, count);
+    }
+
+    return start;
+}
+
+/* pmmAllocateMovable(): allocates one page whose contents may be migrated, so
+ * that it can be borrowed from the contiguous memory area if necessary
+ * params: none
+ * returns: physical address of the page allocated, zero on fail
+ */
+
+uintptr_t pmmAllocateMovable(void) {
+    uintptr_t addr = pmmAllocate();
+    if(addr || !cmaLimit) return addr;
+
+    // out of general memory, so borrow from the contiguous memory area
+    acquireLockBlocking(&lock);
+    for(int i = 0; !addr && (i < status.nodeCount); i++)
+        addr = buddyAllocateZone(i, PMM_ZONE_CMA, 0, cmaLimit);
+
+    if(addr) {
+        if(pmmMark(addr, true))
+            KERROR("buddy allocator returned used page 0x%08X\n", addr);
+        status.cmaLentPages++;
+    }
+
+    releaseLock(&lock);
+    return addr;
+}
+
 /* pmmAllocateContiguous(): allocates contiguous physical memory
  * params: count - how many pages to allocate
  * params: flags - requirements for the memory block
@@ -249,39 +1386,72 @@ uintptr_t pmmAllocateContiguous(size_t count, int flags) {
     // memory below the 4 GB address line (<= 0xFFFFFFFF)
     // this is going to become necessary in drivers for devices that only have
     // a 32-bit addressing mode, like certain DMA and network controllers
+    if(!count) return 0;
 
     acquireLockBlocking(&lock);
 
-    uintptr_t start = status.lowestUsableAddress;
-    uintptr_t end;
-    if(flags & PMM_CONTIGUOUS_LOW && status.highestUsableAddress > 0xFFFFFFFF) {
-        end = 0xFFFFF000;   // last page of the 32-bit address space
-    } else {
-        end = status.highestUsableAddress - (count * PAGE_SIZE);
+    uintptr_t limit = buddyReady ? buddyLimit : status.highestUsableAddress;
+    if((flags & PMM_CONTIGUOUS_LOW) && (limit > PMM_DMA32_LIMIT)) {
+        limit = PMM_DMA32_LIMIT;    // end of the 32-bit address space
     }
 
-    uintptr_t addr;
+    uintptr_t start = 0;
 
-    do {
-        for(addr = start; addr < (start + (count * PAGE_SIZE)); addr += PAGE_SIZE) {
-            if(pmmIsUsed(addr)) break;
+    // the contiguous memory area is tried first because it is kept free for
+    // exactly this purpose
+    if(buddyReady && cmaLimit) {
+        start = cmaAllocate(count, limit);
+        if(start) status.cmaAllocations++;
+    }
+
+    if(buddyReady && !start) {
+        // round up to the nearest power of two and give back the excess
+        int order = 0;
+        while((order <= PMM_MAX_ORDER) && (((size_t)1 << order) < count))
+            order++;
+
+        if(order <= PMM_MAX_ORDER) {
+            start = buddyAllocate(order, limit, localNode());
+            if(start && (((size_t)1 << order) > count))
+                buddyFreeRange(start + (count * PAGE_SIZE), ((size_t)1 << order) - count);
         }
 
-        if(addr >= (start + (count * PAGE_SIZE))) {
-            if(!pmmMarkContiguous(start, count, true)) {
-                releaseLock(&lock);
-                return start;
-            }
+        if(!start) {
+            // either larger than the biggest block or the free lists are too
+            // fragmented, so search for a run of free pages spanning blocks,
+            // again trying the normal zone before touching DMA32
+            if(limit > PMM_DMA32_LIMIT)
+                start = pmmScanContiguous(count, PMM_DMA32_LIMIT, limit);
+            if(!start) start = pmmScanContiguous(count, 0, limit);
+            if(start) buddyCarve(start, count);
+        }
+    } else if(!start) {
+        start = pmmScanContiguous(count, 0, limit);
+    }
+
+    if(start && pmmMarkContiguous(start, count, true))
+        KERROR("contiguous allocation at 0x%08X overlaps used pages\n", start);
 
+    // contiguous memory is handed to devices, so it must never be migrated
+    if(start && buddyReady) pmmPin(start, count);
+
+    releaseLock(&lock);
+
+    if(start || !buddyReady) return start;
+
+    // memory is too fragmented, so try to make room by migrating pages, first
+    // evicting pages lent out from the contiguous memory area
+    if(cmaLimit && (cmaBase + (count * PAGE_SIZE)) <= limit) {
+        start = pmmCompact(count, cmaBase, (cmaLimit < limit) ? cmaLimit : limit);
+        if(start) {
+            acquireLockBlocking(&lock);
+            status.cmaAllocations++;
             releaseLock(&lock);
-            return 0;
-        } else {
-            start += PAGE_SIZE;
+            return start;
         }
-    } while(start < end);
+    }
 
-    releaseLock(&lock);
-    return 0;
+    return pmmCompact(count, 0, limit);
 }
 
 /* pmmFreeContiguous(): frees a contiguous block of physical memory
@@ -291,13 +1461,130 @@ uintptr_t pmmAllocateContiguous(size_t count, int flags) {
  */
 
 int pmmFreeContiguous(uintptr_t phys, size_t count) {
-    int status = 0;
+    if(!count) return 0;
+    phys &= ~(PAGE_SIZE-1);
+    if(phys < status.lowestUsableAddress || (phys + (count * PAGE_SIZE)) > status.highestUsableAddress)
+        return -1;
+
+    acquireLockBlocking(&lock);
+    unpin(phys, count);
+
+    // the common case is a range that is entirely in use, which can be
+    // cleared a word at a time and handed back as whole buddy blocks
+    if(pmmCountUsed(phys, count) == count) {
+        pmmMarkContiguous(phys, count, false);
+        if(buddyReady) buddyFreeRange(phys, count);
+        releaseLock(&lock);
+        return 0;
+    }
+
+    // otherwise free page by page so that double frees are still caught
+    int s = 0;
     for(size_t i = 0; i < count; i++) {
-        status |= pmmFree(phys);
-        phys += PAGE_SIZE;
+        uintptr_t addr = phys + (i * PAGE_SIZE);
+        if(!pmmMark(addr, false)) {
+            if(buddyReady) buddyFree(addr, 0);
+        } else {
+            s = -1;
+        }
     }
-    
-    return status;
+
+    releaseLock(&lock);
+    return s;
+}
+
+/* pmmShare(): adds a reference to a page so that it can be mapped read-only
+ * by another address space and copied on the first write
+ * params: phys - physical address of the page, which must be in use
+ * returns: true if the page is now shared, false if it must be copied now
+ */
+
+bool pmmShare(uintptr_t phys) {
+    phys &= ~(PAGE_SIZE-1);
+    if(!shareEnabled || !buddyReady) return false;
+    if(phys < status.lowestUsableAddress || phys >= buddyLimit) return false;
+
+    // a device may be writing to pinned pages behind our back
+    uintptr_t page = phys / PAGE_SIZE;
+    if(pinBitmap[page / 64] & ((uint64_t)1 << (page % 64))) return false;
+
+    uint16_t count = __atomic_load_n(&shareCounts[page], __ATOMIC_RELAXED);
+    do {
+        if(count >= PMM_SHARE_MAX) return false;
+    } while(!__atomic_compare_exchange_n(&shareCounts[page], &count, count + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    __atomic_fetch_add(&status.pagesShared, 1, __ATOMIC_RELAXED);
+    return true;
+}
+
+/* pmmShareCount(): returns the number of extra references to a page
+ * params: phys - physical address of the page
+ * returns: number of references beyond the first, zero if it isn't shared
+ */
+
+int pmmShareCount(uintptr_t phys) {
+    if(!buddyReady || phys >= buddyLimit) return 0;
+
+    uint16_t count = __atomic_load_n(&shareCounts[phys / PAGE_SIZE], __ATOMIC_RELAXED);
+    if(count == PMM_SHARE_UNMANAGED) return 0;
+    return count;
+}
+
+/* pmmReclaimable(): checks whether a page's contents can be moved out of it
+ * and the page freed, which is only the case for unpinned pages with a
+ * single reference
+ * params: phys - physical address of the page
+ * returns: true if the page can be reclaimed
+ */
+
+bool pmmReclaimable(uintptr_t phys) {
+    phys &= ~(PAGE_SIZE-1);
+    if(!buddyReady || phys < status.lowestUsableAddress || phys >= buddyLimit) return false;
+
+    uintptr_t page = phys / PAGE_SIZE;
+    if(pinBitmap[page / 64] & ((uint64_t)1 << (page % 64))) return false;
+    if(__atomic_load_n(&shareCounts[page], __ATOMIC_RELAXED)) return false;
+    return pmmIsUsed(phys);
+}
+
+/* pmmUnshare(): gives the caller a private, writable copy of a shared page
+ * params: phys - physical address of the shared page
+ * returns: physical address of the private page, zero on fail
+ */
+
+uintptr_t pmmUnshare(uintptr_t phys) {
+    phys &= ~(PAGE_SIZE-1);
+    __atomic_fetch_add(&status.cowFaults, 1, __ATOMIC_RELAXED);
+
+    // the last reference can simply keep the page
+    if(!pmmShareCount(phys)) return phys;
+
+    uintptr_t copy = pmmAllocateMovable();
+    if(!copy) return 0;
+
+    memcpy((void *)vmmMMIO(copy, true), (const void *)vmmMMIO(phys, true), PAGE_SIZE);
+
+    // and give up the reference to the original, which frees it if everyone
+    // else has copied it in the meantime
+    pmmFree(phys);
+
+    __atomic_fetch_add(&status.cowCopies, 1, __ATOMIC_RELAXED);
+    return copy;
+}
+
+/* pmmMoveShares(): moves the references of a page to a copy of it, for use
+ * when migrating a page that may be shared
+ * params: from - physical address of the original page
+ * params: to - physical address of the copy
+ * returns: nothing
+ */
+
+void pmmMoveShares(uintptr_t from, uintptr_t to) {
+    if(!buddyReady || from >= buddyLimit || to >= buddyLimit) return;
+
+    uint16_t count = __atomic_exchange_n(&shareCounts[from / PAGE_SIZE], 0, __ATOMIC_ACQ_REL);
+    if(count == PMM_SHARE_UNMANAGED) count = 0;
+    __atomic_store_n(&shareCounts[to / PAGE_SIZE], count, __ATOMIC_RELEASE);
 }
 
 /* pcontig(): allocates or deallocates contiguous physical memory for drivers
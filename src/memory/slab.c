@@ -0,0 +1,326 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* Slab Allocator */
+
+/* most kernel heap allocations are command and message structures of a few
+ * dozen to a few hundred bytes, so instead of giving each one its own page,
+ * these are carved out of single-page slabs, one cache per size class
+ *
+ * each slab starts with a header and holds objects of one size; free objects
+ * are linked through their first word, and each CPU keeps a small magazine of
+ * free objects per size class so that most allocations and frees don't touch
+ * the shared caches at all */
+
+#include <string.h>
+#include <platform/platform.h>
+#include <platform/mmap.h>
+#include <platform/lock.h>
+#include <kernel/memory.h>
+#include <kernel/logger.h>
+
+typedef struct Slab {
+    uint64_t magic;
+    struct SlabCache *cache;
+    struct Slab *next, *prev;
+    void *free;                 // free objects in this slab
+    uint32_t used, capacity;
+} Slab;
+
+typedef struct SlabCache {
+    lock_t lock;
+    size_t size;
+    int index;
+    Slab *partial, *full, *empty;
+    size_t emptyCount;
+    size_t slabs;
+    uint64_t allocations, frees;
+    uint64_t cpuHits, cpuMisses;
+} SlabCache;
+
+static const size_t sizes[SLAB_CLASSES] = {
+    16, 32, 64, 96, 128, 192, 256, 384, 512, 1024
+};
+
+static SlabCache caches[SLAB_CLASSES];
+static bool ready = false;
+
+// whole-page allocations followed by an unmapped page, for debugging
+bool heapGuard = false;
+
+/* slabSetup(): sets up the size classes on first use */
+
+static void slabSetup() {
+    for(int i = 0; i < SLAB_CLASSES; i++) {
+        caches[i].lock = LOCK_INITIAL;
+        caches[i].size = sizes[i];
+        caches[i].index = i;
+    }
+
+    ready = true;
+}
+
+/* slabInit(): configures the slab allocator
+ * params: boot - kernel boot information structure
+ * returns: nothing
+ */
+
+void slabInit(KernelBootInfo *boot) {
+    if(!ready) slabSetup();
+
+    // guard pages catch heap overflows at the cost of a page per allocation
+    heapGuard = bootArgFlag(boot->arguments, "heapguard");
+    if(heapGuard) KDEBUG("kernel heap guard pages enabled, slab allocator disabled\n");
+}
+
+static inline int classOf(size_t size) {
+    for(int i = 0; i < SLAB_CLASSES; i++) {
+        if(size <= sizes[i]) return i;
+    }
+
+    return -1;
+}
+
+static inline Slab *slabOf(const void *ptr) {
+    return (Slab *) ((uintptr_t) ptr & ~(PAGE_SIZE-1));
+}
+
+/* listRemove(), listPush(): move slabs between the lists of a cache */
+
+static void listRemove(Slab **list, Slab *slab) {
+    if(slab->prev) slab->prev->next = slab->next;
+    else *list = slab->next;
+    if(slab->next) slab->next->prev = slab->prev;
+}
+
+static void listPush(Slab **list, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if(*list) (*list)->prev = slab;
+    *list = slab;
+}
+
+/* slabCreate(): creates a new slab for a cache, with the cache locked
+ * params: cache - cache to grow
+ * returns: pointer to the slab, NULL on fail
+ */
+
+static Slab *slabCreate(SlabCache *cache) {
+    uintptr_t base = vmmAllocate(KERNEL_HEAP_BASE, KERNEL_HEAP_LIMIT, 1, VMM_WRITE);
+    if(!base) return NULL;
+
+    Slab *slab = (Slab *) base;
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->used = 0;
+    slab->capacity = (PAGE_SIZE - SLAB_HEADER_SIZE) / cache->size;
+    slab->free = NULL;
+
+    // thread the free list from the end so objects are handed out in order
+    for(int i = slab->capacity - 1; i >= 0; i--) {
+        void **object = (void **) (base + SLAB_HEADER_SIZE + (i * cache->size));
+        *object = slab->free;
+        slab->free = object;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+/* cacheTake(): takes objects out of the slabs of a cache
+ * params: cache - cache to allocate from
+ * params: objects - array to store the objects in
+ * params: count - number of objects wanted
+ * returns: number of objects taken
+ */
+
+static int cacheTake(SlabCache *cache, void **objects, int count) {
+    int taken = 0;
+
+    acquireLockBlocking(&cache->lock);
+    while(taken < count) {
+        Slab *slab = cache->partial;
+        if(!slab) {
+            slab = cache->empty;
+            if(slab) {
+                listRemove(&cache->empty, slab);
+                cache->emptyCount--;
+            } else {
+                slab = slabCreate(cache);
+                if(!slab) break;
+            }
+
+            listPush(&cache->partial, slab);
+        }
+
+        while((taken < count) && slab->free) {
+            void **object = (void **) slab->free;
+            slab->free = *object;
+            slab->used++;
+            objects[taken++] = object;
+        }
+
+        if(!slab->free) {
+            listRemove(&cache->partial, slab);
+            listPush(&cache->full, slab);
+        }
+    }
+
+    releaseLock(&cache->lock);
+    return taken;
+}
+
+/* cacheReturn(): returns objects to the slabs they came from
+ * params: cache - cache the objects belong to
+ * params: objects - array of objects
+ * params: count - number of objects
+ * returns: nothing
+ */
+
+static void cacheReturn(SlabCache *cache, void **objects, int count) {
+    uintptr_t release[SLAB_MAGAZINE_SIZE];
+    int releaseCount = 0;
+
+    acquireLockBlocking(&cache->lock);
+    for(int i = 0; i < count; i++) {
+        Slab *slab = slabOf(objects[i]);
+        if(!slab->free) {
+            listRemove(&cache->full, slab);
+            listPush(&cache->partial, slab);
+        }
+
+        *(void **) objects[i] = slab->free;
+        slab->free = objects[i];
+        slab->used--;
+
+        if(!slab->used) {
+            // keep a few empty slabs around and give the rest back
+            listRemove(&cache->partial, slab);
+            if((cache->emptyCount < SLAB_EMPTY_MAX) || (releaseCount >= SLAB_MAGAZINE_SIZE)) {
+                listPush(&cache->empty, slab);
+                cache->emptyCount++;
+            } else {
+                slab->magic = 0;
+                release[releaseCount++] = (uintptr_t) slab;
+                cache->slabs--;
+            }
+        }
+    }
+
+    releaseLock(&cache->lock);
+
+    for(int i = 0; i < releaseCount; i++)
+        vmmFree(release[i], 1);
+}
+
+/* slabAllocate(): allocates a small object from the kernel heap
+ * params: size - size of the object
+ * returns: pointer to the object, NULL if the size is not served by slabs
+ */
+
+void *slabAllocate(size_t size) {
+    if(heapGuard || !size || (size > SLAB_MAX_SIZE)) return NULL;
+    if(!ready) slabSetup();
+
+    int index = classOf(size);
+    SlabCache *cache = &caches[index];
+    void *object = NULL;
+
+    SlabCPUCache *cpu = platformGetSlabCache();
+    if(cpu) {
+        acquireLockBlocking(&cpu->lock);
+        if(!cpu->count[index]) {
+            // refill half the magazine at once
+            cpu->count[index] = cacheTake(cache, cpu->objects[index], SLAB_MAGAZINE_SIZE / 2);
+            __atomic_add_fetch(&cache->cpuMisses, 1, __ATOMIC_RELAXED);
+        } else {
+            __atomic_add_fetch(&cache->cpuHits, 1, __ATOMIC_RELAXED);
+        }
+
+        if(cpu->count[index]) object = cpu->objects[index][--cpu->count[index]];
+        releaseLock(&cpu->lock);
+    } else {
+        cacheTake(cache, &object, 1);
+    }
+
+    if(object) __atomic_add_fetch(&cache->allocations, 1, __ATOMIC_RELAXED);
+    return object;
+}
+
+/* slabSize(): returns the size of a slab object
+ * params: ptr - pointer to the object
+ * returns: size of the object, zero if it doesn't belong to a slab
+ */
+
+size_t slabSize(const void *ptr) {
+    if(!ptr || !ready) return 0;
+    if(((uintptr_t) ptr < KERNEL_HEAP_BASE) || ((uintptr_t) ptr > KERNEL_HEAP_LIMIT)) return 0;
+    if(((uintptr_t) ptr & (PAGE_SIZE-1)) < SLAB_HEADER_SIZE) return 0;
+
+    Slab *slab = slabOf(ptr);
+    if(slab->magic != SLAB_MAGIC) return 0;
+    return slab->cache->size;
+}
+
+/* slabFree(): frees a small object back to its slab
+ * params: ptr - pointer to the object
+ * returns: true if the object belonged to a slab, false otherwise
+ */
+
+bool slabFree(void *ptr) {
+    if(!slabSize(ptr)) return false;
+
+    SlabCache *cache = slabOf(ptr)->cache;
+    int index = cache->index;
+    __atomic_add_fetch(&cache->frees, 1, __ATOMIC_RELAXED);
+
+    SlabCPUCache *cpu = platformGetSlabCache();
+    if(!cpu) {
+        cacheReturn(cache, &ptr, 1);
+        return true;
+    }
+
+    acquireLockBlocking(&cpu->lock);
+    if(cpu->count[index] >= SLAB_MAGAZINE_SIZE) {
+        // give the older half of the magazine back to the slabs
+        cacheReturn(cache, cpu->objects[index], SLAB_MAGAZINE_SIZE / 2);
+        memmove(&cpu->objects[index][0], &cpu->objects[index][SLAB_MAGAZINE_SIZE / 2], (SLAB_MAGAZINE_SIZE / 2) * sizeof(void *));
+        cpu->count[index] -= SLAB_MAGAZINE_SIZE / 2;
+    }
+
+    cpu->objects[index][cpu->count[index]++] = ptr;
+    releaseLock(&cpu->lock);
+    return true;
+}
+
+/* slabStatus(): returns usage statistics of each slab cache
+ * params: dst - array of status structures
+ * params: count - number of entries in the array
+ * returns: number of entries filled in
+ */
+
+int slabStatus(SlabStatus *dst, int count) {
+    if(!ready) slabSetup();
+    if(count > SLAB_CLASSES) count = SLAB_CLASSES;
+
+    for(int i = 0; i < count; i++) {
+        SlabCache *cache = &caches[i];
+        acquireLockBlocking(&cache->lock);
+        dst[i].size = cache->size;
+        dst[i].slabs = cache->slabs;
+        dst[i].objects = cache->slabs * ((PAGE_SIZE - SLAB_HEADER_SIZE) / cache->size);
+        releaseLock(&cache->lock);
+
+        dst[i].allocations = __atomic_load_n(&cache->allocations, __ATOMIC_RELAXED);
+        dst[i].frees = __atomic_load_n(&cache->frees, __ATOMIC_RELAXED);
+        dst[i].used = dst[i].allocations - dst[i].frees;
+        dst[i].cpuHits = __atomic_load_n(&cache->cpuHits, __ATOMIC_RELAXED);
+        dst[i].cpuMisses = __atomic_load_n(&cache->cpuMisses, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
\ No newline at end of file
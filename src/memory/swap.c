@@ -0,0 +1,526 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* Compressed Swap */
+
+/* when free memory runs low, cold pages of user memory are compressed into
+ * the kernel heap and their physical pages are freed; the page table entry
+ * is left non-present with the handle of the compressed copy in place of the
+ * physical address, and the page fault handler decompresses it on access
+ *
+ * cold pages are found with a clock over the accessed bits, the hand being
+ * a per-address-space cursor: a page that was accessed since the last pass
+ * gets its bit cleared and a second chance, and one that wasn't is taken;
+ * like compaction, only processes with no thread running or in a system call
+ * are scanned so that their page tables can't change under our feet
+ *
+ * pages are compressed with a small LZ77 codec in the style of LZ4, which is
+ * cheap enough to keep swap-in latency well below that of any storage device
+ * and does particularly well on the zero-filled and sparse pages that make up
+ * most of the memory nobody touches */
+
+#include <stdlib.h>
+#include <string.h>
+#include <platform/platform.h>
+#include <platform/lock.h>
+#include <kernel/memory.h>
+#include <kernel/sched.h>
+#include <kernel/logger.h>
+
+#define LZ_MIN_MATCH        4
+#define LZ_HASH_BITS        12
+#define LZ_MAX_OFFSET       0xFFFF
+
+// one compressed page in the pool
+typedef struct {
+    void *data;             // compressed contents, NULL if the slot is free
+    uint16_t size;
+    uint16_t refs;          // page table entries referring to it
+    uint32_t next;          // next free slot
+} SwapSlot;
+
+static bool enabled = true;
+static lock_t lock = LOCK_INITIAL;
+static SwapSlot *slots = NULL;
+static uint32_t slotCount = 0, freeSlot = 0;
+
+static uint64_t pages = 0, bytes = 0, scanned = 0;
+static uint64_t outs = 0, ins = 0, rejected = 0, inTime = 0;
+
+// only the reclaim thread compresses, so these are not contended
+static lock_t compressLock = LOCK_INITIAL;
+static uint16_t table[1 << LZ_HASH_BITS];
+static uint8_t buffer[SWAP_MAX_SIZE];
+
+/* lzLength(): writes the extra bytes of a literal or match length
+ * params: dst - output buffer
+ * params: op - position in the output buffer
+ * params: max - size of the output buffer
+ * params: n - length beyond what fit in the token
+ * returns: new position in the output buffer, zero if it doesn't fit
+ */
+
+static size_t lzLength(uint8_t *dst, size_t op, size_t max, size_t n) {
+    while(n >= 255) {
+        if(op >= max) return 0;
+        dst[op++] = 255;
+        n -= 255;
+    }
+
+    if(op >= max) return 0;
+    dst[op++] = n;
+    return op;
+}
+
+/* lzSequence(): writes a run of literals followed by a match
+ * params: dst - output buffer
+ * params: op - position in the output buffer
+ * params: max - size of the output buffer
+ * params: literals - literal bytes
+ * params: literalCount - number of literal bytes
+ * params: offset - distance back to the match, ignored for the last sequence
+ * params: length - length of the match, zero for the last sequence
+ * returns: new position in the output buffer, zero if it doesn't fit
+ */
+
+static size_t lzSequence(uint8_t *dst, size_t op, size_t max, const uint8_t *literals, size_t literalCount, size_t offset, size_t length) {
+    size_t matchCode = length ? length - LZ_MIN_MATCH : 0;
+    if(op >= max) return 0;
+
+    size_t token = op++;
+    dst[token] = ((literalCount < 15 ? literalCount : 15) << 4) | (matchCode < 15 ? matchCode : 15);
+
+    if(literalCount >= 15) {
+        op = lzLength(dst, op, max, literalCount - 15);
+        if(!op) return 0;
+    }
+
+    if((op + literalCount) > max) return 0;
+    memcpy(dst + op, literals, literalCount);
+    op += literalCount;
+
+    if(!length) return op;
+
+    if((op + 2) > max) return 0;
+    dst[op++] = offset & 0xFF;
+    dst[op++] = offset >> 8;
+
+    if(matchCode >= 15) op = lzLength(dst, op, max, matchCode - 15);
+    return op;
+}
+
+/* lzCompress(): compresses a block of memory
+ * params: src - input
+ * params: len - size of the input, at most 64 KiB
+ * params: dst - output buffer
+ * params: max - size of the output buffer
+ * returns: size of the compressed data, zero if it doesn't fit
+ */
+
+static size_t lzCompress(const uint8_t *src, size_t len, uint8_t *dst, size_t max) {
+    memset(table, 0, sizeof(table));
+
+    size_t ip = 0, anchor = 0, op = 0;
+    while((ip + LZ_MIN_MATCH) <= len) {
+        uint32_t sequence;
+        memcpy(&sequence, src + ip, 4);
+        uint32_t hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+        size_t ref = table[hash];
+        table[hash] = ip;
+
+        uint32_t candidate;
+        memcpy(&candidate, src + ref, 4);
+        if((ref >= ip) || ((ip - ref) > LZ_MAX_OFFSET) || (candidate != sequence)) {
+            ip++;
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+        while(((ip + length) < len) && (src[ref + length] == src[ip + length]))
+            length++;
+
+        op = lzSequence(dst, op, max, src + anchor, ip - anchor, ip - ref, length);
+        if(!op) return 0;
+
+        ip += length;
+        anchor = ip;
+    }
+
+    // whatever is left is written out as literals
+    return lzSequence(dst, op, max, src + anchor, len - anchor, 0, 0);
+}
+
+/* lzDecompress(): decompresses a block of memory
+ * params: src - compressed data
+ * params: len - size of the compressed data
+ * params: dst - output buffer
+ * params: max - size of the output buffer
+ * returns: size of the decompressed data, zero on corrupt input
+ */
+
+static size_t lzDecompress(const uint8_t *src, size_t len, uint8_t *dst, size_t max) {
+    size_t ip = 0, op = 0;
+    while(ip < len) {
+        uint8_t token = src[ip++];
+
+        size_t literalCount = token >> 4;
+        if(literalCount == 15) {
+            uint8_t b;
+            do {
+                if(ip >= len) return 0;
+                b = src[ip++];
+                literalCount += b;
+            } while(b == 255);
+        }
+
+        if(((ip + literalCount) > len) || ((op + literalCount) > max)) return 0;
+        memcpy(dst + op, src + ip, literalCount);
+        ip += literalCount;
+        op += literalCount;
+
+        // the last sequence has no match
+        if(ip >= len) break;
+
+        if((ip + 2) > len) return 0;
+        size_t offset = src[ip] | (src[ip+1] << 8);
+        ip += 2;
+
+        size_t length = token & 15;
+        if(length == 15) {
+            uint8_t b;
+            do {
+                if(ip >= len) return 0;
+                b = src[ip++];
+                length += b;
+            } while(b == 255);
+        }
+
+        length += LZ_MIN_MATCH;
+        if(!offset || (offset > op) || ((op + length) > max)) return 0;
+
+        // matches may overlap the bytes they produce
+        for(size_t i = 0; i < length; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+
+    return op;
+}
+
+/* swapInit(): configures the compressed swap
+ * params: boot - kernel boot information structure
+ * returns: nothing
+ */
+
+void swapInit(KernelBootInfo *boot) {
+    // allow swapping to be turned off for comparison
+    enabled = !bootArgFlag(boot->arguments, "noswap");
+    if(!enabled) KDEBUG("compressed swap disabled by boot arguments\n");
+}
+
+/* swapStore(): compresses a page into the pool
+ * params: page - pointer to the contents of the page
+ * returns: handle of the compressed page, zero if it wasn't stored
+ */
+
+static uint32_t swapStore(const void *page) {
+    acquireLockBlocking(&compressLock);
+    size_t size = lzCompress(page, PAGE_SIZE, buffer, SWAP_MAX_SIZE);
+    if(!size) {
+        releaseLock(&compressLock);
+        __atomic_add_fetch(&rejected, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    void *data = malloc(size);
+    if(!data) {
+        releaseLock(&compressLock);
+        return 0;
+    }
+
+    memcpy(data, buffer, size);
+    releaseLock(&compressLock);
+
+    acquireLockBlocking(&lock);
+
+    if(!freeSlot) {
+        // handles must fit in the physical address bits of a page table entry
+        uint32_t count = slotCount ? slotCount * 2 : 1024;
+        if(count > ((uint32_t)1 << 28)) count = (uint32_t)1 << 28;
+        SwapSlot *newSlots = (count > slotCount) ? realloc(slots, count * sizeof(SwapSlot)) : NULL;
+        if(!newSlots) {
+            releaseLock(&lock);
+            free(data);
+            return 0;
+        }
+
+        // slot zero is never handed out so that zero can mean failure
+        for(uint32_t i = count - 1; i >= (slotCount ? slotCount : 1); i--) {
+            newSlots[i].data = NULL;
+            newSlots[i].next = freeSlot;
+            freeSlot = i;
+        }
+
+        slots = newSlots;
+        slotCount = count;
+    }
+
+    uint32_t handle = freeSlot;
+    freeSlot = slots[handle].next;
+    slots[handle].data = data;
+    slots[handle].size = size;
+    slots[handle].refs = 1;
+
+    pages++;
+    bytes += size;
+    outs++;
+
+    releaseLock(&lock);
+    return handle;
+}
+
+/* slotOf(): validates the handle in a swap page table entry
+ * params: entry - physical address field of the page table entry
+ * returns: handle of the compressed page, zero if invalid
+ */
+
+static uint32_t slotOf(uintptr_t entry) {
+    if((entry & VMM_PAGE_SWAP_MASK) != VMM_PAGE_SWAP) return 0;
+
+    uint32_t handle = (entry & ~(PAGE_SIZE-1)) >> VMM_PAGE_SWAP_SHIFT;
+    if(!handle || (handle >= slotCount) || !slots[handle].data) return 0;
+    return handle;
+}
+
+/* dropSlot(): drops a reference to a compressed page, with the lock held
+ * params: handle - handle of the compressed page
+ * returns: nothing
+ */
+
+static void dropSlot(uint32_t handle) {
+    if(--slots[handle].refs) return;
+
+    pages--;
+    bytes -= slots[handle].size;
+    free(slots[handle].data);
+    slots[handle].data = NULL;
+    slots[handle].next = freeSlot;
+    freeSlot = handle;
+}
+
+/* swapShare(): adds a reference to a compressed page for a forked address
+ * space, which gets its own copy when it touches the page
+ * params: entry - physical address field of the page table entry
+ * returns: true on success
+ */
+
+bool swapShare(uintptr_t entry) {
+    acquireLockBlocking(&lock);
+    uint32_t handle = slotOf(entry);
+    bool shared = handle && (slots[handle].refs < 0xFFFF);
+    if(shared) slots[handle].refs++;
+    releaseLock(&lock);
+    return shared;
+}
+
+/* swapDiscard(): drops a reference to a compressed page whose mapping is gone
+ * params: entry - physical address field of the page table entry
+ * returns: nothing
+ */
+
+void swapDiscard(uintptr_t entry) {
+    acquireLockBlocking(&lock);
+    uint32_t handle = slotOf(entry);
+    if(handle) dropSlot(handle);
+    releaseLock(&lock);
+}
+
+/* swapIn(): brings a compressed page back into memory in the address space in
+ * use, this is called by the page fault handler
+ * params: addr - page-aligned logical address
+ * params: entry - physical address field of the page table entry
+ * params: flags - page flags stored in the page table entry
+ * returns: zero on success
+ */
+
+int swapIn(uintptr_t addr, uintptr_t entry, int flags) {
+    uint64_t start = platformNanoseconds();
+
+    uintptr_t phys = pmmAllocateMovable();
+    if(!phys) {
+        KERROR("ran out of physical memory while swapping in page\n");
+        return -1;
+    }
+
+    acquireLockBlocking(&lock);
+
+    // another thread of the same address space may have done it already
+    uintptr_t current;
+    int status = vmmPageStatus(addr, &current);
+    if(!(status & PLATFORM_PAGE_SWAP) || (current != entry)) {
+        releaseLock(&lock);
+        pmmFree(phys);
+        return (status & PLATFORM_PAGE_PRESENT) ? 0 : -1;
+    }
+
+    uint32_t handle = slotOf(entry);
+    if(!handle || (lzDecompress(slots[handle].data, slots[handle].size, (uint8_t *) vmmMMIO(phys, true), PAGE_SIZE) != PAGE_SIZE)) {
+        releaseLock(&lock);
+        KERROR("corrupt compressed page 0x%08X at 0x%08X\n", entry, addr);
+        pmmFree(phys);
+        return -1;
+    }
+
+    flags = (flags & ~(PLATFORM_PAGE_SWAP | PLATFORM_PAGE_ACCESSED)) | PLATFORM_PAGE_PRESENT;
+    if(!platformMapPage(addr, phys, flags)) {
+        releaseLock(&lock);
+        KERROR("could not map physical page 0x%08X to logical 0x%08X\n", phys, addr);
+        pmmFree(phys);
+        return -1;
+    }
+
+    dropSlot(handle);
+    ins++;
+    inTime += platformNanoseconds() - start;
+    releaseLock(&lock);
+    return 0;
+}
+
+/* swapStatus(): fills in compressed swap statistics
+ * params: dst - physical memory status structure
+ * returns: nothing
+ */
+
+void swapStatus(PhysicalMemoryStatus *dst) {
+    acquireLockBlocking(&lock);
+    dst->swapPages = pages;
+    dst->swapBytes = bytes;
+    dst->swapScanned = scanned;
+    dst->swapOuts = outs;
+    dst->swapIns = ins;
+    dst->swapInTime = inTime;
+    releaseLock(&lock);
+
+    dst->swapRejected = __atomic_load_n(&rejected, __ATOMIC_RELAXED);
+}
+
+// state of a reclaim pass over one address space
+typedef struct {
+    VMATree *vmas;
+    size_t count;
+    size_t target;
+    uintptr_t frames[SWAP_SCAN_BATCH];
+} ReclaimPass;
+
+/* reclaimPage(): page scanner that gives recently used pages a second chance
+ * and compresses the others */
+
+static int reclaimPage(uintptr_t virt, uintptr_t *phys, int *flags, void *arg) {
+    ReclaimPass *pass = (ReclaimPass *) arg;
+    if(!(*flags & PLATFORM_PAGE_USER)) return 0;
+
+    if(*flags & PLATFORM_PAGE_ACCESSED) {
+        *flags &= ~PLATFORM_PAGE_ACCESSED;
+        return 0;
+    }
+
+    // device memory and pages shared with other address spaces stay put
+    VMA area;
+    if((*flags & PLATFORM_PAGE_COW) || !pmmReclaimable(*phys)) return 0;
+    if(!vmaFind(pass->vmas, virt, &area) || (area.flags & VMM_DEVICE)) return 0;
+
+    uint32_t handle = swapStore((const void *) vmmMMIO(*phys, true));
+    if(!handle) return 0;
+
+    // the frame can only be freed once the translation is gone everywhere
+    pass->frames[pass->count++] = *phys;
+    *phys = ((uintptr_t) handle << VMM_PAGE_SWAP_SHIFT) | VMM_PAGE_SWAP;
+    *flags &= ~PLATFORM_PAGE_PRESENT;
+
+    return (pass->count >= pass->target);
+}
+
+/* reclaim(): runs one pass of the clock over every idle process
+ * params: target - number of pages to reclaim
+ * returns: number of pages reclaimed
+ */
+
+static size_t reclaim(size_t target) {
+    ReclaimPass *pass = malloc(sizeof(ReclaimPass));
+    if(!pass) return 0;
+
+    size_t total = 0;
+
+    schedLock();
+
+    Process *p = getProcessQueue();
+    while(p && (total < target)) {
+        if(p->threadCount && p->threads && p->threads[0] && processIsIdle(p)) {
+            void *context = p->threads[0]->context;
+            VMATree *vmas = platformGetContextVMAs(context);
+            if(vmas) {
+                pass->vmas = vmas;
+                pass->count = 0;
+                pass->target = target - total;
+                if(pass->target > SWAP_SCAN_BATCH) pass->target = SWAP_SCAN_BATCH;
+
+                size_t visited = platformScanUserPages(context, &vmas->reclaimCursor, SWAP_SCAN_BATCH, &reclaimPage, pass);
+                __atomic_add_fetch(&scanned, visited, __ATOMIC_RELAXED);
+
+                if(pass->count) pmmFreeBatch(pass->count, pass->frames);
+                total += pass->count;
+            }
+        }
+
+        p = p->next;
+    }
+
+    schedRelease();
+
+    free(pass);
+    return total;
+}
+
+/* reclaimThread(): kernel thread that keeps some memory free by compressing
+ * cold pages whenever it runs low
+ * params: args - unused
+ * returns: never
+ */
+
+void *reclaimThread(void *args) {
+    uint64_t last = 0;
+
+    for(;;) {
+        if(enabled && (platformUptime() != last)) {
+            last = platformUptime();
+
+            PhysicalMemoryStatus status;
+            pmmStatus(&status);
+
+            size_t low = status.usablePages / SWAP_LOW_WATERMARK;
+            size_t high = status.usablePages / SWAP_HIGH_WATERMARK;
+            size_t freePages = status.usablePages - status.usedPages;
+
+            if(freePages < low) {
+                // clean file pages are the cheapest to give up, so those go
+                // first before anything is compressed
+                size_t target = high - freePages;
+                size_t dropped = pageCacheShrink(target);
+                target = (dropped < target) ? target - dropped : 0;
+
+                // keep going while passes make progress, the ones that don't
+                // have at least cleared accessed bits for the next one
+                while(target) {
+                    size_t reclaimed = reclaim(target);
+                    if(!reclaimed) break;
+                    target = (reclaimed < target) ? target - reclaimed : 0;
+                }
+            }
+        }
+
+        platformIdle();
+    }
+}
\ No newline at end of file
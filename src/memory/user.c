@@ -0,0 +1,166 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ *
+ * Core Microkernel
+ */
+
+/* User Memory Access */
+
+/* these copy memory to and from the address space of a thread other than the
+ * one the CPU is running, by looking its pages up in its own page tables and
+ * going through the kernel's direct mapping of physical memory, so that the
+ * kernel doesn't have to load that address space to reach it
+ *
+ * only pages that aren't present yet, or are shared copy-on-write and about
+ * to be written, require the address space to be loaded so the page fault
+ * handler can bring them in */
+
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <platform/platform.h>
+#include <kernel/sched.h>
+#include <kernel/memory.h>
+
+/* userRange(): checks that a range of memory lies within the user half
+ * params: addr - base address
+ * params: len - length of the range
+ * returns: true if the range is entirely in user memory
+ */
+
+static bool userRange(uintptr_t addr, size_t len) {
+    if(addr < USER_BASE_ADDRESS) return false;
+    if(len > (USER_LIMIT_ADDRESS - addr + 1)) return false;
+    return true;
+}
+
+/* userPage(): finds the physical page backing a user address in a thread's
+ * address space, bringing it in if necessary
+ * params: t - thread whose address space to look in
+ * params: addr - user address
+ * params: write - true if the page is going to be written to
+ * returns: physical address corresponding to addr, zero if inaccessible
+ */
+
+static uintptr_t userPage(Thread *t, uintptr_t addr, bool write) {
+    int flags;
+    uintptr_t phys = platformGetThreadPage(t->context, &flags, addr);
+
+    if(flags & PLATFORM_PAGE_PRESENT) {
+        if(!(flags & PLATFORM_PAGE_USER)) return 0;
+        if(!write || (flags & PLATFORM_PAGE_WRITE)) return phys;
+
+        // read-only pages can only be written to if they're copy-on-write
+        if(!(flags & PLATFORM_PAGE_COW)) return 0;
+    }
+
+    // the page fault handler works on the address space in use
+    if(threadUseContext(t->tid)) return 0;
+
+    int access = VMM_PAGE_FAULT_USER;
+    if(write) access |= VMM_PAGE_FAULT_WRITE;
+    if(flags & PLATFORM_PAGE_PRESENT) access |= VMM_PAGE_FAULT_PRESENT;
+    if(vmmPageFault(addr, access)) return 0;
+
+    phys = platformGetThreadPage(t->context, &flags, addr);
+    if(!(flags & PLATFORM_PAGE_PRESENT) || !(flags & PLATFORM_PAGE_USER)) return 0;
+    if(write && !(flags & PLATFORM_PAGE_WRITE)) return 0;
+    return phys;
+}
+
+/* copyToUser(): copies memory into a thread's address space
+ * params: t - destination thread
+ * params: dst - destination user address
+ * params: src - source kernel buffer
+ * params: len - number of bytes to copy
+ * returns: zero on success, -EFAULT if any of the destination is inaccessible
+ */
+
+int copyToUser(Thread *t, uintptr_t dst, const void *src, size_t len) {
+    if(!t || !userRange(dst, len)) return -EFAULT;
+
+    const uint8_t *ptr = (const uint8_t *) src;
+    while(len) {
+        size_t offset = dst & (PAGE_SIZE-1);
+        size_t chunk = PAGE_SIZE - offset;
+        if(chunk > len) chunk = len;
+
+        uintptr_t phys = userPage(t, dst, true);
+        if(!phys) return -EFAULT;
+
+        memcpy((void *) vmmMMIO((phys & ~(PAGE_SIZE-1)) + offset, true), ptr, chunk);
+        dst += chunk;
+        ptr += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* copyFromUser(): copies memory out of a thread's address space
+ * params: t - source thread
+ * params: dst - destination kernel buffer
+ * params: src - source user address
+ * params: len - number of bytes to copy
+ * returns: zero on success, -EFAULT if any of the source is inaccessible
+ */
+
+int copyFromUser(Thread *t, void *dst, uintptr_t src, size_t len) {
+    if(!t || !userRange(src, len)) return -EFAULT;
+
+    uint8_t *ptr = (uint8_t *) dst;
+    while(len) {
+        size_t offset = src & (PAGE_SIZE-1);
+        size_t chunk = PAGE_SIZE - offset;
+        if(chunk > len) chunk = len;
+
+        uintptr_t phys = userPage(t, src, false);
+        if(!phys) return -EFAULT;
+
+        memcpy(ptr, (const void *) vmmMMIO((phys & ~(PAGE_SIZE-1)) + offset, true), chunk);
+        src += chunk;
+        ptr += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* strncpyFromUser(): copies a null-terminated string out of a thread's address
+ * space, stopping at the terminator or after max bytes
+ * params: t - source thread
+ * params: dst - destination kernel buffer, at least max bytes
+ * params: src - source user address
+ * params: max - maximum number of bytes to copy, including the terminator
+ * returns: length of the string excluding the terminator, max if it was not
+ *          terminated within max bytes, -EFAULT if the source is inaccessible
+ */
+
+ssize_t strncpyFromUser(Thread *t, char *dst, uintptr_t src, size_t max) {
+    if(!t || (src < USER_BASE_ADDRESS) || (src > USER_LIMIT_ADDRESS)) return -EFAULT;
+
+    size_t copied = 0;
+    while(copied < max) {
+        if(src > USER_LIMIT_ADDRESS) return -EFAULT;
+
+        size_t offset = src & (PAGE_SIZE-1);
+        size_t chunk = PAGE_SIZE - offset;
+        if(chunk > (max - copied)) chunk = max - copied;
+
+        uintptr_t phys = userPage(t, src, false);
+        if(!phys) return -EFAULT;
+
+        const char *page = (const char *) vmmMMIO((phys & ~(PAGE_SIZE-1)) + offset, true);
+        for(size_t i = 0; i < chunk; i++) {
+            dst[copied] = page[i];
+            if(!page[i]) return copied;
+            copied++;
+        }
+
+        src += chunk;
+    }
+
+    return copied;
+}
\ No newline at end of file
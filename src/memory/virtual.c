@@ -12,16 +12,35 @@
 #include <kernel/logger.h>
 
 static KernelHeapStatus status;
+static size_t faultAround = VMM_FAULT_AROUND;     // maximum window in pages
 
-/* vmmInit(): initializes the virtual memory manager */
+/* vmmInit(): initializes the virtual memory manager
+ * params: boot - kernel boot information structure
+ * returns: nothing
+ */
 
-void vmmInit() {
+void vmmInit(KernelBootInfo *boot) {
     if(platformPagingSetup()) {
         KERROR("failed to create paging structures; cannot initialize virtual memory manager\n");
         while(1);
     }
 
+    // physical memory is now directly mapped, so the physical memory manager
+    // can build its free lists
+    pmmInitBuddy();
+
     memset(&status, 0, sizeof(KernelHeapStatus));
+
+    // the fault-around window can be tuned or turned off for comparison
+    if(bootArgFlag(boot->arguments, "nofaultaround")) faultAround = 1;
+    else if(bootArgSize(boot->arguments, "faultaround")) faultAround = bootArgSize(boot->arguments, "faultaround");
+    if(faultAround > VMM_FAULT_AROUND_MAX) faultAround = VMM_FAULT_AROUND_MAX;
+
+    KDEBUG("fault-around window is up to %d pages\n", faultAround);
+
+    slabInit(boot);
+    swapInit(boot);
+    pageCacheInit(boot);
 }
 
 /* vmmPageStatus(): returns the status of a page
@@ -47,6 +66,20 @@ bool vmmIsUsed(uintptr_t addr) {
     return (s & PLATFORM_PAGE_PRESENT) || (s & PLATFORM_PAGE_SWAP);
 }
 
+/* vmmPlatformFlags(): translates VMM flags into platform page flags
+ * params: flags - VMM flags
+ * returns: platform page flags, without the present flag
+ */
+
+static int vmmPlatformFlags(int flags) {
+    int platformFlags = 0;
+    if(flags & VMM_USER) platformFlags |= PLATFORM_PAGE_USER;
+    if(flags & VMM_WRITE) platformFlags |= PLATFORM_PAGE_WRITE;
+    if(flags & VMM_EXEC) platformFlags |= PLATFORM_PAGE_EXEC;
+    if(flags & VMM_NO_CACHE) platformFlags |= PLATFORM_PAGE_NO_CACHE;
+    return platformFlags;
+}
+
 /* vmmAllocate(): allocates virtual memory
  * params: base - base of logical address
  * params: limit - limit of logical address
@@ -59,17 +92,35 @@ uintptr_t vmmAllocate(uintptr_t base, uintptr_t limit, size_t count, int flags)
     // find free virtual memory
     base &= ~(PAGE_SIZE-1);
     limit &= ~(PAGE_SIZE-1);
+
+    // user address spaces keep track of their memory in areas, which are
+    // searched in logarithmic time and leave the page tables untouched
+    VMATree *vmas = platformGetVMAs();
+    if(vmas && (limit <= USER_LIMIT_ADDRESS))
+        return vmaAllocate(vmas, base, limit, count, flags);
+
+    // we are NOT setting the page-present flag here for performance reasons
+    // true physical memory will only be allocated when the memory is used
+    int platformFlags = vmmPlatformFlags(flags);
+
+    // the kernel heap has an arena that knows where its free space is
+    if((base == KERNEL_HEAP_BASE) && (limit <= KERNEL_HEAP_LIMIT)) {
+        uintptr_t ptr = vmemAllocate(&kernelHeapArena, count);
+        if(!ptr) return 0;
+
+        for(size_t i = 0; i < count; i++) {
+            if(!platformMapPage(ptr + (i*PAGE_SIZE), VMM_PAGE_ALLOCATE, platformFlags)) {
+                vmmFree(ptr, count);
+                return 0;
+            }
+        }
+
+        return ptr;
+    }
+
     uintptr_t start = base;
     uintptr_t end = limit - (count * PAGE_SIZE);
     uintptr_t addr;
-    
-    // we are NOT setting the page-present flag here for performance reasons
-    // true physical memory will only be allocated when the memory is used
-    int platformFlags = 0;
-    if(flags & VMM_USER) platformFlags |= PLATFORM_PAGE_USER;
-    if(flags & VMM_WRITE) platformFlags |= PLATFORM_PAGE_WRITE;
-    if(flags & VMM_EXEC) platformFlags |= PLATFORM_PAGE_EXEC;
-    if(flags & VMM_NO_CACHE) platformFlags |= PLATFORM_PAGE_NO_CACHE;
 
     do {
         for(addr = start; addr < (start + (count*PAGE_SIZE)); addr += PAGE_SIZE) {
@@ -107,23 +158,314 @@ int vmmFree(uintptr_t addr, size_t count) {
     int pageStatus;
     uintptr_t phys;
 
+    // physical frames are collected and released in batches so the physical
+    // memory manager's lock isn't taken once per page, and so that a single
+    // TLB invalidation covers the whole batch before its frames are reused
+    uintptr_t frames[64];
+    size_t frameCount = 0;
+    size_t flushed = 0;
+
     for(size_t i = 0; i < count; i++) {
         pageStatus = vmmPageStatus(addr + (i * PAGE_SIZE), &phys);
         if(pageStatus & PLATFORM_PAGE_ERROR) {
             status |= 1;
         } else if(pageStatus & PLATFORM_PAGE_PRESENT) {
-            status |= pmmFree(phys);
-        } else if(pageStatus & PLATFORM_PAGE_SWAP) {
-            // TODO: free swap space when swapping is implemented
+            frames[frameCount++] = phys;
+        } else if((pageStatus & PLATFORM_PAGE_SWAP) && ((phys & VMM_PAGE_SWAP_MASK) == VMM_PAGE_SWAP)) {
+            swapDiscard(phys);
         }
 
-        // now free the virtual page itself
-        status |= platformUnmapPage(addr + (i * PAGE_SIZE));
+        // now free the virtual page itself, without creating page tables for
+        // pages that were never touched
+        if(pageStatus & (PLATFORM_PAGE_PRESENT | PLATFORM_PAGE_SWAP))
+            status |= platformUnmapPage(addr + (i * PAGE_SIZE));
+
+        if(frameCount == 64) {
+            platformInvalidatePages(addr + (flushed * PAGE_SIZE), i + 1 - flushed);
+            flushed = i + 1;
+
+            status |= pmmFreeBatch(frameCount, frames);
+            frameCount = 0;
+        }
     }
 
+    platformInvalidatePages(addr + (flushed * PAGE_SIZE), count - flushed);
+    if(frameCount) status |= pmmFreeBatch(frameCount, frames);
+
+    VMATree *vmas = platformGetVMAs();
+    if(vmas && (addr <= USER_LIMIT_ADDRESS)) status |= vmaRemove(vmas, addr, count);
+    else if((addr >= KERNEL_HEAP_BASE) && (addr <= KERNEL_HEAP_LIMIT)) vmemFree(&kernelHeapArena, addr, count);
     return status;
 }
 
+/* vmmRelease(): unmaps virtual memory without freeing the physical memory
+ * behind it, for mappings of memory the kernel doesn't own
+ * params: addr - logical address to be released
+ * params: count - page count
+ * returns: 0 on success
+ */
+
+int vmmRelease(uintptr_t addr, size_t count) {
+    addr &= ~(PAGE_SIZE-1);
+
+    int status = 0;
+    for(size_t i = 0; i < count; i++) {
+        if(vmmIsUsed(addr + (i * PAGE_SIZE)))
+            status |= platformUnmapPage(addr + (i * PAGE_SIZE));
+    }
+
+    platformInvalidatePages(addr, count);
+
+    VMATree *vmas = platformGetVMAs();
+    if(vmas && (addr <= USER_LIMIT_ADDRESS)) status |= vmaRemove(vmas, addr, count);
+    return status;
+}
+
+/* vmmMove(): moves the page table entries of a range of memory to another
+ * range, so that its contents follow without being copied
+ * params: from - logical address of the range
+ * params: to - logical address it is moved to, already reserved
+ * params: count - page count
+ * returns: 0 on success
+ */
+
+int vmmMove(uintptr_t from, uintptr_t to, size_t count) {
+    from &= ~(PAGE_SIZE-1);
+    to &= ~(PAGE_SIZE-1);
+
+    int status = 0;
+    for(size_t i = 0; i < count; i++) {
+        // physical pages, compressed pages and pages that are yet to be
+        // allocated all move the same way, keeping their flags
+        uintptr_t phys;
+        int pageStatus = vmmPageStatus(from + (i * PAGE_SIZE), &phys);
+        if(pageStatus & PLATFORM_PAGE_ERROR) continue;
+        if(!(pageStatus & (PLATFORM_PAGE_PRESENT | PLATFORM_PAGE_SWAP))) continue;
+
+        if(!platformMapPage(to + (i * PAGE_SIZE), phys, pageStatus)) {
+            status |= 1;
+            continue;
+        }
+
+        status |= platformUnmapPage(from + (i * PAGE_SIZE));
+    }
+
+    platformInvalidatePages(from, count);
+    return status;
+}
+
+/* vmmRemap(): resizes a range of memory, growing it in place when the pages
+ * after it are free and otherwise moving it elsewhere with vmmMove()
+ * params: addr - logical address of the range
+ * params: count - current page count
+ * params: newCount - new page count
+ * params: base - base of logical address, if the range has to move
+ * params: limit - limit of logical address, if the range has to move
+ * params: flags - attributes of the memory added to the range
+ * params: move - whether the range may be moved
+ * returns: new address of the range, 0 on failure
+ */
+
+uintptr_t vmmRemap(uintptr_t addr, size_t count, size_t newCount, uintptr_t base,
+                   uintptr_t limit, int flags, bool move) {
+    addr &= ~(PAGE_SIZE-1);
+    if(!newCount) return 0;
+
+    if(newCount <= count) {
+        if(newCount < count) vmmFree(addr + (newCount * PAGE_SIZE), count - newCount);
+        return addr;
+    }
+
+    uintptr_t end = addr + (count * PAGE_SIZE);
+    size_t extra = newCount - count;
+
+    VMATree *vmas = platformGetVMAs();
+    if(vmas && (addr <= USER_LIMIT_ADDRESS)) {
+        uintptr_t tail = vmaAllocate(vmas, end, limit, extra, flags);
+        if(tail == end) return addr;
+        if(tail) vmaRemove(vmas, tail, extra);
+    } else if((addr >= KERNEL_HEAP_BASE) && (addr <= KERNEL_HEAP_LIMIT)) {
+        if(vmemClaim(&kernelHeapArena, end, extra)) {
+            int platformFlags = vmmPlatformFlags(flags);
+            for(size_t i = 0; i < extra; i++) {
+                if(!platformMapPage(end + (i*PAGE_SIZE), VMM_PAGE_ALLOCATE, platformFlags)) {
+                    vmmFree(end, extra);
+                    return 0;
+                }
+            }
+
+            return addr;
+        }
+    }
+
+    if(!move) return 0;
+
+    uintptr_t ptr = vmmAllocate(base, limit, newCount, flags);
+    if(!ptr) return 0;
+
+    if(vmmMove(addr, ptr, count)) {
+        // put back whatever was moved and give up
+        vmmMove(ptr, addr, count);
+        vmmFree(ptr, newCount);
+        return 0;
+    }
+
+    // the old range is empty now, so this only releases its addresses
+    vmmFree(addr, count);
+    return ptr;
+}
+
+/* vmmCopyOnWrite(): gives an address space its own copy of a page that was
+ * shared copy-on-write
+ * params: addr - logical address that was written to
+ * params: access - access conditions that caused the fault
+ * returns: 0 on success
+ */
+
+static int vmmCopyOnWrite(uintptr_t addr, int access) {
+    uintptr_t phys;
+    addr &= ~(PAGE_SIZE-1);
+    int status = vmmPageStatus(addr, &phys);
+    if(!(status & PLATFORM_PAGE_PRESENT)) return -1;
+    if(!(status & PLATFORM_PAGE_USER) && (access & VMM_PAGE_FAULT_USER)) return -1;
+
+    // another CPU may have already handled the fault
+    if(status & PLATFORM_PAGE_WRITE) return 0;
+    if(!(status & PLATFORM_PAGE_COW)) return -1;
+
+    uintptr_t copy = pmmUnshare(phys);
+    if(!copy) {
+        KERROR("ran out of physical memory while copying shared page\n");
+        return -1;
+    }
+
+    status = (status & ~PLATFORM_PAGE_COW) | PLATFORM_PAGE_WRITE;
+    if(!platformMapPage(addr, copy, status)) {
+        KERROR("could not map physical page 0x%08X to logical 0x%08X\n", copy, addr);
+        return -1;
+    }
+
+    // the translation of the original page may be cached wherever this
+    // address space is in use
+    if(copy != phys) platformInvalidatePages(addr, 1);
+    return 0;
+}
+
+/* vmmFaultAround(): brings in the untouched pages of anonymous memory around
+ * a page fault, so that memory used sequentially takes fewer faults; the
+ * window starts small and doubles as long as each fault lands right next to
+ * the window of the previous one, in either direction
+ * params: vmas - VMA tree of the address space in use
+ * params: area - memory area that the fault happened in
+ * params: addr - page-aligned logical address that caused the fault
+ * returns: nothing
+ */
+
+static void vmmFaultAround(VMATree *vmas, const VMA *area, uintptr_t addr) {
+    acquireLockBlocking(&vmas->lock);
+    vmas->faults++;
+
+    // pages prefaulted last time that have been touched since were worth it
+    for(size_t i = 0; vmas->prefaultMask && (i < VMM_FAULT_AROUND_MAX); i++) {
+        if(!(vmas->prefaultMask & ((uint64_t)1 << i))) continue;
+
+        uintptr_t phys;
+        int status = vmmPageStatus(vmas->faultBase + (i * PAGE_SIZE), &phys);
+        if((status & PLATFORM_PAGE_PRESENT) && (status & PLATFORM_PAGE_ACCESSED))
+            vmas->prefaultHits++;
+    }
+
+    vmas->prefaultMask = 0;
+
+    size_t initial = (faultAround + 3) / 4;
+    bool up = (addr == vmas->faultLimit);
+    bool down = ((addr + PAGE_SIZE) == vmas->faultBase);
+    if(up || down) vmas->faultWindow *= 2;
+    else vmas->faultWindow = initial;
+
+    if(vmas->faultWindow < initial) vmas->faultWindow = initial;
+    if(vmas->faultWindow > faultAround) vmas->faultWindow = faultAround;
+
+    // stacks grow down, so the window extends below the fault in that case
+    size_t window = (area->flags & VMM_FILE) ? 1 : vmas->faultWindow;
+    uintptr_t base, limit;
+    if(down) {
+        base = (addr - area->base) >= ((window - 1) * PAGE_SIZE) ? addr - ((window - 1) * PAGE_SIZE) : area->base;
+        limit = addr + PAGE_SIZE;
+    } else {
+        base = addr;
+        limit = (area->limit - addr) >= (window * PAGE_SIZE) ? addr + (window * PAGE_SIZE) : area->limit;
+    }
+
+    vmas->faultBase = base;
+    vmas->faultLimit = limit;
+
+    uintptr_t targets[VMM_FAULT_AROUND_MAX];
+    size_t count = 0;
+    for(uintptr_t page = base; page < limit; page += PAGE_SIZE) {
+        uintptr_t phys;
+        if((page != addr) && !(vmmPageStatus(page, &phys) & (PLATFORM_PAGE_PRESENT | PLATFORM_PAGE_SWAP)))
+            targets[count++] = page;
+    }
+
+    // one batch allocation for the whole window, which may fall short
+    uintptr_t pages[VMM_FAULT_AROUND_MAX];
+    size_t allocated = pmmAllocateBatch(count, pages);
+    for(size_t i = 0; i < allocated; i++) {
+        memset((void *) vmmMMIO(pages[i], true), 0, PAGE_SIZE);
+        if(!platformMapPage(targets[i], pages[i], vmmPlatformFlags(area->flags) | PLATFORM_PAGE_PRESENT)) {
+            pmmFreeBatch(allocated - i, &pages[i]);
+            break;
+        }
+
+        vmas->prefaultMask |= (uint64_t)1 << ((targets[i] - base) / PAGE_SIZE);
+        vmas->prefaulted++;
+    }
+
+    releaseLock(&vmas->lock);
+}
+
+/* vmmAreaFault(): brings in a zero-filled page of user memory that was never
+ * touched, along with its neighbours if the memory is anonymous
+ * params: addr - logical address that caused the fault
+ * params: access - access conditions that caused the fault
+ * returns: 0 on success
+ */
+
+static int vmmAreaFault(uintptr_t addr, int access) {
+    VMATree *vmas = platformGetVMAs();
+    VMA area;
+    if(!vmas || (addr > USER_LIMIT_ADDRESS) || !vmaFind(vmas, addr, &area))
+        return -1;
+
+    // device memory is mapped up front and has nothing to fall back to
+    if(area.flags & VMM_DEVICE) return -1;
+
+    if(!(area.flags & VMM_EXEC) && (access & VMM_PAGE_FAULT_FETCH)) return -1;
+    if(!(area.flags & VMM_USER) && (access & VMM_PAGE_FAULT_USER)) return -1;
+    if(!(area.flags & VMM_WRITE) && (access & VMM_PAGE_FAULT_WRITE)) return -1;
+
+    uintptr_t phys = pmmAllocateMovable();
+    if(!phys) {
+        KERROR("ran out of physical memory while handling page fault\n");
+        return -1;
+    }
+
+    // anonymous memory is only zeroed here, one page at a time as it is used,
+    // so that large reservations cost nothing until they are touched
+    memset((void *) vmmMMIO(phys, true), 0, PAGE_SIZE);
+
+    addr &= ~(PAGE_SIZE-1);
+    if(!platformMapPage(addr, phys, vmmPlatformFlags(area.flags) | PLATFORM_PAGE_PRESENT)) {
+        KERROR("could not map physical page 0x%08X to logical 0x%08X\n", phys, addr);
+        pmmFree(phys);
+        return -1;
+    }
+
+    vmmFaultAround(vmas, &area, addr);
+    return 0;
+}
+
 /* vmmPageFault(): platform-independent page fault handler
  * params: addr - logical address that caused the fault
  * params: access - access conditions that caused the fault
@@ -133,10 +475,14 @@ int vmmFree(uintptr_t addr, size_t count) {
 int vmmPageFault(uintptr_t addr, int access) {
     // determine the conditions that caused the fault
     if(access & VMM_PAGE_FAULT_PRESENT) {
-        // page faults on a present page indicate privilege violations
-        // this is an automatic fail
-        KWARN("access violation at 0x%016X\n", addr);
-        return -1;
+        // page faults on a present page indicate privilege violations, unless
+        // the page is shared copy-on-write and this is the first write to it
+        if(!(access & VMM_PAGE_FAULT_WRITE) || vmmCopyOnWrite(addr, access)) {
+            KWARN("access violation at 0x%016X\n", addr);
+            return -1;
+        }
+
+        return 0;
     }
 
     // get the conditions of the page that caused the fault
@@ -147,6 +493,10 @@ int vmmPageFault(uintptr_t addr, int access) {
     // invalid page?
     if(status & PLATFORM_PAGE_ERROR) return -1;
 
+    // pages of user memory don't exist in the page tables until first used
+    if(!(status & (PLATFORM_PAGE_PRESENT | PLATFORM_PAGE_SWAP)))
+        return vmmAreaFault(addr, access);
+
     // no exec perms and attempt to fetch?
     if(!(status & PLATFORM_PAGE_EXEC) && (access & VMM_PAGE_FAULT_FETCH)) return -1;
     // user accessing kernel page?
@@ -161,11 +511,12 @@ int vmmPageFault(uintptr_t addr, int access) {
         uint64_t swapFlags = phys & VMM_PAGE_SWAP_MASK;
         switch(swapFlags) {
         case VMM_PAGE_SWAP:
-            KERROR("TODO: page swapping is not implemented yet; returning failure for now\n");
+            returnValue = swapIn(addr & ~(PAGE_SIZE-1), phys, status);
             break;
         case VMM_PAGE_ALLOCATE:
-            /* here we need to allocate a physical page */
-            phys = pmmAllocate();
+            /* here we need to allocate a physical page, and user pages can be
+             * migrated so they may borrow from the contiguous memory area */
+            phys = (status & PLATFORM_PAGE_USER) ? pmmAllocateMovable() : pmmAllocate();
             if(!phys) {
                 KERROR("ran out of physical memory while handling page fault\n");
                 break;
@@ -211,15 +562,27 @@ uintptr_t vmmMMIO(uintptr_t phys, bool cache) {
 
 uintptr_t vmmSetFlags(uintptr_t base, size_t count, int flags) {
     uintptr_t phys;
-    int parsedFlags = PLATFORM_PAGE_PRESENT;
-    if(flags & VMM_EXEC) parsedFlags |= PLATFORM_PAGE_EXEC;
-    if(flags & VMM_USER) parsedFlags |= PLATFORM_PAGE_USER;
-    if(flags & VMM_WRITE) parsedFlags |= PLATFORM_PAGE_WRITE;
+    int parsedFlags = vmmPlatformFlags(flags) | PLATFORM_PAGE_PRESENT;
+
+    // pages that haven't been touched yet take their flags from the area
+    VMATree *vmas = platformGetVMAs();
+    if(vmas && (base <= USER_LIMIT_ADDRESS)) vmaProtect(vmas, base, count, flags);
 
     for(size_t i = 0; i < count; i++) {
-        if(vmmPageStatus(base + (i*PAGE_SIZE), &phys) & PLATFORM_PAGE_PRESENT)
-            platformMapPage(base + (i*PAGE_SIZE), phys, parsedFlags);
+        int pageStatus = vmmPageStatus(base + (i*PAGE_SIZE), &phys);
+        if(pageStatus & PLATFORM_PAGE_PRESENT) {
+            // shared pages only become writable once they are copied
+            if((parsedFlags & PLATFORM_PAGE_WRITE) && pmmShareCount(phys))
+                platformMapPage(base + (i*PAGE_SIZE), phys, (parsedFlags & ~PLATFORM_PAGE_WRITE) | PLATFORM_PAGE_COW);
+            else
+                platformMapPage(base + (i*PAGE_SIZE), phys, parsedFlags);
+        } else if((pageStatus & PLATFORM_PAGE_SWAP) && ((phys & VMM_PAGE_SWAP_MASK) == VMM_PAGE_SWAP)) {
+            // compressed pages keep their handle and get the new flags when
+            // they are brought back in
+            platformMapPage(base + (i*PAGE_SIZE), phys, parsedFlags & ~PLATFORM_PAGE_PRESENT);
+        }
     }
 
+    platformInvalidatePages(base, count);
     return base;
 }
\ No newline at end of file
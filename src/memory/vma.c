@@ -0,0 +1,459 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* Virtual Memory Areas */
+
+/* every user address space keeps the ranges it has allocated in an AVL tree
+ * keyed by start address, so that finding the area of an address, finding
+ * free space, and unmapping are logarithmic in the number of areas instead of
+ * linear in the number of pages
+ *
+ * every node also tracks the extent of its subtree and the largest gap
+ * between two areas in it, so that searches for free space can skip entire
+ * subtrees that have no room */
+
+#include <stdlib.h>
+#include <string.h>
+#include <kernel/memory.h>
+#include <platform/platform.h>
+#include <platform/lock.h>
+
+static inline int height(VMA *n) {
+    return n ? n->height : 0;
+}
+
+/* update(): recomputes the height and subtree information of a node from its
+ * children
+ * params: n - node
+ * returns: nothing
+ */
+
+static void update(VMA *n) {
+    int lh = height(n->left), rh = height(n->right);
+    n->height = 1 + ((lh > rh) ? lh : rh);
+
+    n->minBase = n->left ? n->left->minBase : n->base;
+    n->maxLimit = n->right ? n->right->maxLimit : n->limit;
+
+    uintptr_t gap = 0;
+    if(n->left) {
+        gap = n->left->maxGap;
+        if((n->base - n->left->maxLimit) > gap) gap = n->base - n->left->maxLimit;
+    }
+
+    if(n->right) {
+        if(n->right->maxGap > gap) gap = n->right->maxGap;
+        if((n->right->minBase - n->limit) > gap) gap = n->right->minBase - n->limit;
+    }
+
+    n->maxGap = gap;
+}
+
+static VMA *rotateLeft(VMA *n) {
+    VMA *r = n->right;
+    n->right = r->left;
+    r->left = n;
+    update(n);
+    update(r);
+    return r;
+}
+
+static VMA *rotateRight(VMA *n) {
+    VMA *l = n->left;
+    n->left = l->right;
+    l->right = n;
+    update(n);
+    update(l);
+    return l;
+}
+
+/* rebalance(): restores the AVL property of a subtree whose children are
+ * balanced
+ * params: n - root of the subtree
+ * returns: new root of the subtree
+ */
+
+static VMA *rebalance(VMA *n) {
+    update(n);
+    int balance = height(n->left) - height(n->right);
+
+    if(balance > 1) {
+        if(height(n->left->left) < height(n->left->right))
+            n->left = rotateLeft(n->left);
+        return rotateRight(n);
+    } else if(balance < -1) {
+        if(height(n->right->right) < height(n->right->left))
+            n->right = rotateRight(n->right);
+        return rotateLeft(n);
+    }
+
+    return n;
+}
+
+static VMA *insertNode(VMA *root, VMA *n) {
+    if(!root) {
+        n->left = NULL;
+        n->right = NULL;
+        update(n);
+        return n;
+    }
+
+    if(n->base < root->base) root->left = insertNode(root->left, n);
+    else root->right = insertNode(root->right, n);
+    return rebalance(root);
+}
+
+static VMA *removeMin(VMA *root, VMA **min) {
+    if(!root->left) {
+        *min = root;
+        return root->right;
+    }
+
+    root->left = removeMin(root->left, min);
+    return rebalance(root);
+}
+
+static VMA *removeNode(VMA *root, uintptr_t base) {
+    if(!root) return NULL;
+
+    if(base < root->base) {
+        root->left = removeNode(root->left, base);
+    } else if(base > root->base) {
+        root->right = removeNode(root->right, base);
+    } else {
+        if(!root->left) return root->right;
+        if(!root->right) return root->left;
+
+        // replace the node with its successor
+        VMA *successor;
+        VMA *right = removeMin(root->right, &successor);
+        successor->left = root->left;
+        successor->right = right;
+        return rebalance(successor);
+    }
+
+    return rebalance(root);
+}
+
+/* findNode(): finds the area containing an address
+ * params: n - root of the tree
+ * params: addr - address
+ * returns: pointer to the area, NULL if the address is not in any area
+ */
+
+static VMA *findNode(VMA *n, uintptr_t addr) {
+    while(n) {
+        if(addr < n->base) n = n->left;
+        else if(addr >= n->limit) n = n->right;
+        else return n;
+    }
+
+    return NULL;
+}
+
+/* findOverlap(): finds the lowest area overlapping a range
+ * params: n - root of the tree
+ * params: base - start of the range
+ * params: limit - end of the range, exclusive
+ * returns: pointer to the area, NULL if no area overlaps the range
+ */
+
+static VMA *findOverlap(VMA *n, uintptr_t base, uintptr_t limit) {
+    VMA *found = NULL;
+    while(n) {
+        if(n->limit <= base) {
+            n = n->right;
+        } else if(n->base >= limit) {
+            n = n->left;
+        } else {
+            found = n;
+            n = n->left;
+        }
+    }
+
+    return found;
+}
+
+/* findGap(): walks a subtree in order looking for the first gap of a given
+ * size at or after a cursor
+ * params: n - root of the subtree
+ * params: cursor - lowest candidate address, advanced past every area passed
+ * params: size - size of the gap in bytes
+ * params: limit - highest address the gap may extend to
+ * returns: true if a gap was found at the cursor before the end of the subtree
+ */
+
+static bool findGap(VMA *n, uintptr_t *cursor, uintptr_t size, uintptr_t limit) {
+    if(!n || (n->maxLimit <= *cursor)) return false;
+    if((*cursor + size) > limit) return false;
+
+    // skip subtrees with no room before or between their areas
+    if((n->minBase < (*cursor + size)) && (n->maxGap < size)) {
+        *cursor = n->maxLimit;
+        return false;
+    }
+
+    if(findGap(n->left, cursor, size, limit)) return true;
+    if(n->base >= (*cursor + size)) return true;
+    if(n->limit > *cursor) *cursor = n->limit;
+
+    return findGap(n->right, cursor, size, limit);
+}
+
+static VMA *cloneNodes(VMA *n, bool *fail) {
+    if(!n || *fail) return NULL;
+
+    VMA *clone = malloc(sizeof(VMA));
+    if(!clone) {
+        *fail = true;
+        return NULL;
+    }
+
+    memcpy(clone, n, sizeof(VMA));
+    clone->left = cloneNodes(n->left, fail);
+    clone->right = cloneNodes(n->right, fail);
+    return clone;
+}
+
+static void destroyNodes(VMA *n) {
+    if(!n) return;
+    destroyNodes(n->left);
+    destroyNodes(n->right);
+    free(n);
+}
+
+/* insertArea(): inserts an area into the tree, merging it with neighbors
+ * that have the same flags; the tree's lock must be held
+ * params: tree - VMA tree
+ * params: n - area to insert, which must not overlap any other area
+ * returns: nothing
+ */
+
+static void insertArea(VMATree *tree, VMA *n) {
+    VMA *prev = n->base ? findNode(tree->root, n->base - 1) : NULL;
+    if(prev && (prev->limit == n->base) && (prev->flags == n->flags)) {
+        tree->root = removeNode(tree->root, prev->base);
+        tree->count--;
+        n->base = prev->base;
+        free(prev);
+    }
+
+    VMA *next = findNode(tree->root, n->limit);
+    if(next && (next->base == n->limit) && (next->flags == n->flags)) {
+        tree->root = removeNode(tree->root, next->base);
+        tree->count--;
+        n->limit = next->limit;
+        free(next);
+    }
+
+    tree->root = insertNode(tree->root, n);
+    tree->count++;
+}
+
+/* vmaCreate(): creates an empty VMA tree for a new address space
+ * params: none
+ * returns: pointer to the tree, NULL on fail
+ */
+
+VMATree *vmaCreate() {
+    VMATree *tree = calloc(1, sizeof(VMATree));
+    if(!tree) return NULL;
+
+    tree->lock = LOCK_INITIAL;
+    return tree;
+}
+
+/* vmaClone(): duplicates a VMA tree for a forked address space
+ * params: tree - VMA tree
+ * returns: pointer to the new tree, NULL on fail
+ */
+
+VMATree *vmaClone(VMATree *tree) {
+    if(!tree) return NULL;
+
+    VMATree *clone = vmaCreate();
+    if(!clone) return NULL;
+
+    bool fail = false;
+    acquireLockBlocking(&tree->lock);
+    clone->root = cloneNodes(tree->root, &fail);
+    clone->count = tree->count;
+    clone->pages = tree->pages;
+    releaseLock(&tree->lock);
+
+    if(fail) {
+        vmaDestroy(clone);
+        return NULL;
+    }
+
+    return clone;
+}
+
+/* vmaDestroy(): frees a VMA tree along with all of its areas
+ * params: tree - VMA tree
+ * returns: nothing
+ */
+
+void vmaDestroy(VMATree *tree) {
+    if(!tree) return;
+    destroyNodes(tree->root);
+    free(tree);
+}
+
+/* vmaFind(): looks up the area containing an address
+ * params: tree - VMA tree
+ * params: addr - address
+ * params: area - where to copy the area to
+ * returns: true if the address is in an area
+ */
+
+bool vmaFind(VMATree *tree, uintptr_t addr, VMA *area) {
+    acquireLockBlocking(&tree->lock);
+    VMA *n = findNode(tree->root, addr);
+    if(n) memcpy(area, n, sizeof(VMA));
+    releaseLock(&tree->lock);
+
+    return n != NULL;
+}
+
+/* vmaAllocate(): finds and reserves the lowest free range of pages
+ * params: tree - VMA tree
+ * params: base - lowest address the range may start at
+ * params: limit - highest address the range may extend to
+ * params: count - number of pages
+ * params: flags - VMM flags of the area
+ * returns: start of the range, zero on fail
+ */
+
+uintptr_t vmaAllocate(VMATree *tree, uintptr_t base, uintptr_t limit, size_t count, int flags) {
+    if(!count) return 0;
+
+    base &= ~(PAGE_SIZE-1);
+    uintptr_t size = count * PAGE_SIZE;
+
+    VMA *n = malloc(sizeof(VMA));
+    if(!n) return 0;
+
+    acquireLockBlocking(&tree->lock);
+
+    // past the last area everything is free, so a failed search leaves the
+    // cursor at the only remaining candidate
+    uintptr_t cursor = base;
+    findGap(tree->root, &cursor, size, limit);
+    if((cursor + size) > limit || (cursor + size) < cursor) {
+        releaseLock(&tree->lock);
+        free(n);
+        return 0;
+    }
+
+    n->base = cursor;
+    n->limit = cursor + size;
+    n->flags = flags;
+    insertArea(tree, n);
+    if(!(flags & VMM_DEVICE)) tree->pages += count;
+
+    releaseLock(&tree->lock);
+    return cursor;
+}
+
+/* vmaUpdate(): removes a range of pages from the areas of a tree, or changes
+ * the flags of the parts of the range that are in an area
+ * params: tree - VMA tree
+ * params: base - start of the range
+ * params: count - number of pages
+ * params: flags - new VMM flags, negative to remove the range instead
+ * returns: zero on success
+ */
+
+static int vmaUpdate(VMATree *tree, uintptr_t base, size_t count, int flags) {
+    base &= ~(PAGE_SIZE-1);
+    uintptr_t limit = base + (count * PAGE_SIZE);
+
+    acquireLockBlocking(&tree->lock);
+
+    VMA *n;
+    uintptr_t cursor = base;
+    while((cursor < limit) && (n = findOverlap(tree->root, cursor, limit))) {
+        // splitting an area in the middle takes a second node, and changing
+        // the flags of part of an area takes a third
+        VMA *tail = NULL, *changed = NULL;
+        if((n->base < cursor) && (n->limit > limit)) tail = malloc(sizeof(VMA));
+        if(flags >= 0) changed = malloc(sizeof(VMA));
+
+        if(((n->base < cursor) && (n->limit > limit) && !tail) || ((flags >= 0) && !changed)) {
+            releaseLock(&tree->lock);
+            if(tail) free(tail);
+            if(changed) free(changed);
+            return -1;
+        }
+
+        tree->root = removeNode(tree->root, n->base);
+        tree->count--;
+
+        uintptr_t start = (n->base > cursor) ? n->base : cursor;
+        uintptr_t end = (n->limit < limit) ? n->limit : limit;
+
+        if(!(n->flags & VMM_DEVICE)) tree->pages -= (end - start) / PAGE_SIZE;
+        if((flags >= 0) && !(flags & VMM_DEVICE)) tree->pages += (end - start) / PAGE_SIZE;
+
+        if(changed) {
+            memcpy(changed, n, sizeof(VMA));
+            changed->base = start;
+            changed->limit = end;
+            changed->flags = flags;
+        }
+
+        // keep whatever lies outside of the range
+        if(tail) {
+            memcpy(tail, n, sizeof(VMA));
+            tail->base = limit;
+            insertArea(tree, tail);
+        } else if(n->limit > limit) {
+            n->base = limit;
+            insertArea(tree, n);
+            n = NULL;
+        }
+
+        if(n && (n->base < cursor)) {
+            n->limit = cursor;
+            insertArea(tree, n);
+            n = NULL;
+        }
+
+        if(n) free(n);
+        if(changed) insertArea(tree, changed);
+
+        cursor = end;
+    }
+
+    releaseLock(&tree->lock);
+    return 0;
+}
+
+/* vmaRemove(): removes a range of pages from the areas of a tree, splitting
+ * areas that are partially covered
+ * params: tree - VMA tree
+ * params: base - start of the range
+ * params: count - number of pages
+ * returns: zero on success
+ */
+
+int vmaRemove(VMATree *tree, uintptr_t base, size_t count) {
+    return vmaUpdate(tree, base, count, -1);
+}
+
+/* vmaProtect(): changes the flags of the mapped parts of a range of pages
+ * params: tree - VMA tree
+ * params: base - start of the range
+ * params: count - number of pages
+ * params: flags - new VMM flags
+ * returns: zero on success
+ */
+
+int vmaProtect(VMATree *tree, uintptr_t base, size_t count, int flags) {
+    return vmaUpdate(tree, base, count, flags);
+}
\ No newline at end of file
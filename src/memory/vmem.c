@@ -0,0 +1,469 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* Kernel Virtual Address Arenas */
+
+/* ranges of kernel virtual memory are handed out by an arena that knows its
+ * free space as a set of extents, instead of probing the page tables page by
+ * page from the start of the range on every allocation
+ *
+ * every free extent is in two AVL trees: one keyed by address, to find its
+ * neighbours so that freed ranges coalesce, and one keyed by size and then
+ * address, for best-fit allocation; both are logarithmic in the number of
+ * free extents
+ *
+ * small allocations are the common case, so the last few extents freed of
+ * each size up to VMEM_QCACHE_MAX pages are kept aside and handed straight
+ * back out without touching the trees
+ *
+ * the extent tags themselves can't come from the kernel heap, since the heap
+ * is built on top of this; a few are set aside statically and more are carved
+ * out of whole physical pages through the direct map */
+
+#include <string.h>
+#include <kernel/memory.h>
+#include <platform/platform.h>
+#include <platform/mmap.h>
+#include <platform/lock.h>
+
+#define BY_ADDRESS          0
+#define BY_SIZE             1
+
+typedef struct VmemExtent {
+    uintptr_t base;
+    size_t size;                    // in pages
+    struct VmemExtent *left[2], *right[2];
+    int height[2];
+    struct VmemExtent *next;        // unused extent tags
+} VmemExtent;
+
+VmemArena kernelHeapArena = {
+    .lock = LOCK_INITIAL,
+    .base = KERNEL_HEAP_BASE,
+    .limit = KERNEL_HEAP_LIMIT + 1,
+};
+
+static lock_t tagLock = LOCK_INITIAL;
+static VmemExtent bootTags[VMEM_BOOT_EXTENTS];
+static VmemExtent *freeTags = NULL;
+static bool tagsReady = false;
+
+/* tagAllocate(): allocates an extent tag
+ * params: none
+ * returns: pointer to the tag, NULL on fail
+ */
+
+static VmemExtent *tagAllocate() {
+    acquireLockBlocking(&tagLock);
+
+    if(!tagsReady) {
+        for(int i = 0; i < VMEM_BOOT_EXTENTS; i++) {
+            bootTags[i].next = freeTags;
+            freeTags = &bootTags[i];
+        }
+
+        tagsReady = true;
+    }
+
+    if(!freeTags) {
+        uintptr_t phys = pmmAllocate();
+        if(!phys) {
+            releaseLock(&tagLock);
+            return NULL;
+        }
+
+        VmemExtent *tags = (VmemExtent *) vmmMMIO(phys, true);
+        for(int i = 0; i < (PAGE_SIZE / sizeof(VmemExtent)); i++) {
+            tags[i].next = freeTags;
+            freeTags = &tags[i];
+        }
+    }
+
+    VmemExtent *tag = freeTags;
+    freeTags = tag->next;
+    releaseLock(&tagLock);
+
+    memset(tag, 0, sizeof(VmemExtent));
+    return tag;
+}
+
+static void tagFree(VmemExtent *tag) {
+    acquireLockBlocking(&tagLock);
+    tag->next = freeTags;
+    freeTags = tag;
+    releaseLock(&tagLock);
+}
+
+/* compare(): orders two extents in one of the trees */
+
+static inline int compare(int tree, const VmemExtent *a, const VmemExtent *b) {
+    if((tree == BY_SIZE) && (a->size != b->size)) return (a->size < b->size) ? -1 : 1;
+    if(a->base != b->base) return (a->base < b->base) ? -1 : 1;
+    return 0;
+}
+
+static inline int height(int tree, VmemExtent *n) {
+    return n ? n->height[tree] : 0;
+}
+
+static void update(int tree, VmemExtent *n) {
+    int lh = height(tree, n->left[tree]), rh = height(tree, n->right[tree]);
+    n->height[tree] = 1 + ((lh > rh) ? lh : rh);
+}
+
+static VmemExtent *rotateLeft(int tree, VmemExtent *n) {
+    VmemExtent *r = n->right[tree];
+    n->right[tree] = r->left[tree];
+    r->left[tree] = n;
+    update(tree, n);
+    update(tree, r);
+    return r;
+}
+
+static VmemExtent *rotateRight(int tree, VmemExtent *n) {
+    VmemExtent *l = n->left[tree];
+    n->left[tree] = l->right[tree];
+    l->right[tree] = n;
+    update(tree, n);
+    update(tree, l);
+    return l;
+}
+
+/* rebalance(): restores the AVL property of a subtree whose children are
+ * balanced
+ * params: tree - which of the two trees
+ * params: n - root of the subtree
+ * returns: new root of the subtree
+ */
+
+static VmemExtent *rebalance(int tree, VmemExtent *n) {
+    update(tree, n);
+    int balance = height(tree, n->left[tree]) - height(tree, n->right[tree]);
+
+    if(balance > 1) {
+        VmemExtent *l = n->left[tree];
+        if(height(tree, l->left[tree]) < height(tree, l->right[tree]))
+            n->left[tree] = rotateLeft(tree, l);
+        return rotateRight(tree, n);
+    }
+
+    if(balance < -1) {
+        VmemExtent *r = n->right[tree];
+        if(height(tree, r->right[tree]) < height(tree, r->left[tree]))
+            n->right[tree] = rotateRight(tree, r);
+        return rotateLeft(tree, n);
+    }
+
+    return n;
+}
+
+static VmemExtent *insert(int tree, VmemExtent *root, VmemExtent *n) {
+    if(!root) {
+        n->left[tree] = NULL;
+        n->right[tree] = NULL;
+        n->height[tree] = 1;
+        return n;
+    }
+
+    if(compare(tree, n, root) < 0) root->left[tree] = insert(tree, root->left[tree], n);
+    else root->right[tree] = insert(tree, root->right[tree], n);
+    return rebalance(tree, root);
+}
+
+static VmemExtent *removeMin(int tree, VmemExtent *root, VmemExtent **min) {
+    if(!root->left[tree]) {
+        *min = root;
+        return root->right[tree];
+    }
+
+    root->left[tree] = removeMin(tree, root->left[tree], min);
+    return rebalance(tree, root);
+}
+
+static VmemExtent *removeNode(int tree, VmemExtent *root, VmemExtent *n) {
+    if(!root) return NULL;
+
+    int c = compare(tree, n, root);
+    if(c < 0) {
+        root->left[tree] = removeNode(tree, root->left[tree], n);
+    } else if(c > 0) {
+        root->right[tree] = removeNode(tree, root->right[tree], n);
+    } else {
+        VmemExtent *l = root->left[tree], *r = root->right[tree];
+        if(!r) return l;
+
+        VmemExtent *min;
+        r = removeMin(tree, r, &min);
+        min->left[tree] = l;
+        min->right[tree] = r;
+        return rebalance(tree, min);
+    }
+
+    return rebalance(tree, root);
+}
+
+static void extentInsert(VmemArena *arena, VmemExtent *n) {
+    arena->roots[BY_ADDRESS] = insert(BY_ADDRESS, arena->roots[BY_ADDRESS], n);
+    arena->roots[BY_SIZE] = insert(BY_SIZE, arena->roots[BY_SIZE], n);
+    arena->extents++;
+}
+
+static void extentRemove(VmemArena *arena, VmemExtent *n) {
+    arena->roots[BY_ADDRESS] = removeNode(BY_ADDRESS, arena->roots[BY_ADDRESS], n);
+    arena->roots[BY_SIZE] = removeNode(BY_SIZE, arena->roots[BY_SIZE], n);
+    arena->extents--;
+}
+
+/* bestFit(): finds the smallest free extent of at least a given size, the
+ * lowest such one if there are several
+ * params: arena - arena to search
+ * params: pages - size in pages
+ * returns: pointer to the extent, NULL if none is large enough
+ */
+
+static VmemExtent *bestFit(VmemArena *arena, size_t pages) {
+    VmemExtent *n = arena->roots[BY_SIZE], *best = NULL;
+    while(n) {
+        if(n->size >= pages) {
+            best = n;
+            n = n->left[BY_SIZE];
+        } else {
+            n = n->right[BY_SIZE];
+        }
+    }
+
+    return best;
+}
+
+/* neighbours(): finds the free extents immediately below and above an address
+ * params: arena - arena to search
+ * params: addr - address
+ * params: below - where to store the last extent starting below addr
+ * params: above - where to store the first extent starting above addr
+ * returns: nothing
+ */
+
+static void neighbours(VmemArena *arena, uintptr_t addr, VmemExtent **below, VmemExtent **above) {
+    *below = NULL;
+    *above = NULL;
+
+    VmemExtent *n = arena->roots[BY_ADDRESS];
+    while(n) {
+        if(n->base < addr) {
+            *below = n;
+            n = n->right[BY_ADDRESS];
+        } else {
+            *above = n;
+            n = n->left[BY_ADDRESS];
+        }
+    }
+}
+
+/* arenaSetup(): gives an arena its whole range as one free extent on first use,
+ * with the arena locked */
+
+static bool arenaSetup(VmemArena *arena) {
+    VmemExtent *all = tagAllocate();
+    if(!all) return false;
+
+    all->base = arena->base;
+    all->size = (arena->limit - arena->base) / PAGE_SIZE;
+    extentInsert(arena, all);
+
+    arena->freePages = all->size;
+    arena->ready = true;
+    return true;
+}
+
+/* vmemAllocate(): allocates a range of virtual addresses from an arena
+ * params: arena - arena to allocate from
+ * params: pages - number of pages
+ * returns: base address of the range, zero on fail
+ */
+
+uintptr_t vmemAllocate(VmemArena *arena, size_t pages) {
+    if(!pages) return 0;
+
+    acquireLockBlocking(&arena->lock);
+    if(!arena->ready && !arenaSetup(arena)) {
+        releaseLock(&arena->lock);
+        return 0;
+    }
+
+    uintptr_t addr = 0;
+
+    if((pages <= VMEM_QCACHE_MAX) && arena->qcount[pages-1]) {
+        addr = arena->qcache[pages-1][--arena->qcount[pages-1]];
+        arena->qcacheHits++;
+    } else {
+        VmemExtent *n = bestFit(arena, pages);
+        if(!n) {
+            releaseLock(&arena->lock);
+            return 0;
+        }
+
+        // take the start of the extent and put back whatever is left
+        extentRemove(arena, n);
+        addr = n->base;
+
+        if(n->size > pages) {
+            n->base += pages * PAGE_SIZE;
+            n->size -= pages;
+            extentInsert(arena, n);
+        } else {
+            tagFree(n);
+        }
+
+        arena->freePages -= pages;
+        arena->usedPages += pages;
+    }
+
+    arena->allocations++;
+    releaseLock(&arena->lock);
+    return addr;
+}
+
+/* vmemClaim(): allocates a specific range of virtual addresses from an arena,
+ * so that an allocation can grow into the range right after it
+ * params: arena - arena to allocate from
+ * params: addr - base address of the range
+ * params: pages - number of pages
+ * returns: true if the whole range was free and is now allocated
+ */
+
+bool vmemClaim(VmemArena *arena, uintptr_t addr, size_t pages) {
+    if(!pages || (addr < arena->base) || (addr >= arena->limit)) return false;
+
+    acquireLockBlocking(&arena->lock);
+    if(!arena->ready && !arenaSetup(arena)) {
+        releaseLock(&arena->lock);
+        return false;
+    }
+
+    // the free extent starting at or below the range must cover all of it
+    VmemExtent *n = arena->roots[BY_ADDRESS], *owner = NULL;
+    while(n) {
+        if(n->base <= addr) {
+            owner = n;
+            n = n->right[BY_ADDRESS];
+        } else {
+            n = n->left[BY_ADDRESS];
+        }
+    }
+
+    uintptr_t limit = addr + (pages * PAGE_SIZE);
+    if(!owner || ((owner->base + (owner->size * PAGE_SIZE)) < limit)) {
+        releaseLock(&arena->lock);
+        return false;
+    }
+
+    // whatever is left on the upper side needs a tag of its own
+    VmemExtent *tail = NULL;
+    uintptr_t ownerLimit = owner->base + (owner->size * PAGE_SIZE);
+    if(ownerLimit > limit) {
+        tail = tagAllocate();
+        if(!tail) {
+            releaseLock(&arena->lock);
+            return false;
+        }
+
+        tail->base = limit;
+        tail->size = (ownerLimit - limit) / PAGE_SIZE;
+    }
+
+    extentRemove(arena, owner);
+    if(owner->base < addr) {
+        owner->size = (addr - owner->base) / PAGE_SIZE;
+        extentInsert(arena, owner);
+    } else {
+        tagFree(owner);
+    }
+
+    if(tail) extentInsert(arena, tail);
+
+    arena->freePages -= pages;
+    arena->usedPages += pages;
+    releaseLock(&arena->lock);
+    return true;
+}
+
+/* vmemFree(): returns a range of virtual addresses to an arena
+ * params: arena - arena the range was allocated from
+ * params: addr - base address of the range
+ * params: pages - number of pages
+ * returns: nothing
+ */
+
+void vmemFree(VmemArena *arena, uintptr_t addr, size_t pages) {
+    if(!pages || (addr < arena->base) || (addr >= arena->limit)) return;
+
+    acquireLockBlocking(&arena->lock);
+    arena->frees++;
+
+    if((pages <= VMEM_QCACHE_MAX) && (arena->qcount[pages-1] < VMEM_QCACHE_SIZE)) {
+        arena->qcache[pages-1][arena->qcount[pages-1]++] = addr;
+        releaseLock(&arena->lock);
+        return;
+    }
+
+    arena->freePages += pages;
+    arena->usedPages -= pages;
+
+    // coalesce with the free extents on either side
+    VmemExtent *below, *above;
+    neighbours(arena, addr, &below, &above);
+
+    VmemExtent *n = NULL;
+    if(below && ((below->base + (below->size * PAGE_SIZE)) == addr)) {
+        extentRemove(arena, below);
+        below->size += pages;
+        n = below;
+    }
+
+    if(above && ((addr + (pages * PAGE_SIZE)) == above->base)) {
+        extentRemove(arena, above);
+        if(n) {
+            n->size += above->size;
+            tagFree(above);
+        } else {
+            above->base = addr;
+            above->size += pages;
+            n = above;
+        }
+    }
+
+    if(!n) {
+        n = tagAllocate();
+        if(!n) {
+            // the range is lost, which is still better than handing it out twice
+            releaseLock(&arena->lock);
+            return;
+        }
+
+        n->base = addr;
+        n->size = pages;
+    }
+
+    extentInsert(arena, n);
+    releaseLock(&arena->lock);
+}
+
+/* vmemStatus(): returns usage statistics of an arena
+ * params: arena - arena to look at
+ * params: used - where to store the number of pages allocated
+ * params: free - where to store the number of free pages
+ * params: extents - where to store the number of free extents
+ * returns: nothing
+ */
+
+void vmemStatus(VmemArena *arena, size_t *used, size_t *free, size_t *extents) {
+    acquireLockBlocking(&arena->lock);
+    *used = arena->usedPages;
+    *free = arena->freePages;
+    *extents = arena->extents;
+    releaseLock(&arena->lock);
+}
\ No newline at end of file
@@ -88,6 +88,7 @@ int apicInit() {
 
                 cpu->apicID = localAPIC->apicID;
                 cpu->procID = localAPIC->procID;
+                cpu->node = acpiCPUNode(localAPIC->apicID);
                 cpu->bootCPU = (localAPIC->apicID == bspID);
                 cpu->running = cpu->bootCPU;
                 cpu->next = NULL;
@@ -164,6 +165,7 @@ int apicInit() {
     /* continue booting with info acquired from ACPI */
     smpCPUInfoSetup();      // info structure for the boot CPU
     apicTimerInit();        // local APIC timer
+    tlbInit();              // TLB shootdown IPIs
     smpBoot();              // start up other non-boot CPUs
     ioapicInit();           // I/O APICs
 
@@ -182,6 +184,18 @@ uint32_t lapicRead(uint32_t reg) {
     return *ptr;
 }
 
+/* lapicSendIPI(): sends a fixed inter-processor interrupt to another CPU
+ * params: apicID - local APIC ID of the destination CPU
+ * params: vector - interrupt vector to raise on the destination CPU
+ * returns: nothing
+ */
+
+void lapicSendIPI(uint8_t apicID, uint8_t vector) {
+    lapicWrite(LAPIC_INT_COMMAND_HIGH, (uint32_t)apicID << 24);
+    lapicWrite(LAPIC_INT_COMMAND_LOW, LAPIC_INT_CMD_FIXED | LAPIC_INT_CMD_EDGE | vector);
+    while(lapicRead(LAPIC_INT_COMMAND_LOW) & LAPIC_INT_CMD_DELIVERY);
+}
+
 /* platformAcknowledgeIRQ(): platform-independent function that will be called
  * at the end of an IRQ handler
  * params: unused - pointer to data that may be necessary for IRQ acknowledgement; unused on x86_64
@@ -102,8 +102,8 @@ PlatformCPU *findCPUAPIC(uint8_t id) {
  * the kernel's GS base, also sets up a per-CPU GDT and TSS and stack */
 
 void smpCPUInfoSetup() {
-    // enable FS/GS segmentation
-    writeCR4(readCR4() | CR4_FSGSBASE);
+    // enable FS/GS segmentation and global pages
+    writeCR4(readCR4() | CR4_FSGSBASE | CR4_GLOBAL_PAGES);
 
     CPUIDRegisters regs;
     readCPUID(1, &regs);
@@ -156,6 +156,8 @@ void smpCPUInfoSetup() {
 
     info->cpuIndex = i;
     info->cpu = cpu;
+    info->pmmCache.node = cpu->node;
+    info->pagingRoot = readCR3() & ~(PAGE_SIZE-1);
 
     info->irqcmd = calloc(1, sizeof(IRQCommand));
     if(!info->irqcmd) {
@@ -169,11 +171,13 @@ void smpCPUInfoSetup() {
     writeMSR(MSR_FS_BASE, 0);
     writeMSR(MSR_GS_BASE, 0);
     writeMSR(MSR_GS_BASE_KERNEL, (uint64_t)info);
+    __atomic_store_n(&cpu->info, info, __ATOMIC_RELEASE);
 
     if(cpu->bootCPU) bootCPUInfo = info;
 
     tssSetup();
     lnmiConfigure();
+    tlbCPUSetup();
 }
 
 /* apMain(): entry points for application processors */
@@ -191,7 +195,7 @@ int apMain() {
 
     writeCR0(readCR0() & ~CR0_NOT_WRITE_THROUGH);
     writeCR0(readCR0() & ~CR0_CACHE_DISABLE);
-    writeCR0(readCR0() & ~CR0_WRITE_PROTECT);
+    writeCR0(readCR0() | CR0_WRITE_PROTECT);    // same as the boot CPU
 
     smpCPUInfoSetup();
 
@@ -342,14 +346,14 @@ int platformWhichCPU() {
     return getKernelCPUInfo()->cpuIndex;
 }
 
-/* platformUptime(): global uptime, really the timer ticks for the boot CPU
+/* platformUptime(): global uptime in timer ticks, which keeps counting while
+ * CPUs are idle with their timers stopped
  * params: none
- * returns: timer ticks elapsed on boot CPU
+ * returns: timer ticks elapsed since the boot CPU's timer was set up
  */
 
 uint64_t platformUptime() {
-    if(!bootCPUInfo) return 0;
-    return bootCPUInfo->uptime;
+    return apicTimerUptime();
 }
 
 /* platformGetIRQCommand(): returns a pointer to the CPU's IRQ command
@@ -359,4 +363,60 @@ uint64_t platformUptime() {
 
 IRQCommand *platformGetIRQCommand() {
     return getKernelCPUInfo()->irqcmd;
+}
+
+/* platformGetPMMCache(): returns a pointer to the CPU's physical page cache
+ * params: none
+ * returns: pointer to the cache, NULL if the per-CPU info is not set up yet
+ */
+
+void *platformGetPMMCache() {
+    // the boot CPU's info structure is the first to be created, and until
+    // then we can't even safely read the GS base
+    if(!bootCPUInfo) return NULL;
+
+    KernelCPUInfo *info = getKernelCPUInfo();
+    if(!info) return NULL;
+    return &info->pmmCache;
+}
+
+/* platformGetSlabCache(): returns a pointer to the CPU's slab free lists
+ * params: none
+ * returns: pointer to the free lists, NULL if the per-CPU info is not set up yet
+ */
+
+void *platformGetSlabCache() {
+    if(!bootCPUInfo) return NULL;
+
+    KernelCPUInfo *info = getKernelCPUInfo();
+    if(!info) return NULL;
+    return &info->slabCache;
+}
+
+/* platformGetRunQueue(): returns a pointer to a CPU's run queue
+ * params: n - index of the CPU
+ * returns: pointer to the run queue, NULL if the CPU is not set up yet
+ */
+
+void *platformGetRunQueue(int n) {
+    PlatformCPU *cpu = platformGetCPU(n);
+    if(!cpu) return NULL;
+
+    KernelCPUInfo *info = __atomic_load_n(&cpu->info, __ATOMIC_ACQUIRE);
+    if(!info) return NULL;
+    return &info->runQueue;
+}
+
+/* platformGetVMAs(): returns the memory areas of the address space in use on
+ * the current CPU
+ * params: none
+ * returns: pointer to the VMA tree, NULL for kernel address spaces
+ */
+
+void *platformGetVMAs() {
+    if(!bootCPUInfo) return NULL;
+
+    KernelCPUInfo *info = getKernelCPUInfo();
+    if(!info) return NULL;
+    return info->vmas;
 }
\ No newline at end of file
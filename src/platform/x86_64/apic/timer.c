@@ -10,6 +10,18 @@
  * physical circuit as the CPU, reducing latency compared to external timers
  * like the HPET or the legacy PIT (which I don't intend to support) */
 
+/* The timer runs in one-shot mode, or TSC-deadline mode where the CPU has it,
+ * and is programmed for whenever the scheduler next needs to run rather than
+ * on every tick; an idle CPU stops it altogether unless a sleeping thread is
+ * due. Uptime is counted off the time stamp counter so that it stays right no
+ * matter how many ticks go by without an interrupt.
+ *
+ * That only works if the TSC is invariant, that is it runs at the same rate
+ * through frequency changes and sleep states, and if every CPU's TSC agrees
+ * with the boot CPU's. Otherwise uptime is the count of timer interrupts on
+ * the boot CPU, as with the periodic timer, and the boot CPU never stops its
+ * timer. */
+
 #include <stddef.h>
 #include <platform/apic.h>
 #include <platform/x86_64.h>
@@ -19,6 +31,28 @@
 #include <kernel/sched.h>
 
 static uint64_t apicFrequency;
+static uint64_t tscFrequency = 0;       // calibrated once on the boot CPU
+static uint64_t tscBase, tscPerTick = 0;
+static bool tscDeadline = false;
+static bool tscUptime = false;          // false to count ticks instead
+static uint64_t tickCount = 0;          // ticks counted by the boot CPU
+static uint64_t uptimeSeen = 0;         // highest uptime read off any TSC
+
+/* timerCountTicks(): stops using the TSC for uptime and carries on from
+ * wherever it had got to by counting ticks on the boot CPU */
+
+static void timerCountTicks() {
+    __atomic_store_n(&tickCount, __atomic_load_n(&uptimeSeen, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_store_n(&tscDeadline, false, __ATOMIC_RELAXED);
+    __atomic_store_n(&tscUptime, false, __ATOMIC_RELEASE);
+    KWARN("time stamp counters are not synchronized, counting timer ticks for uptime\n");
+
+    // and make sure the boot CPU's timer is running to count them
+    PlatformCPU *cpu;
+    for(int i = 0; (cpu = platformGetCPU(i)); i++) {
+        if(cpu->bootCPU) platformWakeCPU(i);
+    }
+}
 
 /* apicTimerInit(): initializes the local APIC timer
  * this may depend on the CMOS to calibrate the timer */
@@ -53,6 +87,7 @@ int apicTimerInit() {
     lapicWrite(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);    // enable timer
 
     uint32_t apicInitial = lapicRead(LAPIC_TIMER_CURRENT);
+    uint64_t tscInitial = readTSC();
 
     outb(0x43, 0x30);   // channel 0, high and low in one transfer, mode 0
     outb(0x40, pitFrequency & 0xFF);
@@ -71,6 +106,7 @@ int apicTimerInit() {
     }
 
     uint32_t apicFinal = lapicRead(LAPIC_TIMER_CURRENT);
+    uint64_t tscFinal = readTSC();
 
     // disable the APIC timer
     lapicWrite(LAPIC_TIMER_INITIAL, 0);
@@ -79,6 +115,38 @@ int apicTimerInit() {
 
     KDEBUG("local APIC frequency is %d MHz\n", apicFrequency / 1000 / 1000);
 
+    // the time stamp counter is calibrated the same way for fine timing
+    if(!tscFrequency) {
+        tscFrequency = (tscFinal - tscInitial) * 100;
+        KDEBUG("time stamp counter frequency is %d MHz\n", tscFrequency / 1000 / 1000);
+
+        // uptime starts counting here, as it did with the periodic timer
+        tscBase = tscFinal;
+        tscPerTick = tscFrequency / PLATFORM_TIMER_FREQUENCY;
+
+        // CPUID.80000007h:EDX bit 8 is the invariant TSC
+        readCPUID(0x80000000, &regs);
+        if(regs.eax >= 0x80000007) {
+            readCPUID(0x80000007, &regs);
+            tscUptime = (regs.edx & (1 << 8)) != 0;
+        }
+
+        // the deadline would drift just like uptime without an invariant TSC
+        readCPUID(1, &regs);
+        tscDeadline = tscUptime && (regs.ecx & (1 << 24));
+
+        if(tscUptime) KDEBUG("counting uptime with the invariant time stamp counter\n");
+        else KDEBUG("time stamp counter is not invariant, counting timer ticks for uptime\n");
+        if(tscDeadline) KDEBUG("using TSC-deadline mode for the timer\n");
+    } else if(__atomic_load_n(&tscUptime, __ATOMIC_ACQUIRE)) {
+        // a CPU whose TSC is behind uptime as already seen elsewhere can't
+        // share the boot CPU's time base
+        uint64_t seen = __atomic_load_n(&uptimeSeen, __ATOMIC_ACQUIRE);
+        uint64_t tsc = readTSC();
+        if((tsc < tscBase) || (((tsc - tscBase) / tscPerTick) < seen))
+            timerCountTicks();
+    }
+
     // ensure the hardware can go at least twice as fast as the software
     if(apicFrequency < (PLATFORM_TIMER_FREQUENCY*2)) {
         KERROR("local APIC frequency is not high enough to use as main timing source\n");
@@ -87,14 +155,22 @@ int apicTimerInit() {
 
     //KDEBUG("setting up system timer at %d kHz\n", PLATFORM_TIMER_FREQUENCY / 1000);
 
-    // set up the local APIC timer in periodic mode and allocate interrupt 0xFE for it
-    lapicWrite(LAPIC_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_LVT_MASK | LAPIC_TIMER_IRQ);
+    // set up the local APIC timer in one-shot mode and allocate interrupt 0xFE for it
+    KernelCPUInfo *info = getKernelCPUInfo();
+    bool deadline = __atomic_load_n(&tscDeadline, __ATOMIC_RELAXED);
+    uint32_t mode = deadline ? LAPIC_TIMER_TSC_DEADLINE : LAPIC_TIMER_ONE_SHOT;
+    lapicWrite(LAPIC_LVT_TIMER, mode | LAPIC_LVT_MASK | LAPIC_TIMER_IRQ);
     lapicWrite(LAPIC_TIMER_DIVIDE, LAPIC_TIMER_DIVIDER_1);
     installInterrupt((uint64_t)timerHandlerStub, GDT_KERNEL_CODE, PRIVILEGE_KERNEL, INTERRUPT_TYPE_INT, LAPIC_TIMER_IRQ);
 
-    // unmask the IRQ and enable the timer
+    // unmask the IRQ and start ticking
+    if(info) {
+        info->tscDeadline = deadline;
+        info->uptime = apicTimerUptime();
+    }
+
     lapicWrite(LAPIC_LVT_TIMER, lapicRead(LAPIC_LVT_TIMER) & ~LAPIC_LVT_MASK);
-    lapicWrite(LAPIC_TIMER_INITIAL, apicFrequency / PLATFORM_TIMER_FREQUENCY);
+    platformSetTimer(1);
 
     return 0;
 }
@@ -105,16 +181,150 @@ uint64_t apicTimerFrequency() {
     return apicFrequency;
 }
 
+/* platformNanoseconds(): returns a high-resolution timestamp for measuring
+ * short intervals
+ * params: none
+ * returns: nanoseconds counted by the time stamp counter, zero before the
+ *          timer is calibrated
+ */
+
+uint64_t platformNanoseconds() {
+    if(!tscFrequency) return 0;
+
+    uint64_t tsc = readTSC();
+    return ((tsc / tscFrequency) * 1000000000) + (((tsc % tscFrequency) * 1000000000) / tscFrequency);
+}
+
+/* apicTimerUptime(): returns the number of timer ticks since the timer was
+ * first calibrated, whether or not they were delivered as interrupts */
+
+uint64_t apicTimerUptime() {
+    if(!tscPerTick) return 0;
+    if(!__atomic_load_n(&tscUptime, __ATOMIC_ACQUIRE)) return __atomic_load_n(&tickCount, __ATOMIC_RELAXED);
+
+    // keep track of the furthest any CPU has got, so that CPUs coming up
+    // later can be checked against it
+    uint64_t uptime = (readTSC() - tscBase) / tscPerTick;
+    uint64_t seen = __atomic_load_n(&uptimeSeen, __ATOMIC_RELAXED);
+    while((uptime > seen) && !__atomic_compare_exchange_n(&uptimeSeen, &seen, uptime, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return uptime;
+}
+
+/* platformSetTimer(): programs the timer of the current CPU
+ * params: ticks - timer ticks until the next interrupt, zero to stop the timer
+ * returns: nothing
+ */
+
+void platformSetTimer(uint64_t ticks) {
+    KernelCPUInfo *info = getKernelCPUInfo();
+    bool deadline = info ? info->tscDeadline : tscDeadline;
+
+    // switch back to one-shot mode if the TSC turned out to be unusable
+    if(deadline && !__atomic_load_n(&tscDeadline, __ATOMIC_RELAXED)) {
+        writeMSR(MSR_TSC_DEADLINE, 0);
+        lapicWrite(LAPIC_LVT_TIMER, (lapicRead(LAPIC_LVT_TIMER) & ~LAPIC_TIMER_TSC_DEADLINE) | LAPIC_TIMER_ONE_SHOT);
+        info->tscDeadline = deadline = false;
+    }
+
+    uint64_t apicPerTick = apicFrequency / PLATFORM_TIMER_FREQUENCY;
+    if(!__atomic_load_n(&tscUptime, __ATOMIC_ACQUIRE)) {
+        // the boot CPU keeps time by counting its ticks, so its timer never
+        // stops, and a wakeup doesn't cut short the tick in progress
+        if(!info || info->cpu->bootCPU) {
+            if(!lapicRead(LAPIC_TIMER_CURRENT)) lapicWrite(LAPIC_TIMER_INITIAL, apicPerTick);
+            return;
+        }
+
+        if(ticks > (0xFFFFFFFF / apicPerTick)) ticks = 0xFFFFFFFF / apicPerTick;
+        lapicWrite(LAPIC_TIMER_INITIAL, ticks * apicPerTick);
+        return;
+    }
+
+    if(!ticks) {
+        if(deadline) writeMSR(MSR_TSC_DEADLINE, 0);
+        else lapicWrite(LAPIC_TIMER_INITIAL, 0);
+        return;
+    }
+
+    // the APIC counter is only 32 bits wide, so long waits fire early and
+    // the scheduler programs the rest on the next interrupt
+    if(!deadline && (ticks > (0xFFFFFFFF / apicPerTick) - 1))
+        ticks = (0xFFFFFFFF / apicPerTick) - 1;
+
+    // interrupts land on tick boundaries so that uptime has always moved on
+    // by the time they come in
+    uint64_t due = tscBase + ((apicTimerUptime() + ticks) * tscPerTick);
+    if(deadline) {
+        writeMSR(MSR_TSC_DEADLINE, due);
+        return;
+    }
+
+    uint64_t now = readTSC();
+    uint64_t count = (due > now) ? (((due - now) * apicPerTick) / tscPerTick) + 1 : 1;
+    lapicWrite(LAPIC_TIMER_INITIAL, count);
+}
+
+/* platformWakeCPU(): interrupts a CPU that may be idle with its timer stopped
+ * so that it picks up newly queued work
+ * params: n - index of the CPU
+ * returns: nothing
+ */
+
+void platformWakeCPU(int n) {
+    PlatformCPU *cpu = platformGetCPU(n);
+    if(!cpu || !__atomic_load_n(&cpu->info, __ATOMIC_ACQUIRE)) return;
+
+    // an early timer interrupt makes the CPU reschedule straight away
+    lapicSendIPI(cpu->apicID, LAPIC_TIMER_IRQ);
+}
+
+/* timerIdle(): stops or pushes out the timer of a CPU that is about to halt,
+ * called from platformIdle() with interrupts disabled */
+
+void timerIdle() {
+    KernelCPUInfo *info = getKernelCPUInfo();
+    info->timerIdle = true;
+    platformSetTimer(schedIdle());
+}
+
+/* timerResume(): restarts the tick of a CPU that halted and was woken by
+ * something other than its timer */
+
+void timerResume() {
+    KernelCPUInfo *info = getKernelCPUInfo();
+    if(!info->timerIdle) return;
+
+    info->timerIdle = false;
+    schedResume();
+    platformSetTimer(1);
+}
+
 /* timerIRQ(): timer IRQ handler 
- * this is called PLATFORM_TIMER_FREQUENCY times per second */
+ * this is called whenever the scheduler asked to be, and on wakeups */
 
 void timerIRQ(void *stack) {
     setLocalSched(false);
     KernelCPUInfo *info = getKernelCPUInfo();
-    info->uptime++;
+    if(info->timerIdle) {
+        info->timerIdle = false;
+        schedResume();
+    }
+
+    // without a usable TSC the boot CPU's expired one-shot timer is what
+    // counts a tick, as opposed to a wakeup IPI on the same vector
+    if(info->cpu->bootCPU && !__atomic_load_n(&tscUptime, __ATOMIC_ACQUIRE) && !lapicRead(LAPIC_TIMER_CURRENT))
+        __atomic_add_fetch(&tickCount, 1, __ATOMIC_RELAXED);
+
+    // account for every tick since the last interrupt on this CPU
+    uint64_t uptime = apicTimerUptime();
+    uint64_t elapsed = (uptime > info->uptime) ? uptime - info->uptime : 0;
+    if(uptime > info->uptime) info->uptime = uptime;
+
+    // keep ticking by default, the scheduler pushes this out when it can
+    platformSetTimer(1);
 
     // is it time for a context switch?
-    if(!schedTimer()) {
+    if(!schedTimer(elapsed)) {
         if(info->thread && info->thread->context) {
             platformSaveContext(info->thread->context, stack);
         }
@@ -68,13 +68,14 @@ void installExceptions() {
 void exception(uint64_t number, uint64_t code, InterruptRegisters *r) {
     // TODO: handle different exceptions differently
 
-    // invoke the virtual memory manager ONLY if a page fault occurs for an ABSENT page
-    // because this will either mean that a page needs to be swapped OR physical memory
-    // needs to be allocated
-    // page faults for PRESENT pages mean that a thread violated its permissions, so
-    // terminate the process (TODO)
-    if((number == 14) && !(code & PF_PRESENT)) {     // page fault is exception #14 on x86
+    // invoke the virtual memory manager for page faults, because this will
+    // either mean that a page needs to be swapped, that physical memory needs
+    // to be allocated, or that a page shared copy-on-write was written to
+    // other page faults for PRESENT pages mean that a thread violated its
+    // permissions, so terminate the process (TODO)
+    if(number == 14) {      // page fault is exception #14 on x86
         int pfStatus = 0;
+        if(code & PF_PRESENT) pfStatus |= VMM_PAGE_FAULT_PRESENT;
         if(code & PF_FETCH) pfStatus |= VMM_PAGE_FAULT_FETCH;
         if(code & PF_USER) pfStatus |= VMM_PAGE_FAULT_USER;
         if(code & PF_WRITE) pfStatus |= VMM_PAGE_FAULT_WRITE;
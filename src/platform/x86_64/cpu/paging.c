@@ -9,11 +9,13 @@
 #include <stdint.h>
 #include <platform/x86_64.h>
 #include <platform/platform.h>
+#include <platform/context.h>
 #include <kernel/logger.h>
 #include <kernel/memory.h>
 #include <kernel/tty.h>
 
 static uint64_t *kernelPagingRoot;  // pml4 -- PHYSICAL ADDRESS
+uint64_t kernelMappedLimit = (uint64_t)KERNEL_BASE_MAPPED << 30;
 
 /* platformPagingSetup(): sets up the kernel's paging structures
  * this is called by the virtual memory manager early in the boot process
@@ -32,34 +34,58 @@ int platformPagingSetup() {
     // enable no-execute pages
     writeMSR(MSR_EFER, readMSR(MSR_EFER) | MSR_EFER_NX_ENABLE);
 
-    // map physical memory into the higher half
-    uint64_t *pml4 = (uint64_t *)pmmAllocate();     // 512 GiB per entry
-    uint64_t *pdp = (uint64_t *)pmmAllocate();      // 1 GiB per entry
+    // map all of physical memory into the higher half, and at least the low
+    // few gigabytes regardless for firmware and device memory
+    PhysicalMemoryStatus pmm;
+    pmmStatus(&pmm);
+    uint64_t gigabytes = (pmm.highestPhysicalAddress + 0x3FFFFFFF) >> 30;
+    if(gigabytes < KERNEL_BASE_MAPPED) gigabytes = KERNEL_BASE_MAPPED;
+    if(gigabytes > ((KERNEL_HEAP_BASE - KERNEL_MMIO_BASE) >> 30))
+        gigabytes = (KERNEL_HEAP_BASE - KERNEL_MMIO_BASE) >> 30;
+
+    // use 1 GiB pages where supported, and mark everything global because the
+    // kernel is mapped identically in every address space
+    bool hugePages = regs.edx & (1 << 26);
 
-    if(!pml4 || !pdp) {
+    uint64_t *pml4 = (uint64_t *)pmmAllocate();     // 512 GiB per entry
+    if(!pml4) {
         KERROR("unable to allocate memory for paging root structs\n");
         return -1;
     }
 
     memset(pml4, 0, PAGE_SIZE);
-    memset(pdp, 0, PAGE_SIZE);
 
-    //pml4[0] = (uint64_t)pdp | PT_PAGE_PRESENT | PT_PAGE_RW | PT_PAGE_USER;
-    pml4[256] = (uint64_t)pdp | PT_PAGE_PRESENT | PT_PAGE_RW;
-    
     uint64_t addr = 0;
+    uint64_t *pdp = NULL;                           // 1 GiB per entry
     uint64_t *pd;
-    for(int i = 0; i < KERNEL_BASE_MAPPED; i++) {
+    for(uint64_t i = 0; i < gigabytes; i++) {
+        if(!(i % 512)) {
+            pdp = (uint64_t *)pmmAllocate();
+            if(!pdp) {
+                KERROR("unable to allocate memory for page directory pointer %d\n", i / 512);
+                return -1;
+            }
+
+            memset(pdp, 0, PAGE_SIZE);
+            pml4[256 + (i / 512)] = (uint64_t)pdp | PT_PAGE_PRESENT | PT_PAGE_RW;
+        }
+
+        if(hugePages) {
+            pdp[i % 512] = addr | PT_PAGE_PRESENT | PT_PAGE_RW | PT_PAGE_SIZE_EXTENSION | PT_PAGE_GLOBAL;
+            addr += 0x40000000;
+            continue;
+        }
+
         pd = (uint64_t *)pmmAllocate();
         if(!pd) {
             KERROR("unable to allocate memory for page directory %d\n", i);
             return -1;
         }
 
-        pdp[i] = (uint64_t)pd | PT_PAGE_PRESENT | PT_PAGE_RW | PT_PAGE_USER;
+        pdp[i % 512] = (uint64_t)pd | PT_PAGE_PRESENT | PT_PAGE_RW | PT_PAGE_USER;
 
         for(int j = 0; j < 512; j++) {
-            pd[j] = addr | PT_PAGE_PRESENT | PT_PAGE_RW | PT_PAGE_SIZE_EXTENSION;
+            pd[j] = addr | PT_PAGE_PRESENT | PT_PAGE_RW | PT_PAGE_SIZE_EXTENSION | PT_PAGE_GLOBAL;
             addr += 0x200000;
         }
     }
@@ -67,8 +93,11 @@ int platformPagingSetup() {
     // load the new paging roots
     writeCR3((uint64_t)pml4);
 
+    kernelMappedLimit = gigabytes << 30;
+    writeCR4(readCR4() | CR4_GLOBAL_PAGES);
+
     ttyRemapFramebuffer();
-    KDEBUG("kernel paging structures created, mapped %d GiB at 0x%X\n", KERNEL_BASE_MAPPED, KERNEL_MMIO_BASE);
+    KDEBUG("kernel paging structures created, mapped %d GiB at 0x%X using %s pages\n", gigabytes, KERNEL_MMIO_BASE, hugePages ? "1 GiB" : "2 MiB");
     kernelPagingRoot = pml4;
     return 0;
 }
@@ -92,13 +121,50 @@ void *platformCloneKernelSpace() {
     return memcpy((void *)vmmMMIO(ptr, true), (const void *)vmmMMIO((uintptr_t)kernelPagingRoot, true), PAGE_SIZE);
 }
 
-/* platformGetPage(): returns the physical address and flags of a logical address
+/* pageFlags(): translates the flags of a page table entry
+ * params: entry - page table entry
+ * returns: platform-independent page flags
+ */
+
+static int pageFlags(uint64_t entry) {
+    int flags = 0;
+    if(entry & PT_PAGE_PRESENT) flags |= PLATFORM_PAGE_PRESENT;
+    else if(entry) flags |= PLATFORM_PAGE_SWAP;  // not present in main memory but non-zero
+
+    if(entry & PT_PAGE_RW) flags |= PLATFORM_PAGE_WRITE;
+    if(entry & PT_PAGE_USER) flags |= PLATFORM_PAGE_USER;
+    if(!(entry & PT_PAGE_NXE)) flags |= PLATFORM_PAGE_EXEC;
+    if(entry & PT_PAGE_NO_CACHE) flags |= PLATFORM_PAGE_NO_CACHE;
+    if(entry & PT_PAGE_COW) flags |= PLATFORM_PAGE_COW;
+    if(entry & PT_PAGE_ACCESSED) flags |= PLATFORM_PAGE_ACCESSED;
+    return flags;
+}
+
+/* entryFlags(): translates page flags into the flags of a page table entry
+ * params: flags - platform-independent page flags
+ * returns: flags of the page table entry
+ */
+
+static uint64_t entryFlags(int flags) {
+    uint64_t entry = 0;
+    if(flags & PLATFORM_PAGE_PRESENT) entry |= PT_PAGE_PRESENT;
+    if(flags & PLATFORM_PAGE_WRITE) entry |= PT_PAGE_RW;
+    if(flags & PLATFORM_PAGE_USER) entry |= PT_PAGE_USER;
+    if(!(flags & PLATFORM_PAGE_EXEC)) entry |= PT_PAGE_NXE;
+    if(flags & PLATFORM_PAGE_NO_CACHE) entry |= PT_PAGE_NO_CACHE | PT_PAGE_WRITE_THROUGH;
+    if(flags & PLATFORM_PAGE_COW) entry |= PT_PAGE_COW;
+    if(flags & PLATFORM_PAGE_ACCESSED) entry |= PT_PAGE_ACCESSED;
+    return entry;
+}
+
+/* getPage(): returns the physical address and flags of a logical address
+ * params: root - physical address of the paging root to look it up in
  * params: flags - pointer to where to store the flags
  * params: addr - logical address
  * returns: physical address corresponding to logical address
  */
 
-uintptr_t platformGetPage(int *flags, uintptr_t addr) {
+static uintptr_t getPage(uint64_t root, int *flags, uintptr_t addr) {
     /*uint64_t highestIdentityAddress = ((uint64_t)IDENTITY_MAP_GBS << 30) - 1; // GiB to bytes
     if(addr <= highestIdentityAddress) {
         *flags = PLATFORM_PAGE_PRESENT | PLATFORM_PAGE_WRITE | PLATFORM_PAGE_EXEC;
@@ -118,7 +184,7 @@ uintptr_t platformGetPage(int *flags, uintptr_t addr) {
     uintptr_t offset = addr & (PAGE_SIZE-1);
 
     // TODO: account for inconsistencies between virtual and physical addresses here
-    uint64_t *pml4 = (uint64_t *)vmmMMIO(readCR3() & ~(PAGE_SIZE-1), true);
+    uint64_t *pml4 = (uint64_t *)vmmMMIO(root & ~(PAGE_SIZE-1), true);
     uint64_t pml4Entry = pml4[pml4Index];
     if(!(pml4Entry & PT_PAGE_PRESENT)) return 0;
 
@@ -132,19 +198,40 @@ uintptr_t platformGetPage(int *flags, uintptr_t addr) {
 
     uint64_t *pt = (uint64_t *)vmmMMIO((pdEntry & ~(PAGE_SIZE-1)), true);
     uint64_t ptEntry = pt[ptIndex];
-    
-    if(ptEntry & PT_PAGE_PRESENT) *flags |= PLATFORM_PAGE_PRESENT;
-    else if(ptEntry) *flags |= PLATFORM_PAGE_SWAP;  // not present in main memory but non-zero
-
-    if(ptEntry & PT_PAGE_RW) *flags |= PLATFORM_PAGE_WRITE;
-    if(ptEntry & PT_PAGE_USER) *flags |= PLATFORM_PAGE_USER;
-    if(!(ptEntry & PT_PAGE_NXE)) *flags |= PLATFORM_PAGE_EXEC;
-    if(ptEntry & PT_PAGE_NO_CACHE) *flags |= PLATFORM_PAGE_NO_CACHE;
-    
+    *flags = pageFlags(ptEntry);
     return (ptEntry & ~(PAGE_SIZE-1) & ~(PT_PAGE_NXE)) | offset;
 }
 
+/* platformGetPage(): returns the physical address and flags of a logical address
+ * params: flags - pointer to where to store the flags
+ * params: addr - logical address
+ * returns: physical address corresponding to logical address
+ */
+
+uintptr_t platformGetPage(int *flags, uintptr_t addr) {
+    return getPage(readCR3(), flags, addr);
+}
+
+/* platformGetThreadPage(): returns the physical address and flags of a logical
+ * address in another thread's address space, without switching to it
+ * params: context - platform-specific thread context
+ * params: flags - pointer to where to store the flags
+ * params: addr - logical address
+ * returns: physical address corresponding to logical address
+ */
+
+uintptr_t platformGetThreadPage(void *context, int *flags, uintptr_t addr) {
+    ThreadContext *ctx = (ThreadContext *) context;
+    if(!ctx || !ctx->cr3) {
+        *flags = 0;
+        return 0;
+    }
+
+    return getPage(ctx->cr3, flags, addr);
+}
+
 /* platformMapPage(): maps a physical address to a logical address
+ * any translation of the old mapping must be invalidated by the caller
  * params: logical - logical address, page-aligned
  * params: physical - physical address, page-aligned
  * params: flags - page flags requested
@@ -204,15 +291,12 @@ uintptr_t platformMapPage(uintptr_t logical, uintptr_t physical, int flags) {
     }
 
     uint64_t *pt = (uint64_t *)vmmMMIO((pdEntry & ~(PAGE_SIZE-1)), true);
-    uint64_t parsedFlags = 0;
-
-    if(flags & PLATFORM_PAGE_PRESENT) parsedFlags |= PT_PAGE_PRESENT;
-    if(flags & PLATFORM_PAGE_WRITE) parsedFlags |= PT_PAGE_RW;
-    if(flags & PLATFORM_PAGE_USER) parsedFlags |= PT_PAGE_USER;
-    if(!(flags & PLATFORM_PAGE_EXEC)) parsedFlags |= PT_PAGE_NXE;
-    if(flags & PLATFORM_PAGE_NO_CACHE) parsedFlags |= PT_PAGE_NO_CACHE | PT_PAGE_WRITE_THROUGH;
+    uint64_t parsedFlags = entryFlags(flags & ~PLATFORM_PAGE_ACCESSED);
+    if((flags & PLATFORM_PAGE_PRESENT) && (logical >= KERNEL_BASE_ADDRESS)) parsedFlags |= PT_PAGE_GLOBAL;
 
-    pt[ptIndex] = physical | parsedFlags;
+    // unmapped pages must be told apart from pages in swap
+    if(!physical && !(flags & PLATFORM_PAGE_PRESENT)) pt[ptIndex] = 0;
+    else pt[ptIndex] = physical | parsedFlags;
 
     // maintain canonical addresses
     if(logical & ((uint64_t)1 << 47)) return logical | 0xFFF0000000000000;
@@ -220,6 +304,7 @@ uintptr_t platformMapPage(uintptr_t logical, uintptr_t physical, int flags) {
 }
 
 /* platformUnmapPage(): unmaps a physical address from a logical address 
+ * the caller must invalidate the translation, preferably for many pages at once
  * params: addr - logical address
  * returns: 0 on success
  */
@@ -236,10 +321,11 @@ int platformUnmapPage(uintptr_t addr) {
  * this works for PDPs, PDs, and PTs
  * params: ptr - physical pointer to the paging structure
  * params: layer - 0 for PDPs, 1 for PDs, and 2 for PTs
+ * params: share - true to share pages copy-on-write instead of copying them
  * returns: physical pointer to the clone, zero on fail
  */
 
-uint64_t clonePagingLayer(uint64_t ptr, int layer) {
+uint64_t clonePagingLayer(uint64_t ptr, int layer, bool share) {
     if(!ptr || layer < 0 || layer > 2) return 0;
 
     uint64_t *parent = (uint64_t *)vmmMMIO(ptr & ~(PAGE_SIZE-1), true);
@@ -249,26 +335,73 @@ uint64_t clonePagingLayer(uint64_t ptr, int layer) {
 
     uint64_t newPhys, oldPhys;
 
-    for(int i = 0; i < 512; i++) {
-        if(parent[i] & PT_PAGE_PRESENT) {
-            // are we working with the PT?
-            if(layer == 2) {
-                newPhys = pmmAllocate();
-                if(!newPhys) return 0;
+    if(layer == 2) {
+        // user pages are shared read-only between the parent and the child
+        // wherever possible, and writable ones are marked so that the first
+        // write to them makes a private copy
+        bool shared[512];
+        size_t count = 0;
+        for(int i = 0; i < 512; i++) {
+            shared[i] = false;
+            if(!(parent[i] & PT_PAGE_PRESENT)) continue;
+
+            oldPhys = parent[i] & ~((PAGE_SIZE-1) | PT_PAGE_NXE);
+            if(share && (parent[i] & PT_PAGE_USER) && pmmShare(oldPhys)) {
+                shared[i] = true;
+                if(parent[i] & PT_PAGE_RW)
+                    parent[i] = (parent[i] & ~PT_PAGE_RW) | PT_PAGE_COW;
+            } else {
+                count++;
+            }
+        }
 
+        // allocate frames for every page that must be copied in one batch
+        // rather than taking the allocator lock once per page
+        uintptr_t pages[512];
+        size_t allocated = pmmAllocateBatch(count, pages);
+        if(allocated != count) {
+            pmmFreeBatch(allocated, pages);
+            for(int i = 0; i < 512; i++) {
+                // this only drops the references taken above
+                if(shared[i]) pmmFree(parent[i] & ~((PAGE_SIZE-1) | PT_PAGE_NXE));
+            }
+
+            pmmFree(cloneBase);
+            return 0;
+        }
+
+        size_t next = 0;
+        for(int i = 0; i < 512; i++) {
+            if(shared[i]) {
+                clone[i] = parent[i];
+            } else if(parent[i] & PT_PAGE_PRESENT) {
+                newPhys = pages[next++];
                 oldPhys = parent[i] & ~((PAGE_SIZE-1) | PT_PAGE_NXE);
                 memcpy((void *)vmmMMIO(newPhys, true), (const void *)vmmMMIO(oldPhys, true), PAGE_SIZE);
 
                 clone[i] = newPhys | (parent[i] & ((uint64_t)PT_PAGE_LOW_FLAGS | PT_PAGE_NXE));   // copy the parent's permissions
-            } else {
-                // here we're working with either the PDP or PD that is also present
-                newPhys = pmmAllocate();
-                if(!newPhys) return 0;
 
-                oldPhys = parent[i] & ~(PAGE_SIZE-1);
-                clone[i] = clonePagingLayer(oldPhys, layer+1);
-                clone[i] |= parent[i] & PT_PAGE_LOW_FLAGS;  // copy permissions again
+                // a private copy of a copy-on-write page is simply writable
+                if(parent[i] & PT_PAGE_COW) clone[i] |= PT_PAGE_RW;
+            } else if(parent[i] && swapShare(parent[i] & ~((PAGE_SIZE-1) | PT_PAGE_NXE))) {
+                // compressed pages are shared until either side swaps them in
+                clone[i] = parent[i];
+            } else {
+                clone[i] = 0;
             }
+        }
+
+        return cloneBase;
+    }
+
+    for(int i = 0; i < 512; i++) {
+        if(parent[i] & PT_PAGE_PRESENT) {
+            // here we're working with either the PDP or PD that is also present
+            oldPhys = parent[i] & ~(PAGE_SIZE-1);
+            newPhys = clonePagingLayer(oldPhys, layer+1, share);
+            if(!newPhys) return 0;
+
+            clone[i] = newPhys | (parent[i] & PT_PAGE_LOW_FLAGS);  // copy permissions again
         } else {
             clone[i] = 0;
         }
@@ -279,10 +412,11 @@ uint64_t clonePagingLayer(uint64_t ptr, int layer) {
 
 /* platformCloneUserSpace(): deep clones the user address space
  * params: parent - physical pointer to the PML4 of the parent
+ * params: share - true to share pages copy-on-write instead of copying them
  * returns: physical pointer to the child PML4, NULL on fail
  */
 
-void *platformCloneUserSpace(uintptr_t parent) {
+void *platformCloneUserSpace(uintptr_t parent, bool share) {
     uint64_t base = pmmAllocate();
     if(!base) return NULL;
 
@@ -293,7 +427,7 @@ void *platformCloneUserSpace(uintptr_t parent) {
         uint64_t ptr = oldPML4[i] & ~(PAGE_SIZE-1);
         uint64_t flags = oldPML4[i] & PT_PAGE_LOW_FLAGS;
         if((flags & PT_PAGE_PRESENT) && ptr) {
-            newPML4[i] = clonePagingLayer(ptr, 0) | flags;
+            newPML4[i] = clonePagingLayer(ptr, 0, share) | flags;
         } else {
             newPML4[i] = 0;
         }
@@ -303,7 +437,129 @@ void *platformCloneUserSpace(uintptr_t parent) {
         newPML4[i] = oldPML4[i];    // the kernel is in every address space
     }
 
+    // the parent's writable pages may have just become read-only
+    if(share) platformInvalidateTLB();
+
     //KDEBUG("cloned PML4 at 0x%08X into 0x%08X\n", parent, base);
 
     return (void *) base;
+}
+
+/* platformWalkUserPages(): visits every present page in the user half of a
+ * thread's address space, allowing the visitor to remap it
+ * params: context - platform-specific thread context
+ * params: walker - function called with the virtual address, a pointer to the
+ *         physical address, and arg; changes to the physical address are
+ *         written back with the same permissions, non-zero return ends the walk
+ * params: arg - argument passed to the walker
+ * returns: zero if every page was visited, otherwise the walker's return value
+ */
+
+int platformWalkUserPages(void *context, PlatformPageWalker walker, void *arg) {
+    ThreadContext *ctx = (ThreadContext *) context;
+    if(!ctx || !ctx->cr3) return 0;
+
+    uint64_t *pml4 = (uint64_t *)vmmMMIO(ctx->cr3 & ~(PAGE_SIZE-1), true);
+    for(int i = 0; i < 256; i++) {
+        if(!(pml4[i] & PT_PAGE_PRESENT)) continue;
+        uint64_t *pdp = (uint64_t *)vmmMMIO(pml4[i] & ~((PAGE_SIZE-1) | PT_PAGE_NXE), true);
+
+        for(int j = 0; j < 512; j++) {
+            if(!(pdp[j] & PT_PAGE_PRESENT) || (pdp[j] & PT_PAGE_SIZE_EXTENSION)) continue;
+            uint64_t *pd = (uint64_t *)vmmMMIO(pdp[j] & ~((PAGE_SIZE-1) | PT_PAGE_NXE), true);
+
+            for(int k = 0; k < 512; k++) {
+                if(!(pd[k] & PT_PAGE_PRESENT) || (pd[k] & PT_PAGE_SIZE_EXTENSION)) continue;
+                uint64_t *pt = (uint64_t *)vmmMMIO(pd[k] & ~((PAGE_SIZE-1) | PT_PAGE_NXE), true);
+
+                for(int l = 0; l < 512; l++) {
+                    if(!(pt[l] & PT_PAGE_PRESENT)) continue;
+
+                    uintptr_t virt = ((uintptr_t)i << 39) | ((uintptr_t)j << 30) | ((uintptr_t)k << 21) | ((uintptr_t)l << 12);
+                    uintptr_t phys = pt[l] & ~((PAGE_SIZE-1) | PT_PAGE_NXE);
+                    uintptr_t old = phys;
+
+                    int status = walker(virt, &phys, arg);
+                    if(phys != old)
+                        pt[l] = (phys & ~(PAGE_SIZE-1)) | (pt[l] & ((PAGE_SIZE-1) | PT_PAGE_NXE));
+
+                    if(status) return status;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* platformScanUserPages(): visits the present pages in the user half of a
+ * thread's address space in order of address, resuming where the last scan
+ * left off, and allows the scanner to change their flags or unmap them
+ * params: context - platform-specific thread context
+ * params: cursor - address to resume from, updated to where the scan stopped
+ *         and reset to zero once the end of the user half is reached
+ * params: count - maximum number of pages to visit
+ * params: scanner - function called with the virtual address, pointers to
+ *         the physical address and flags, and arg; changes to either are
+ *         written back, non-zero return ends the scan
+ * params: arg - argument passed to the scanner
+ * returns: number of pages visited
+ */
+
+size_t platformScanUserPages(void *context, uintptr_t *cursor, size_t count, PlatformPageScanner scanner, void *arg) {
+    ThreadContext *ctx = (ThreadContext *) context;
+    if(!ctx || !ctx->cr3 || !count) return 0;
+
+    uintptr_t start = *cursor;
+    size_t visited = 0;
+    bool changed = false;
+    *cursor = 0;
+
+    uint64_t *pml4 = (uint64_t *)vmmMMIO(ctx->cr3 & ~(PAGE_SIZE-1), true);
+    for(int i = (start >> 39) & 511; i < 256; i++) {
+        if(!(pml4[i] & PT_PAGE_PRESENT)) continue;
+        uint64_t *pdp = (uint64_t *)vmmMMIO(pml4[i] & ~((PAGE_SIZE-1) | PT_PAGE_NXE), true);
+
+        for(int j = 0; j < 512; j++) {
+            uintptr_t pdpBase = ((uintptr_t)i << 39) | ((uintptr_t)j << 30);
+            if((pdpBase + ((uintptr_t)1 << 30)) <= start) continue;
+            if(!(pdp[j] & PT_PAGE_PRESENT) || (pdp[j] & PT_PAGE_SIZE_EXTENSION)) continue;
+            uint64_t *pd = (uint64_t *)vmmMMIO(pdp[j] & ~((PAGE_SIZE-1) | PT_PAGE_NXE), true);
+
+            for(int k = 0; k < 512; k++) {
+                uintptr_t pdBase = pdpBase | ((uintptr_t)k << 21);
+                if((pdBase + ((uintptr_t)1 << 21)) <= start) continue;
+                if(!(pd[k] & PT_PAGE_PRESENT) || (pd[k] & PT_PAGE_SIZE_EXTENSION)) continue;
+                uint64_t *pt = (uint64_t *)vmmMMIO(pd[k] & ~((PAGE_SIZE-1) | PT_PAGE_NXE), true);
+
+                for(int l = 0; l < 512; l++) {
+                    uintptr_t virt = pdBase | ((uintptr_t)l << 12);
+                    if((virt < start) || !(pt[l] & PT_PAGE_PRESENT)) continue;
+
+                    uintptr_t phys = pt[l] & ~((PAGE_SIZE-1) | PT_PAGE_NXE);
+                    int flags = pageFlags(pt[l]);
+                    uintptr_t oldPhys = phys;
+                    int oldFlags = flags;
+
+                    int status = scanner(virt, &phys, &flags, arg);
+                    if((phys != oldPhys) || (flags != oldFlags)) {
+                        uint64_t dirty = (flags & PLATFORM_PAGE_PRESENT) ? (pt[l] & PT_PAGE_DIRTY) : 0;
+                        pt[l] = (phys & ~(PAGE_SIZE-1)) | entryFlags(flags) | dirty;
+                        changed = true;
+                    }
+
+                    visited++;
+                    if(status || (visited >= count)) {
+                        *cursor = virt + PAGE_SIZE;
+                        goto done;
+                    }
+                }
+            }
+        }
+    }
+
+done:
+    // the address space may be loaded elsewhere or cached under its PCID
+    if(changed) tlbInvalidateContext(ctx);
+    return visited;
 }
\ No newline at end of file
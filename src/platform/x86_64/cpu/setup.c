@@ -71,7 +71,10 @@ int platformCPUSetup() {
 
     writeCR0(readCR0() & ~CR0_NOT_WRITE_THROUGH);
     writeCR0(readCR0() & ~CR0_CACHE_DISABLE);
-    writeCR0(readCR0() & ~CR0_WRITE_PROTECT);
+
+    // honor read-only pages in the kernel too, so that writes to user pages
+    // shared copy-on-write fault just like they do in user space
+    writeCR0(readCR0() | CR0_WRITE_PROTECT);
 
     // read the CPU model
     memset(_model, 0, 49);
@@ -0,0 +1,345 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ *
+ * Platform-Specific Code for x86_64
+ */
+
+/* TLB Invalidation */
+
+/* page table changes are invalidated locally with invlpg, or with a full
+ * flush when the range is large enough that reloading CR3 is cheaper, and on
+ * the other CPUs that may have cached the same translations through an IPI
+ *
+ * only one shootdown is in flight at a time, and the CPU sending it waits
+ * until every target has acknowledged it, so that physical pages are never
+ * reused while a stale translation to them survives anywhere; because locks
+ * are acquired with interrupts disabled, CPUs spinning on a lock also answer
+ * shootdowns so that they can't deadlock the CPU waiting on them
+ *
+ * when the CPU supports PCIDs, every address space is tagged with one so that
+ * switching between them keeps their translations cached; PCIDs are handed
+ * out in generations, and once a generation runs out every CPU flushes its
+ * whole TLB before using a PCID from the next one
+ *
+ * translations left behind on CPUs that have since switched to another
+ * address space are not shot down; instead every address space counts its
+ * invalidations, and CPUs flush its PCID when they load it again if it has
+ * been invalidated since they last did */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <platform/platform.h>
+#include <platform/x86_64.h>
+#include <platform/apic.h>
+#include <platform/smp.h>
+#include <platform/lock.h>
+#include <platform/context.h>
+#include <kernel/memory.h>
+#include <kernel/boot.h>
+#include <kernel/logger.h>
+
+// beyond this many pages, a full flush is faster than invalidating each one
+#define TLB_INVLPG_LIMIT        32
+
+// PCID zero is left for the boot paging root
+#define PCID_COUNT              4096
+#define PCID_SHIFT              12
+
+extern KernelBootInfo boot;
+
+static bool ready = false;
+static lock_t lock = LOCK_INITIAL;
+
+// the shootdown in flight, zero count for a full flush
+static uintptr_t shootdownBase;
+static size_t shootdownCount;
+static int shootdownRemaining;
+
+static bool pcidEnabled = false;
+static lock_t pcidLock = LOCK_INITIAL;
+static uint64_t pcidGeneration = 1;
+static uint64_t pcidNext = 1;
+
+/* flushAll(): flushes every translation on the current CPU, including the
+ * ones tagged with other PCIDs
+ * params: none
+ * returns: nothing
+ */
+
+static void flushAll() {
+    uint64_t cr4 = readCR4();
+    writeCR4(cr4 ^ CR4_GLOBAL_PAGES);
+    writeCR4(cr4);
+}
+
+/* flushLocal(): invalidates a range of pages on the current CPU
+ * params: base - base address
+ * params: count - number of pages, zero to flush everything
+ * returns: nothing
+ */
+
+static void flushLocal(uintptr_t base, size_t count) {
+    // kernel mappings are global, so reloading CR3 would leave them cached,
+    // but invlpg still drops them whichever PCID is in use
+    if(!count || ((count > TLB_INVLPG_LIMIT) && (base >= KERNEL_BASE_ADDRESS))) {
+        flushAll();
+        return;
+    }
+
+    // reloading CR3 without the no-flush bit flushes the current PCID
+    if(count > TLB_INVLPG_LIMIT) {
+        writeCR3(readCR3());
+        return;
+    }
+
+    base &= ~(PAGE_SIZE-1);
+    for(size_t i = 0; i < count; i++)
+        invlpg(base + (i * PAGE_SIZE));
+}
+
+/* tlbShootdownPoll(): handles a shootdown addressed to the current CPU, if
+ * there is one; this is also called by CPUs spinning on locks
+ * params: none
+ * returns: nothing
+ */
+
+void tlbShootdownPoll() {
+    if(!__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) return;
+
+    KernelCPUInfo *kinfo = getKernelCPUInfo();
+    if(!kinfo || !__atomic_load_n(&kinfo->tlbPending, __ATOMIC_ACQUIRE)) return;
+
+    flushLocal(shootdownBase, shootdownCount);
+
+    __atomic_store_n(&kinfo->tlbPending, 0, __ATOMIC_RELEASE);
+    __atomic_sub_fetch(&shootdownRemaining, 1, __ATOMIC_ACQ_REL);
+}
+
+/* tlbShootdownIRQ(): handler for the TLB shootdown IPI */
+
+void tlbShootdownIRQ() {
+    tlbShootdownPoll();
+    platformAcknowledgeIRQ(NULL);
+}
+
+/* shootdown(): invalidates a range of pages on every other CPU that may have
+ * translations for it cached, and waits until they all have
+ * params: root - paging root the range belongs to, zero for all of them
+ * params: base - base address
+ * params: count - number of pages, zero to flush everything
+ * returns: nothing
+ */
+
+static void shootdown(uint64_t root, uintptr_t base, size_t count) {
+    if(!__atomic_load_n(&ready, __ATOMIC_ACQUIRE) || (platformCountCPU() < 2)) return;
+
+    KernelCPUInfo *kinfo = getKernelCPUInfo();
+    acquireLockBlocking(&lock);
+
+    shootdownBase = base;
+    shootdownCount = count;
+    __atomic_store_n(&shootdownRemaining, 0, __ATOMIC_SEQ_CST);
+
+    // CPUs with a different paging root loaded have no live translations of
+    // the lower half to flush, and any CPU that loads this root after the
+    // check below either starts with a clean TLB or catches up on load
+    for(int i = 0; i < platformCountCPU(); i++) {
+        PlatformCPU *cpu = platformGetCPU(i);
+        KernelCPUInfo *target = __atomic_load_n(&cpu->info, __ATOMIC_ACQUIRE);
+        if(!target || (target == kinfo)) continue;
+        if(root && (__atomic_load_n(&target->pagingRoot, __ATOMIC_SEQ_CST) != root)) continue;
+
+        __atomic_add_fetch(&shootdownRemaining, 1, __ATOMIC_SEQ_CST);
+        __atomic_store_n(&target->tlbPending, 1, __ATOMIC_RELEASE);
+        lapicSendIPI(cpu->apicID, LAPIC_TLB_IPI);
+    }
+
+    while(__atomic_load_n(&shootdownRemaining, __ATOMIC_ACQUIRE));
+
+    releaseLock(&lock);
+}
+
+/* pcidAssign(): assigns a PCID from the current generation to an address
+ * space, starting a new generation if this one has run out
+ * params: ctx - thread context
+ * returns: PCID along with its generation
+ */
+
+static uint64_t pcidAssign(ThreadContext *ctx) {
+    acquireLockBlocking(&pcidLock);
+
+    // another CPU may have assigned one already
+    uint64_t pcid = __atomic_load_n(&ctx->pcid, __ATOMIC_ACQUIRE);
+    if((pcid >> PCID_SHIFT) != pcidGeneration) {
+        if(pcidNext >= PCID_COUNT) {
+            __atomic_add_fetch(&pcidGeneration, 1, __ATOMIC_ACQ_REL);
+            pcidNext = 1;
+        }
+
+        pcid = (pcidGeneration << PCID_SHIFT) | pcidNext;
+        pcidNext++;
+        __atomic_store_n(&ctx->pcid, pcid, __ATOMIC_RELEASE);
+    }
+
+    releaseLock(&pcidLock);
+    return pcid;
+}
+
+/* tlbLoadContext(): loads the paging root of a thread context on the current
+ * CPU, keeping the translations cached for its PCID where possible
+ * params: context - thread context
+ * returns: nothing
+ */
+
+void tlbLoadContext(void *context) {
+    ThreadContext *ctx = (ThreadContext *) context;
+    KernelCPUInfo *kinfo = getKernelCPUInfo();
+    uint64_t root = ctx->cr3 & ~(PAGE_SIZE-1);
+
+    // TLB shootdowns for this address space must reach this CPU from here on
+    __atomic_store_n(&kinfo->pagingRoot, root, __ATOMIC_SEQ_CST);
+    kinfo->context = ctx;
+
+    if(!pcidEnabled) {
+        if((readCR3() & ~(PAGE_SIZE-1)) != root) writeCR3(root);
+        return;
+    }
+
+    uint64_t pcid = __atomic_load_n(&ctx->pcid, __ATOMIC_ACQUIRE);
+    while((pcid >> PCID_SHIFT) != __atomic_load_n(&pcidGeneration, __ATOMIC_ACQUIRE))
+        pcid = pcidAssign(ctx);
+
+    // the first PCID of a new generation may still tag stale translations
+    bool flushed = false;
+    if((pcid >> PCID_SHIFT) != kinfo->pcidGeneration) {
+        flushAll();
+        kinfo->pcidGeneration = pcid >> PCID_SHIFT;
+        flushed = true;
+    }
+
+    uint64_t id = pcid & (PCID_COUNT-1);
+    uint64_t generation = __atomic_load_n(&ctx->tlbGeneration, __ATOMIC_SEQ_CST);
+    bool current = flushed || (kinfo->pcidSeen[id] == generation);
+    kinfo->pcidSeen[id] = generation;
+
+    if((readCR3() & ~CR3_NO_FLUSH) == (root | id)) {
+        if(!current) writeCR3(root | id);
+    } else {
+        writeCR3(root | id | (current ? CR3_NO_FLUSH : 0));
+    }
+}
+
+/* tlbInvalidateContext(): invalidates every translation of a thread's address
+ * space wherever it may be cached, whether or not it is in use on this CPU
+ * params: context - thread context
+ * returns: nothing
+ */
+
+void tlbInvalidateContext(void *context) {
+    ThreadContext *ctx = (ThreadContext *) context;
+    KernelCPUInfo *kinfo = getKernelCPUInfo();
+    uint64_t root = ctx->cr3 & ~(PAGE_SIZE-1);
+
+    uint64_t generation = __atomic_add_fetch(&ctx->tlbGeneration, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&kinfo->pagingRoot, __ATOMIC_SEQ_CST) == root) {
+        if(pcidEnabled) kinfo->pcidSeen[ctx->pcid & (PCID_COUNT-1)] = generation;
+        flushLocal(0, 0);
+    }
+
+    shootdown(root, 0, 0);
+}
+
+/* tlbCPUSetup(): enables PCIDs on the current CPU if they are in use
+ * params: none
+ * returns: nothing
+ */
+
+void tlbCPUSetup() {
+    if(!pcidEnabled) return;
+
+    KernelCPUInfo *kinfo = getKernelCPUInfo();
+    kinfo->pcidSeen = calloc(PCID_COUNT, sizeof(uint64_t));
+    if(!kinfo->pcidSeen) {
+        KERROR("could not allocate memory for PCID state for CPU %d\n", kinfo->cpuIndex);
+        while(1);
+    }
+
+    // CR3 must refer to PCID zero when PCIDs are enabled
+    writeCR3(readCR3() & ~(PAGE_SIZE-1));
+    writeCR4(readCR4() | CR4_PCID);
+    kinfo->pcidGeneration = __atomic_load_n(&pcidGeneration, __ATOMIC_ACQUIRE);
+}
+
+/* tlbInit(): installs the TLB shootdown IPI handler and decides whether to use
+ * PCIDs; this is called on the boot CPU after its per-CPU info is set up
+ * params: none
+ * returns: nothing
+ */
+
+void tlbInit() {
+    installInterrupt((uint64_t)tlbShootdownStub, GDT_KERNEL_CODE, PRIVILEGE_KERNEL, INTERRUPT_TYPE_INT, LAPIC_TLB_IPI);
+
+    CPUIDRegisters regs;
+    readCPUID(1, &regs);
+    if(!(regs.ecx & (1 << 17))) {
+        KDEBUG("CPU doesn't support PCIDs, switching address spaces will flush the TLB\n");
+    } else if(bootArgFlag(boot.arguments, "nopcid")) {
+        KDEBUG("PCIDs disabled by boot arguments\n");
+    } else {
+        pcidEnabled = true;
+        tlbCPUSetup();
+        KDEBUG("using PCIDs to keep translations across address space switches\n");
+    }
+
+    __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+}
+
+/* platformFlushTLB(): flushes every translation on this CPU
+ * params: none
+ * returns: nothing
+ */
+
+void platformFlushTLB() {
+    flushAll();
+}
+
+/* platformInvalidateTLB(): flushes every translation on every CPU
+ * params: none
+ * returns: nothing
+ */
+
+void platformInvalidateTLB() {
+    flushAll();
+    shootdown(0, 0, 0);
+}
+
+/* platformInvalidatePages(): invalidates a range of pages in the address space
+ * in use, on this CPU and every other CPU using the same address space
+ * params: base - base address
+ * params: count - number of pages
+ * returns: nothing
+ */
+
+void platformInvalidatePages(uintptr_t base, size_t count) {
+    if(!count) return;
+
+    // the kernel's half of the address space is the same everywhere
+    if(base >= KERNEL_BASE_ADDRESS) {
+        flushLocal(base, count);
+        shootdown(0, base, count);
+        return;
+    }
+
+    // CPUs that have switched away from this address space catch up when
+    // they load it again
+    KernelCPUInfo *kinfo = getKernelCPUInfo();
+    ThreadContext *ctx = kinfo ? kinfo->context : NULL;
+    if(ctx) {
+        uint64_t generation = __atomic_add_fetch(&ctx->tlbGeneration, 1, __ATOMIC_SEQ_CST);
+        if(pcidEnabled) kinfo->pcidSeen[ctx->pcid & (PCID_COUNT-1)] = generation;
+    }
+
+    flushLocal(base, count);
+    shootdown(readCR3() & ~(PAGE_SIZE-1), base, count);
+}
\ No newline at end of file
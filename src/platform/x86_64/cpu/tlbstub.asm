@@ -0,0 +1,24 @@
+
+; lux - a lightweight unix-like operating system
+; Omar Elghoul, 2024
+
+[bits 64]
+
+section .text
+
+%include "cpu/stack.asm"
+
+; assembly stub for the TLB shootdown IPI handler
+
+global tlbShootdownStub
+align 16
+tlbShootdownStub:
+    cli
+    pushaq
+
+    cld
+    extern tlbShootdownIRQ
+    call tlbShootdownIRQ    ; IPI is acknowledged in here
+
+    popaq
+    iretq
@@ -38,6 +38,12 @@ writeCR3:
     mov cr3, rdi
     ret
 
+global invlpg
+align 16
+invlpg:
+    invlpg [rdi]
+    ret
+
 global readCR4
 align 16
 readCR4:
@@ -192,6 +198,14 @@ writeMSR:
     wrmsr
     ret
 
+global readTSC
+align 16
+readTSC:
+    rdtsc
+    shl rdx, 32
+    or rax, rdx
+    ret
+
 global enableIRQs
 align 16
 enableIRQs:
@@ -64,6 +64,7 @@
 #define LAPIC_TIMER_PERIODIC            (1 << 17)
 #define LAPIC_TIMER_TSC_DEADLINE        (2 << 17)
 #define LAPIC_TIMER_IRQ                 0xFE        // use INT 0xFE for the timer
+#define LAPIC_TLB_IPI                   0xFD        // and INT 0xFD for TLB shootdowns
 
 #define LAPIC_TIMER_DIVIDER_2           0x00
 #define LAPIC_TIMER_DIVIDER_4           0x01
@@ -75,6 +76,7 @@
 #define LAPIC_TIMER_DIVIDER_1           0x0B
 
 // Local APIC Interrupt Command
+#define LAPIC_INT_CMD_FIXED             (0 << 8)
 #define LAPIC_INT_CMD_INIT              (5 << 8)
 #define LAPIC_INT_CMD_STARTUP           (6 << 8)
 #define LAPIC_INT_CMD_DELIVERY          (1 << 12)   // set to ZERO on success
@@ -86,6 +88,7 @@
 // Local APIC MSR
 #define MSR_LAPIC                       0x1B
 #define MSR_LAPIC_ENABLED               (1 << 11)
+#define MSR_TSC_DEADLINE                0x6E0
 
 // I/O APIC Registers
 #define IOAPIC_REGSEL                   0x00
@@ -209,8 +212,10 @@ typedef struct LocalNMI {
 int apicInit();
 void lapicWrite(uint32_t, uint32_t);
 uint32_t lapicRead(uint32_t);
+void lapicSendIPI(uint8_t, uint8_t);
 int apicTimerInit();
 uint64_t apicTimerFrequency();
+uint64_t apicTimerUptime();
 void timerHandlerStub();
 
 int ioapicRegister(IOAPIC *);
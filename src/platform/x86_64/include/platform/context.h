@@ -46,6 +46,11 @@ typedef struct {
 
     int iopl;               // set to 1 if I/O port privileges have been modified
     uint8_t ioports[8192];  // I/O port privileges
+
+    void *vmas;             // memory areas of user threads
+
+    uint64_t pcid;          // PCID, and the generation it was assigned in
+    uint64_t tlbGeneration; // bumped whenever its translations are invalidated
 } __attribute__((packed)) ThreadContext;
 
 void *platformCreateContext(void *, int, uintptr_t, uintptr_t);
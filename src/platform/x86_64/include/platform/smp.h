@@ -11,6 +11,7 @@
 #include <stdbool.h>
 #include <kernel/sched.h>
 #include <kernel/servers.h>
+#include <kernel/memory.h>
 #include <platform/tss.h>
 
 // every platform must define some kind of structure that allows it to identify
@@ -19,8 +20,10 @@
 
 typedef struct PlatformCPU {
     uint8_t procID, apicID;
+    int node;            // NUMA node
     bool bootCPU;        // true for the BSP
     bool running;
+    void *info;          // per-CPU kernel info, NULL until the CPU is set up
     struct PlatformCPU *next;
 } PlatformCPU;
 
@@ -31,7 +34,9 @@ typedef struct {
     void *kernelStack;
     void *kernelSwitchStack;
     PlatformCPU *cpu;
-    uint64_t uptime;
+    uint64_t uptime;        // global uptime as of the last timer interrupt here
+    bool timerIdle;         // timer was stopped or pushed out to halt the CPU
+    bool tscDeadline;       // timer is in TSC-deadline mode
 
     // currently running process and thread
     Process *process;
@@ -41,7 +46,30 @@ typedef struct {
     // IRQ command structure
     IRQCommand *irqcmd;
 
+    // free physical pages owned by this CPU
+    PhysicalMemoryCache pmmCache;
+
+    // free kernel heap objects owned by this CPU
+    SlabCPUCache slabCache;
+
+    // threads waiting to run on this CPU
+    RunQueue runQueue;
+
     int cpuIndex;
+
+    // paging root and thread context loaded on this CPU, and whether a TLB
+    // shootdown addressed to this CPU is waiting to be handled
+    uint64_t pagingRoot;
+    void *context;
+    int tlbPending;
+
+    // PCID generation this CPU has flushed for, and the translation generation
+    // of each PCID's address space when this CPU last loaded it
+    uint64_t pcidGeneration;
+    uint64_t *pcidSeen;
+
+    // memory areas of the address space in use, NULL for kernel threads
+    void *vmas;
 } KernelCPUInfo;
 
 void smpCPUInfoSetup();
@@ -49,6 +49,7 @@ void writeCR0(uint64_t);
 uint64_t readCR2();
 uint64_t readCR3();
 void writeCR3(uint64_t);
+void invlpg(uintptr_t);
 uint64_t readCR4();
 void writeCR4(uint64_t);
 void loadGDT(void *);
@@ -65,6 +66,7 @@ uint16_t inw(uint16_t);
 uint32_t ind(uint16_t);
 void resetSegments(uint64_t, uint8_t);
 uint32_t readCPUID(uint32_t, CPUIDRegisters *);
+uint64_t readTSC();
 uint64_t readMSR(uint32_t);
 void writeMSR(uint32_t, uint64_t);
 void enableIRQs();
@@ -75,7 +77,11 @@ void halt();
 #define CR0_CACHE_DISABLE           0x40000000  // caching
 #define CR0_WRITE_PROTECT           0x00010000
 
+#define CR4_GLOBAL_PAGES            0x00000080  // toggling this flushes the entire TLB
 #define CR4_FSGSBASE                0x00010000  // enable fs/gs segmentation
+#define CR4_PCID                    0x00020000  // process-context identifiers
+
+#define CR3_NO_FLUSH                0x8000000000000000  // keep the PCID's translations
 
 // other x86_64-specific routines
 extern GDTEntry gdt[];
@@ -83,6 +89,11 @@ extern IDTEntry idt[];
 extern GDTR gdtr;
 extern IDTR idtr;
 void installInterrupt(uint64_t, uint16_t, int, int, int);
+void tlbInit();
+void tlbCPUSetup();
+void tlbLoadContext(void *);
+void tlbInvalidateContext(void *);
+void tlbShootdownStub();
 
 #define PRIVILEGE_KERNEL        0
 #define PRIVILEGE_USER          3
@@ -109,7 +120,11 @@ void installInterrupt(uint64_t, uint16_t, int, int, int);
 #define PT_PAGE_USER            0x0004
 #define PT_PAGE_WRITE_THROUGH   0x0008
 #define PT_PAGE_NO_CACHE        0x0010
+#define PT_PAGE_ACCESSED        0x0020
+#define PT_PAGE_DIRTY           0x0040
 #define PT_PAGE_SIZE_EXTENSION  0x0080
+#define PT_PAGE_GLOBAL          0x0100      // kept in the TLB across CR3 reloads
+#define PT_PAGE_COW             0x0200      // available to software, marks copy-on-write pages
 #define PT_PAGE_NXE             ((uint64_t)0x8000000000000000)   // SET to disable execution privilege
 #define PT_PAGE_LOW_FLAGS       (PT_PAGE_PRESENT | PT_PAGE_RW | PT_PAGE_USER | PT_PAGE_NO_CACHE)
 
@@ -61,6 +61,14 @@ acquireLockBlocking:
 
 .wait:
     pause
+
+    ; interrupts are disabled, so keep answering TLB shootdowns while waiting
+    ; in case the lock is held by the CPU waiting on this one
+    push rdi
+    extern tlbShootdownPoll
+    call tlbShootdownPoll
+    pop rdi
+
     test dword [rdi], 1
     jnz .wait
     jmp .try
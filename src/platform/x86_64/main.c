@@ -47,10 +47,11 @@ int platformMain(KernelBootInfo *k) {
 
     installExceptions();
     pmmInit(&boot);
-    vmmInit();
+    vmmInit(&boot);
 
     ttyCreateBackbuffer();
     acpiInit(&boot);
+    acpiNUMAInit();
     apicInit();
     platformInitialSeed();
     ramdiskInit(&boot);
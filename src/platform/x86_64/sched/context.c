@@ -105,6 +105,9 @@ void *platformCreateContext(void *ptr, int level, uintptr_t entry, uintptr_t arg
         // on the process's size and location and etc
         // same for entry point and args
 
+        context->vmas = vmaCreate();
+        if(!context->vmas) return NULL;
+
         return ptr;
     }
 }
@@ -136,6 +139,9 @@ void platformSwitchContext(Thread *t) {
 
     kinfo->thread = t;
     kinfo->process = getProcess(t->pid);
+    kinfo->vmas = ctx->vmas;
+
+    tlbLoadContext(ctx);
     platformLoadContext(t->context);
 }
 
@@ -146,7 +152,8 @@ void platformSwitchContext(Thread *t) {
 
 int platformUseContext(void *ptr) {
     ThreadContext *ctx = (ThreadContext *)ptr;
-    writeCR3(ctx->cr3);
+    getKernelCPUInfo()->vmas = ctx->vmas;
+    tlbLoadContext(ctx);
     return 0;
 }
 
@@ -226,7 +233,6 @@ int platformSetContext(Thread *t, uintptr_t entry, uintptr_t highest, const char
 
     uintptr_t stack = vmmAllocate(base, USER_LIMIT_ADDRESS, pages, VMM_WRITE | VMM_USER);
     if(!stack) return -1;
-    memset((void *)stack, 0, PLATFORM_THREAD_STACK + PAGE_SIZE);
 
     stack += PLATFORM_THREAD_STACK;
     ctx->regs.rsp = stack;
@@ -267,10 +273,11 @@ SyscallRequest *platformCreateSyscallContext(Thread *t) {
 /* platformCloneContext(): creates a deep clone of a thread's context
  * params: cctx - pointer to child context
  * params: pctx - pointer to parent context
+ * params: share - true to share user pages copy-on-write
  * returns: pointer to child context on success, NULL on failure
  */
 
-void *platformCloneContext(void *cctx, const void *pctx) {
+void *platformCloneContext(void *cctx, const void *pctx, bool share) {
     ThreadContext *child = (ThreadContext *)cctx;
     ThreadContext *parent = (ThreadContext *)pctx;
 
@@ -280,8 +287,19 @@ void *platformCloneContext(void *cctx, const void *pctx) {
     // now create a deep clone of the LOWER HALF of the paging structures
     // the kernel is always present in the higher half of every address space
     // and is unchanging, so it doesn't need cloning
-    child->cr3 = (uint64_t)platformCloneUserSpace(parent->cr3);
+    child->cr3 = (uint64_t)platformCloneUserSpace(parent->cr3, share);
     if(!child->cr3) return NULL;
+
+    // the child's address space is new and gets a PCID of its own
+    child->pcid = 0;
+    child->tlbGeneration = 0;
+
+    // the child inherits all areas, including the ones it hasn't touched yet
+    if(parent->vmas) {
+        child->vmas = vmaClone(parent->vmas);
+        if(!child->vmas) return NULL;
+    }
+
     return child;
 }
 
@@ -323,6 +341,10 @@ void freePT(uint64_t *base, int depth, int maxdepth) {
     PhysicalMemoryStatus st;
     pmmStatus(&st);
 
+    // return frames to the physical memory manager in batches
+    uintptr_t pages[64];
+    size_t count = 0;
+
     for(int i = 0; i < 512; i++) {
         uint64_t entry = base[i];
         uint64_t phys = entry & ~((PAGE_SIZE-1) | PT_PAGE_NXE);
@@ -330,9 +352,18 @@ void freePT(uint64_t *base, int depth, int maxdepth) {
             if(depth < maxdepth)
                 freePT((uint64_t *) vmmMMIO(phys, true), depth+1, maxdepth);
 
-            pmmFree(phys);
+            pages[count++] = phys;
+            if(count == 64) {
+                pmmFreeBatch(count, pages);
+                count = 0;
+            }
+        } else if(entry && (depth == maxdepth)) {
+            // pages that were compressed out of memory
+            swapDiscard(phys);
         }
     }
+
+    if(count) pmmFreeBatch(count, pages);
 }
 
 /* platformCleanThread(): cleans up the memory space used by a thread after it
@@ -343,8 +374,12 @@ void freePT(uint64_t *base, int depth, int maxdepth) {
  */
 
 void platformCleanThread(void *ptr, uintptr_t highest) {
-    if(!ptr || highest <= USER_BASE_ADDRESS+PAGE_SIZE) return;
+    if(!ptr) return;
     ThreadContext *ctx = ptr;
+    vmaDestroy(ctx->vmas);
+    ctx->vmas = NULL;
+
+    if(highest <= USER_BASE_ADDRESS+PAGE_SIZE) return;
     if(!ctx->cr3) return;
     
     // free the page tables themselves and all associated physical mem
@@ -360,3 +395,56 @@ void platformCleanThread(void *ptr, uintptr_t highest) {
 
     pmmFree(ctx->cr3);
 }
+
+
+/* countPT(): counts the pages present in a paging structure
+ * params: base - base pointer to the paging structure
+ * params: depth - 1 for PDP, 2 for PD, 3 for PT
+ * returns: number of present pages
+ */
+
+static size_t countPT(uint64_t *base, int depth) {
+    size_t count = 0;
+    for(int i = 0; i < 512; i++) {
+        if(!(base[i] & PT_PAGE_PRESENT)) continue;
+
+        if(depth == 3)
+            count++;
+        else
+            count += countPT((uint64_t *) vmmMMIO(base[i] & ~((PAGE_SIZE-1) | PT_PAGE_NXE), true), depth+1);
+    }
+
+    return count;
+}
+
+/* platformMemoryUsage(): reports the memory usage of a thread's address space
+ * params: ptr - pointer to thread context
+ * params: committed - where to store the number of pages reserved
+ * params: resident - where to store the number of pages in physical memory
+ * returns: nothing
+ */
+
+void platformMemoryUsage(void *ptr, size_t *committed, size_t *resident) {
+    ThreadContext *ctx = ptr;
+    VMATree *vmas = ctx->vmas;
+    *committed = vmas ? vmas->pages : 0;
+    *resident = 0;
+
+    if(!vmas || !ctx->cr3) return;
+
+    uint64_t *pml4 = (uint64_t *) vmmMMIO(ctx->cr3, true);
+    for(int i = 0; i < 256; i++) {
+        if(pml4[i] & PT_PAGE_PRESENT)
+            *resident += countPT((uint64_t *) vmmMMIO(pml4[i] & ~(PAGE_SIZE-1), true), 1);
+    }
+}
+
+/* platformGetContextVMAs(): returns the memory areas of a thread's address space
+ * params: ptr - pointer to thread context
+ * returns: pointer to the VMA tree, NULL for kernel threads
+ */
+
+void *platformGetContextVMAs(void *ptr) {
+    ThreadContext *ctx = ptr;
+    return ctx ? ctx->vmas : NULL;
+}
\ No newline at end of file
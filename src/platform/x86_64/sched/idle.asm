@@ -62,11 +62,20 @@ platformIdle:
 
     ; if we get here then there is no work in the scheduler's queue
     ; we need to restore the original stack
-    ; so halt the CPU for one timer tick so it doesn't burn up
+    ; and halt the CPU with its timer stopped until something needs it
+    extern timerIdle
+    call timerIdle
+
     sti
     hlt
 
 .next:
+    ; restart the tick if we were woken by anything other than the timer
+    cli
+    extern timerResume
+    call timerResume
+    sti
+
     popaq
     add rsp, 40         ; skip over iret frame
     ret
@@ -44,8 +44,10 @@ platformLoadContext:
 
     fxrstor64 [rdi]
 
-    ; save performance by only invalidating TLB if the context actually changed
+    ; the paging root and its PCID are normally already loaded by
+    ; platformSwitchContext(), so only reload it if the context changed
     mov rax, cr3
+    and rax, -4096          ; strip the PCID
     mov rbx, [rdi+512]      ; pml4
     cmp rax, rbx
     jz .continue
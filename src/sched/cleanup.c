@@ -18,6 +18,5 @@
 
 void threadCleanup(Thread *t) {
     platformCleanThread(t->context, t->highest);
-
-    /* TODO: properly re-implement this after implementing per-CPU run queue */
+    schedDequeue(t);
 }
\ No newline at end of file
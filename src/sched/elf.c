@@ -11,6 +11,7 @@
 #include <kernel/memory.h>
 #include <kernel/sched.h>
 #include <platform/mmap.h>
+#include <platform/platform.h>
 
 /*
  * loadELF(): loads the sections of an ELF file
@@ -83,9 +84,17 @@ uint64_t loadELF(const void *binary, uint64_t *highest) {
                 return 0;
             }
 
-            if(vp != (prhdr->virtualAddress & ~(PAGE_SIZE-1)))
+            if(vp != (prhdr->virtualAddress & ~(PAGE_SIZE-1))) {
                 overlap = 1;
 
+                // the page shared with the previous segment may have been
+                // made read-only, and the kernel honors that too
+                uintptr_t shared = prhdr->virtualAddress & ~(PAGE_SIZE-1);
+                int status = vmmPageStatus(shared, NULL);
+                if(!(status & PLATFORM_PAGE_WRITE))
+                    vmmSetFlags(shared, 1, flags | ((status & PLATFORM_PAGE_EXEC) ? VMM_EXEC : 0));
+            }
+
             memset((void *)prhdr->virtualAddress, 0, prhdr->memorySize);
             memcpy((void *)prhdr->virtualAddress, (const void *)((uintptr_t)binary + prhdr->fileOffset), prhdr->fileSize);
 
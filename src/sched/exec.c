@@ -15,6 +15,7 @@
 #include <kernel/elf.h>
 #include <kernel/modules.h>
 #include <kernel/signal.h>
+#include <sys/time.h>
 
 int execmve(Thread *, void *, const char **, const char **);
 
@@ -41,7 +42,7 @@ pid_t execveMemory(const void *ptr, const char **argv, const char **envp) {
     process->threadCount = 1;
     process->threads = calloc(process->threadCount, sizeof(Thread *));
     if(!process->threads) {
-        free(process);
+        processDestroy(process);
         schedRelease();
         return 0;
     }
@@ -49,7 +50,7 @@ pid_t execveMemory(const void *ptr, const char **argv, const char **envp) {
     process->threads[0] = calloc(1, sizeof(Thread));
     if(!process->threads[0]) {
         free(process->threads);
-        free(process);
+        processDestroy(process);
         schedRelease();
         return 0;
     }
@@ -63,7 +64,7 @@ pid_t execveMemory(const void *ptr, const char **argv, const char **envp) {
     if(!process->threads[0]->context) {
         free(process->threads[0]);
         free(process->threads);
-        free(process);
+        processDestroy(process);
         schedRelease();
         return 0;
     }
@@ -72,11 +73,13 @@ pid_t execveMemory(const void *ptr, const char **argv, const char **envp) {
         free(process->threads[0]->context);
         free(process->threads[0]);
         free(process->threads);
-        free(process);
+        processDestroy(process);
         schedRelease();
         return 0;
     }
 
+    // the process is already indexed, so this can't need a new leaf
+    indexThread(pid, process->threads[0]);
     threadUseContext(pid);
 
     uint64_t highest;
@@ -84,10 +87,11 @@ pid_t execveMemory(const void *ptr, const char **argv, const char **envp) {
 
     if(platformSetContext(process->threads[0], entry, highest, argv, envp)) {
         threadUseContext(getTid());
+        indexThread(pid, NULL);
         free(process->threads[0]->context);
         free(process->threads[0]);
         free(process->threads);
-        free(process);
+        processDestroy(process);
         schedRelease();
         return 0;
     }
@@ -101,6 +105,7 @@ pid_t execveMemory(const void *ptr, const char **argv, const char **envp) {
     //schedAdjustTimeslice();
 
     threadUseContext(getTid());
+    unblockThread(process->threads[0]);
     schedRelease();
     return pid;
 }
@@ -339,12 +344,15 @@ int execmve(Thread *t, void *image, const char **argv, const char **envp) {
     t->signals = signalDefaults();
     t->signalMask = 0;
 
+    // timers from timer_create() don't survive exec, unlike alarm()
+    timerRelease(p);
+
     // TODO: here we've successfully loaded the new program, but we also need
     // to free up memory used by the original program
     platformCleanThread(oldctx, oldHighest);
     free(oldctx);
 
-    t->status = THREAD_QUEUED;
     schedAdjustTimeslice();
+    unblockThread(t);
     return 0; // return to syscall dispatcher; the thread will not see this return
 }
\ No newline at end of file
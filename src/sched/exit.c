@@ -9,6 +9,8 @@
 #include <platform/context.h>
 #include <kernel/sched.h>
 #include <kernel/logger.h>
+#include <kernel/timer.h>
+#include <sys/time.h>
 
 /* terminateThread(): helper function to terminate a thread
  * params: t - thread to exit
@@ -26,6 +28,8 @@ void terminateThread(Thread *t, int status, bool normal) {
 
     if(normal) t->exitStatus |= EXIT_NORMAL;
 
+    ktimerCancel(&t->sleepTimer);
+
     // lumen can never terminate
     if(t->pid == getLumenPID() || t->tid == getLumenPID()) {
         KPANIC("kernel panic: lumen (pid %d) terminated %snormally with exit status %d\n", getLumenPID(), normal ? "" : "ab", status);
@@ -51,6 +55,12 @@ void terminateThread(Thread *t, int status, bool normal) {
         }
     }
 
+    // nothing is left to deliver timer signals to
+    if(p->zombie) {
+        ktimerCancel(&p->realTimer);
+        timerRelease(p);
+    }
+
     if(p->zombie && p->childrenCount && p->children) {
         // parent process is now a zombie, mark all children as orphans before
         // the parent status is read and it quits
@@ -15,6 +15,26 @@
 #include <kernel/signal.h>
 #include <kernel/socket.h>
 
+/* forkCanShare(): checks whether the parent's pages can be shared with the
+ * child copy-on-write, which is only safe if no other thread of the parent can
+ * be writing through translations that are about to become stale
+ * params: t - thread calling fork()
+ * returns: true if no other thread of the parent is running or in a syscall
+ */
+
+static bool forkCanShare(Thread *t) {
+    Process *p = getProcess(t->pid);
+    if(!p || !p->threads) return false;
+
+    for(size_t i = 0; i < p->threadCount; i++) {
+        Thread *other = p->threads[i];
+        if(!other || (other == t)) continue;
+        if((other->status == THREAD_RUNNING) || other->syscall.busy) return false;
+    }
+
+    return true;
+}
+
 /* fork(): forks the running thread
  * params: t - pointer to thread structure
  * returns: zero to child, PID of child to parent, negative on fail
@@ -36,7 +56,7 @@ pid_t fork(Thread *t) {
     p->threadCount = 1;
     p->threads = calloc(p->threadCount, sizeof(Thread *));
     if(!p->threads) {
-        free(p);
+        processDestroy(p);
         schedRelease();
         return -ENOMEM;
     }
@@ -44,12 +64,12 @@ pid_t fork(Thread *t) {
     p->threads[0] = calloc(1, sizeof(Thread));
     if(!p->threads[0]) {
         free(p->threads);
-        free(p);
+        processDestroy(p);
         schedRelease();
         return -ENOMEM;
     }
 
-    // add the new thread to the queue
+    // the new thread only goes in a run queue once it is fully set up
     p->threads[0]->status = THREAD_QUEUED;
     p->threads[0]->next = NULL;
     p->threads[0]->pid = pid;
@@ -67,17 +87,17 @@ pid_t fork(Thread *t) {
     if(!p->threads[0]->context || !p->threads[0]->signalContext) {
         free(p->threads[0]);
         free(p->threads);
-        free(p);
+        processDestroy(p);
         schedRelease();
         return -ENOMEM;
     }
 
     // and clone the parent's context
-    if(!platformCloneContext(p->threads[0]->context, t->context)) {
+    if(!platformCloneContext(p->threads[0]->context, t->context, forkCanShare(t))) {
         free(p->threads[0]->context);
         free(p->threads[0]);
         free(p->threads);
-        free(p);
+        processDestroy(p);
         schedRelease();
         return -ENOMEM;
     }
@@ -128,11 +148,16 @@ pid_t fork(Thread *t) {
 
         // if we made this far then the creation was successful
         // list the child process as a child of the parent
-        Process **newChildren = realloc(parent->children, parent->childrenCount+1);
+        Process **newChildren = realloc(parent->children, sizeof(Process *) * (parent->childrenCount+1));
         if(!newChildren) {
             // we can't add the child to the parent's list
             platformCleanThread(p->threads[0]->context, p->threads[0]->highest);
-            free(p);
+            free(p->threads[0]->signalContext);
+            free(p->threads[0]->context);
+            free(p->threads[0]);
+            free(p->threads);
+            processDestroy(p);
+            schedRelease();
             return -ENOMEM;
         }
 
@@ -147,6 +172,8 @@ pid_t fork(Thread *t) {
 
     // and we're done - return zero to the child
     platformSetContextStatus(p->threads[0]->context, 0);
+    indexThread(pid, p->threads[0]);
+    unblockThread(p->threads[0]);
     schedRelease();
     return pid;     // and PID to the parent
 }
@@ -0,0 +1,300 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* Interval Timers */
+
+/* setitimer() and alarm() share one real-time timer per process, and
+ * timer_create() gives each process up to MAX_PROCESS_TIMERS more; they all
+ * run off the kernel timer wheel and notify the process with a signal, so
+ * programs can wait for time to pass without polling */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <kernel/sched.h>
+#include <kernel/signal.h>
+#include <kernel/timer.h>
+#include <platform/platform.h>
+#include <sys/time.h>
+
+typedef struct ProcessTimer {
+    KernelTimer timer;
+    pid_t pid;
+    clockid_t clock;
+    int notify, signal;
+    uint64_t interval;      // timer ticks, zero for one-shot timers
+} ProcessTimer;
+
+/* intervalNext(): returns the next deadline of a periodic timer, skipping
+ * periods that were missed entirely instead of firing them in a burst
+ * params: deadline - deadline that was just reached
+ * params: interval - period in timer ticks, zero for one-shot timers
+ * returns: next deadline, zero if the timer doesn't repeat
+ */
+
+static uint64_t intervalNext(uint64_t deadline, uint64_t interval) {
+    if(!interval) return 0;
+
+    uint64_t now = platformUptime();
+    deadline += interval;
+    if(deadline <= now) deadline += (((now - deadline) / interval) + 1) * interval;
+    return deadline;
+}
+
+/* realExpire(): sends SIGALRM when the real-time timer of a process goes off */
+
+static uint64_t realExpire(KernelTimer *timer) {
+    Process *p = (Process *) timer->arg;
+    kill(NULL, p->pid, SIGALRM);
+    return intervalNext(timer->deadline, p->realInterval);
+}
+
+/* processTimerExpire(): notifies a process when one of its timers goes off */
+
+static uint64_t processTimerExpire(KernelTimer *timer) {
+    ProcessTimer *pt = (ProcessTimer *) timer->arg;
+    if(pt->notify == SIGEV_SIGNAL) kill(NULL, pt->pid, pt->signal);
+    return intervalNext(timer->deadline, pt->interval);
+}
+
+/* setitimer(): sets the interval timer of a process
+ * params: t - calling thread
+ * params: which - ITIMER_REAL, the other timers are not supported
+ * params: new - new value and interval, a zero value disarms the timer
+ * params: old - buffer to store the previous value and interval, may be NULL
+ * returns: zero on success, negative error code on fail
+ */
+
+int setitimer(Thread *t, int which, const struct itimerval *new, struct itimerval *old) {
+    // virtual and profiling timers would need CPU time accounting
+    if(which != ITIMER_REAL) return -EINVAL;
+    if((new->it_value.tv_usec < 0) || (new->it_value.tv_usec >= 1000000) ||
+    (new->it_interval.tv_usec < 0) || (new->it_interval.tv_usec >= 1000000))
+        return -EINVAL;
+
+    Process *p = getProcess(t->pid);
+    if(!p) return -ESRCH;
+
+    if(old) getitimer(t, which, old);
+
+    uint64_t value = timevalTicks(&new->it_value);
+    p->realInterval = timevalTicks(&new->it_interval);
+
+    if(value) {
+        p->realTimer.expire = &realExpire;
+        p->realTimer.arg = p;
+        ktimerStart(&p->realTimer, platformUptime() + value);
+    } else {
+        ktimerCancel(&p->realTimer);
+    }
+
+    return 0;
+}
+
+/* getitimer(): returns the interval timer of a process
+ * params: t - calling thread
+ * params: which - ITIMER_REAL, the other timers are not supported
+ * params: cur - buffer to store the time left and interval
+ * returns: zero on success, negative error code on fail
+ */
+
+int getitimer(Thread *t, int which, struct itimerval *cur) {
+    if(which != ITIMER_REAL) return -EINVAL;
+
+    Process *p = getProcess(t->pid);
+    if(!p) return -ESRCH;
+
+    ticksTimeval(ktimerRemaining(&p->realTimer), &cur->it_value);
+    ticksTimeval(p->realInterval, &cur->it_interval);
+    return 0;
+}
+
+/* alarm(): sends SIGALRM to the calling process after a number of seconds
+ * params: t - calling thread
+ * params: seconds - seconds until the signal, zero to cancel a pending alarm
+ * returns: seconds left until the previous alarm, zero if there was none
+ */
+
+unsigned int alarm(Thread *t, unsigned int seconds) {
+    Process *p = getProcess(t->pid);
+    if(!p) return 0;
+
+    // a pending alarm never reads back as zero seconds
+    uint64_t remaining = ktimerRemaining(&p->realTimer);
+    unsigned int previous = (remaining + PLATFORM_TIMER_FREQUENCY - 1) / PLATFORM_TIMER_FREQUENCY;
+
+    p->realInterval = 0;
+    if(seconds) {
+        p->realTimer.expire = &realExpire;
+        p->realTimer.arg = p;
+        ktimerStart(&p->realTimer, platformUptime() + ((uint64_t) seconds * PLATFORM_TIMER_FREQUENCY));
+    } else {
+        ktimerCancel(&p->realTimer);
+    }
+
+    return previous;
+}
+
+/* timerFind(): returns a timer of a process by its ID
+ * params: p - process
+ * params: id - timer ID
+ * returns: pointer to the timer, NULL if there is none
+ */
+
+static ProcessTimer *timerFind(Process *p, timer_t id) {
+    if(!p || (id < 0) || (id >= MAX_PROCESS_TIMERS)) return NULL;
+    return p->timers[id];
+}
+
+/* timer_create(): creates a timer for the calling process
+ * params: t - calling thread
+ * params: clock - CLOCK_REALTIME or CLOCK_MONOTONIC
+ * params: sev - how to notify the process, NULL for SIGALRM
+ * params: id - buffer to store the timer ID
+ * returns: zero on success, negative error code on fail
+ */
+
+int timer_create(Thread *t, clockid_t clock, const struct sigevent *sev, timer_t *id) {
+    if((clock != CLOCK_REALTIME) && (clock != CLOCK_MONOTONIC)) return -EINVAL;
+
+    int notify = sev ? sev->sigev_notify : SIGEV_SIGNAL;
+    int signal = sev ? sev->sigev_signo : SIGALRM;
+
+    // threads are created in user space, so SIGEV_THREAD is left to libc
+    if(notify == SIGEV_THREAD) return -ENOTSUP;
+    if((notify != SIGEV_SIGNAL) && (notify != SIGEV_NONE)) return -EINVAL;
+    if((notify == SIGEV_SIGNAL) && ((signal < 1) || (signal > MAX_SIGNAL))) return -EINVAL;
+
+    Process *p = getProcess(t->pid);
+    if(!p) return -ESRCH;
+
+    ProcessTimer *pt = calloc(1, sizeof(ProcessTimer));
+    if(!pt) return -ENOMEM;
+
+    pt->pid = p->pid;
+    pt->clock = clock;
+    pt->notify = notify;
+    pt->signal = signal;
+    pt->timer.expire = &processTimerExpire;
+    pt->timer.arg = pt;
+
+    schedLock();
+    for(int i = 0; i < MAX_PROCESS_TIMERS; i++) {
+        if(!p->timers[i]) {
+            p->timers[i] = pt;
+            schedRelease();
+
+            *id = i;
+            return 0;
+        }
+    }
+
+    schedRelease();
+    free(pt);
+    return -EAGAIN;
+}
+
+/* timer_gettime(): returns the time left on a timer
+ * params: t - calling thread
+ * params: id - timer ID
+ * params: cur - buffer to store the time left and interval
+ * returns: zero on success, negative error code on fail
+ */
+
+int timer_gettime(Thread *t, timer_t id, struct itimerspec *cur) {
+    ProcessTimer *pt = timerFind(getProcess(t->pid), id);
+    if(!pt) return -EINVAL;
+
+    ticksTimespec(ktimerRemaining(&pt->timer), &cur->it_value);
+    ticksTimespec(pt->interval, &cur->it_interval);
+    return 0;
+}
+
+/* timer_settime(): arms or disarms a timer
+ * params: t - calling thread
+ * params: id - timer ID
+ * params: flags - TIMER_ABSTIME if the value is an absolute time on the
+ *                 timer's clock rather than relative to now
+ * params: new - new value and interval, a zero value disarms the timer
+ * params: old - buffer to store the previous value and interval, may be NULL
+ * returns: zero on success, negative error code on fail
+ */
+
+int timer_settime(Thread *t, timer_t id, int flags, const struct itimerspec *new, struct itimerspec *old) {
+    ProcessTimer *pt = timerFind(getProcess(t->pid), id);
+    if(!pt) return -EINVAL;
+
+    if((new->it_value.tv_nsec < 0) || (new->it_value.tv_nsec >= 1000000000) ||
+    (new->it_interval.tv_nsec < 0) || (new->it_interval.tv_nsec >= 1000000000))
+        return -EINVAL;
+
+    if(old) timer_gettime(t, id, old);
+
+    if(!new->it_value.tv_sec && !new->it_value.tv_nsec) {
+        ktimerCancel(&pt->timer);
+        return 0;
+    }
+
+    uint64_t now = platformUptime();
+    uint64_t value = timespecTicks(&new->it_value);
+    uint64_t deadline;
+
+    if(!(flags & TIMER_ABSTIME)) {
+        deadline = now + value;
+    } else if(pt->clock == CLOCK_MONOTONIC) {
+        // the monotonic clock counts from boot, as uptime does
+        deadline = value;
+    } else {
+        // times in the past go off straight away
+        uint64_t realtime = (platformTimestamp() * PLATFORM_TIMER_FREQUENCY) + (now % PLATFORM_TIMER_FREQUENCY);
+        deadline = now + ((value > realtime) ? value - realtime : 0);
+    }
+
+    pt->interval = timespecTicks(&new->it_interval);
+    ktimerStart(&pt->timer, deadline);
+    return 0;
+}
+
+/* timer_delete(): deletes a timer
+ * params: t - calling thread
+ * params: id - timer ID
+ * returns: zero on success, negative error code on fail
+ */
+
+int timer_delete(Thread *t, timer_t id) {
+    Process *p = getProcess(t->pid);
+
+    schedLock();
+    ProcessTimer *pt = timerFind(p, id);
+    if(!pt) {
+        schedRelease();
+        return -EINVAL;
+    }
+
+    p->timers[id] = NULL;
+    schedRelease();
+
+    ktimerCancel(&pt->timer);
+    free(pt);
+    return 0;
+}
+
+/* timerRelease(): deletes all the timers a process created, for when it
+ * exits or replaces its program
+ * params: p - process
+ * returns: nothing
+ */
+
+void timerRelease(Process *p) {
+    for(int i = 0; i < MAX_PROCESS_TIMERS; i++) {
+        ProcessTimer *pt = p->timers[i];
+        if(!pt) continue;
+
+        p->timers[i] = NULL;
+        ktimerCancel(&pt->timer);
+        free(pt);
+    }
+}
\ No newline at end of file
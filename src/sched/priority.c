@@ -0,0 +1,164 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+#include <errno.h>
+#include <kernel/sched.h>
+
+/* nice values from -20 to 19 are folded into the scheduler's priority levels,
+ * and each level reads back as the nice value at the start of its range */
+
+static int niceLevel(int nice) {
+    if(nice <= -15) return PRIORITY_HIGHEST;
+    if(nice < 0) return PRIORITY_HIGH;
+    if(nice < 10) return PRIORITY_NORMAL;
+    return PRIORITY_LOW;
+}
+
+static int levelNice(int level) {
+    switch(level) {
+    case PRIORITY_HIGHEST: return -20;
+    case PRIORITY_HIGH: return -10;
+    case PRIORITY_LOW: return 10;
+    default: return 0;
+    }
+}
+
+/* priorityMatches(): checks if a process is selected by setpriority() and
+ * getpriority() arguments
+ * params: p - process
+ * params: which - PRIO_PROCESS, PRIO_PGRP, or PRIO_USER
+ * params: who - process ID, process group ID, or user ID
+ * returns: true/false
+ */
+
+static bool priorityMatches(Process *p, int which, id_t who) {
+    switch(which) {
+    case PRIO_PROCESS: return p->pid == who;
+    case PRIO_PGRP: return p->pgrp == who;
+    case PRIO_USER: return p->user == who;
+    default: return false;
+    }
+}
+
+/* priorityTarget(): resolves the zero ID to the caller's own process, group,
+ * or user
+ * params: caller - calling process
+ * params: which - PRIO_PROCESS, PRIO_PGRP, or PRIO_USER
+ * params: who - ID passed by the caller
+ * returns: ID to look for
+ */
+
+static id_t priorityTarget(Process *caller, int which, id_t who) {
+    if(who) return who;
+
+    switch(which) {
+    case PRIO_PROCESS: return caller->pid;
+    case PRIO_PGRP: return caller->pgrp;
+    default: return caller->user;
+    }
+}
+
+/* setpriority(): sets the scheduling priority of processes
+ * params: t - calling thread
+ * params: which - PRIO_PROCESS, PRIO_PGRP, or PRIO_USER
+ * params: who - process ID, process group ID, or user ID, zero for the caller's
+ * a thread ID with PRIO_PROCESS selects that thread alone
+ * params: prio - nice value, lower values running first
+ * returns: zero on success, negative errno on fail
+ */
+
+int setpriority(Thread *t, int which, id_t who, int prio) {
+    if((which < PRIO_PROCESS) || (which > PRIO_USER)) return -EINVAL;
+
+    Process *caller = getProcess(t->pid);
+    if(!caller) return -ESRCH;
+
+    // only root can raise priorities above normal
+    int level = niceLevel(prio);
+    if((level > PRIORITY_NORMAL) && caller->user) return -EACCES;
+
+    who = priorityTarget(caller, which, who);
+
+    schedLock();
+
+    if((which == PRIO_PROCESS) && !getProcess(who)) {
+        Thread *target = getThread(who);
+        Process *p = target ? getProcess(target->pid) : NULL;
+        if(!p) {
+            schedRelease();
+            return -ESRCH;
+        }
+
+        if(caller->user && (p->user != caller->user)) {
+            schedRelease();
+            return -EPERM;
+        }
+
+        schedSetPriority(target, level);
+        schedRelease();
+        return 0;
+    }
+
+    int found = 0;
+    bool denied = false;
+    for(Process *p = getProcessQueue(); p; p = p->next) {
+        if(!priorityMatches(p, which, who)) continue;
+        if(caller->user && (p->user != caller->user)) {
+            denied = true;
+            continue;
+        }
+
+        for(size_t i = 0; i < p->threadCount; i++) {
+            if(p->threads[i]) schedSetPriority(p->threads[i], level);
+        }
+
+        found++;
+    }
+
+    schedRelease();
+    if(!found) return denied ? -EPERM : -ESRCH;
+    return 0;
+}
+
+/* getpriority(): returns the scheduling priority of processes
+ * params: t - calling thread
+ * params: which - PRIO_PROCESS, PRIO_PGRP, or PRIO_USER
+ * params: who - process ID, process group ID, or user ID, zero for the caller's
+ * returns: 20 minus the lowest nice value of the selected processes, which is
+ *          never negative, negative errno on fail
+ */
+
+int getpriority(Thread *t, int which, id_t who) {
+    if((which < PRIO_PROCESS) || (which > PRIO_USER)) return -EINVAL;
+
+    Process *caller = getProcess(t->pid);
+    if(!caller) return -ESRCH;
+
+    who = priorityTarget(caller, which, who);
+
+    schedLock();
+
+    int level = 0;
+    if((which == PRIO_PROCESS) && !getProcess(who)) {
+        Thread *target = getThread(who);
+        if(target) level = target->priority ? target->priority : PRIORITY_NORMAL;
+    } else {
+        for(Process *p = getProcessQueue(); p; p = p->next) {
+            if(!priorityMatches(p, which, who)) continue;
+
+            for(size_t i = 0; i < p->threadCount; i++) {
+                if(!p->threads[i]) continue;
+                int priority = p->threads[i]->priority ? p->threads[i]->priority : PRIORITY_NORMAL;
+                if(priority > level) level = priority;
+            }
+        }
+    }
+
+    schedRelease();
+    if(!level) return -ESRCH;
+    return 20 - levelNice(level);
+}
\ No newline at end of file
@@ -16,21 +16,37 @@
 #include <kernel/signal.h>
 #include <kernel/logger.h>
 
+// the PID/TID index is a two-level table over the whole PID space, filled in
+// with the scheduler locked and read without it; exited processes stay in it
+// as zombies, and the only structures ever freed behind it are those of
+// processes that failed to be created and never ran
+typedef struct {
+    Process *process;
+    Thread *thread;
+} PidIndexEntry;
+
 static bool scheduling = false;
 int processes, threads;
 static lock_t lock = LOCK_INITIAL;
 static uint8_t *pidBitmap;
+static pid_t *freePids;      // unused PIDs in no particular order
+static int freePidCount;
+static PidIndexEntry **pidIndex;
 static Process *first;       // first process in the linked list
 static Process *last;
 static pid_t lumen;          // we'll need this to adopt orphaned processes
 static pid_t kernel;
 static Thread *kthread;      // main kernel thread
+static RunQueue **runQueues; // one per CPU
+static int queueCount;
 
 /* schedInit(): initializes the scheduler */
 
 void schedInit() {
     pidBitmap = calloc(1, (MAX_PID + 7) / 8);
-    if(!pidBitmap) {
+    freePids = calloc(MAX_PID, sizeof(pid_t));
+    pidIndex = calloc((MAX_PID + PID_INDEX_LEAF - 1) / PID_INDEX_LEAF, sizeof(PidIndexEntry *));
+    if(!pidBitmap || !freePids || !pidIndex) {
         KERROR("could not allocate memory for scheduler\n");
         while(1);
     }
@@ -41,6 +57,30 @@ void schedInit() {
     last = NULL;
 
     pidBitmap[0] = 1;   // PID zero is reserved and cannot be used
+
+    freePidCount = 0;
+    for(pid_t pid = 1; pid < MAX_PID; pid++)
+        freePids[freePidCount++] = pid;
+
+    // the run queues live in the per-CPU info structures, which exist for
+    // every CPU by now
+    queueCount = platformCountCPU();
+    runQueues = calloc(queueCount, sizeof(RunQueue *));
+    if(!runQueues) {
+        KERROR("could not allocate memory for scheduler\n");
+        while(1);
+    }
+
+    for(int i = 0; i < queueCount; i++) {
+        runQueues[i] = platformGetRunQueue(i);
+        if(!runQueues[i]) {
+            KERROR("CPU %d has no run queue\n", i);
+            while(1);
+        }
+
+        runQueues[i]->cpu = i;
+    }
+
     KDEBUG("scheduler initialized\n");
 }
 
@@ -72,12 +112,13 @@ bool pidIsUsed(pid_t pid) {
  */
 
 pid_t allocatePid() {
-    if(processes >= MAX_PID || threads >= MAX_PID) return 0;
+    if(!freePidCount) return 0;
 
-    pid_t pid;
-    do {
-        pid = rand() % MAX_PID;
-    } while(pidIsUsed(pid));
+    // pick a random unused PID and fill its place with the last one, which
+    // takes the same time no matter how few are left
+    int i = rand() % freePidCount;
+    pid_t pid = freePids[i];
+    freePids[i] = freePids[--freePidCount];
 
     size_t byte = pid / 8;
     size_t bit = pid % 8;
@@ -86,18 +127,71 @@ pid_t allocatePid() {
     return pid;
 }
 
+/* pidIndexEntry(): returns the entry of an ID in the PID/TID index
+ * params: id - process or thread ID
+ * params: create - whether to allocate the leaf the entry is in if needed
+ * returns: pointer to the entry, NULL if there is none
+ */
+
+static PidIndexEntry *pidIndexEntry(pid_t id, bool create) {
+    if(!pidIndex || (id <= 0) || (id >= MAX_PID)) return NULL;
+
+    PidIndexEntry **slot = &pidIndex[id / PID_INDEX_LEAF];
+    PidIndexEntry *leaf = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if(!leaf && create) {
+        leaf = calloc(PID_INDEX_LEAF, sizeof(PidIndexEntry));
+        if(!leaf) return NULL;
+        __atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+    }
+
+    return leaf ? &leaf[id % PID_INDEX_LEAF] : NULL;
+}
+
+/* indexProcess(): sets the process structure a PID refers to, with the
+ * scheduler locked
+ * params: pid - process ID
+ * params: p - process structure, NULL to remove it
+ * returns: true on success
+ */
+
+static bool indexProcess(pid_t pid, Process *p) {
+    PidIndexEntry *entry = pidIndexEntry(pid, p != NULL);
+    if(!entry) return !p;
+
+    __atomic_store_n(&entry->process, p, __ATOMIC_RELEASE);
+    return true;
+}
+
+/* indexThread(): sets the thread structure a TID refers to, with the
+ * scheduler locked
+ * params: tid - thread ID
+ * params: t - thread structure, NULL to remove it
+ * returns: true on success
+ */
+
+bool indexThread(pid_t tid, Thread *t) {
+    PidIndexEntry *entry = pidIndexEntry(tid, t != NULL);
+    if(!entry) return !t;
+
+    __atomic_store_n(&entry->thread, t, __ATOMIC_RELEASE);
+    return true;
+}
+
 /* releasePid(): releases a PID 
  * params: pid - process ID
  * returns: nothing
  */
 
 void releasePid(pid_t pid) {
-    if(pid >= MAX_PID) return;
+    if((pid <= 0) || (pid >= MAX_PID) || !pidIsUsed(pid)) return;
 
     size_t byte = pid / 8;
     size_t bit = pid % 8;
 
     pidBitmap[byte] &= ~(1 << bit);
+    freePids[freePidCount++] = pid;
+    indexThread(pid, NULL);
+    indexProcess(pid, NULL);
 }
 
 /* kthreadCreate(): spawns a new kernel thread
@@ -111,36 +205,17 @@ pid_t kthreadCreate(void *(*entry)(void *), void *arg) {
     pid_t tid = allocatePid();
     if(!tid) {
         KWARN("unable to allocate a PID, maximum processes running?\n");
+        releaseLock(&lock);
         return 0;
     }
 
-    Process *p;
-
-    /* special case for the kernel idle thread
-     * this is the ONLY thread that runs in kernel space */
-    if(!processes) {
-        // creating initial kernel thread
-        first = calloc(1, sizeof(Process));
-        if(!first) {
-            KERROR("failed to allocate memory for kernel thread\n");
-            releaseLock(&lock);
-            return 0;
-        }
-
-        p = first;
-    } else {
-        p = first;
-        while(p->next) {
-            p = p->next;
-        }
-
-        p->next = calloc(1, sizeof(Process));
-        p = p->next;
-        if(!p) {
-            KERROR("failed to allocate memory for kernel thread\n");
-            releaseLock(&lock);
-            return 0;
-        }
+    // the process is only linked into the list once it is complete
+    Process *p = calloc(1, sizeof(Process));
+    if(!p) {
+        KERROR("failed to allocate memory for kernel thread\n");
+        releasePid(tid);
+        releaseLock(&lock);
+        return 0;
     }
 
     p->pid = tid;
@@ -156,7 +231,7 @@ pid_t kthreadCreate(void *(*entry)(void *), void *arg) {
     if(!p->threads) {
         KERROR("failed to allocate memory for kernel thread\n");
         free(p);
-        if(!processes) first = NULL;
+        releasePid(tid);
         releaseLock(&lock);
         return 0;
     }
@@ -166,7 +241,7 @@ pid_t kthreadCreate(void *(*entry)(void *), void *arg) {
         KERROR("failed to allocate memory for kernel thread\n");
         free(p->threads);
         free(p);
-        if(!processes) first = NULL;
+        releasePid(tid);
         releaseLock(&lock);
         return 0;
     }
@@ -182,7 +257,7 @@ pid_t kthreadCreate(void *(*entry)(void *), void *arg) {
         free(p->threads[0]);
         free(p->threads);
         free(p);
-        if(!processes) first = NULL;
+        releasePid(tid);
         releaseLock(&lock);
         return 0;
     }
@@ -193,18 +268,35 @@ pid_t kthreadCreate(void *(*entry)(void *), void *arg) {
         free(p->threads[0]);
         free(p->threads);
         free(p);
-        if(!processes) first = NULL;
+        releasePid(tid);
         releaseLock(&lock);
         return 0;
     }
 
-    KDEBUG("spawned kernel thread with PID %d\n", tid);
+    if(!indexProcess(tid, p) || !indexThread(tid, p->threads[0])) {
+        KERROR("failed to allocate memory for kernel thread\n");
+        free(p->threads[0]->context);
+        free(p->threads[0]);
+        free(p->threads);
+        free(p);
+        releasePid(tid);
+        releaseLock(&lock);
+        return 0;
+    }
+
+    /* special case for the kernel idle thread
+     * this is the ONLY thread that runs in kernel space */
+    if(!processes) first = p;
+    else last->next = p;
     last = p;
 
+    KDEBUG("spawned kernel thread with PID %d\n", tid);
+
     processes++;
     threads++;
 
     schedAdjustTimeslice();
+    unblockThread(p->threads[0]);
     releaseLock(&lock);
     return tid;
 }
@@ -215,15 +307,9 @@ pid_t kthreadCreate(void *(*entry)(void *), void *arg) {
  */
 
 Process *getProcess(pid_t pid) {
-    if(!pid || !first) return NULL;
-
-    Process *p = first;
-    do {
-        if(p->pid == pid) return p;
-        p = p->next;
-    } while(p);
-
-    return NULL;
+    PidIndexEntry *entry = pidIndexEntry(pid, false);
+    if(!entry) return NULL;
+    return __atomic_load_n(&entry->process, __ATOMIC_ACQUIRE);
 }
 
 /* getThread(): returns the thread structure associated with a TID
@@ -232,22 +318,9 @@ Process *getProcess(pid_t pid) {
  */
 
 Thread *getThread(pid_t tid) {
-    if(!tid || !first) return NULL;
-
-    Process *p = first;
-    Thread *t;
-    do {
-        if(p->threadCount && p->threads) {
-            for(int i = 0; i < p->threadCount; i++) {
-                t = p->threads[i];
-                if(t && t->tid == tid) return t;
-            }
-        }
-
-        p = p->next;
-    } while(p);
-
-    return NULL;
+    PidIndexEntry *entry = pidIndexEntry(tid, false);
+    if(!entry) return NULL;
+    return __atomic_load_n(&entry->thread, __ATOMIC_ACQUIRE);
 }
 
 /* getPid(): returns the current running process
@@ -268,30 +341,315 @@ pid_t getTid() {
     return platformGetTid();
 }
 
-/* schedTimer(): scheduler timer main function
+/* priorityLevel(): returns the run queue level of a thread's priority */
+
+static inline int priorityLevel(Thread *t) {
+    if((t->priority < PRIORITY_LOW) || (t->priority > PRIORITY_HIGHEST)) return PRIORITY_NORMAL - 1;
+    return t->priority - 1;
+}
+
+/* runQueueAdd(): appends a thread to a run queue unless it is already in one
+ * params: queue - run queue
+ * params: t - thread, which must have the queued status
+ * returns: nothing
+ */
+
+static void runQueueAdd(RunQueue *queue, Thread *t) {
+    if(__atomic_exchange_n(&t->enqueued, true, __ATOMIC_SEQ_CST)) return;
+
+    int level = priorityLevel(t);
+
+    acquireLockBlocking(&queue->lock);
+    t->runQueue = queue;
+    t->runLevel = level;
+    t->runNext = NULL;
+    t->queuedAt = platformNanoseconds();
+
+    if(queue->tail[level]) queue->tail[level]->runNext = t;
+    else queue->head[level] = t;
+    queue->tail[level] = t;
+    queue->levels |= (1 << level);
+
+    __atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELAXED);
+    releaseLock(&queue->lock);
+
+    // the CPU may have stopped its timer, in which case nothing would get it
+    // to look at the queue again; this pairs with the check in schedIdle()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&queue->idle, __ATOMIC_RELAXED) && (queue != runQueues[platformWhichCPU()]))
+        platformWakeCPU(queue->cpu);
+}
+
+/* runQueuePop(): takes the next thread that is still ready to run off a run
+ * queue, dropping threads that blocked or exited after they were queued; the
+ * highest priority level goes first, unless a lower one has been starved
+ * params: queue - run queue
+ * returns: pointer to the thread, NULL if there is none
+ */
+
+static Thread *runQueuePop(RunQueue *queue) {
+    if(!__atomic_load_n(&queue->count, __ATOMIC_RELAXED)) return NULL;
+
+    acquireLockBlocking(&queue->lock);
+    uint64_t now = platformNanoseconds();
+
+    Thread *t = NULL;
+    while(queue->levels) {
+        int level = 31 - __builtin_clz(queue->levels);
+        for(int i = 0; i < level; i++) {
+            Thread *waiting = queue->head[i];
+            if(waiting && (now > (waiting->queuedAt + SCHED_STARVATION_LIMIT))) {
+                level = i;
+                break;
+            }
+        }
+
+        t = queue->head[level];
+        queue->head[level] = t->runNext;
+        if(!queue->head[level]) {
+            queue->tail[level] = NULL;
+            queue->levels &= ~(1 << level);
+        }
+
+        __atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELAXED);
+
+        t->runQueue = NULL;
+        t->runNext = NULL;
+
+        // the status is checked after the thread is marked as out of the
+        // queue, so that a wakeup in between is never lost
+        __atomic_store_n(&t->enqueued, false, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&t->status, __ATOMIC_SEQ_CST) == THREAD_QUEUED) break;
+        t = NULL;
+    }
+
+    releaseLock(&queue->lock);
+    return t;
+}
+
+/* runQueueBusiest(): finds the longest run queue other than a CPU's own
+ * params: cpu - index of the CPU
+ * returns: pointer to the run queue, NULL if all the others are empty
+ */
+
+static RunQueue *runQueueBusiest(int cpu) {
+    RunQueue *busiest = NULL;
+    size_t most = 0;
+
+    for(int i = 0; i < queueCount; i++) {
+        size_t count = __atomic_load_n(&runQueues[i]->count, __ATOMIC_RELAXED);
+        if((i != cpu) && (count > most)) {
+            busiest = runQueues[i];
+            most = count;
+        }
+    }
+
+    return busiest;
+}
+
+/* runQueueSteal(): takes a thread from the busiest run queue, for a CPU that
+ * has nothing left in its own
+ * params: cpu - index of the idle CPU
+ * returns: pointer to the thread, NULL if there is nothing to steal
+ */
+
+static Thread *runQueueSteal(int cpu) {
+    RunQueue *victim = runQueueBusiest(cpu);
+    if(!victim) return NULL;
+
+    Thread *t = runQueuePop(victim);
+    if(t) runQueues[cpu]->steals++;
+    return t;
+}
+
+/* runQueueFor(): chooses the run queue for a thread that is ready to run,
+ * which is that of the CPU it last ran on unless that one is overloaded
+ * params: t - thread
+ * returns: pointer to the run queue
+ */
+
+static RunQueue *runQueueFor(Thread *t) {
+    RunQueue *queue = ((t->cpu >= 0) && (t->cpu < queueCount)) ? runQueues[t->cpu] : runQueues[0];
+    RunQueue *idlest = queue;
+
+    for(int i = 0; i < queueCount; i++) {
+        if(__atomic_load_n(&runQueues[i]->count, __ATOMIC_RELAXED) < __atomic_load_n(&idlest->count, __ATOMIC_RELAXED))
+            idlest = runQueues[i];
+    }
+
+    if(__atomic_load_n(&queue->count, __ATOMIC_RELAXED) >= (__atomic_load_n(&idlest->count, __ATOMIC_RELAXED) + SCHED_IMBALANCE))
+        return idlest;
+    return queue;
+}
+
+/* schedBalance(): evens out the local run queue with the busiest one by
+ * pulling half the difference over
+ * params: cpu - index of the local CPU
+ * returns: nothing
+ */
+
+static void schedBalance(int cpu) {
+    RunQueue *local = runQueues[cpu];
+    RunQueue *busiest = runQueueBusiest(cpu);
+    if(!busiest) return;
+
+    size_t localCount = __atomic_load_n(&local->count, __ATOMIC_RELAXED);
+    size_t busiestCount = __atomic_load_n(&busiest->count, __ATOMIC_RELAXED);
+    if(busiestCount < (localCount + SCHED_IMBALANCE)) return;
+
+    // only one queue is locked at a time, so two CPUs pulling from each
+    // other can't deadlock
+    for(size_t i = 0; i < (busiestCount - localCount) / 2; i++) {
+        Thread *t = runQueuePop(busiest);
+        if(!t) break;
+
+        runQueueAdd(local, t);
+        local->pulls++;
+    }
+}
+
+/* schedDequeue(): removes a thread from the run queue it is waiting in
+ * params: t - thread
+ * returns: nothing
+ */
+
+void schedDequeue(Thread *t) {
+    RunQueue *queue = t->runQueue;
+    if(!queue) return;
+
+    acquireLockBlocking(&queue->lock);
+
+    // the thread may have been taken off the queue in the meantime
+    int level = t->runLevel;
+    Thread *prev = NULL, *n = queue->head[level];
+    while(n && (n != t)) {
+        prev = n;
+        n = n->runNext;
+    }
+
+    if(n) {
+        if(prev) prev->runNext = t->runNext;
+        else queue->head[level] = t->runNext;
+        if(queue->tail[level] == t) queue->tail[level] = prev;
+        if(!queue->head[level]) queue->levels &= ~(1 << level);
+        __atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELAXED);
+
+        t->runQueue = NULL;
+        t->runNext = NULL;
+        __atomic_store_n(&t->enqueued, false, __ATOMIC_SEQ_CST);
+    }
+
+    releaseLock(&queue->lock);
+}
+
+/* schedStatus(): returns statistics of the run queue of each CPU
+ * params: dst - array of status structures
+ * params: count - number of entries in the array
+ * returns: number of entries filled in
+ */
+
+int schedStatus(SchedCPUStatus *dst, int count) {
+    if(count > queueCount) count = queueCount;
+
+    for(int i = 0; i < count; i++) {
+        RunQueue *queue = runQueues[i];
+        dst[i].queued = __atomic_load_n(&queue->count, __ATOMIC_RELAXED);
+        dst[i].switches = queue->switches;
+        dst[i].steals = queue->steals;
+        dst[i].pulls = queue->pulls;
+        dst[i].latency = queue->latency;
+        dst[i].maxLatency = queue->maxLatency;
+    }
+
+    return count;
+}
+
+/* schedNextTimer(): determines when the timer of a CPU is next needed, which
+ * is when the running thread's time slice is up, the run queues are due to be
+ * balanced, or the next kernel timer is due, whichever comes first
+ * params: t - thread running on the CPU
+ * params: cpu - index of the CPU
+ * returns: number of timer ticks from now
+ */
+
+static uint64_t schedNextTimer(Thread *t, int cpu) {
+    uint64_t next = (t && t->time) ? t->time : 1;
+
+    uint64_t balance = SCHED_BALANCE_INTERVAL - (runQueues[cpu]->ticks % SCHED_BALANCE_INTERVAL);
+    if(balance < next) next = balance;
+
+    uint64_t timer = ktimerNext();
+    if(timer && (timer < next)) next = timer;
+
+    return next;
+}
+
+/* schedIdle(): prepares the current CPU to halt with nothing to run; the CPU
+ * is marked idle so that it gets woken up when a thread is queued on it
+ * params: none
+ * returns: timer ticks until the next kernel timer is due, zero if the timer
+ *          can be stopped
+ */
+
+uint64_t schedIdle() {
+    if(!scheduling || !queueCount) return 1;
+
+    RunQueue *queue = runQueues[platformWhichCPU()];
+    __atomic_store_n(&queue->idle, true, __ATOMIC_SEQ_CST);
+
+    // a thread may have been queued before the flag was visible
+    if(schedBusy()) {
+        __atomic_store_n(&queue->idle, false, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    return ktimerNext();
+}
+
+/* schedResume(): marks the current CPU as no longer idle
  * params: none
+ * returns: nothing
+ */
+
+void schedResume() {
+    if(!queueCount) return;
+    __atomic_store_n(&runQueues[platformWhichCPU()]->idle, false, __ATOMIC_RELAXED);
+}
+
+/* schedTimer(): scheduler timer main function
+ * params: ticks - timer ticks elapsed since the last call on this CPU
  * returns: remaining time in milliseconds
  */
 
-uint64_t schedTimer() {
-    if(!scheduling || !processes || !threads || !first || !last) {
+uint64_t schedTimer(uint64_t ticks) {
+    if(!scheduling || !processes || !threads || !first || !last || !queueCount) {
         return 1;
     }
 
     //if(!acquireLock(&lock)) return 1;
 
-    // decrement the time slice of the current thread
+    // rebalance the run queues every now and then
+    int cpu = platformWhichCPU();
+    RunQueue *queue = runQueues[cpu];
+    uint64_t before = queue->ticks;
+    queue->ticks += ticks;
+    if((before / SCHED_BALANCE_INTERVAL) != (queue->ticks / SCHED_BALANCE_INTERVAL)) schedBalance(cpu);
+
+    // take the elapsed ticks off the time slice of the current thread
     uint64_t time;
-    Thread *t = getThread(getTid());
+    Thread *t = platformGetThread();
     if(!t) {
         time = 0;
     } else {
-        if(t->time) t->time--;  // prevent underflows
+        t->time = (t->time > ticks) ? t->time - ticks : 0;  // prevent underflows
         time = t->time;
     }
 
-    // and that of sleeping threads too
-    schedSleepTimer();
+    // run kernel timers that are due, which wake up sleeping threads
+    ktimerExpire();
+
+    // and skip the ticks in between when nothing needs to happen
+    if(time) platformSetTimer(schedNextTimer(t, cpu));
 
     //releaseLock(&lock);
     return time;
@@ -303,16 +661,9 @@ uint64_t schedTimer() {
  */
 
 bool schedBusy() {
-    Process *qp = first;
-    Thread *qt = NULL;
-    while(qp) {
-        if(qp->threads && qp->threadCount) qt = qp->threads[0];
-        while(qt) {
-            if(qt->status == THREAD_QUEUED) return true;
-            qt = qt->next;
-        }
-
-        qp = qp->next;
+    // an idle CPU steals from any other queue, so all of them count
+    for(int i = 0; i < queueCount; i++) {
+        if(__atomic_load_n(&runQueues[i]->count, __ATOMIC_RELAXED)) return true;
     }
 
     return false;
@@ -324,58 +675,51 @@ bool schedBusy() {
  */
 
 void schedule() {
-    if(!scheduling || !processes || !threads) return;
+    if(!scheduling || !processes || !threads || !queueCount) return;
 
-    //acquireLockBlocking(&lock);
-    if(!acquireLock(&lock)) return;
     setLocalSched(false);
 
-    Process *p = platformGetProcess();
-    Thread *t = platformGetThread();
-    Thread *current = t;
+    Thread *current = platformGetThread();
     int cpu = platformWhichCPU();   // cpu index
-    int rounds = 0;
-
-    if(!p || !t) p = first;         // initial scheduling event
+    RunQueue *queue = runQueues[cpu];
+    Thread *t;
 
-    while(rounds < 2) {
-        if(!p->threadCount || !p->threads) {
-            p = p->next;
-            continue;
+    while((t = runQueuePop(queue)) || (t = runQueueSteal(cpu))) {
+        // compaction, reclaim and fork() rely on the scheduler lock to keep
+        // idle processes off every CPU while they work on their memory, so
+        // while it is held the thread waits for the next pass
+        if(!acquireLock(&lock)) {
+            runQueueAdd(queue, t);
+            break;
         }
 
-        t = p->threads[0];
+        // signal handlers may terminate the thread, and they look through the
+        // process list, which is why they also need the lock
+        if(t->signalQueue) signalHandle(t);
 
-        while(t) {
-            if(t->status == THREAD_QUEUED) {
-                if(current && (current->status == THREAD_RUNNING))
-                    current->status = THREAD_QUEUED;
-
-                signalHandle(t);
-
-                if(t->status == THREAD_QUEUED) {
-                    // check status again because the signal handler may terminate a thread
-                    t->status = THREAD_RUNNING;
-                    t->time = schedTimeslice(t, t->priority);
-                    t->cpu = cpu;
-                    releaseLock(&lock);
-                    platformSwitchContext(t);
-                }
-            }
+        // a thread can briefly be in two queues when it is woken up as it is
+        // being taken off one, so whoever gets here first runs it
+        int status = THREAD_QUEUED;
+        bool claimed = __atomic_compare_exchange_n(&t->status, &status, THREAD_RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        releaseLock(&lock);
+        if(!claimed) continue;
 
-            t = t->next;
-        }
+        if(current && (current != t) && (current->status == THREAD_RUNNING))
+            unblockThread(current);
 
-        p = p->next;
-        if(!p) {
-            // circular queue
-            p = first;
-            rounds++;
+        uint64_t now = platformNanoseconds();
+        if(now > t->queuedAt) {
+            uint64_t latency = now - t->queuedAt;
+            queue->latency += latency;
+            if(latency > queue->maxLatency) queue->maxLatency = latency;
         }
-    }
 
-    releaseLock(&lock);
-    return;
+        queue->switches++;
+        t->time = schedTimeslice(t, t->priority);
+        t->cpu = cpu;
+        platformSetTimer(schedNextTimer(t, cpu));
+        platformSwitchContext(t);
+    }
 }
 
 /* processCreate(): creates a blank process
@@ -393,32 +737,34 @@ pid_t processCreate() {
         return 0;
     }
 
-    Process *process = first;
-    while(process->next) {
-        process = process->next;
-    }
-
-    process->next = calloc(1, sizeof(Process));
-    if(!process->next) {
+    Process *process = calloc(1, sizeof(Process));
+    if(!process || !indexProcess(pid, process)) {
         KERROR("failed to allocate memory for new process\n");
+        if(process) free(process);
+        releasePid(pid);
         return 0;
     }
 
-    process = process->next;
     Process *current = getProcess(getPid());
     if(current) {
-        current->children = realloc(current->children, sizeof(Process *) * current->childrenCount+1);
-        if(!current->children) {
+        Process **children = realloc(current->children, sizeof(Process *) * (current->childrenCount+1));
+        if(!children) {
             KERROR("failed to allocate memory for new process\n");
             free(process);
+            releasePid(pid);
             return 0;
         }
 
         // add to the list of children processes
+        current->children = children;
         current->children[current->childrenCount] = process;
         current->childrenCount++;
     }
 
+    // append to the list without walking it
+    last->next = process;
+    last = process;
+
     // identify the process
     process->pid = pid;
     process->parent = getPid();
@@ -433,6 +779,37 @@ pid_t processCreate() {
     return pid;
 }
 
+/* processDestroy(): undoes processCreate() for a process that could not be
+ * set up, with the scheduler locked; its threads must already be freed
+ * params: p - process structure
+ * returns: nothing
+ */
+
+void processDestroy(Process *p) {
+    // fork() lists the child under its parent on top of processCreate(), so
+    // every list of children is checked, along with finding the process that
+    // links to this one
+    Process *prev = NULL;
+    for(Process *q = first; q; q = q->next) {
+        if(q->next == p) prev = q;
+
+        for(int i = 0; i < q->childrenCount; i++) {
+            if(q->children[i] == p) {
+                q->children[i] = q->children[--q->childrenCount];
+                i--;
+            }
+        }
+    }
+
+    if(prev) prev->next = p->next;
+    else if(first == p) first = p->next;
+    if(last == p) last = prev;
+
+    releasePid(p->pid);
+    if(p->children) free(p->children);
+    free(p);
+}
+
 /* threadUseContext(): switches to the paging context of a thread
  * params: tid - thread ID
  * returns: zero on success
@@ -447,17 +824,37 @@ int threadUseContext(pid_t tid) {
 
 /* schedTimeslice(): allocates a time slice for a thread
  * params: t - thread structure
- * params: p - priority level (0 = highest, 3 = lowest)
+ * params: p - priority level (PRIORITY_LOW to PRIORITY_HIGHEST)
  * returns: time slice in milliseconds accounting for CPU count
  */
 
 uint64_t schedTimeslice(Thread *t, int p) {
-    if(!p) p = PRIORITY_NORMAL;
-    uint64_t time = p * SCHED_TIME_SLICE;
+    if((p < PRIORITY_LOW) || (p > PRIORITY_HIGHEST)) p = PRIORITY_NORMAL;
+
+    // higher priorities get longer time slices on top of running first
+    uint64_t time = SCHED_TIME_SLICE;
+    if(p > PRIORITY_NORMAL) time *= (p - PRIORITY_NORMAL + 1);
     t->priority = p;
     return time;
 }
 
+/* schedSetPriority(): changes the priority of a thread, moving it to its new
+ * level if it is waiting in a run queue
+ * params: t - thread structure
+ * params: p - priority level (PRIORITY_LOW to PRIORITY_HIGHEST)
+ * returns: nothing
+ */
+
+void schedSetPriority(Thread *t, int p) {
+    if((p < PRIORITY_LOW) || (p > PRIORITY_HIGHEST)) return;
+
+    t->priority = p;
+    if(t->runQueue && (t->runLevel != priorityLevel(t))) {
+        schedDequeue(t);
+        if(t->status == THREAD_QUEUED) runQueueAdd(runQueueFor(t), t);
+    }
+}
+
 /* schedAdjustTimeslice(): adjusts the timeslices of all queued threads */
 
 void schedAdjustTimeslice() {
@@ -508,6 +905,7 @@ void blockThread(Thread *t) {
 
 void unblockThread(Thread *t) {
     t->status = THREAD_QUEUED;      // the scheduler will eventually run it
+    if(queueCount) runQueueAdd(runQueueFor(t), t);
 }
 
 /* yield(): gives up control of a thread and puts it back in the queue
@@ -516,8 +914,8 @@ void unblockThread(Thread *t) {
  */
 
 int yield(Thread *t) {
-    t->status = THREAD_QUEUED;
     t->time = schedTimeslice(t, t->priority);
+    unblockThread(t);
     return 0;
 }
 
@@ -530,6 +928,22 @@ Process *getProcessQueue() {
     return first;
 }
 
+/* processIsIdle(): checks whether a process can't touch its memory, for use
+ * with the scheduler locked
+ * params: p - process
+ * returns: true if no thread of the process is running or in a system call
+ */
+
+bool processIsIdle(Process *p) {
+    for(size_t i = 0; i < p->threadCount; i++) {
+        Thread *t = p->threads[i];
+        if(!t) continue;
+        if((t->status == THREAD_RUNNING) || t->syscall.busy) return false;
+    }
+
+    return true;
+}
+
 /* setLumenPID(): saves the PID of lumen 
  * params: pid - process ID
  * returns: nothing
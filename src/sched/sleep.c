@@ -5,79 +5,76 @@
  * Core Microkernel
  */
 
-#include <stdlib.h>
-#include <string.h>
+#include <errno.h>
 #include <kernel/sched.h>
 #include <kernel/logger.h>
+#include <kernel/timer.h>
 #include <platform/platform.h>
+#include <sys/time.h>
 
-static Thread **sleepingThreads = NULL;   // list of sleeping threads
-static int sleepingCount = 0;
+/* sleeping threads are woken by a kernel timer embedded in the thread, which
+ * goes off at the uptime the sleep is due to end */
 
-/* msleep(): pauses thread execution for a duration of time in milliseconds
- * params: t - thread to be paused
- * params: msec - minimum number of milliseconds to pause
- * returns: zero
+/* sleepExpire(): wakes up a thread whose sleep has ended
+ * params: timer - sleep timer of the thread
+ * returns: zero, the timer doesn't repeat
  */
 
-unsigned long msleep(Thread *t, unsigned long msec) {
-    msec *= (PLATFORM_TIMER_FREQUENCY / 1000);  // convert ms to timer ticks
-    if(!msec) return 0;
-
-    schedLock();
-    t->status = THREAD_SLEEP;
-    t->time = msec;
-
-    sleepingCount++;
-    Thread **list = realloc(sleepingThreads, sizeof(Thread *) * sleepingCount);
-    if(!list) {
-        KERROR("failed to allocate memory to put thread %d to sleep\n", t->tid);
-        t->status = THREAD_QUEUED;  // failed sleep (?)
+static uint64_t sleepExpire(KernelTimer *timer) {
+    Thread *t = (Thread *) timer->arg;
+    if(t->status == THREAD_SLEEP) {
         t->time = schedTimeslice(t, t->priority);
-        sleepingCount--;
-        schedRelease();
-        return 0;
+        unblockThread(t);
     }
 
-    sleepingThreads = list;
-    sleepingThreads[sleepingCount-1] = t;
-    schedRelease();
     return 0;
 }
 
-/* schedSleepTimer(): ticks sleeping threads and wakes them if the duration has elapsed
- * params: none
+/* sleepTicks(): puts a thread to sleep for a number of timer ticks
+ * params: t - thread to be paused
+ * params: ticks - number of timer ticks to pause for
  * returns: nothing
  */
 
-void schedSleepTimer() {
-    // we don't need to lock the scheduler because it is already locked by
-    // schedTimer() which calls this timer
-    if(!sleepingCount || !sleepingThreads) return;
+static void sleepTicks(Thread *t, uint64_t ticks) {
+    if(!ticks) return;
 
-    for(int i = 0; i < sleepingCount; i++) {
-        if(sleepingThreads[i] && sleepingThreads[i]->status == THREAD_SLEEP) {
-            sleepingThreads[i]->time--;
+    schedLock();
+    t->status = THREAD_SLEEP;
 
-            if(!sleepingThreads[i]->time) {
-                // duration has elapsed, wake this thread
-                sleepingThreads[i]->status = THREAD_QUEUED;
-                sleepingThreads[i]->time = schedTimeslice(sleepingThreads[i], sleepingThreads[i]->priority);
+    // the system call is done with the thread's memory, so the process can
+    // count as idle for compaction and reclaim while it sleeps
+    t->syscall.busy = false;
+    t->sleepTimer.expire = &sleepExpire;
+    t->sleepTimer.arg = t;
+    ktimerStart(&t->sleepTimer, platformUptime() + ticks);
+    schedRelease();
+}
 
-                sleepingThreads[i] = NULL;
+/* msleep(): pauses thread execution for a duration of time in milliseconds
+ * params: t - thread to be paused
+ * params: msec - minimum number of milliseconds to pause
+ * returns: zero
+ */
+
+unsigned long msleep(Thread *t, unsigned long msec) {
+    // convert ms to timer ticks, rounding up so that short sleeps still sleep
+    sleepTicks(t, ((msec * PLATFORM_TIMER_FREQUENCY) + 999) / 1000);
+    return 0;
+}
 
-                if(i != (sleepingCount-1)) {
-                    memmove(&sleepingThreads[i], &sleepingThreads[i+1], (sleepingCount-i) * sizeof(Thread *));
-                }
+/* nanosleep(): pauses thread execution with nanosecond precision, which is
+ * rounded up to the next timer tick
+ * params: t - thread to be paused
+ * params: req - duration to pause for
+ * params: rem - time left if the sleep is interrupted, which it never is
+ * returns: zero on success, negative error code on fail
+ */
 
-                i--;
-                sleepingCount--;
-            }
-        }
-    }
+int nanosleep(Thread *t, const struct timespec *req, struct timespec *rem) {
+    if((req->tv_sec < 0) || (req->tv_nsec < 0) || (req->tv_nsec >= 1000000000))
+        return -EINVAL;
 
-    if(!sleepingCount) {
-        free(sleepingThreads);
-        sleepingThreads = NULL;
-    }
+    sleepTicks(t, timespecTicks(req));
+    return 0;
 }
\ No newline at end of file
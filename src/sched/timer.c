@@ -0,0 +1,258 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Core Microkernel
+ */
+
+/* Timer Wheel */
+
+/* kernel timers are kept in a hierarchical timing wheel: level zero has one
+ * slot per tick for the next TIMER_WHEEL_SLOTS ticks, and each level above
+ * has slots that are TIMER_WHEEL_SLOTS times as wide; a timer is put in the
+ * lowest level whose range covers its deadline, and the slots of the upper
+ * levels are cascaded down one level whenever the level below wraps around,
+ * so starting, cancelling and expiring a timer all take constant time
+ *
+ * the wheel is processed up to the current uptime by whichever CPU's timer
+ * interrupt gets to it first; ticks in which nothing is due are skipped over
+ * using a bitmap of the slots in use, since idle CPUs can let a lot of them
+ * go by at once */
+
+#include <platform/platform.h>
+#include <platform/lock.h>
+#include <kernel/timer.h>
+
+static KernelTimer *wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+static uint64_t occupied[TIMER_WHEEL_LEVELS];  // bitmaps of non-empty slots
+static uint64_t base = 0;           // next tick to be processed
+static size_t pending = 0;
+static lock_t lock = LOCK_INITIAL;
+
+/* wheelInsert(): puts a timer in the slot its deadline falls in, with the
+ * wheel locked
+ * params: timer - timer to insert
+ * returns: nothing
+ */
+
+static void wheelInsert(KernelTimer *timer) {
+    // overdue timers go off on the next tick processed
+    uint64_t deadline = (timer->deadline > base) ? timer->deadline : base;
+    uint64_t delta = deadline - base;
+
+    // timers out of range are parked at the far end of the top level and
+    // put back where they belong when that slot is cascaded
+    if(delta >= (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS))) {
+        delta = (1ULL << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1;
+        deadline = base + delta;
+    }
+
+    int level = 0;
+    while(delta >= (1ULL << (TIMER_WHEEL_BITS * (level + 1)))) level++;
+
+    int slot = (deadline >> (TIMER_WHEEL_BITS * level)) & (TIMER_WHEEL_SLOTS - 1);
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = NULL;
+    timer->next = wheel[level][slot];
+    if(timer->next) timer->next->prev = timer;
+    wheel[level][slot] = timer;
+    occupied[level] |= (1ULL << slot);
+}
+
+/* wheelRemove(): takes a timer out of its slot, with the wheel locked
+ * params: timer - timer to remove
+ * returns: nothing
+ */
+
+static void wheelRemove(KernelTimer *timer) {
+    if(timer->prev) timer->prev->next = timer->next;
+    else wheel[timer->level][timer->slot] = timer->next;
+    if(timer->next) timer->next->prev = timer->prev;
+
+    if(!wheel[timer->level][timer->slot]) occupied[timer->level] &= ~(1ULL << timer->slot);
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/* wheelDetach(): empties a slot, with the wheel locked
+ * params: level - level of the wheel
+ * params: slot - index of the slot
+ * returns: list of timers that were in the slot
+ */
+
+static KernelTimer *wheelDetach(int level, int slot) {
+    KernelTimer *list = wheel[level][slot];
+    wheel[level][slot] = NULL;
+    occupied[level] &= ~(1ULL << slot);
+    return list;
+}
+
+/* wheelNextTick(): finds the next tick at which a level zero slot is due or
+ * an upper level slot is cascaded, with the wheel locked
+ * params: none
+ * returns: tick number, UINT64_MAX if the wheel is empty
+ */
+
+static uint64_t wheelNextTick() {
+    uint64_t next = UINT64_MAX;
+
+    for(int level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        if(!occupied[level]) continue;
+
+        // the slots of this level are visited at multiples of its width,
+        // starting with the first one at or after the next tick
+        int shift = TIMER_WHEEL_BITS * level;
+        uint64_t first = (base + (1ULL << shift) - 1) >> shift;
+        int start = first & (TIMER_WHEEL_SLOTS - 1);
+
+        uint64_t rotated = occupied[level];
+        if(start) rotated = (rotated >> start) | (rotated << (TIMER_WHEEL_SLOTS - start));
+
+        uint64_t tick = (first + __builtin_ctzll(rotated)) << shift;
+        if(tick < next) next = tick;
+    }
+
+    return next;
+}
+
+/* wheelTick(): cascades the upper levels and expires the timers due at the
+ * next tick, with the wheel locked
+ * params: none
+ * returns: nothing
+ */
+
+static void wheelTick() {
+    // each level is cascaded when the one below it wraps around
+    for(int level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+        int shift = TIMER_WHEEL_BITS * level;
+        if(base & ((1ULL << shift) - 1)) break;
+
+        KernelTimer *list = wheelDetach(level, (base >> shift) & (TIMER_WHEEL_SLOTS - 1));
+        while(list) {
+            KernelTimer *timer = list;
+            list = list->next;
+            wheelInsert(timer);
+        }
+    }
+
+    KernelTimer *list = wheelDetach(0, base & (TIMER_WHEEL_SLOTS - 1));
+    base++;
+
+    while(list) {
+        KernelTimer *timer = list;
+        list = list->next;
+
+        timer->next = NULL;
+        timer->prev = NULL;
+        timer->pending = false;
+        pending--;
+
+        uint64_t deadline = timer->expire(timer);
+        if(deadline) {
+            timer->deadline = deadline;
+            timer->pending = true;
+            pending++;
+            wheelInsert(timer);
+        }
+    }
+}
+
+/* ktimerStart(): starts or restarts a kernel timer
+ * params: timer - timer, with its expire callback set
+ * params: deadline - uptime in timer ticks at which the timer goes off
+ * returns: nothing
+ */
+
+void ktimerStart(KernelTimer *timer, uint64_t deadline) {
+    acquireLockBlocking(&lock);
+
+    if(timer->pending) wheelRemove(timer);
+    else pending++;
+
+    timer->deadline = deadline;
+    timer->pending = true;
+    wheelInsert(timer);
+
+    releaseLock(&lock);
+}
+
+/* ktimerCancel(): stops a kernel timer; once this returns, its callback is
+ * not running and will not run
+ * params: timer - timer
+ * returns: true if the timer was pending
+ */
+
+bool ktimerCancel(KernelTimer *timer) {
+    acquireLockBlocking(&lock);
+
+    bool wasPending = timer->pending;
+    if(wasPending) {
+        wheelRemove(timer);
+        timer->pending = false;
+        pending--;
+    }
+
+    releaseLock(&lock);
+    return wasPending;
+}
+
+/* ktimerRemaining(): returns the time left on a kernel timer
+ * params: timer - timer
+ * returns: timer ticks until the deadline, zero if the timer is not pending
+ */
+
+uint64_t ktimerRemaining(KernelTimer *timer) {
+    acquireLockBlocking(&lock);
+
+    uint64_t now = platformUptime();
+    uint64_t remaining = 0;
+    if(timer->pending) remaining = (timer->deadline > now) ? timer->deadline - now : 1;
+
+    releaseLock(&lock);
+    return remaining;
+}
+
+/* ktimerExpire(): runs the timers that are due, called by the timer of every
+ * CPU and a no-op for all but the first one to get here
+ * params: none
+ * returns: nothing
+ */
+
+void ktimerExpire() {
+    if(!acquireLock(&lock)) return;
+
+    uint64_t now = platformUptime();
+    while(base <= now) {
+        // nothing happens in between, so skip straight to the next tick that
+        // has something to do
+        uint64_t next = wheelNextTick();
+        if(next > now) {
+            base = now + 1;
+            break;
+        }
+
+        base = next;
+        wheelTick();
+    }
+
+    releaseLock(&lock);
+}
+
+/* ktimerNext(): returns how long until the timer wheel next needs processing,
+ * so that idle CPUs know when their timer is needed
+ * params: none
+ * returns: timer ticks from now, zero if there are no timers
+ */
+
+uint64_t ktimerNext() {
+    if(!__atomic_load_n(&pending, __ATOMIC_RELAXED)) return 0;
+    if(!acquireLock(&lock)) return 1;   // check again on the next tick
+
+    uint64_t now = platformUptime();
+    uint64_t next = wheelNextTick();
+    releaseLock(&lock);
+
+    if(next == UINT64_MAX) return 0;
+    return (next > now) ? next - now : 1;
+}
\ No newline at end of file
@@ -7,6 +7,7 @@
 
 /* Kernel-Server Communication */
 
+#include <errno.h>
 #include <string.h>
 #include <platform/mmap.h>
 #include <platform/platform.h>
@@ -30,6 +31,7 @@ static void (*generalRequests[])(Thread *, int, const MessageHeader *req, void *
 void handleGeneralRequest(int sd, const MessageHeader *req, void *res) {
     if(req->response || !req->requester || req->length < sizeof(MessageHeader))
         return;
+    if(req->command > MAX_GENERAL_COMMAND) return;
 
     Thread *t = getThread(req->requester);
     if(!t) return;
@@ -91,6 +93,142 @@ void serverRand(Thread *t, int sd, const MessageHeader *req, void *res) {
     send(NULL, sd, response, sizeof(RandCommand), 0);
 }
 
+/* serverProcessStatus(): returns the status and memory usage of a process */
+
+void serverProcessStatus(Thread *t, int sd, const MessageHeader *req, void *res) {
+    if(req->length < sizeof(ProcessStatusCommand)) return;
+
+    ProcessStatusCommand *request = (ProcessStatusCommand *) req;
+    ProcessStatusCommand *response = (ProcessStatusCommand *) res;
+    memcpy(response, req, sizeof(MessageHeader));
+    response->header.response = 1;
+    response->header.length = sizeof(ProcessStatusCommand);
+    response->pid = request->pid;
+
+    Process *p = getProcess(request->pid);
+    if(!p || !p->threadCount || !p->threads[0] || !p->threads[0]->context) {
+        response->header.status = -ESRCH;
+        send(NULL, sd, response, sizeof(ProcessStatusCommand), 0);
+        return;
+    }
+
+    response->header.status = 0;
+    response->parent = p->parent;
+    response->user = p->user;
+    response->group = p->group;
+    response->threads = p->threadCount;
+
+    // committed pages are reserved by the process, while resident pages are
+    // the ones it has actually touched
+    size_t committed, resident;
+    platformMemoryUsage(p->threads[0]->context, &committed, &resident);
+    response->committedPages = committed;
+    response->residentPages = resident;
+
+    // the prefault hit ratio is prefaultHits / prefaultedPages
+    VMATree *vmas = platformGetContextVMAs(p->threads[0]->context);
+    if(vmas) {
+        response->faults = vmas->faults;
+        response->prefaultedPages = vmas->prefaulted;
+        response->prefaultHits = vmas->prefaultHits;
+    } else {
+        response->faults = 0;
+        response->prefaultedPages = 0;
+        response->prefaultHits = 0;
+    }
+
+    send(NULL, sd, response, sizeof(ProcessStatusCommand), 0);
+}
+
+/* serverCacheInvalidate(): drops cached pages of a file that has changed */
+
+void serverCacheInvalidate(Thread *t, int sd, const MessageHeader *req, void *res) {
+    if(req->length < sizeof(CacheInvalidateCommand)) return;
+
+    CacheInvalidateCommand *request = (CacheInvalidateCommand *) req;
+    if(strnlen(request->device, MAX_FILE_PATH) >= MAX_FILE_PATH) return;
+    pageCacheInvalidate(request->device, request->id, request->offset, request->length);
+}
+
+/* serverCacheStatus(): returns page cache statistics of a device */
+
+void serverCacheStatus(Thread *t, int sd, const MessageHeader *req, void *res) {
+    if(req->length < sizeof(CacheStatusCommand)) return;
+
+    CacheStatusCommand *request = (CacheStatusCommand *) req;
+    if(strnlen(request->device, MAX_FILE_PATH) >= MAX_FILE_PATH) return;
+
+    CacheStatusCommand *response = (CacheStatusCommand *) res;
+    memcpy(response, req, sizeof(MessageHeader));
+    response->header.response = 1;
+    response->header.length = sizeof(CacheStatusCommand);
+
+    strcpy(response->device, request->device);
+
+    size_t pages = 0;
+    response->hits = 0;
+    response->misses = 0;
+    response->header.status = pageCacheStatus(request->device, &response->hits, &response->misses, &pages);
+    response->pages = pages;
+    send(NULL, sd, response, sizeof(CacheStatusCommand), 0);
+}
+
+/* serverHeapStatus(): returns usage statistics of the kernel heap */
+
+void serverHeapStatus(Thread *t, int sd, const MessageHeader *req, void *res) {
+    HeapStatusCommand *response = (HeapStatusCommand *) res;
+    memcpy(response, req, sizeof(MessageHeader));
+    response->header.response = 1;
+    response->header.status = 0;
+    response->header.length = sizeof(HeapStatusCommand);
+
+    size_t used, free, extents;
+    vmemStatus(&kernelHeapArena, &used, &free, &extents);
+    response->usedPages = used;
+    response->freePages = free;
+    response->freeExtents = extents;
+
+    SlabStatus caches[SLAB_CLASSES];
+    response->caches = slabStatus(caches, SLAB_CLASSES);
+
+    for(int i = 0; i < response->caches; i++) {
+        response->cache[i].size = caches[i].size;
+        response->cache[i].slabs = caches[i].slabs;
+        response->cache[i].objects = caches[i].objects;
+        response->cache[i].used = caches[i].used;
+        response->cache[i].allocations = caches[i].allocations;
+        response->cache[i].frees = caches[i].frees;
+        response->cache[i].cpuHits = caches[i].cpuHits;
+        response->cache[i].cpuMisses = caches[i].cpuMisses;
+    }
+
+    send(NULL, sd, response, sizeof(HeapStatusCommand), 0);
+}
+
+/* serverSchedStatus(): returns run queue statistics of each CPU */
+
+void serverSchedStatus(Thread *t, int sd, const MessageHeader *req, void *res) {
+    SchedStatusCommand *response = (SchedStatusCommand *) res;
+    memcpy(response, req, sizeof(MessageHeader));
+    response->header.response = 1;
+    response->header.status = 0;
+    response->header.length = sizeof(SchedStatusCommand);
+
+    SchedCPUStatus cpus[64];
+    response->cpus = schedStatus(cpus, 64);
+
+    for(int i = 0; i < response->cpus; i++) {
+        response->cpu[i].queued = cpus[i].queued;
+        response->cpu[i].switches = cpus[i].switches;
+        response->cpu[i].steals = cpus[i].steals;
+        response->cpu[i].pulls = cpus[i].pulls;
+        response->cpu[i].latency = cpus[i].latency;
+        response->cpu[i].maxLatency = cpus[i].maxLatency;
+    }
+
+    send(NULL, sd, response, sizeof(SchedStatusCommand), 0);
+}
+
 /* getFramebuffer(): provides frame buffer access to the requesting thread */
 
 void getFramebuffer(Thread *t, int sd, const MessageHeader *req, void *res) {
@@ -110,7 +248,7 @@ void getFramebuffer(Thread *t, int sd, const MessageHeader *req, void *res) {
     uintptr_t phys = ((uintptr_t)ttyStatus.fbhw - KERNEL_MMIO_BASE);
 
     size_t pages = (ttyStatus.h * ttyStatus.pitch + PAGE_SIZE - 1) / PAGE_SIZE;
-    uintptr_t base = vmmAllocate(USER_MMIO_BASE, USER_LIMIT_ADDRESS, pages, VMM_USER | VMM_WRITE);
+    uintptr_t base = vmmAllocate(USER_MMIO_BASE, USER_LIMIT_ADDRESS, pages, VMM_USER | VMM_WRITE | VMM_DEVICE);
     if(!base) return;
 
     // and finally map it
@@ -138,6 +276,10 @@ static void (*generalRequests[])(Thread *, int, const MessageHeader *req, void *
     NULL,               // 3 - request I/O access
     NULL,               // 4 - get process I/O privileges
     NULL,               // 5 - get list of processes/threads
-    NULL,               // 6 - get status of process/thread
+    serverProcessStatus,    // 6 - get status of process/thread
     getFramebuffer,     // 7 - request framebuffer access
+    serverCacheInvalidate,  // 8 - invalidate page cache
+    serverCacheStatus,  // 9 - page cache status
+    serverHeapStatus,   // 10 - kernel heap status
+    serverSchedStatus,  // 11 - scheduler status
 };
@@ -40,15 +40,13 @@ void handleSyscallResponse(int sd, const SyscallHeader *hdr) {
     case COMMAND_STAT:
         if(hdr->header.status) break;
         StatCommand *statcmd = (StatCommand *) hdr;
-        threadUseContext(req->thread->tid);
-        memcpy((void *)req->params[1], &statcmd->buffer, sizeof(struct stat));
+        req->ret = copyToUser(req->thread, req->params[1], &statcmd->buffer, sizeof(struct stat));
         break;
     
     case COMMAND_STATVFS:
         if(hdr->header.status) break;
         StatvfsCommand *statvfscmd = (StatvfsCommand *) hdr;
-        threadUseContext(req->thread->tid);
-        memcpy((void *)req->params[1], &statvfscmd->buffer, sizeof(struct statvfs));
+        req->ret = copyToUser(req->thread, req->params[1], &statvfscmd->buffer, sizeof(struct statvfs));
         break;
 
     case COMMAND_OPEN:
@@ -76,6 +74,10 @@ void handleSyscallResponse(int sd, const SyscallHeader *hdr) {
         file->sd = sd;
         file->charDev = opencmd->charDev;
 
+        // anything cached from before the file was truncated is stale
+        if(!file->charDev && (opencmd->flags & O_TRUNC))
+            pageCacheInvalidate(opencmd->device, opencmd->id, 0, 0);
+
         strcpy(file->abspath, opencmd->abspath);
         strcpy(file->device, opencmd->device);
         strcpy(file->path, opencmd->path);
@@ -100,13 +102,19 @@ void handleSyscallResponse(int sd, const SyscallHeader *hdr) {
         } else if(status < 0) break;  // here an actual error happened
         
         RWCommand *readcmd = (RWCommand *) hdr;
-        threadUseContext(req->thread->tid);
-        memcpy((void *)req->params[1], readcmd->data, hdr->header.status);
+        if(copyToUser(req->thread, req->params[1], readcmd->data, hdr->header.status))
+            req->ret = -EFAULT;
 
         // update file position
         file = (FileDescriptor *) p->io[req->params[0]].data;
         file->position = readcmd->position;
 
+        // and keep the data for later reads, a short read of a regular file
+        // means it ended
+        if(!file->charDev)
+            pageCacheFill(file->device, file->id, readcmd->position - status, readcmd->data, status,
+                (status < req->params[2]) ? PAGE_CACHE_EOF : 0, req->cacheGeneration);
+
         break;
 
     case COMMAND_WRITE:
@@ -129,6 +137,16 @@ void handleSyscallResponse(int sd, const SyscallHeader *hdr) {
         // update file position
         file = (FileDescriptor *) p->io[req->params[0]].data;
         file->position = writecmd->position;
+
+        // reads handled by the server while the write was in flight may have
+        // cached the old data after writeFile() dropped it
+        if(!file->charDev && status) {
+            if(p->io[req->params[0]].flags & O_APPEND)
+                pageCacheInvalidate(file->device, file->id, 0, 0);
+            else
+                pageCacheInvalidate(file->device, file->id, writecmd->position - status, status);
+        }
+
         break;
 
     case COMMAND_IOCTL:
@@ -138,9 +156,8 @@ void handleSyscallResponse(int sd, const SyscallHeader *hdr) {
         status = (ssize_t) hdr->header.status;
 
         if((status >= 0) && (ioctlcmd->opcode & IOCTL_OUT_PARAM)) {
-            threadUseContext(req->thread->tid);
-            unsigned long *out = (unsigned long *) req->params[2];
-            *out = ioctlcmd->parameter;
+            if(copyToUser(req->thread, req->params[2], &ioctlcmd->parameter, sizeof(unsigned long)))
+                req->ret = -EFAULT;
         }
 
         break;
@@ -182,15 +199,17 @@ void handleSyscallResponse(int sd, const SyscallHeader *hdr) {
         dir->position = readdircmd->position;
 
         // and copy the descriptor and write its pointer into the buffer
-        threadUseContext(req->thread->tid);
-        struct dirent **direntptr = (struct dirent **) req->params[2];
+        struct dirent *direntptr = NULL;
         if(!readdircmd->end) {
-            memcpy((void *)req->params[1], &readdircmd->entry, sizeof(struct dirent) + strlen(readdircmd->entry.d_name) + 1);
-            *direntptr = (struct dirent *) req->params[1];
-        } else {
-            *direntptr = NULL;
+            if(copyToUser(req->thread, req->params[1], &readdircmd->entry, sizeof(struct dirent) + strlen(readdircmd->entry.d_name) + 1)) {
+                req->ret = -EFAULT;
+                break;
+            }
+
+            direntptr = (struct dirent *) req->params[1];
         }
 
+        req->ret = copyToUser(req->thread, req->params[2], &direntptr, sizeof(struct dirent *));
         break;
     
     case COMMAND_EXEC:
@@ -229,13 +248,12 @@ void handleSyscallResponse(int sd, const SyscallHeader *hdr) {
         if(hdr->header.status <= 0) break;
 
         ReadLinkCommand *rlcmd = (ReadLinkCommand *) hdr;
-        threadUseContext(req->thread->tid);
 
         size_t linkLength = hdr->header.status;
         if(linkLength > req->params[2]) linkLength = req->params[2];
 
-        req->ret = linkLength;
-        memcpy((void *) req->params[1], rlcmd->path, linkLength);       
+        if(copyToUser(req->thread, req->params[1], rlcmd->path, linkLength)) req->ret = -EFAULT;
+        else req->ret = linkLength;
         break;
 
     case COMMAND_FSYNC:
@@ -254,5 +272,5 @@ void handleSyscallResponse(int sd, const SyscallHeader *hdr) {
     }
 
     platformSetContextStatus(req->thread->context, req->ret);
-    req->thread->status = THREAD_QUEUED;
+    unblockThread(req->thread);
 }
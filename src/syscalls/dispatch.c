@@ -163,6 +163,72 @@ void syscallDispatchGetTimeOfDay(SyscallRequest *req) {
     }
 }
 
+void syscallDispatchSetPriority(SyscallRequest *req) {
+    req->ret = setpriority(req->thread, req->params[0], req->params[1], req->params[2]);
+    req->unblock = true;
+}
+
+void syscallDispatchGetPriority(SyscallRequest *req) {
+    req->ret = getpriority(req->thread, req->params[0], req->params[1]);
+    req->unblock = true;
+}
+
+void syscallDispatchNanosleep(SyscallRequest *req) {
+    if(syscallVerifyPointer(req, req->params[0], sizeof(struct timespec)) &&
+    (!req->params[1] || syscallVerifyPointer(req, req->params[1], sizeof(struct timespec)))) {
+        req->ret = nanosleep(req->thread, (const struct timespec *) req->params[0], (struct timespec *) req->params[1]);
+        req->unblock = true;
+    }
+}
+
+void syscallDispatchSetitimer(SyscallRequest *req) {
+    if(syscallVerifyPointer(req, req->params[1], sizeof(struct itimerval)) &&
+    (!req->params[2] || syscallVerifyPointer(req, req->params[2], sizeof(struct itimerval)))) {
+        req->ret = setitimer(req->thread, req->params[0], (const struct itimerval *) req->params[1], (struct itimerval *) req->params[2]);
+        req->unblock = true;
+    }
+}
+
+void syscallDispatchGetitimer(SyscallRequest *req) {
+    if(syscallVerifyPointer(req, req->params[1], sizeof(struct itimerval))) {
+        req->ret = getitimer(req->thread, req->params[0], (struct itimerval *) req->params[1]);
+        req->unblock = true;
+    }
+}
+
+void syscallDispatchAlarm(SyscallRequest *req) {
+    req->ret = alarm(req->thread, req->params[0]);
+    req->unblock = true;
+}
+
+void syscallDispatchTimerCreate(SyscallRequest *req) {
+    if((!req->params[1] || syscallVerifyPointer(req, req->params[1], sizeof(struct sigevent))) &&
+    syscallVerifyPointer(req, req->params[2], sizeof(timer_t))) {
+        req->ret = timer_create(req->thread, req->params[0], (const struct sigevent *) req->params[1], (timer_t *) req->params[2]);
+        req->unblock = true;
+    }
+}
+
+void syscallDispatchTimerSettime(SyscallRequest *req) {
+    if(syscallVerifyPointer(req, req->params[2], sizeof(struct itimerspec)) &&
+    (!req->params[3] || syscallVerifyPointer(req, req->params[3], sizeof(struct itimerspec)))) {
+        req->ret = timer_settime(req->thread, req->params[0], req->params[1], (const struct itimerspec *) req->params[2], (struct itimerspec *) req->params[3]);
+        req->unblock = true;
+    }
+}
+
+void syscallDispatchTimerGettime(SyscallRequest *req) {
+    if(syscallVerifyPointer(req, req->params[1], sizeof(struct itimerspec))) {
+        req->ret = timer_gettime(req->thread, req->params[0], (struct itimerspec *) req->params[1]);
+        req->unblock = true;
+    }
+}
+
+void syscallDispatchTimerDelete(SyscallRequest *req) {
+    req->ret = timer_delete(req->thread, req->params[0]);
+    req->unblock = true;
+}
+
 void syscallDispatchGetPgrp(SyscallRequest *req) {
     Process *p = getProcess(req->thread->tid);
     req->ret = p->pgrp;
@@ -800,6 +866,11 @@ void syscallDispatchMsync(SyscallRequest *req) {
     }
 }
 
+void syscallDispatchMremap(SyscallRequest *req) {
+    req->ret = (uint64_t) mremap(req->thread, (void *) req->params[0], req->params[1], req->params[2], req->params[3]);
+    req->unblock = true;
+}
+
 /* Group 5: Driver I/O Functions */
 
 void syscallDispatchIoperm(SyscallRequest *req) {
@@ -929,4 +1000,19 @@ void (*syscallDispatchTable[])(SyscallRequest *) = {
     syscallDispatchMMIO,        // 64 - mmio()
     syscallDispatchPContig,     // 65 - pcontig()
     syscallDispatchVToP,        // 66 - vtop()
+
+    /* group 4 continued: memory management */
+    syscallDispatchMremap,      // 67 - mremap()
+
+    /* group 1 continued: scheduler functions */
+    syscallDispatchSetPriority, // 68 - setpriority()
+    syscallDispatchGetPriority, // 69 - getpriority()
+    syscallDispatchNanosleep,   // 70 - nanosleep()
+    syscallDispatchSetitimer,   // 71 - setitimer()
+    syscallDispatchGetitimer,   // 72 - getitimer()
+    syscallDispatchAlarm,       // 73 - alarm()
+    syscallDispatchTimerCreate, // 74 - timer_create()
+    syscallDispatchTimerSettime,// 75 - timer_settime()
+    syscallDispatchTimerGettime,// 76 - timer_gettime()
+    syscallDispatchTimerDelete, // 77 - timer_delete()
 };
@@ -137,9 +137,9 @@ int syscallProcess() {
 
     if((syscall->thread->status == THREAD_BLOCKED) && syscall->unblock) {
         // this way we prevent accidentally running threads that exit()
-        syscall->thread->status = THREAD_QUEUED;
         syscall->thread->time = schedTimeslice(syscall->thread, syscall->thread->priority);
         syscall->busy = false;
+        unblockThread(syscall->thread);
     }
 
     setLocalSched(true);
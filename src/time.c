@@ -14,3 +14,45 @@ int gettimeofday(Thread *t, struct timeval *tv, void *tzp) {
     tv->tv_usec = (platformUptime() % PLATFORM_TIMER_FREQUENCY) * 1000;
     return 0;
 }
+
+/* timevalTicks(): converts a duration to timer ticks, rounding up
+ * params: tv - duration
+ * returns: number of timer ticks
+ */
+
+uint64_t timevalTicks(const struct timeval *tv) {
+    if((tv->tv_sec < 0) || (tv->tv_usec < 0)) return 0;
+    return (tv->tv_sec * PLATFORM_TIMER_FREQUENCY) + (((tv->tv_usec * PLATFORM_TIMER_FREQUENCY) + 999999) / 1000000);
+}
+
+/* timespecTicks(): converts a duration to timer ticks, rounding up
+ * params: ts - duration
+ * returns: number of timer ticks
+ */
+
+uint64_t timespecTicks(const struct timespec *ts) {
+    if((ts->tv_sec < 0) || (ts->tv_nsec < 0)) return 0;
+    return (ts->tv_sec * PLATFORM_TIMER_FREQUENCY) + (((ts->tv_nsec * PLATFORM_TIMER_FREQUENCY) + 999999999) / 1000000000);
+}
+
+/* ticksTimeval(): converts timer ticks to a duration
+ * params: ticks - number of timer ticks
+ * params: tv - buffer to store the duration
+ * returns: nothing
+ */
+
+void ticksTimeval(uint64_t ticks, struct timeval *tv) {
+    tv->tv_sec = ticks / PLATFORM_TIMER_FREQUENCY;
+    tv->tv_usec = (ticks % PLATFORM_TIMER_FREQUENCY) * (1000000 / PLATFORM_TIMER_FREQUENCY);
+}
+
+/* ticksTimespec(): converts timer ticks to a duration
+ * params: ticks - number of timer ticks
+ * params: ts - buffer to store the duration
+ * returns: nothing
+ */
+
+void ticksTimespec(uint64_t ticks, struct timespec *ts) {
+    ts->tv_sec = ticks / PLATFORM_TIMER_FREQUENCY;
+    ts->tv_nsec = (ticks % PLATFORM_TIMER_FREQUENCY) * (1000000000 / PLATFORM_TIMER_FREQUENCY);
+}
\ No newline at end of file